@@ -74,6 +74,7 @@ static guint signals[SPICE_CURSOR_LAST_SIGNAL];
 
 static display_cursor * display_cursor_ref(display_cursor *cursor);
 static void display_cursor_unref(display_cursor *cursor);
+static gsize display_cursor_size(gconstpointer cursor);
 static void channel_set_handlers(SpiceChannelClass *klass);
 
 G_DEFINE_TYPE_WITH_PRIVATE(SpiceCursorChannel, spice_cursor_channel, SPICE_TYPE_CHANNEL)
@@ -113,7 +114,7 @@ static void spice_cursor_channel_init(SpiceCursorChannel *channel)
 
     c = channel->priv = spice_cursor_channel_get_instance_private(channel);
 
-    c->cursors = cache_new((GDestroyNotify)display_cursor_unref);
+    c->cursors = cache_new((GDestroyNotify)display_cursor_unref, display_cursor_size);
 }
 
 static void spice_cursor_channel_finalize(GObject *obj)
@@ -353,6 +354,13 @@ static void display_cursor_unref(display_cursor *cursor)
         g_free(cursor);
 }
 
+static gsize display_cursor_size(gconstpointer data)
+{
+    const display_cursor *cursor = data;
+
+    return sizeof(*cursor) + cursor->hdr.width * cursor->hdr.height * 4;
+}
+
 static const char *cursor_type_to_string(int type)
 {
     switch (type) {
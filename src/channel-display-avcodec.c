@@ -0,0 +1,477 @@
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-channel-priv.h"
+
+#include "channel-display-priv.h"
+
+
+/* libavcodec decoder implementation */
+
+/*
+ * Selected with SPICE_VIDEO_DECODER=avcodec, GStreamer stays the default
+ * and handles the codecs libavcodec lacks.
+ *
+ * Like the builtin MJPEG decoder, the frames are decoded in order on a
+ * worker thread as soon as they are queued, converted to BGRX by
+ * swscale, and only their presentation is scheduled at their mm_time on
+ * the channel context, see channel-display-worker.c. Unlike MJPEG frames, they depend on each other,
+ * so only those nothing references are skipped when late, the others
+ * are decoded without the conversion, see stream_get_frame_action().
+ *
+ * SPICE_AVCODEC_THREAD_TYPE is "slice" (the default), "frame" or
+ * "frame,slice". Frame threading gives the best throughput but delays
+ * each picture by one frame per extra thread, slice threading only helps
+ * streams encoded with several slices but adds no delay.
+ * SPICE_AVCODEC_THREADS sets the number of threads, 0 (the default)
+ * picks one per CPU.
+ */
+
+#define AVCODEC_MAX_THREADS 16
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define AVCODEC_OUT_FORMAT AV_PIX_FMT_BGR0
+#else
+#define AVCODEC_OUT_FORMAT AV_PIX_FMT_0RGB
+#endif
+
+static const enum AVCodecID avcodec_ids[] = {
+    [SPICE_VIDEO_CODEC_TYPE_VP8] = AV_CODEC_ID_VP8,
+    [SPICE_VIDEO_CODEC_TYPE_H264] = AV_CODEC_ID_H264,
+    [SPICE_VIDEO_CODEC_TYPE_VP9] = AV_CODEC_ID_VP9,
+    [SPICE_VIDEO_CODEC_TYPE_H265] = AV_CODEC_ID_HEVC,
+};
+
+typedef struct AVCodecFrame {
+    SpiceFrame *frame;
+    /* late, only decoded for the frames that reference it */
+    gboolean decode_only;
+
+    /* NULL if the frame could not be decoded or is not displayed */
+    uint8_t *out;
+    int width;
+    int height;
+} AVCodecFrame;
+
+typedef struct AVCodecDecoder {
+    VideoDecoder base;
+
+    /* ---------- libavcodec, worker only ---------- */
+
+    AVCodecContext *context;
+    AVPacket *packet;
+    AVFrame *picture;
+    struct SwsContext *sws;
+    /* the frames sent to libavcodec that did not come out yet */
+    GQueue *pending;
+
+    /* ---------- Worker thread ---------- */
+
+    /* its lock protects decoded and cancelled */
+    VideoWorker worker;
+    gboolean cancelled;
+
+    /* ---------- Frame queue ---------- */
+
+    /* the decoded frames waiting for their time */
+    GQueue *decoded;
+    uint32_t last_mm_time;
+    gboolean has_last_mm_time;
+} AVCodecDecoder;
+
+
+/* ---------- Frames ---------- */
+
+/* called with the lock held */
+static void avcodec_frame_free(AVCodecDecoder *decoder, AVCodecFrame *f)
+{
+    video_worker_buffer_put(&decoder->worker, f->out, (gsize)f->width * f->height * 4);
+    spice_frame_free(f->frame);
+    g_free(f);
+}
+
+
+/* ---------- Decoder proper ---------- */
+
+/* worker thread */
+static void avcodec_decoder_push(AVCodecDecoder *decoder, AVCodecFrame *f)
+{
+    g_mutex_lock(&decoder->worker.lock);
+    if (decoder->cancelled) {
+        avcodec_frame_free(decoder, f);
+    } else {
+        g_queue_push_tail(decoder->decoded, f);
+        video_worker_wakeup(&decoder->worker);
+    }
+    g_mutex_unlock(&decoder->worker.lock);
+}
+
+/* worker thread */
+static void avcodec_decoder_output(AVCodecDecoder *decoder, AVFrame *picture)
+{
+    AVCodecFrame *f;
+    uint8_t *dest[4] = { NULL };
+    int dest_linesize[4] = { 0 };
+    int flags;
+
+    /* the streams have no B frames so the pictures come out in the
+     * order the frames went in, those skipped could not be decoded */
+    while ((f = g_queue_pop_head(decoder->pending)) != NULL) {
+        if (f->frame->mm_time == (uint32_t)picture->pts)
+            break;
+        SPICE_DEBUG("libavcodec did not output the frame at %u", f->frame->mm_time);
+        avcodec_decoder_push(decoder, f);
+    }
+    if (f == NULL) {
+        SPICE_DEBUG("libavcodec output an unknown frame at %" G_GINT64_FORMAT, picture->pts);
+        return;
+    }
+    if (f->decode_only) {
+        avcodec_decoder_push(decoder, f);
+        return;
+    }
+
+#ifdef SPICE_QUALITY
+    flags = SWS_BICUBIC | SWS_ACCURATE_RND | SWS_FULL_CHR_H_INT;
+#else
+    flags = SWS_FAST_BILINEAR;
+#endif
+    /* same size, swscale uses its unscaled YUV to RGB converters */
+    decoder->sws = sws_getCachedContext(decoder->sws,
+                                        picture->width, picture->height, picture->format,
+                                        picture->width, picture->height, AVCODEC_OUT_FORMAT,
+                                        flags, NULL, NULL, NULL);
+    if (decoder->sws == NULL) {
+        g_warning("swscale cannot convert from %s",
+                  av_get_pix_fmt_name(picture->format));
+        avcodec_decoder_push(decoder, f);
+        return;
+    }
+
+    f->out = video_worker_buffer_get(&decoder->worker,
+                                     (gsize)picture->width * picture->height * 4);
+    f->width = picture->width;
+    f->height = picture->height;
+    dest[0] = f->out;
+    dest_linesize[0] = picture->width * 4;
+    sws_scale(decoder->sws, (const uint8_t * const *)picture->data, picture->linesize,
+              0, picture->height, dest, dest_linesize);
+
+    avcodec_decoder_push(decoder, f);
+}
+
+/* worker thread */
+static void avcodec_decoder_worker(gpointer data, gpointer user_data)
+{
+    AVCodecDecoder *decoder = user_data;
+    AVCodecFrame *f = data;
+    SpiceFrame *frame = f->frame;
+    int ret;
+
+    g_mutex_lock(&decoder->worker.lock);
+    if (decoder->cancelled) {
+        avcodec_frame_free(decoder, f);
+        g_mutex_unlock(&decoder->worker.lock);
+        return;
+    }
+    g_mutex_unlock(&decoder->worker.lock);
+
+    /* libavcodec copies the data since the packet is not refcounted */
+    decoder->packet->data = frame->data;
+    decoder->packet->size = frame->size;
+    decoder->packet->pts = frame->mm_time;
+    g_queue_push_tail(decoder->pending, f);
+
+    ret = avcodec_send_packet(decoder->context, decoder->packet);
+    av_packet_unref(decoder->packet);
+    if (ret < 0) {
+        SPICE_DEBUG("libavcodec could not decode the frame at %u: %s",
+                    frame->mm_time, av_err2str(ret));
+        g_queue_pop_tail(decoder->pending);
+        avcodec_decoder_push(decoder, f);
+        return;
+    }
+
+    while ((ret = avcodec_receive_frame(decoder->context, decoder->picture)) == 0) {
+        avcodec_decoder_output(decoder, decoder->picture);
+        av_frame_unref(decoder->picture);
+    }
+    if (ret != AVERROR(EAGAIN)) {
+        SPICE_DEBUG("libavcodec error: %s", av_err2str(ret));
+    }
+}
+
+/* channel context */
+static void avcodec_decoder_display_frame(VideoDecoder *video_decoder)
+{
+    AVCodecDecoder *decoder = (AVCodecDecoder*)video_decoder;
+    AVCodecFrame *f;
+
+    g_mutex_lock(&decoder->worker.lock);
+    f = g_queue_pop_head(decoder->decoded);
+    g_mutex_unlock(&decoder->worker.lock);
+    g_return_if_fail(f != NULL);
+
+    /* Display the frame and dispose of it */
+    stream_display_frame(decoder->base.stream, f->frame,
+                         f->width, f->height, SPICE_UNKNOWN_STRIDE, f->out);
+    g_mutex_lock(&decoder->worker.lock);
+    avcodec_frame_free(decoder, f);
+    g_mutex_unlock(&decoder->worker.lock);
+}
+
+/* ---------- VideoDecoder's queue scheduling ---------- */
+
+/* channel context */
+static void avcodec_decoder_schedule(VideoDecoder *video_decoder)
+{
+    AVCodecDecoder *decoder = (AVCodecDecoder*)video_decoder;
+    AVCodecFrame *f;
+
+    if (decoder->worker.timer_id) {
+        return;
+    }
+
+    guint32 time = stream_get_time(decoder->base.stream);
+    g_mutex_lock(&decoder->worker.lock);
+    while ((f = g_queue_peek_head(decoder->decoded)) != NULL) {
+        AVCodecFrame *next;
+
+        if (f->out == NULL) {
+            g_queue_pop_head(decoder->decoded);
+            avcodec_frame_free(decoder, f);
+            continue;
+        }
+
+        if (spice_mmtime_diff(time, f->frame->mm_time) <= 0) {
+            video_worker_display_in(&decoder->worker, f->frame->mm_time - time);
+            break;
+        }
+
+        /* display it now, unless the next one is due too */
+        next = g_queue_peek_nth(decoder->decoded, 1);
+        if (next == NULL || next->out == NULL ||
+            spice_mmtime_diff(time, next->frame->mm_time) < 0) {
+            video_worker_display_in(&decoder->worker, 0);
+            break;
+        }
+
+        SPICE_DEBUG("%s: rendering too late by %u ms (ts: %u, mmtime: %u), dropping ",
+                    __FUNCTION__, time - f->frame->mm_time,
+                    f->frame->mm_time, time);
+        stream_dropped_frame_on_playback(decoder->base.stream);
+        g_queue_pop_head(decoder->decoded);
+        avcodec_frame_free(decoder, f);
+    }
+    g_mutex_unlock(&decoder->worker.lock);
+}
+
+/* channel context */
+static void avcodec_decoder_drop_queue(AVCodecDecoder *decoder)
+{
+    AVCodecFrame *f;
+
+    video_worker_stop_display(&decoder->worker);
+    g_mutex_lock(&decoder->worker.lock);
+    while ((f = g_queue_pop_head(decoder->decoded)) != NULL) {
+        avcodec_frame_free(decoder, f);
+    }
+    g_mutex_unlock(&decoder->worker.lock);
+}
+
+/* ---------- VideoDecoder's public API ---------- */
+
+static gboolean avcodec_decoder_queue_frame(VideoDecoder *video_decoder,
+                                            SpiceFrame *frame, int32_t margin)
+{
+    AVCodecDecoder *decoder = (AVCodecDecoder*)video_decoder;
+    AVCodecFrame *f;
+
+    if (frame->size == 0) {
+        SPICE_DEBUG("got an empty frame buffer!");
+        spice_frame_free(frame);
+        return TRUE;
+    }
+
+    if (decoder->has_last_mm_time &&
+        spice_mmtime_diff(frame->mm_time, decoder->last_mm_time) < 0) {
+        /* This should really not happen */
+        SPICE_DEBUG("new-frame-time < last-frame-time (%u < %u):"
+                    " resetting stream",
+                    frame->mm_time, decoder->last_mm_time);
+        avcodec_decoder_drop_queue(decoder);
+    }
+    decoder->last_mm_time = frame->mm_time;
+    decoder->has_last_mm_time = TRUE;
+
+    f = g_new0(AVCodecFrame, 1);
+    f->frame = frame;
+    switch (stream_get_frame_action(video_decoder, frame, margin)) {
+    case STREAM_FRAME_SKIP:
+        SPICE_DEBUG("skipping a late frame no other frame references");
+        g_free(f);
+        spice_frame_free(frame);
+        return TRUE;
+    case STREAM_FRAME_DECODE_ONLY:
+        f->decode_only = TRUE;
+        break;
+    default:
+        break;
+    }
+
+    video_worker_push(&decoder->worker, f);
+    return TRUE;
+}
+
+static void avcodec_decoder_reschedule(VideoDecoder *video_decoder)
+{
+    AVCodecDecoder *decoder = (AVCodecDecoder*)video_decoder;
+
+    video_worker_reschedule(&decoder->worker);
+}
+
+static void avcodec_decoder_destroy(VideoDecoder* video_decoder)
+{
+    AVCodecDecoder *decoder = (AVCodecDecoder*)video_decoder;
+    AVCodecFrame *f;
+
+    g_mutex_lock(&decoder->worker.lock);
+    decoder->cancelled = TRUE;
+    g_mutex_unlock(&decoder->worker.lock);
+    avcodec_decoder_drop_queue(decoder);
+    /* the worker frees the frames still queued */
+    video_worker_stop(&decoder->worker);
+
+    /* and those still in libavcodec */
+    while ((f = g_queue_pop_head(decoder->pending)) != NULL) {
+        avcodec_frame_free(decoder, f);
+    }
+    g_queue_free(decoder->pending);
+    g_queue_free(decoder->decoded);
+    avcodec_free_context(&decoder->context);
+    av_packet_free(&decoder->packet);
+    av_frame_free(&decoder->picture);
+    sws_freeContext(decoder->sws);
+    video_worker_clear(&decoder->worker);
+    g_free(decoder);
+}
+
+static void avcodec_decoder_set_threading(AVCodecContext *context)
+{
+    const gchar *env = g_getenv("SPICE_AVCODEC_THREADS");
+    gchar **types;
+    guint i;
+
+    context->thread_count = env ? MIN(strtoul(env, NULL, 10), AVCODEC_MAX_THREADS) : 0;
+
+    env = g_getenv("SPICE_AVCODEC_THREAD_TYPE");
+    types = g_strsplit(env ? env : "slice", ",", -1);
+    context->thread_type = 0;
+    for (i = 0; types[i] != NULL; i++) {
+        if (g_str_equal(types[i], "frame")) {
+            context->thread_type |= FF_THREAD_FRAME;
+        } else if (g_str_equal(types[i], "slice")) {
+            context->thread_type |= FF_THREAD_SLICE;
+        } else {
+            g_warning("unknown SPICE_AVCODEC_THREAD_TYPE '%s'", types[i]);
+        }
+    }
+    g_strfreev(types);
+
+    if (!(context->thread_type & FF_THREAD_FRAME)) {
+        /* output each picture as soon as it is decoded */
+        context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    }
+#ifndef SPICE_QUALITY
+    context->flags2 |= AV_CODEC_FLAG2_FAST;
+#endif
+}
+
+/* SPICE_VIDEO_DECODER=avcodec selects libavcodec over GStreamer */
+G_GNUC_INTERNAL
+gboolean avcodec_video_enabled(void)
+{
+    return g_strcmp0(g_getenv("SPICE_VIDEO_DECODER"), "avcodec") == 0;
+}
+
+G_GNUC_INTERNAL
+gboolean avcodec_video_has_codec(int codec_type)
+{
+    if (codec_type <= 0 || (gsize)codec_type >= G_N_ELEMENTS(avcodec_ids) ||
+        avcodec_ids[codec_type] == AV_CODEC_ID_NONE) {
+        return FALSE;
+    }
+    return avcodec_find_decoder(avcodec_ids[codec_type]) != NULL;
+}
+
+G_GNUC_INTERNAL
+VideoDecoder* create_avcodec_decoder(int codec_type, display_stream *stream)
+{
+    AVCodecDecoder *decoder;
+    const AVCodec *codec;
+    AVCodecContext *context;
+    int ret;
+
+    if (!avcodec_video_has_codec(codec_type)) {
+        return NULL;
+    }
+    codec = avcodec_find_decoder(avcodec_ids[codec_type]);
+    context = avcodec_alloc_context3(codec);
+    g_return_val_if_fail(context != NULL, NULL);
+    avcodec_decoder_set_threading(context);
+
+    ret = avcodec_open2(context, codec, NULL);
+    if (ret < 0) {
+        g_warning("could not open the libavcodec %s decoder: %s",
+                  codec->name, av_err2str(ret));
+        avcodec_free_context(&context);
+        return NULL;
+    }
+    SPICE_DEBUG("decoding %s with libavcodec, %d threads, thread type %d",
+                codec->name, context->thread_count, context->active_thread_type);
+
+    decoder = g_new0(AVCodecDecoder, 1);
+    decoder->base.destroy = avcodec_decoder_destroy;
+    decoder->base.reschedule = avcodec_decoder_reschedule;
+    decoder->base.queue_frame = avcodec_decoder_queue_frame;
+    decoder->base.codec_type = codec_type;
+    decoder->base.stream = stream;
+
+    decoder->context = context;
+    decoder->packet = av_packet_alloc();
+    decoder->picture = av_frame_alloc();
+    decoder->pending = g_queue_new();
+    decoder->decoded = g_queue_new();
+    video_worker_init(&decoder->worker, &decoder->base, avcodec_decoder_worker,
+                      avcodec_decoder_schedule, avcodec_decoder_display_frame);
+
+    /* All the other fields are initialized to zero by g_new0(). */
+
+    /* makes the draw-area visible */
+    hand_pipeline_to_widget(stream, NULL);
+
+    return (VideoDecoder*)decoder;
+}
@@ -19,6 +19,7 @@
 #include "spice-client.h"
 #include "spice-common.h"
 #include "spice-channel-priv.h"
+#include "spice-session-priv.h"
 #include "common/recorder.h"
 
 #include "channel-display-priv.h"
@@ -26,7 +27,7 @@
 #include <gst/gst.h>
 #include <gst/app/gstappsrc.h>
 #include <gst/app/gstappsink.h>
-#include <gst/video/gstvideometa.h>
+#include <gst/video/video.h>
 
 
 typedef struct SpiceGstFrame SpiceGstFrame;
@@ -56,13 +57,24 @@ typedef struct SpiceGstDecoder {
     SpiceGstFrame *display_frame;
     guint timer_id;
     guint pending_samples;
+
+    /* ---------- Settings ---------- */
+
+    gboolean low_latency;
+    guint max_decoded_frames;
+
+    /* where the decoder goes when its stream is destroyed, if it can
+     * be reused */
+    SpiceVideoDecoderPool *pool;
 } SpiceGstDecoder;
 
 #define VALID_VIDEO_CODEC_TYPE(codec) \
     (codec > 0 && codec < G_N_ELEMENTS(gst_opts))
 
-/* Decoded frames are big so limit how many are queued by GStreamer */
+/* Decoded frames are big so limit how many are queued by GStreamer,
+ * SPICE_GST_MAX_DECODED_FRAMES overrides it */
 #define MAX_DECODED_FRAMES 2
+#define MAX_DECODED_FRAMES_LOW_LATENCY 1
 
 /* GstPlayFlags enum is in plugin's header which should not be exported.
  * https://bugzilla.gnome.org/show_bug.cgi?id=784279
@@ -126,22 +138,14 @@ static void schedule_frame(SpiceGstDecoder *decoder);
 
 RECORDER(frames_stats, 64, "Frames statistics");
 
-static int spice_gst_buffer_get_stride(GstBuffer *buffer)
-{
-    GstVideoMeta *video = gst_buffer_get_video_meta(buffer);
-    return video && video->n_planes > 0 ? video->stride[0] : SPICE_UNKNOWN_STRIDE;
-}
-
-/* main context */
+/* channel context */
 static gboolean display_frame(gpointer video_decoder)
 {
     SpiceGstDecoder *decoder = (SpiceGstDecoder*)video_decoder;
     SpiceGstFrame *gstframe;
     GstCaps *caps;
-    gint width, height;
-    GstStructure *s;
-    GstBuffer *buffer;
-    GstMapInfo mapinfo;
+    GstVideoInfo info;
+    GstVideoFrame frame;
 
     g_mutex_lock(&decoder->queues_mutex);
     decoder->timer_id = 0;
@@ -162,22 +166,25 @@ static gboolean display_frame(gpointer video_decoder)
         goto error;
     }
 
-    s = gst_caps_get_structure(caps, 0);
-    if (!gst_structure_get_int(s, "width", &width) ||
-        !gst_structure_get_int(s, "height", &height)) {
+    if (!gst_video_info_from_caps(&info, caps)) {
         spice_warning("GStreamer error: could not get the size of the frame");
         goto error;
     }
 
-    buffer = gst_sample_get_buffer(gstframe->decoded_sample);
-    if (!gst_buffer_map(buffer, &mapinfo, GST_MAP_READ)) {
+    /* maps the plane at its offset and stride, from the video meta if
+     * any, rather than merging the memories of the buffer into a copy */
+    if (!gst_video_frame_map(&frame, &info,
+                             gst_sample_get_buffer(gstframe->decoded_sample),
+                             GST_MAP_READ)) {
         spice_warning("GStreamer error: could not map the buffer");
         goto error;
     }
 
     stream_display_frame(decoder->base.stream, gstframe->encoded_frame,
-                         width, height, spice_gst_buffer_get_stride(buffer), mapinfo.data);
-    gst_buffer_unmap(buffer, &mapinfo);
+                         GST_VIDEO_FRAME_WIDTH(&frame), GST_VIDEO_FRAME_HEIGHT(&frame),
+                         GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0),
+                         GST_VIDEO_FRAME_PLANE_DATA(&frame, 0));
+    gst_video_frame_unmap(&frame);
 
  error:
     free_gst_frame(gstframe);
@@ -297,13 +304,15 @@ static void schedule_frame(SpiceGstDecoder *decoder)
         }
 
         if (spice_mmtime_diff(gstframe->encoded_frame->mm_time, now) >= 0) {
-            decoder->timer_id = g_timeout_add(gstframe->encoded_frame->mm_time - now,
-                                              display_frame, decoder);
+            decoder->timer_id = spice_channel_timeout_add(decoder->base.stream->channel,
+                                                          gstframe->encoded_frame->mm_time - now,
+                                                          display_frame, decoder);
         } else if (decoder->display_frame && !decoder->pending_samples) {
             /* Still attempt to display the least out of date frame so the
              * video is not completely frozen for an extended period of time.
              */
-            decoder->timer_id = g_timeout_add(0, display_frame, decoder);
+            decoder->timer_id = spice_channel_timeout_add(decoder->base.stream->channel,
+                                                          0, display_frame, decoder);
         } else {
             SPICE_DEBUG("%s: rendering too late by %u ms (ts: %u, mmtime: %u), dropping",
                         __FUNCTION__, now - gstframe->encoded_frame->mm_time,
@@ -324,7 +333,7 @@ static void schedule_frame(SpiceGstDecoder *decoder)
  * as soon as they become available. Instead just increment pending_samples so
  * schedule_frame() knows whether it can pull a new sample when it needs one.
  *
- * Note that GStreamer's signals are not always run in the main context, hence
+ * Note that GStreamer's signals are not always run in the channel context, hence
  * the schedule_frame() + display_frame() mechanism. So we might as well use
  * a callback here (lower overhead).
  */
@@ -382,6 +391,20 @@ static gboolean handle_pipeline_message(GstBus *bus, GstMessage *msg, gpointer v
         free_pipeline(decoder);
         break;
     }
+    case GST_MESSAGE_LATENCY: {
+        GstQuery *query = gst_query_new_latency();
+        GstClockTime min_latency, max_latency;
+        gboolean live;
+
+        if (gst_element_query(decoder->pipeline, query)) {
+            gst_query_parse_latency(query, &live, &min_latency, &max_latency);
+            SPICE_DEBUG("%s pipeline latency for stream %u: %" GST_TIME_FORMAT,
+                        gst_opts[decoder->base.codec_type].name,
+                        decoder->base.stream->id, GST_TIME_ARGS(min_latency));
+        }
+        gst_query_unref(query);
+        break;
+    }
     case GST_MESSAGE_STREAM_START: {
         gchar *filename = g_strdup_printf("spice-gtk-gst-pipeline-debug-%" G_GUINT32_FORMAT "-%s",
                                           decoder->base.stream->id,
@@ -489,17 +512,61 @@ deep_element_added_cb(GstBin *pipeline, GstBin *bin, GstElement *element,
     }
 }
 
-static gboolean create_pipeline(SpiceGstDecoder *decoder)
+/* GStreamer thread
+ *
+ * Tell upstream that the frames may come with a video meta. Otherwise
+ * the decoders and converters that produce frames with padded strides
+ * or plane offsets copy each of them into a tightly packed buffer for
+ * appsink, while display_frame() can use the planes where they are.
+ */
+static GstPadProbeReturn appsink_query_probe(GstPad *pad, GstPadProbeInfo *info,
+                                             gpointer data)
+{
+    GstQuery *query = GST_PAD_PROBE_INFO_QUERY(info);
+
+    if (GST_QUERY_TYPE(query) == GST_QUERY_ALLOCATION &&
+        !gst_query_find_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL)) {
+        gst_query_add_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL);
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+static GstElement *create_appsink(void)
+{
+    GstElement *sink;
+    GstCaps *caps;
+    GstPad *pad;
+
+    sink = gst_element_factory_make("appsink", "sink");
+    if (sink == NULL) {
+        spice_warning("error upon creation of 'appsink' element");
+        return NULL;
+    }
+    caps = gst_caps_from_string("video/x-raw,format=BGRx");
+    g_object_set(sink,
+             "caps", caps,
+             "sync", FALSE,
+             "drop", FALSE,
+             NULL);
+    gst_caps_unref(caps);
+    pad = gst_element_get_static_pad(sink, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM,
+                      appsink_query_probe, NULL, NULL);
+    gst_object_unref(pad);
+
+    return sink;
+}
+
+static GstElement *create_playbin(SpiceGstDecoder *decoder)
 {
-    GstBus *bus;
     GstElement *playbin, *sink;
     SpiceGstPlayFlags flags;
-    GstCaps *caps;
 
     playbin = gst_element_factory_make("playbin", "playbin");
     if (playbin == NULL) {
         spice_warning("error upon creation of 'playbin' element");
-        return FALSE;
+        return NULL;
     }
 
     /* Passing the pipeline to widget, try to get window handle and
@@ -507,19 +574,11 @@ static gboolean create_pipeline(SpiceGstDecoder *decoder)
      * will happen only when prepare-window-handle message is received
      */
     if (!hand_pipeline_to_widget(decoder->base.stream, GST_PIPELINE(playbin))) {
-        sink = gst_element_factory_make("appsink", "sink");
+        sink = create_appsink();
         if (sink == NULL) {
-            spice_warning("error upon creation of 'appsink' element");
             gst_object_unref(playbin);
-            return FALSE;
+            return NULL;
         }
-        caps = gst_caps_from_string("video/x-raw,format=BGRx");
-        g_object_set(sink,
-                 "caps", caps,
-                 "sync", FALSE,
-                 "drop", FALSE,
-                 NULL);
-        gst_caps_unref(caps);
         g_object_set(playbin,
                  "video-sink", gst_object_ref(sink),
                  NULL);
@@ -562,14 +621,132 @@ static gboolean create_pipeline(SpiceGstDecoder *decoder)
     flags &= ~(GST_PLAY_FLAG_AUDIO | GST_PLAY_FLAG_TEXT);
     g_object_set(playbin, "flags", flags, NULL);
 
+    return playbin;
+}
+
+/* sets the property if the element has it, from its string form */
+static void set_element_arg(GstElement *element, const gchar *name, const gchar *value)
+{
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(element), name)) {
+        SPICE_DEBUG("setting %s %s=%s", gst_element_name(element), name, value);
+        gst_util_set_object_arg(G_OBJECT(element), name, value);
+    } else {
+        SPICE_DEBUG("low latency: %s has no %s property, not tuned",
+                    gst_element_name(element), name);
+    }
+}
+
+/* Tunes the decoders for latency rather than throughput. Frame threads
+ * each add a frame of delay in libav, slice threads do not. The
+ * elements are matched by factory, their names are instance names such
+ * as avdec_h264-0. */
+static void tune_low_latency_element(const GValue *item, gpointer data)
+{
+    GstElement *element = g_value_get_object(item);
+    const gchar *threads = data;
+    GstElementFactory *factory = gst_element_get_factory(element);
+    const gchar *name;
+
+    if (factory == NULL)
+        return;
+    name = gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory));
+
+    if (g_str_has_prefix(name, "avdec_")) {
+        set_element_arg(element, "thread-type", "slice");
+        set_element_arg(element, "max-threads", threads);
+    } else if (g_str_equal(name, "jpegdec")) {
+        set_element_arg(element, "idct-method", "ifast");
+    } else if (g_str_equal(name, "vp8dec") || g_str_equal(name, "vp9dec")) {
+        set_element_arg(element, "threads", threads);
+    } else if (g_str_equal(name, "videoconvert")) {
+        set_element_arg(element, "n-threads", threads);
+    } else if (gst_element_factory_list_is_type(factory, GST_ELEMENT_FACTORY_TYPE_DECODER)) {
+        SPICE_DEBUG("low latency: decoder %s (%s) not tuned",
+                    gst_element_name(element), name);
+    }
+}
+
+/* appsrc ! parser ! decoder ! videoconvert ! appsink, without playbin's
+ * typefinding and autoplugging, nor its queues */
+static GstElement *create_low_latency_pipeline(SpiceGstDecoder *decoder)
+{
+    GstElement *pipeline, *src, *convert, *sink;
+    GstIterator *it;
+    gboolean linked;
+    GError *err = NULL;
+    gchar *desc, *threads;
+    GstPad *pad;
+
+    desc = g_strdup_printf("appsrc name=src ! %s ! videoconvert name=convert",
+                           gst_opts[decoder->base.codec_type].dec_name);
+    pipeline = gst_parse_launch_full(desc, NULL, GST_PARSE_FLAG_FATAL_ERRORS, &err);
+    g_free(desc);
+    if (pipeline == NULL) {
+        spice_warning("error upon creation of the low latency pipeline: %s",
+                      err ? err->message : "unknown error");
+        g_clear_error(&err);
+        return NULL;
+    }
+
+    sink = create_appsink();
+    if (sink == NULL) {
+        gst_object_unref(pipeline);
+        return NULL;
+    }
+    g_object_set(sink, "enable-last-sample", FALSE, NULL);
+    gst_bin_add(GST_BIN(pipeline), gst_object_ref(sink));
+    convert = gst_bin_get_by_name(GST_BIN(pipeline), "convert");
+    linked = gst_element_link(convert, sink);
+    gst_object_unref(convert);
+    if (!linked) {
+        spice_warning("error upon linking the low latency pipeline");
+        gst_object_unref(sink);
+        gst_object_unref(pipeline);
+        return NULL;
+    }
+    decoder->appsink = GST_APP_SINK(sink);
+
+    /* the appsink gets the statistics probe playbin installs with
+     * deep_element_added_cb() */
+    pad = gst_element_get_static_pad(sink, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, sink_event_probe, decoder, NULL);
+    gst_object_unref(pad);
+
+    threads = g_strdup_printf("%u", g_get_num_processors());
+    it = gst_bin_iterate_recurse(GST_BIN(pipeline));
+    gst_iterator_foreach(it, tune_low_latency_element, threads);
+    gst_iterator_free(it);
+    g_free(threads);
+
+    src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+    app_source_setup(pipeline, src, decoder);
+    gst_object_unref(src);
+
+    /* there is no overlay, makes the draw-area visible */
+    hand_pipeline_to_widget(decoder->base.stream, NULL);
+
+    return pipeline;
+}
+
+static gboolean create_pipeline(SpiceGstDecoder *decoder)
+{
+    GstBus *bus;
+
     g_warn_if_fail(decoder->appsrc == NULL);
-    decoder->pipeline = playbin;
+    if (decoder->low_latency) {
+        decoder->pipeline = create_low_latency_pipeline(decoder);
+    } else {
+        decoder->pipeline = create_playbin(decoder);
+    }
+    if (decoder->pipeline == NULL) {
+        return FALSE;
+    }
 
     if (decoder->appsink) {
         GstAppSinkCallbacks appsink_cbs = { NULL };
         appsink_cbs.new_sample = new_sample;
         gst_app_sink_set_callbacks(decoder->appsink, &appsink_cbs, decoder, NULL);
-        gst_app_sink_set_max_buffers(decoder->appsink, MAX_DECODED_FRAMES);
+        gst_app_sink_set_max_buffers(decoder->appsink, decoder->max_decoded_frames);
         gst_app_sink_set_drop(decoder->appsink, FALSE);
     }
     bus = gst_pipeline_get_bus(GST_PIPELINE(decoder->pipeline));
@@ -605,16 +782,13 @@ static void spice_gst_decoder_reschedule(VideoDecoder *video_decoder)
     g_mutex_unlock(&decoder->queues_mutex);
 
     if (timer_id != 0) {
-        g_source_remove(timer_id);
+        spice_channel_source_remove(decoder->base.stream->channel, timer_id);
     }
     schedule_frame(decoder);
 }
 
-/* main context */
-static void spice_gst_decoder_destroy(VideoDecoder *video_decoder)
+static void spice_gst_decoder_free(SpiceGstDecoder *decoder)
 {
-    SpiceGstDecoder *decoder = (SpiceGstDecoder*)video_decoder;
-
     /* Stop and free the pipeline to ensure there will not be any further
      * new_sample() call (clearing thread-safety concerns).
      */
@@ -625,7 +799,7 @@ static void spice_gst_decoder_destroy(VideoDecoder *video_decoder)
      * scheduled display_frame() call and drop the queued frames.
      */
     if (decoder->timer_id) {
-        g_source_remove(decoder->timer_id);
+        spice_channel_source_remove(decoder->base.stream->channel, decoder->timer_id);
     }
     g_mutex_clear(&decoder->queues_mutex);
     g_queue_free_full(decoder->decoding_queue, (GDestroyNotify)free_gst_frame);
@@ -640,6 +814,215 @@ static void spice_gst_decoder_destroy(VideoDecoder *video_decoder)
      */
 }
 
+/* Drops the frames being decoded or displayed and detaches the decoder
+ * from its stream, leaving the pipeline playing and ready for the next
+ * stream. Returns FALSE if the pipeline cannot be reused.
+ */
+static gboolean spice_gst_decoder_flush(SpiceGstDecoder *decoder)
+{
+    GstBus *bus;
+
+    if (decoder->pipeline == NULL || decoder->appsrc == NULL || decoder->appsink == NULL) {
+        return FALSE;
+    }
+
+    if (decoder->timer_id) {
+        spice_channel_source_remove(decoder->base.stream->channel, decoder->timer_id);
+        decoder->timer_id = 0;
+    }
+
+    /* Once the flush stops, the streaming threads have left new_sample()
+     * and sink_event_probe(), and no frame is left in the pipeline.
+     */
+    if (!gst_element_send_event(GST_ELEMENT(decoder->appsrc), gst_event_new_flush_start()) ||
+        !gst_element_send_event(GST_ELEMENT(decoder->appsrc), gst_event_new_flush_stop(FALSE))) {
+        SPICE_DEBUG("GStreamer error: could not flush the pipeline");
+        return FALSE;
+    }
+
+    g_mutex_lock(&decoder->queues_mutex);
+    while (!g_queue_is_empty(decoder->decoding_queue)) {
+        free_gst_frame(g_queue_pop_head(decoder->decoding_queue));
+    }
+    g_clear_pointer(&decoder->display_frame, free_gst_frame);
+    decoder->pending_samples = 0;
+    g_mutex_unlock(&decoder->queues_mutex);
+
+    /* the watch is added again in the context of the next stream */
+    bus = gst_pipeline_get_bus(GST_PIPELINE(decoder->pipeline));
+    gst_bus_remove_watch(bus);
+    gst_object_unref(bus);
+    decoder->base.stream = NULL;
+
+    return TRUE;
+}
+
+/* Attaches a flushed decoder to stream */
+static void spice_gst_decoder_bind(SpiceGstDecoder *decoder, display_stream *stream)
+{
+    GstBus *bus;
+
+    decoder->base.stream = stream;
+    decoder->last_mm_time = stream_get_time(stream);
+
+    /* drop the messages posted while idle */
+    bus = gst_pipeline_get_bus(GST_PIPELINE(decoder->pipeline));
+    gst_bus_set_flushing(bus, TRUE);
+    gst_bus_set_flushing(bus, FALSE);
+    gst_bus_add_watch(bus, handle_pipeline_message, decoder);
+    gst_object_unref(bus);
+
+    if (decoder->low_latency) {
+        /* makes the draw-area visible */
+        hand_pipeline_to_widget(stream, NULL);
+    }
+}
+
+/* ---------- Idle decoders pool ---------- */
+
+/*
+ * The decoders of the destroyed streams are flushed and kept by the
+ * session for the next streams of the same codec, so that a guest
+ * starting and stopping videos does not build, negotiate and tear down
+ * a pipeline each time. Only the decoders presenting through appsink
+ * are kept, the GstVideoOverlay ones are tied to the widget of their
+ * stream.
+ */
+struct SpiceVideoDecoderPool {
+    GMutex lock;
+    GQueue idle[G_N_ELEMENTS(gst_opts)];
+    /* idle decoders kept per codec */
+    guint size;
+    guint64 hits;
+    guint64 misses;
+};
+
+G_GNUC_INTERNAL
+SpiceVideoDecoderPool *video_decoder_pool_new(guint size)
+{
+    SpiceVideoDecoderPool *pool = g_new0(SpiceVideoDecoderPool, 1);
+    guint i;
+
+    g_mutex_init(&pool->lock);
+    for (i = 0; i < G_N_ELEMENTS(pool->idle); i++) {
+        g_queue_init(&pool->idle[i]);
+    }
+    pool->size = size;
+    return pool;
+}
+
+/* frees the idle decoders beyond size */
+static void video_decoder_pool_shrink(SpiceVideoDecoderPool *pool, guint size)
+{
+    GSList *l, *unused = NULL;
+    guint i;
+
+    g_mutex_lock(&pool->lock);
+    for (i = 0; i < G_N_ELEMENTS(pool->idle); i++) {
+        while (g_queue_get_length(&pool->idle[i]) > size) {
+            unused = g_slist_prepend(unused, g_queue_pop_tail(&pool->idle[i]));
+        }
+    }
+    g_mutex_unlock(&pool->lock);
+
+    for (l = unused; l != NULL; l = l->next) {
+        spice_gst_decoder_free(l->data);
+    }
+    g_slist_free(unused);
+}
+
+G_GNUC_INTERNAL
+void video_decoder_pool_free(SpiceVideoDecoderPool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    video_decoder_pool_shrink(pool, 0);
+    g_mutex_clear(&pool->lock);
+    g_free(pool);
+}
+
+G_GNUC_INTERNAL
+void video_decoder_pool_trim(SpiceVideoDecoderPool *pool)
+{
+    video_decoder_pool_shrink(pool, 0);
+}
+
+G_GNUC_INTERNAL
+void video_decoder_pool_set_size(SpiceVideoDecoderPool *pool, guint size)
+{
+    g_mutex_lock(&pool->lock);
+    pool->size = size;
+    g_mutex_unlock(&pool->lock);
+
+    video_decoder_pool_shrink(pool, size);
+}
+
+G_GNUC_INTERNAL
+GVariant *video_decoder_pool_get_stats(SpiceVideoDecoderPool *pool)
+{
+    GVariantBuilder builder;
+    guint64 idle = 0;
+    guint i;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{st}"));
+    g_mutex_lock(&pool->lock);
+    for (i = 0; i < G_N_ELEMENTS(pool->idle); i++) {
+        idle += g_queue_get_length(&pool->idle[i]);
+    }
+    g_variant_builder_add(&builder, "{st}", "idle", idle);
+    g_variant_builder_add(&builder, "{st}", "hits", pool->hits);
+    g_variant_builder_add(&builder, "{st}", "misses", pool->misses);
+    g_mutex_unlock(&pool->lock);
+
+    return g_variant_builder_end(&builder);
+}
+
+static SpiceGstDecoder *video_decoder_pool_take(SpiceVideoDecoderPool *pool, int codec_type)
+{
+    SpiceGstDecoder *decoder;
+
+    g_mutex_lock(&pool->lock);
+    decoder = g_queue_pop_head(&pool->idle[codec_type]);
+    if (decoder != NULL) {
+        pool->hits++;
+    } else {
+        pool->misses++;
+    }
+    g_mutex_unlock(&pool->lock);
+
+    return decoder;
+}
+
+static gboolean video_decoder_pool_put(SpiceVideoDecoderPool *pool, SpiceGstDecoder *decoder)
+{
+    GQueue *idle = &pool->idle[decoder->base.codec_type];
+    gboolean kept = FALSE;
+
+    g_mutex_lock(&pool->lock);
+    if (g_queue_get_length(idle) < pool->size) {
+        g_queue_push_head(idle, decoder);
+        kept = TRUE;
+    }
+    g_mutex_unlock(&pool->lock);
+
+    return kept;
+}
+
+/* main context */
+static void spice_gst_decoder_destroy(VideoDecoder *video_decoder)
+{
+    SpiceGstDecoder *decoder = (SpiceGstDecoder*)video_decoder;
+
+    if (decoder->pool != NULL && spice_gst_decoder_flush(decoder) &&
+        video_decoder_pool_put(decoder->pool, decoder)) {
+        return;
+    }
+
+    spice_gst_decoder_free(decoder);
+}
+
 
 /* spice_gst_decoder_queue_frame() queues the SpiceFrame for decoding and
  * displaying. The steps it goes through are as follows:
@@ -689,6 +1072,7 @@ static gboolean spice_gst_decoder_queue_frame(VideoDecoder *video_decoder,
                                               SpiceFrame *frame, int margin)
 {
     SpiceGstDecoder *decoder = (SpiceGstDecoder*)video_decoder;
+    StreamFrameAction action;
 
     if (frame->size == 0) {
         SPICE_DEBUG("got an empty frame buffer!");
@@ -704,12 +1088,13 @@ static gboolean spice_gst_decoder_queue_frame(VideoDecoder *video_decoder,
     }
     decoder->last_mm_time = frame->mm_time;
 
-    if (margin < 0 &&
-        decoder->base.codec_type == SPICE_VIDEO_CODEC_TYPE_MJPEG) {
-        /* Dropping MJPEG frames has no impact on those that follow and
-         * saves CPU so do it.
+    action = stream_get_frame_action(video_decoder, frame, margin);
+    if (action == STREAM_FRAME_SKIP) {
+        /* Dropping MJPEG frames, or H.264/H.265 ones no other frame
+         * references, has no impact on those that follow and saves CPU
+         * so do it.
          */
-        SPICE_DEBUG("dropping a late MJPEG frame");
+        SPICE_DEBUG("dropping a late frame no other frame references");
         spice_frame_free(frame);
         return TRUE;
     }
@@ -737,6 +1122,10 @@ static gboolean spice_gst_decoder_queue_frame(VideoDecoder *video_decoder,
     GST_BUFFER_DURATION(buffer) = GST_CLOCK_TIME_NONE;
     GST_BUFFER_DTS(buffer) = GST_CLOCK_TIME_NONE;
     GST_BUFFER_PTS(buffer) = pts;
+    if (action == STREAM_FRAME_DECODE_ONLY) {
+        /* the decoder drops it once decoded, before the conversion */
+        GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DECODE_ONLY);
+    }
 #if GST_CHECK_VERSION(1,14,0)
     gst_buffer_add_reference_timestamp_meta(buffer, gst_static_caps_get(&stream_reference),
                                             pts, GST_CLOCK_TIME_NONE);
@@ -771,13 +1160,44 @@ static gboolean gstvideo_init(void)
     return success > 0;
 }
 
+/* SPICE_GST_LOW_LATENCY=1 builds an explicit pipeline tuned for latency
+ * instead of playbin, at the cost of the GstVideoOverlay presentation */
+static gboolean gstvideo_low_latency(void)
+{
+    return g_strcmp0(g_getenv("SPICE_GST_LOW_LATENCY"), "1") == 0;
+}
+
+static guint gstvideo_max_decoded_frames(gboolean low_latency)
+{
+    const gchar *env = g_getenv("SPICE_GST_MAX_DECODED_FRAMES");
+
+    if (env != NULL) {
+        return CLAMP(strtoul(env, NULL, 10), 1, 64);
+    }
+    return low_latency ? MAX_DECODED_FRAMES_LOW_LATENCY : MAX_DECODED_FRAMES;
+}
+
 G_GNUC_INTERNAL
 VideoDecoder* create_gstreamer_decoder(int codec_type, display_stream *stream)
 {
     SpiceGstDecoder *decoder = NULL;
+    SpiceVideoDecoderPool *pool;
+    gboolean low_latency;
 
     g_return_val_if_fail(VALID_VIDEO_CODEC_TYPE(codec_type), NULL);
 
+    pool = spice_session_get_video_decoder_pool(spice_channel_get_session(stream->channel));
+    low_latency = gstvideo_low_latency();
+    /* the stream would not use an overlay, take an idle appsink decoder */
+    if (low_latency || !stream->surface->streaming_mode) {
+        decoder = video_decoder_pool_take(pool, codec_type);
+        if (decoder != NULL) {
+            SPICE_DEBUG("reusing an idle %s decoder", gst_opts[codec_type].name);
+            spice_gst_decoder_bind(decoder, stream);
+            return (VideoDecoder*)decoder;
+        }
+    }
+
     if (gstvideo_init()) {
         decoder = g_new0(SpiceGstDecoder, 1);
         decoder->base.destroy = spice_gst_decoder_destroy;
@@ -786,12 +1206,16 @@ VideoDecoder* create_gstreamer_decoder(int codec_type, display_stream *stream)
         decoder->base.codec_type = codec_type;
         decoder->base.stream = stream;
         decoder->last_mm_time = stream_get_time(stream);
+        decoder->low_latency = low_latency;
+        decoder->max_decoded_frames = gstvideo_max_decoded_frames(decoder->low_latency);
         g_mutex_init(&decoder->queues_mutex);
         decoder->decoding_queue = g_queue_new();
 
         if (!create_pipeline(decoder)) {
-            decoder->base.destroy((VideoDecoder*)decoder);
+            spice_gst_decoder_free(decoder);
             decoder = NULL;
+        } else if (decoder->appsink) {
+            decoder->pool = pool;
         }
     }
 
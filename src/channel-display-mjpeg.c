@@ -25,6 +25,34 @@
 
 /* MJpeg decoder implementation */
 
+/*
+ * The frames are decoded on a worker thread as soon as they are queued,
+ * in order, and only their presentation is scheduled at their mm_time on
+ * the channel context. The decoded pixels go to the surface in
+ * stream_display_frame() from there, since the surface belongs to the
+ * channel context and a frame must not show before its time, see
+ * channel-display-worker.c.
+ */
+
+typedef enum {
+    MJPEG_FRAME_QUEUED,
+    MJPEG_FRAME_DECODING,
+    MJPEG_FRAME_DONE,
+    /* dropped while queued or decoding, the worker frees it */
+    MJPEG_FRAME_CANCELLED,
+} MJpegFrameState;
+
+typedef struct MJpegFrame {
+    SpiceFrame *frame;
+    MJpegFrameState state;
+
+    /* set by the worker */
+    gboolean ok;
+    uint8_t *out;
+    JDIMENSION width;
+    JDIMENSION height;
+} MJpegFrame;
+
 typedef struct MJpegDecoder {
     VideoDecoder base;
 
@@ -34,16 +62,16 @@ typedef struct MJpegDecoder {
     struct jpeg_decompress_struct  mjpeg_cinfo;
     struct jpeg_error_mgr          mjpeg_jerr;
 
-    /* ---------- Frame queue ---------- */
+    /* ---------- Worker thread ---------- */
 
-    GQueue *msgq;
-    SpiceFrame *cur_frame;
-    guint timer_id;
+    /* its lock protects the frame states */
+    VideoWorker worker;
+    /* the frame being decoded, worker only */
+    SpiceFrame *decoding;
 
-    /* ---------- Output frame data ---------- */
+    /* ---------- Frame queue ---------- */
 
-    uint8_t *out_frame;
-    uint32_t out_size;
+    GQueue *msgq;
 } MJpegDecoder;
 
 
@@ -52,8 +80,8 @@ typedef struct MJpegDecoder {
 static void mjpeg_src_init(struct jpeg_decompress_struct *cinfo)
 {
     MJpegDecoder *decoder = SPICE_CONTAINEROF(cinfo->src, MJpegDecoder, mjpeg_src);
-    cinfo->src->bytes_in_buffer = decoder->cur_frame->size;
-    cinfo->src->next_input_byte = decoder->cur_frame->data;
+    cinfo->src->bytes_in_buffer = decoder->decoding->size;
+    cinfo->src->next_input_byte = decoder->decoding->data;
 }
 
 static boolean mjpeg_src_fill(struct jpeg_decompress_struct *cinfo)
@@ -74,27 +102,56 @@ static void mjpeg_src_term(struct jpeg_decompress_struct *cinfo)
 }
 
 
-/* ---------- Decoder proper ---------- */
+/* ---------- Frames ---------- */
 
-static void mjpeg_decoder_schedule(MJpegDecoder *decoder);
+/* called with the lock held */
+static void mjpeg_frame_free(MJpegDecoder *decoder, MJpegFrame *f)
+{
+    video_worker_buffer_put(&decoder->worker, f->out, (gsize)f->width * f->height * 4);
+    spice_frame_free(f->frame);
+    g_free(f);
+}
 
-/* main context */
-static gboolean mjpeg_decoder_decode_frame(gpointer video_decoder)
+/* channel context */
+static void mjpeg_frame_drop(MJpegDecoder *decoder, MJpegFrame *f)
+{
+    g_mutex_lock(&decoder->worker.lock);
+    if (f->state == MJPEG_FRAME_DONE)
+        mjpeg_frame_free(decoder, f);
+    else
+        f->state = MJPEG_FRAME_CANCELLED;
+    g_mutex_unlock(&decoder->worker.lock);
+}
+
+static MJpegFrameState mjpeg_frame_get_state(MJpegDecoder *decoder, MJpegFrame *f)
+{
+    MJpegFrameState state;
+
+    g_mutex_lock(&decoder->worker.lock);
+    state = f->state;
+    g_mutex_unlock(&decoder->worker.lock);
+
+    return state;
+}
+
+
+/* ---------- Decoder proper ---------- */
+
+/* worker thread */
+static gboolean mjpeg_decoder_decode_frame(MJpegDecoder *decoder, MJpegFrame *f)
 {
-    MJpegDecoder *decoder = (MJpegDecoder*)video_decoder;
     JDIMENSION width, height;
     uint8_t *dest;
     uint8_t *lines[4];
 
+    decoder->decoding = f->frame;
     jpeg_read_header(&decoder->mjpeg_cinfo, 1);
     width = decoder->mjpeg_cinfo.image_width;
     height = decoder->mjpeg_cinfo.image_height;
-    if (decoder->out_size < width * height * 4) {
-        g_free(decoder->out_frame);
-        decoder->out_size = width * height * 4;
-        decoder->out_frame = g_malloc(decoder->out_size);
-    }
-    dest = decoder->out_frame;
+    f->out = video_worker_buffer_get(&decoder->worker, (gsize)width * height * 4);
+    f->width = width;
+    f->height = height;
+    dest = f->out;
 
 #ifdef JCS_EXTENSIONS
     // requires jpeg-turbo
@@ -121,7 +178,7 @@ static gboolean mjpeg_decoder_decode_frame(gpointer video_decoder)
      */
     if (decoder->mjpeg_cinfo.rec_outbuf_height > G_N_ELEMENTS(lines)) {
         jpeg_abort_decompress(&decoder->mjpeg_cinfo);
-        g_return_val_if_reached(G_SOURCE_REMOVE);
+        g_return_val_if_reached(FALSE);
     }
 
     while (decoder->mjpeg_cinfo.output_scanline < decoder->mjpeg_cinfo.output_height) {
@@ -151,67 +208,122 @@ static gboolean mjpeg_decoder_decode_frame(gpointer video_decoder)
             }
         }
 #endif
-        dest = &(decoder->out_frame[decoder->mjpeg_cinfo.output_scanline * width * 4]);
+        dest = &(f->out[decoder->mjpeg_cinfo.output_scanline * width * 4]);
     }
     jpeg_finish_decompress(&decoder->mjpeg_cinfo);
+    decoder->decoding = NULL;
 
-    /* Display the frame and dispose of it */
-    stream_display_frame(decoder->base.stream, decoder->cur_frame,
-                         width, height, SPICE_UNKNOWN_STRIDE, decoder->out_frame);
-    g_clear_pointer(&decoder->cur_frame, spice_frame_free);
-    decoder->timer_id = 0;
+    return TRUE;
+}
 
-    /* Schedule the next frame */
-    mjpeg_decoder_schedule(decoder);
+/* worker thread */
+static void mjpeg_decoder_worker(gpointer data, gpointer user_data)
+{
+    MJpegDecoder *decoder = user_data;
+    MJpegFrame *f = data;
+    gboolean ok;
+
+    g_mutex_lock(&decoder->worker.lock);
+    if (f->state == MJPEG_FRAME_CANCELLED) {
+        mjpeg_frame_free(decoder, f);
+        g_mutex_unlock(&decoder->worker.lock);
+        return;
+    }
+    f->state = MJPEG_FRAME_DECODING;
+    g_mutex_unlock(&decoder->worker.lock);
+
+    ok = mjpeg_decoder_decode_frame(decoder, f);
+
+    g_mutex_lock(&decoder->worker.lock);
+    if (f->state == MJPEG_FRAME_CANCELLED) {
+        mjpeg_frame_free(decoder, f);
+    } else {
+        f->ok = ok;
+        f->state = MJPEG_FRAME_DONE;
+        video_worker_wakeup(&decoder->worker);
+    }
+    g_mutex_unlock(&decoder->worker.lock);
+}
 
-    return G_SOURCE_REMOVE;
+/* channel context */
+static void mjpeg_decoder_display_frame(VideoDecoder *video_decoder)
+{
+    MJpegDecoder *decoder = (MJpegDecoder*)video_decoder;
+    MJpegFrame *f = g_queue_pop_head(decoder->msgq);
+
+    g_return_if_fail(f != NULL);
+
+    /* Display the frame and dispose of it */
+    stream_display_frame(decoder->base.stream, f->frame,
+                         f->width, f->height, SPICE_UNKNOWN_STRIDE, f->out);
+    mjpeg_frame_drop(decoder, f);
 }
 
 /* ---------- VideoDecoder's queue scheduling ---------- */
 
-static void mjpeg_decoder_schedule(MJpegDecoder *decoder)
+/* channel context */
+static void mjpeg_decoder_schedule(VideoDecoder *video_decoder)
 {
-    if (decoder->timer_id) {
+    MJpegDecoder *decoder = (MJpegDecoder*)video_decoder;
+    MJpegFrame *f;
+
+    if (decoder->worker.timer_id) {
         return;
     }
 
     guint32 time = stream_get_time(decoder->base.stream);
-    SpiceFrame *frame = decoder->cur_frame;
-    decoder->cur_frame = NULL;
-    do {
-        if (frame) {
-            if (spice_mmtime_diff(time, frame->mm_time) <= 0) {
-                guint32 d = frame->mm_time - time;
-                decoder->cur_frame = frame;
-                decoder->timer_id = g_timeout_add(d, mjpeg_decoder_decode_frame, decoder);
-                break;
+    while ((f = g_queue_peek_head(decoder->msgq)) != NULL) {
+        MJpegFrameState state = mjpeg_frame_get_state(decoder, f);
+
+        if (state == MJPEG_FRAME_DONE && !f->ok) {
+            g_queue_pop_head(decoder->msgq);
+            mjpeg_frame_drop(decoder, f);
+            continue;
+        }
+
+        if (spice_mmtime_diff(time, f->frame->mm_time) <= 0) {
+            /* on time, displayed at its time once decoded */
+            if (state == MJPEG_FRAME_DONE) {
+                video_worker_display_in(&decoder->worker, f->frame->mm_time - time);
             }
+            break;
+        }
+
+        if (state == MJPEG_FRAME_DECODING) {
+            /* it was not late when its decoding started */
+            break;
+        }
+        if (state == MJPEG_FRAME_DONE) {
+            MJpegFrame *next = g_queue_peek_nth(decoder->msgq, 1);
 
-            SPICE_DEBUG("%s: rendering too late by %u ms (ts: %u, mmtime: %u), dropping ",
-                        __FUNCTION__, time - frame->mm_time,
-                        frame->mm_time, time);
-            stream_dropped_frame_on_playback(decoder->base.stream);
-            spice_frame_free(frame);
+            /* display it now, unless the next one is due too */
+            if (next == NULL || spice_mmtime_diff(time, next->frame->mm_time) < 0 ||
+                mjpeg_frame_get_state(decoder, next) != MJPEG_FRAME_DONE) {
+                video_worker_display_in(&decoder->worker, 0);
+                break;
+            }
         }
-        frame = g_queue_pop_head(decoder->msgq);
-    } while (frame);
+
+        SPICE_DEBUG("%s: rendering too late by %u ms (ts: %u, mmtime: %u), dropping ",
+                    __FUNCTION__, time - f->frame->mm_time,
+                    f->frame->mm_time, time);
+        stream_dropped_frame_on_playback(decoder->base.stream);
+        g_queue_pop_head(decoder->msgq);
+        mjpeg_frame_drop(decoder, f);
+    }
 }
 
 
 /* mjpeg_decoder_drop_queue() helper */
-static void spice_frame_unref_func(gpointer data, gpointer user_data)
+static void mjpeg_frame_drop_func(gpointer data, gpointer user_data)
 {
-    spice_frame_free(data);
+    mjpeg_frame_drop(user_data, data);
 }
 
 static void mjpeg_decoder_drop_queue(MJpegDecoder *decoder)
 {
-    if (decoder->timer_id != 0) {
-        g_source_remove(decoder->timer_id);
-        decoder->timer_id = 0;
-    }
-    g_clear_pointer(&decoder->cur_frame, spice_frame_free);
-    g_queue_foreach(decoder->msgq, spice_frame_unref_func, NULL);
+    video_worker_stop_display(&decoder->worker);
+    g_queue_foreach(decoder->msgq, mjpeg_frame_drop_func, decoder);
     g_queue_clear(decoder->msgq);
 }
 
@@ -221,16 +333,16 @@ static gboolean mjpeg_decoder_queue_frame(VideoDecoder *video_decoder,
                                           SpiceFrame *frame, int32_t margin)
 {
     MJpegDecoder *decoder = (MJpegDecoder*)video_decoder;
-    SpiceFrame *last_frame;
+    MJpegFrame *last_frame, *f;
 
     last_frame = g_queue_peek_tail(decoder->msgq);
     if (last_frame) {
-        if (spice_mmtime_diff(frame->mm_time, last_frame->mm_time) < 0) {
+        if (spice_mmtime_diff(frame->mm_time, last_frame->frame->mm_time) < 0) {
             /* This should really not happen */
             SPICE_DEBUG("new-frame-time < last-frame-time (%u < %u):"
                         " resetting stream",
                         frame->mm_time,
-                        last_frame->mm_time);
+                        last_frame->frame->mm_time);
             mjpeg_decoder_drop_queue(decoder);
         }
     }
@@ -238,14 +350,17 @@ static gboolean mjpeg_decoder_queue_frame(VideoDecoder *video_decoder,
     /* Dropped MJPEG frames don't impact the ones that come after.
      * So drop late frames as early as possible to save on processing time.
      */
-    if (margin < 0) {
+    if (stream_get_frame_action(video_decoder, frame, margin) == STREAM_FRAME_SKIP) {
         SPICE_DEBUG("dropping a late MJPEG frame");
         spice_frame_free(frame);
         return TRUE;
     }
 
-    g_queue_push_tail(decoder->msgq, frame);
-    mjpeg_decoder_schedule(decoder);
+    f = g_new0(MJpegFrame, 1);
+    f->frame = frame;
+    f->state = MJPEG_FRAME_QUEUED;
+    g_queue_push_tail(decoder->msgq, f);
+    video_worker_push(&decoder->worker, f);
     return TRUE;
 }
 
@@ -253,12 +368,7 @@ static void mjpeg_decoder_reschedule(VideoDecoder *video_decoder)
 {
     MJpegDecoder *decoder = (MJpegDecoder*)video_decoder;
 
-    SPICE_DEBUG("%s", __FUNCTION__);
-    if (decoder->timer_id != 0) {
-        g_source_remove(decoder->timer_id);
-        decoder->timer_id = 0;
-    }
-    mjpeg_decoder_schedule(decoder);
+    video_worker_reschedule(&decoder->worker);
 }
 
 static void mjpeg_decoder_destroy(VideoDecoder* video_decoder)
@@ -266,9 +376,11 @@ static void mjpeg_decoder_destroy(VideoDecoder* video_decoder)
     MJpegDecoder *decoder = (MJpegDecoder*)video_decoder;
 
     mjpeg_decoder_drop_queue(decoder);
+    /* the worker frees the cancelled frames */
+    video_worker_stop(&decoder->worker);
     g_queue_free(decoder->msgq);
     jpeg_destroy_decompress(&decoder->mjpeg_cinfo);
-    g_free(decoder->out_frame);
+    video_worker_clear(&decoder->worker);
     g_free(decoder);
 }
 
@@ -286,6 +398,8 @@ VideoDecoder* create_mjpeg_decoder(int codec_type, display_stream *stream)
     decoder->base.stream = stream;
 
     decoder->msgq = g_queue_new();
+    video_worker_init(&decoder->worker, &decoder->base, mjpeg_decoder_worker,
+                      mjpeg_decoder_schedule, mjpeg_decoder_display_frame);
 
     decoder->mjpeg_cinfo.err = jpeg_std_error(&decoder->mjpeg_jerr);
     jpeg_create_decompress(&decoder->mjpeg_cinfo);
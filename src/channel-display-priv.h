@@ -28,6 +28,8 @@
 #include "client_sw_canvas.h"
 #include "common/quic.h"
 #include "common/rop3.h"
+#include "spice-surface-pool.h"
+#include "video-nal.h"
 
 #include <gst/gst.h>
 
@@ -87,7 +89,47 @@ VideoDecoder* create_mjpeg_decoder(int codec_type, display_stream *stream);
 #endif
 VideoDecoder* create_gstreamer_decoder(int codec_type, display_stream *stream);
 gboolean gstvideo_has_codec(int codec_type);
+#ifdef HAVE_LIBAVCODEC
+VideoDecoder* create_avcodec_decoder(int codec_type, display_stream *stream);
+gboolean avcodec_video_enabled(void);
+gboolean avcodec_video_has_codec(int codec_type);
+#endif
 
+/* channel-display-worker.c */
+typedef void (*VideoWorkerFunc)(VideoDecoder *decoder);
+
+typedef struct VideoWorker {
+    VideoDecoder *decoder;
+    GThreadPool *pool;
+    /* protects wakeup_id, the buffers and the decoder's frames */
+    GMutex lock;
+    /* reschedules once a frame is decoded */
+    guint wakeup_id;
+    /* displays the next frame, channel context only */
+    guint timer_id;
+    VideoWorkerFunc schedule;
+    VideoWorkerFunc display;
+
+    /* the decoded frame buffers kept for reuse */
+    GSList *buffers;
+    guint nbuffers;
+    gsize buffer_size;
+} VideoWorker;
+
+void video_worker_init(VideoWorker *w, VideoDecoder *decoder, GFunc decode,
+                       VideoWorkerFunc schedule, VideoWorkerFunc display);
+void video_worker_stop(VideoWorker *w);
+void video_worker_clear(VideoWorker *w);
+void video_worker_push(VideoWorker *w, gpointer frame);
+void video_worker_wakeup(VideoWorker *w);
+void video_worker_display_in(VideoWorker *w, guint32 delay);
+void video_worker_stop_display(VideoWorker *w);
+void video_worker_reschedule(VideoWorker *w);
+uint8_t *video_worker_buffer_get(VideoWorker *w, gsize size);
+void video_worker_buffer_put(VideoWorker *w, uint8_t *buf, gsize size);
+
+
+typedef struct display_front display_front;
 
 typedef struct display_surface {
     guint32                     surface_id;
@@ -100,6 +142,9 @@ typedef struct display_surface {
     SpiceGlzDecoder             *glz_decoder;
     SpiceZlibDecoder            *zlib_decoder;
     SpiceJpegDecoder            *jpeg_decoder;
+    SpiceSurfacePool            *pool;
+    gboolean                    mapped;     /* see surface_pool_alloc() */
+    display_front               *front;     /* primary with display threads */
 } display_surface;
 
 typedef struct drops_sequence_stats {
@@ -119,6 +164,7 @@ struct display_stream {
     int                         have_region;
 
     VideoDecoder                *video_decoder;
+    VideoNalState               nal_state;
 
     SpiceChannel                *channel;
 
@@ -127,6 +173,9 @@ struct display_stream {
     uint32_t             arrive_late_count;
     uint64_t             arrive_late_time;
     uint32_t             num_drops_on_playback;
+    /* late frames not decoded, or not displayed */
+    uint32_t             num_drops_on_decode;
+    uint32_t             num_decode_only;
     uint32_t             num_input_frames;
     drops_sequence_stats cur_drops_seq_stats;
     GArray               *drops_seqs_stats_arr;
@@ -193,6 +242,16 @@ G_STATIC_ASSERT(G_N_ELEMENTS(gst_opts) <= SPICE_VIDEO_CODEC_TYPE_ENUM_END);
 
 guint32 stream_get_time(display_stream *st);
 void stream_dropped_frame_on_playback(display_stream *st);
+
+typedef enum {
+    STREAM_FRAME_DISPLAY,
+    /* late, decode it for the frames that reference it but do not
+     * display it */
+    STREAM_FRAME_DECODE_ONLY,
+    /* late and no frame references it, drop it */
+    STREAM_FRAME_SKIP,
+} StreamFrameAction;
+StreamFrameAction stream_get_frame_action(VideoDecoder *decoder, SpiceFrame *frame, int margin);
 #define SPICE_UNKNOWN_STRIDE 0
 void stream_display_frame(display_stream *st, SpiceFrame *frame, uint32_t width, uint32_t height, int stride, uint8_t* data);
 guintptr get_window_handle(display_stream *st);
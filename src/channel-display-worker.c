@@ -0,0 +1,183 @@
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-channel-priv.h"
+
+#include "channel-display-priv.h"
+
+/*
+ * The threading shared by the video decoders that decode the frames in
+ * order on a worker thread as soon as they are queued, and only schedule
+ * their presentation at their mm_time on the channel context: the
+ * MJPEG and libavcodec ones. The decoder keeps its queue of frames, the
+ * worker wakes its scheduling up when a frame is decoded, displays the
+ * frame it picks with a timer, and recycles the decoded frame buffers.
+ */
+
+/* the decoded frame buffers kept for reuse */
+#define VIDEO_WORKER_MAX_BUFFERS 4
+
+/* channel context */
+static gboolean video_worker_wakeup_cb(gpointer data)
+{
+    VideoWorker *w = data;
+
+    g_mutex_lock(&w->lock);
+    w->wakeup_id = 0;
+    g_mutex_unlock(&w->lock);
+
+    w->schedule(w->decoder);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* channel context */
+static gboolean video_worker_display_cb(gpointer data)
+{
+    VideoWorker *w = data;
+
+    w->timer_id = 0;
+    w->display(w->decoder);
+
+    /* Schedule the next frame */
+    w->schedule(w->decoder);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* @decode runs on the worker thread for each pushed frame, with
+ * @decoder as user data. @schedule picks the next frame to display on
+ * the channel context, @display displays it. */
+G_GNUC_INTERNAL
+void video_worker_init(VideoWorker *w, VideoDecoder *decoder, GFunc decode,
+                       VideoWorkerFunc schedule, VideoWorkerFunc display)
+{
+    w->decoder = decoder;
+    w->schedule = schedule;
+    w->display = display;
+    g_mutex_init(&w->lock);
+    /* a single thread, the frames are decoded in order */
+    w->pool = g_thread_pool_new(decode, decoder, 1, FALSE, NULL);
+}
+
+/* waits for the frame being decoded, @decode still runs for the frames
+ * queued */
+G_GNUC_INTERNAL
+void video_worker_stop(VideoWorker *w)
+{
+    video_worker_stop_display(w);
+    g_thread_pool_free(w->pool, FALSE, TRUE);
+    w->pool = NULL;
+    if (w->wakeup_id != 0) {
+        spice_channel_source_remove(w->decoder->stream->channel, w->wakeup_id);
+        w->wakeup_id = 0;
+    }
+}
+
+G_GNUC_INTERNAL
+void video_worker_clear(VideoWorker *w)
+{
+    g_slist_free_full(w->buffers, g_free);
+    w->buffers = NULL;
+    g_mutex_clear(&w->lock);
+}
+
+G_GNUC_INTERNAL
+void video_worker_push(VideoWorker *w, gpointer frame)
+{
+    g_thread_pool_push(w->pool, frame, NULL);
+}
+
+/* worker thread, called with the lock held: reschedules once a frame is
+ * decoded */
+G_GNUC_INTERNAL
+void video_worker_wakeup(VideoWorker *w)
+{
+    if (w->wakeup_id == 0)
+        w->wakeup_id = spice_channel_timeout_add(w->decoder->stream->channel, 0,
+                                                 video_worker_wakeup_cb, w);
+}
+
+/* channel context */
+G_GNUC_INTERNAL
+void video_worker_display_in(VideoWorker *w, guint32 delay)
+{
+    g_return_if_fail(w->timer_id == 0);
+
+    w->timer_id = spice_channel_timeout_add(w->decoder->stream->channel, delay,
+                                            video_worker_display_cb, w);
+}
+
+/* channel context */
+G_GNUC_INTERNAL
+void video_worker_stop_display(VideoWorker *w)
+{
+    if (w->timer_id != 0) {
+        spice_channel_source_remove(w->decoder->stream->channel, w->timer_id);
+        w->timer_id = 0;
+    }
+}
+
+/* channel context */
+G_GNUC_INTERNAL
+void video_worker_reschedule(VideoWorker *w)
+{
+    SPICE_DEBUG("%s", __FUNCTION__);
+    video_worker_stop_display(w);
+    w->schedule(w->decoder);
+}
+
+G_GNUC_INTERNAL
+uint8_t *video_worker_buffer_get(VideoWorker *w, gsize size)
+{
+    uint8_t *buf = NULL;
+
+    g_mutex_lock(&w->lock);
+    if (w->buffer_size != size) {
+        /* the stream size changed */
+        g_slist_free_full(w->buffers, g_free);
+        w->buffers = NULL;
+        w->nbuffers = 0;
+        w->buffer_size = size;
+    }
+    if (w->buffers != NULL) {
+        buf = w->buffers->data;
+        w->buffers = g_slist_delete_link(w->buffers, w->buffers);
+        w->nbuffers--;
+    }
+    g_mutex_unlock(&w->lock);
+
+    return buf != NULL ? buf : g_malloc(size);
+}
+
+/* called with the lock held */
+G_GNUC_INTERNAL
+void video_worker_buffer_put(VideoWorker *w, uint8_t *buf, gsize size)
+{
+    if (buf == NULL)
+        return;
+
+    if (size == w->buffer_size && w->nbuffers < VIDEO_WORKER_MAX_BUFFERS) {
+        w->buffers = g_slist_prepend(w->buffers, buf);
+        w->nbuffers++;
+    } else {
+        g_free(buf);
+    }
+}
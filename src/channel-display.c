@@ -20,6 +20,7 @@
 #include <sys/types.h>
 #endif
 #include <glib/gi18n-lib.h>
+#include <cairo.h>
 
 #include "spice-client.h"
 #include "spice-common.h"
@@ -46,12 +47,16 @@
  * #SpiceDisplayChannel::display-primary-create.
  *
  * The update of regions is notified by
+ * #SpiceDisplayChannel::display-invalidate-region and
  * #SpiceDisplayChannel::display-invalidate signals.
  */
 
 #define MONITORS_MAX 256
 
 struct _SpiceDisplayChannelPrivate {
+    /* surfaces and primary are modified by the channel coroutine, which
+     * may run on its own thread, see SpiceSession:display-threads */
+    GMutex                      surfaces_lock;
     GHashTable                  *surfaces;
     display_surface             *primary;
     display_cache               *images;
@@ -60,6 +65,7 @@ struct _SpiceDisplayChannelPrivate {
     SpicePaletteCache           palette_cache;
     SpiceImageSurfaces          image_surfaces;
     SpiceGlzDecoderWindow       *glz_window;
+    SpiceSurfacePool            *surface_pool;
     display_stream              **streams;
     int                         nstreams;
     gboolean                    mark;
@@ -68,8 +74,30 @@ struct _SpiceDisplayChannelPrivate {
     guint                       monitors_max;
     gboolean                    enable_adaptive_streaming;
     SpiceGlScanout scanout;
+
+    /* messages held until the images they draw are decoded by the
+     * pipeline, applied in order, see display_pending_flush() */
+    SpiceDecodePipeline         *decode;
+    GQueue                      pending;
+
+    /* primary surface damage, emitted once per read iteration or mark,
+     * see display_damage_flush() */
+    pixman_region32_t           damage;
 };
 
+/* a held message */
+typedef struct display_pending {
+    SpiceMsgIn                  *in;
+    SpiceDecodeJob              *jobs[2];
+    guint                       njobs;
+} display_pending;
+
+/* the coroutine stops reading when that many messages are held */
+#define DISPLAY_MAX_PENDING 64
+
+/* damage with more rectangles is emitted as its extents */
+#define DISPLAY_MAX_DAMAGE_RECTS 32
+
 G_DEFINE_TYPE_WITH_PRIVATE(SpiceDisplayChannel, spice_display_channel, SPICE_TYPE_CHANNEL)
 
 /* Properties */
@@ -86,6 +114,7 @@ enum {
     SPICE_DISPLAY_PRIMARY_CREATE,
     SPICE_DISPLAY_PRIMARY_DESTROY,
     SPICE_DISPLAY_INVALIDATE,
+    SPICE_DISPLAY_INVALIDATE_REGION,
     SPICE_DISPLAY_MARK,
     SPICE_DISPLAY_GL_DRAW,
     SPICE_DISPLAY_STREAMING_MODE,
@@ -97,11 +126,18 @@ enum {
 static guint signals[SPICE_DISPLAY_LAST_SIGNAL];
 
 static void spice_display_channel_up(SpiceChannel *channel);
+static void spice_display_handle_msg(SpiceChannel *channel, SpiceMsgIn *in);
+static void spice_display_channel_iterate_read(SpiceChannel *channel);
+static void display_pending_clear(SpiceChannel *channel);
+static void display_decode_done(gpointer data);
+static void display_damage_flush(SpiceChannel *channel);
 static void channel_set_handlers(SpiceChannelClass *klass);
+static gsize palette_size(gconstpointer data);
 
 static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary);
 static void clear_streams(SpiceChannel *channel);
 static display_surface *find_surface(SpiceDisplayChannelPrivate *c, guint32 surface_id);
+static uint8_t *display_surface_get_data(display_surface *surface);
 static void spice_display_channel_reset(SpiceChannel *channel, gboolean migrating);
 static void spice_display_channel_set_capabilities(SpiceChannel *channel);
 static void destroy_canvas(display_surface *surface);
@@ -147,7 +183,7 @@ static void spice_display_channel_dispose(GObject *object)
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(object)->priv;
 
     if (c->mark_false_event_id != 0) {
-        g_source_remove(c->mark_false_event_id);
+        spice_channel_source_remove(SPICE_CHANNEL(object), c->mark_false_event_id);
         c->mark_false_event_id = 0;
     }
 
@@ -156,6 +192,9 @@ static void spice_display_channel_dispose(GObject *object)
         c->scanout.fd = -1;
     }
 
+    /* the workers wake up the channel */
+    display_pending_clear(SPICE_CHANNEL(object));
+
     if (G_OBJECT_CLASS(spice_display_channel_parent_class)->dispose)
         G_OBJECT_CLASS(spice_display_channel_parent_class)->dispose(object);
 }
@@ -166,9 +205,12 @@ static void spice_display_channel_finalize(GObject *object)
 
     g_clear_pointer(&c->monitors, g_array_unref);
     clear_surfaces(SPICE_CHANNEL(object), FALSE);
+    pixman_region32_fini(&c->damage);
     g_hash_table_unref(c->surfaces);
+    g_mutex_clear(&c->surfaces_lock);
     clear_streams(SPICE_CHANNEL(object));
     g_clear_pointer(&c->palettes, cache_free);
+    g_clear_pointer(&c->decode, decode_pipeline_free);
 
     if (G_OBJECT_CLASS(spice_display_channel_parent_class)->finalize)
         G_OBJECT_CLASS(spice_display_channel_parent_class)->finalize(object);
@@ -178,15 +220,21 @@ static void spice_display_channel_constructed(GObject *object)
 {
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(object)->priv;
     SpiceSession *s = spice_channel_get_session(SPICE_CHANNEL(object));
+    guint threads;
 
     g_return_if_fail(s != NULL);
-    spice_session_get_caches(s, &c->images, &c->glz_window);
-    c->palettes = cache_new(g_free);
+    spice_session_get_caches(s, &c->images, &c->glz_window, &c->surface_pool);
+    c->palettes = cache_new(g_free, palette_size);
 
     g_return_if_fail(c->glz_window != NULL);
     g_return_if_fail(c->images != NULL);
     g_return_if_fail(c->palettes != NULL);
 
+    threads = decode_pipeline_default_threads();
+    if (threads > 0)
+        c->decode = decode_pipeline_new(c->glz_window, threads,
+                                        display_decode_done, object);
+
     c->monitors = g_array_new(FALSE, TRUE, sizeof(SpiceDisplayMonitorConfig));
     spice_g_signal_connect_object(s, "mm-time-reset",
                                   G_CALLBACK(display_session_mm_time_reset_cb),
@@ -208,15 +256,21 @@ static void spice_display_get_property(GObject    *object,
 
     switch (prop_id) {
     case PROP_WIDTH: {
+        g_mutex_lock(&c->surfaces_lock);
         g_value_set_uint(value, c->primary ? c->primary->width : 0);
+        g_mutex_unlock(&c->surfaces_lock);
         break;
     }
     case PROP_HEIGHT: {
+        g_mutex_lock(&c->surfaces_lock);
         g_value_set_uint(value, c->primary ? c->primary->height : 0);
+        g_mutex_unlock(&c->surfaces_lock);
         break;
     }
     case PROP_MONITORS: {
+        g_mutex_lock(&c->surfaces_lock);
         g_value_set_boxed(value, c->monitors);
+        g_mutex_unlock(&c->surfaces_lock);
         break;
     }
     case PROP_MONITORS_MAX: {
@@ -249,6 +303,7 @@ static void spice_display_set_property(GObject      *object,
 static void spice_display_channel_reset(SpiceChannel *channel, gboolean migrating)
 {
     /* palettes, images, and glz_window are cleared in the session */
+    display_pending_clear(channel);
     clear_streams(channel);
     clear_surfaces(channel, TRUE);
 
@@ -268,6 +323,8 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
 
     channel_class->channel_up   = spice_display_channel_up;
     channel_class->channel_reset = spice_display_channel_reset;
+    channel_class->handle_msg   = spice_display_handle_msg;
+    channel_class->iterate_read = spice_display_channel_iterate_read;
 
     g_object_class_install_property
         (gobject_class, PROP_HEIGHT,
@@ -407,6 +464,33 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
                      4,
                      G_TYPE_INT, G_TYPE_INT, G_TYPE_INT, G_TYPE_INT);
 
+    /**
+     * SpiceDisplayChannel::display-invalidate-region:
+     * @display: the #SpiceDisplayChannel that emitted the signal
+     * @rects: (element-type cairo.RectangleInt): the updated rectangles
+     *
+     * The #SpiceDisplayChannel::display-invalidate-region signal is
+     * emitted when a region of the primary buffer is updated. The
+     * updates are coalesced, the signal is emitted at most once per
+     * network read or display mark, so it is cheaper to handle than
+     * #SpiceDisplayChannel::display-invalidate, which is still emitted
+     * for each rectangle of the region. The #GArray holds
+     * #cairo_rectangle_int_t that do not overlap, take a reference to
+     * keep it after the emission.
+     *
+     * Since: 0.41
+     **/
+    signals[SPICE_DISPLAY_INVALIDATE_REGION] =
+        g_signal_new("display-invalidate-region",
+                     G_OBJECT_CLASS_TYPE(gobject_class),
+                     G_SIGNAL_RUN_FIRST,
+                     0,
+                     NULL, NULL,
+                     g_cclosure_marshal_VOID__BOXED,
+                     G_TYPE_NONE,
+                     1,
+                     G_TYPE_ARRAY);
+
     /**
      * SpiceDisplayChannel::display-mark:
      * @display: the #SpiceDisplayChannel that emitted the signal
@@ -544,20 +628,26 @@ gboolean spice_display_channel_get_primary(SpiceChannel *channel, guint32 surfac
     g_return_val_if_fail(primary != NULL, FALSE);
 
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
-    display_surface *surface = find_surface(c, surface_id);
+    display_surface *surface;
 
-    if (surface == NULL)
+    g_mutex_lock(&c->surfaces_lock);
+    surface = find_surface(c, surface_id);
+    if (surface == NULL || !surface->primary) {
+        g_mutex_unlock(&c->surfaces_lock);
+        g_warn_if_fail(surface == NULL);
         return FALSE;
+    }
 
-    g_return_val_if_fail(surface->primary, FALSE);
-
+    /* the primary data is only freed after the primary-destroy signal
+     * returned, so it stays valid until then, see display_front */
     primary->format = surface->format;
     primary->width = surface->width;
     primary->height = surface->height;
     primary->stride = surface->stride;
     primary->shmid = -1;
-    primary->data = surface->data;
+    primary->data = display_surface_get_data(surface);
     primary->marked = c->mark;
+    g_mutex_unlock(&c->surfaces_lock);
     CHANNEL_DEBUG(channel, "get primary %p", primary->data);
 
     return TRUE;
@@ -781,7 +871,10 @@ static void image_put(SpiceImageCache *cache, uint64_t id, pixman_image_t *image
     SpiceDisplayChannelPrivate *c =
         SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
 
+    cache_lock(c->images);
     cache_add(c->images, id, pixman_image_ref(image));
+    cache_unlock(c->images);
+    g_coroutine_wait_queue_wake(c->images->waiters, id);
 }
 
 typedef struct _WaitImageData
@@ -798,30 +891,45 @@ static gboolean wait_image(gpointer data)
     WaitImageData *wait = data;
     SpiceDisplayChannelPrivate *c =
         SPICE_CONTAINEROF(wait->cache, SpiceDisplayChannelPrivate, image_cache);
-    pixman_image_t *image = cache_find_lossy(c->images, wait->id, &lossy);
+    pixman_image_t *image;
 
-    if (!image || (lossy && !wait->lossy))
+    cache_lock(c->images);
+    image = cache_find_lossy(c->images, wait->id, &lossy);
+    if (!image || (lossy && !wait->lossy)) {
+        cache_unlock(c->images);
         return FALSE;
+    }
 
     wait->image = pixman_image_ref(image);
+    cache_unlock(c->images);
 
     return TRUE;
 }
 
 static pixman_image_t *image_get(SpiceImageCache *cache, uint64_t id)
 {
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
     WaitImageData wait = {
         .lossy = TRUE,
         .cache = cache,
         .id = id,
         .image = NULL
     };
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_image, &wait))
+    if (!g_coroutine_wait_queue_wait(g_coroutine_self(), c->images->waiters,
+                                     id, wait_image, &wait))
         SPICE_DEBUG("wait image got cancelled");
 
     return wait.image;
 }
 
+static gsize palette_size(gconstpointer data)
+{
+    const SpicePalette *palette = data;
+
+    return sizeof(SpicePalette) + palette->num_ents * sizeof(palette->ents[0]);
+}
+
 static void palette_put(SpicePaletteCache *cache, SpicePalette *palette)
 {
     SpiceDisplayChannelPrivate *c =
@@ -862,11 +970,14 @@ static void image_put_lossy(SpiceImageCache *cache, uint64_t id,
     SpiceDisplayChannelPrivate *c =
         SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
 
+    cache_lock(c->images);
 #ifndef NDEBUG
     g_warn_if_fail(cache_find(c->images, id) == NULL);
 #endif
 
     cache_add_lossy(c->images, id, pixman_image_ref(surface), TRUE);
+    cache_unlock(c->images);
+    g_coroutine_wait_queue_wake(c->images->waiters, id);
 }
 
 static void image_replace_lossy(SpiceImageCache *cache, uint64_t id,
@@ -875,18 +986,24 @@ static void image_replace_lossy(SpiceImageCache *cache, uint64_t id,
     SpiceDisplayChannelPrivate *c =
         SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
 
+    cache_lock(c->images);
     cache_replace_lossy(c->images, id, pixman_image_ref(surface), FALSE);
+    cache_unlock(c->images);
+    g_coroutine_wait_queue_wake(c->images->waiters, id);
 }
 
 static pixman_image_t* image_get_lossless(SpiceImageCache *cache, uint64_t id)
 {
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
     WaitImageData wait = {
         .lossy = FALSE,
         .cache = cache,
         .id = id,
         .image = NULL
     };
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_image, &wait))
+    if (!g_coroutine_wait_queue_wait(g_coroutine_self(), c->images->waiters,
+                                     id, wait_image, &wait))
         SPICE_DEBUG("wait lossless got cancelled");
 
     return wait.image;
@@ -946,6 +1063,12 @@ static void spice_display_channel_set_capabilities(SpiceChannel *channel)
     spice_channel_set_capability(channel, SPICE_DISPLAY_CAP_CODEC_MJPEG);
 #endif
     for (i = 1; i < G_N_ELEMENTS(gst_opts); i++) {
+#ifdef HAVE_LIBAVCODEC
+        if (avcodec_video_enabled() && avcodec_video_has_codec(i)) {
+            spice_channel_set_capability(channel, gst_opts[i].cap);
+            continue;
+        }
+#endif
         if (gstvideo_has_codec(i)) {
             spice_channel_set_capability(channel, gst_opts[i].cap);
         } else {
@@ -968,12 +1091,15 @@ static void spice_display_channel_init(SpiceDisplayChannel *channel)
 
     c = channel->priv = spice_display_channel_get_instance_private(channel);
 
+    g_mutex_init(&c->surfaces_lock);
     c->surfaces = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, destroy_surface);
     c->image_cache.ops = &image_cache_ops;
     c->palette_cache.ops = &palette_cache_ops;
     c->image_surfaces.ops = &image_surfaces_ops;
     c->monitors_max = 1;
     c->scanout.fd = -1;
+    g_queue_init(&c->pending);
+    pixman_region32_init(&c->damage);
 
     if (g_getenv("SPICE_DISABLE_ADAPTIVE_STREAMING")) {
         SPICE_DEBUG("adaptive video disabled");
@@ -985,6 +1111,165 @@ static void spice_display_channel_init(SpiceDisplayChannel *channel)
 
 /* ------------------------------------------------------------------ */
 
+/*
+ * With display threads, the canvas of the primary surface draws from the
+ * channel thread while the main context reads it. The main context then
+ * reads a copy of the primary instead, updated from the canvas with the
+ * damage right before the invalidations are emitted, and the canvas
+ * draws with the lock held, see display_surface_lock().
+ *
+ * The copy is kept alive by the pending emissions, so that it remains
+ * valid until display-primary-destroy was handled.
+ */
+struct display_front {
+    gint                        ref;
+    GMutex                      lock;
+    uint8_t                     *back;      /* the canvas data, NULL once destroyed */
+    uint8_t                     *data;
+    int                         width, height, stride;
+};
+
+static display_front *display_front_new(display_surface *surface)
+{
+    display_front *front = g_new0(display_front, 1);
+
+    front->ref = 1;
+    g_mutex_init(&front->lock);
+    front->back = surface->data;
+    front->data = g_malloc0(surface->size);
+    front->width = surface->width;
+    front->height = surface->height;
+    front->stride = surface->stride;
+
+    return front;
+}
+
+static display_front *display_front_ref(display_front *front)
+{
+    g_atomic_int_inc(&front->ref);
+    return front;
+}
+
+/* any context */
+static void display_front_unref(gpointer data)
+{
+    display_front *front = data;
+
+    if (!g_atomic_int_dec_and_test(&front->ref))
+        return;
+
+    g_mutex_clear(&front->lock);
+    g_free(front->data);
+    g_free(front);
+}
+
+/* coroutine context, before the canvas data is freed */
+static void display_front_detach(display_front *front)
+{
+    g_mutex_lock(&front->lock);
+    front->back = NULL;
+    g_mutex_unlock(&front->lock);
+    display_front_unref(front);
+}
+
+typedef struct display_front_update {
+    display_front               *front;
+    guint                       n;
+    gint                        rects[];
+} display_front_update;
+
+/* main context */
+static gboolean display_front_update_main(gpointer data)
+{
+    display_front_update *update = data;
+    display_front *front = update->front;
+    guint i;
+    int y;
+
+    g_mutex_lock(&front->lock);
+    for (i = 0; i < update->n && front->back != NULL; i++) {
+        int x1 = CLAMP(update->rects[i * 4], 0, front->width);
+        int y1 = CLAMP(update->rects[i * 4 + 1], 0, front->height);
+        int x2 = CLAMP(x1 + update->rects[i * 4 + 2], x1, front->width);
+        int y2 = CLAMP(y1 + update->rects[i * 4 + 3], y1, front->height);
+
+        /* the primary surfaces are always 32 bits per pixel in memory */
+        for (y = y1; y < y2; y++)
+            memcpy(front->data + (gsize)y * front->stride + x1 * 4,
+                   front->back + (gsize)y * front->stride + x1 * 4,
+                   (x2 - x1) * 4);
+    }
+    g_mutex_unlock(&front->lock);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void display_front_update_free(gpointer data)
+{
+    display_front_update *update = data;
+
+    display_front_unref(update->front);
+    g_free(update);
+}
+
+/* channel context, queues the copy of @rects from the canvas, which the
+ * main context runs before the invalidations queued afterwards */
+static void display_front_queue_update(display_front *front, const gint *rects, guint n)
+{
+    display_front_update *update;
+
+    update = g_malloc(sizeof(*update) + n * 4 * sizeof(gint));
+    update->front = display_front_ref(front);
+    update->n = n;
+    memcpy(update->rects, rects, n * 4 * sizeof(gint));
+    g_main_context_invoke_full(NULL, G_PRIORITY_DEFAULT, display_front_update_main,
+                               update, display_front_update_free);
+}
+
+/* channel context, around the drawing on @surface */
+static void display_surface_lock(display_surface *surface)
+{
+    if (surface->front != NULL)
+        g_mutex_lock(&surface->front->lock);
+}
+
+static void display_surface_unlock(display_surface *surface)
+{
+    if (surface->front != NULL)
+        g_mutex_unlock(&surface->front->lock);
+}
+
+/* the data the main context reads */
+static uint8_t *display_surface_get_data(display_surface *surface)
+{
+    return surface->front != NULL ? surface->front->data : surface->data;
+}
+
+/* coroutine context, the arrays are replaced rather than modified, the
+ * main context may still hold the previous one */
+static void display_set_monitors(SpiceDisplayChannelPrivate *c, GArray *monitors)
+{
+    GArray *old;
+
+    g_mutex_lock(&c->surfaces_lock);
+    old = c->monitors;
+    c->monitors = monitors;
+    g_mutex_unlock(&c->surfaces_lock);
+    g_array_unref(old);
+}
+
+/* coroutine context, the data of the primary stays valid until the
+ * handlers returned */
+static void display_emit_primary_destroy(SpiceChannel *channel, display_surface *primary)
+{
+    display_front *front = primary != NULL ? primary->front : NULL;
+
+    if (front != NULL)
+        display_front_ref(front);
+    g_coroutine_signal_emit_async(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0,
+                                  front, front != NULL ? display_front_unref : NULL);
+}
+
 static int create_canvas(SpiceChannel *channel, display_surface *surface)
 {
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
@@ -998,16 +1283,22 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
                 return 0;
             }
 
-            g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
+            display_damage_flush(channel);
+            display_emit_primary_destroy(channel, c->primary);
 
+            g_mutex_lock(&c->surfaces_lock);
             g_hash_table_remove(c->surfaces, GINT_TO_POINTER(c->primary->surface_id));
             c->primary = NULL;
+            g_mutex_unlock(&c->surfaces_lock);
         }
 
         CHANNEL_DEBUG(channel, "Create primary canvas");
     }
 
-    surface->data = g_malloc0(surface->size);
+    surface->pool = c->surface_pool;
+    surface->data = surface_pool_alloc(surface->pool, surface->size, &surface->mapped);
+    if (surface->primary && g_coroutine_in_worker_thread())
+        surface->front = display_front_new(surface);
 
     g_return_val_if_fail(c->glz_window, 0);
     g_warn_if_fail(surface->canvas == NULL);
@@ -1015,9 +1306,9 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
     g_warn_if_fail(surface->zlib_decoder == NULL);
     g_warn_if_fail(surface->jpeg_decoder == NULL);
 
-    surface->glz_decoder = glz_decoder_new(c->glz_window);
-    surface->zlib_decoder = zlib_decoder_new();
-    surface->jpeg_decoder = jpeg_decoder_new();
+    surface->glz_decoder = glz_decoder_new(c->glz_window, c->decode);
+    surface->zlib_decoder = zlib_decoder_new(c->decode);
+    surface->jpeg_decoder = jpeg_decoder_new(c->decode);
 
     surface->canvas = canvas_create_for_data(surface->width,
                                              surface->height,
@@ -1032,22 +1323,33 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
                                              surface->zlib_decoder);
 
     g_return_val_if_fail(surface->canvas != NULL, 0);
+    g_mutex_lock(&c->surfaces_lock);
     g_hash_table_insert(c->surfaces, GINT_TO_POINTER(surface->surface_id), surface);
-
     if (surface->primary) {
         g_warn_if_fail(c->primary == NULL);
         c->primary = surface;
-        g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_CREATE], 0,
-                                surface->format, surface->width, surface->height,
-                                surface->stride, -1, surface->data);
+    }
+    g_mutex_unlock(&c->surfaces_lock);
+
+    if (surface->primary) {
+        display_front *front = surface->front;
+
+        if (front != NULL)
+            display_front_ref(front);
+        g_coroutine_signal_emit_async(channel, signals[SPICE_DISPLAY_PRIMARY_CREATE], 0,
+                                      front, front != NULL ? display_front_unref : NULL,
+                                      surface->format, surface->width, surface->height,
+                                      surface->stride, -1, display_surface_get_data(surface));
 
         if (!spice_channel_test_capability(channel, SPICE_DISPLAY_CAP_MONITORS_CONFIG)) {
-            g_array_set_size(c->monitors, 1);
-            SpiceDisplayMonitorConfig *config = &g_array_index(c->monitors, SpiceDisplayMonitorConfig, 0);
+            GArray *monitors = g_array_sized_new(FALSE, TRUE, sizeof(SpiceDisplayMonitorConfig), 1);
+            g_array_set_size(monitors, 1);
+            SpiceDisplayMonitorConfig *config = &g_array_index(monitors, SpiceDisplayMonitorConfig, 0);
             config->x = config->y = 0;
             config->width = surface->width;
             config->height = surface->height;
-            g_coroutine_object_notify(G_OBJECT(channel), "monitors");
+            display_set_monitors(c, monitors);
+            g_coroutine_object_notify_async(G_OBJECT(channel), "monitors");
         }
     }
 
@@ -1063,8 +1365,10 @@ static void destroy_canvas(display_surface *surface)
     zlib_decoder_destroy(surface->zlib_decoder);
     jpeg_decoder_destroy(surface->jpeg_decoder);
 
-    g_clear_pointer(&surface->data, g_free);
     g_clear_pointer(&surface->canvas, surface->canvas->ops->destroy);
+    g_clear_pointer(&surface->front, display_front_detach);
+    surface_pool_release(surface->pool, surface->data, surface->size, surface->mapped);
+    surface->data = NULL;
 }
 
 static display_surface *find_surface(SpiceDisplayChannelPrivate *c, guint32 surface_id)
@@ -1083,10 +1387,17 @@ static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary)
     display_surface *surface;
 
     if (!keep_primary) {
+        display_surface *primary = c->primary;
+
+        g_mutex_lock(&c->surfaces_lock);
         c->primary = NULL;
-        g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
+        g_mutex_unlock(&c->surfaces_lock);
+        pixman_region32_clear(&c->damage);
+        /* still in the table until it is cleared below */
+        display_emit_primary_destroy(channel, primary);
     }
 
+    g_mutex_lock(&c->surfaces_lock);
     g_hash_table_iter_init(&iter, c->surfaces);
     while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&surface)) {
 
@@ -1097,15 +1408,87 @@ static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary)
 
         g_hash_table_iter_remove(&iter);
     }
+    g_mutex_unlock(&c->surfaces_lock);
 }
 
 /* coroutine context */
-static void emit_invalidate(SpiceChannel *channel, SpiceRect *bbox)
+static void display_damage_add(SpiceChannel *channel, SpiceRect *bbox)
 {
-    g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
-                            bbox->left, bbox->top,
-                            bbox->right - bbox->left,
-                            bbox->bottom - bbox->top);
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
+    if (bbox->right <= bbox->left || bbox->bottom <= bbox->top)
+        return;
+
+    pixman_region32_union_rect(&c->damage, &c->damage,
+                               bbox->left, bbox->top,
+                               bbox->right - bbox->left,
+                               bbox->bottom - bbox->top);
+}
+
+/* the invalidations are only queued from a display thread, which does
+ * not wait for the main context to handle them */
+static void display_emit_invalidate(SpiceChannel *channel, display_surface *surface,
+                                    const gint *rects, guint n)
+{
+    GArray *region = g_array_sized_new(FALSE, FALSE, sizeof(cairo_rectangle_int_t), n);
+    guint i;
+
+    if (surface->front != NULL)
+        display_front_queue_update(surface->front, rects, n);
+
+    for (i = 0; i < n; i++) {
+        cairo_rectangle_int_t rect = {
+            .x = rects[i * 4],
+            .y = rects[i * 4 + 1],
+            .width = rects[i * 4 + 2],
+            .height = rects[i * 4 + 3]
+        };
+
+        g_array_append_val(region, rect);
+    }
+    g_coroutine_signal_emit_async(channel, signals[SPICE_DISPLAY_INVALIDATE_REGION], 0,
+                                  region, (GDestroyNotify)g_array_unref, region);
+
+    /* each emission from the coroutine is a round trip to the main
+     * context, skip them when nobody listens */
+    if (!g_signal_has_handler_pending(channel, signals[SPICE_DISPLAY_INVALIDATE], 0, FALSE))
+        return;
+
+    for (i = 0; i < n; i++)
+        g_coroutine_signal_emit_async(channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
+                                      NULL, NULL,
+                                      rects[i * 4], rects[i * 4 + 1],
+                                      rects[i * 4 + 2], rects[i * 4 + 3]);
+}
+
+/* coroutine context */
+static void display_damage_flush(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    pixman_box32_t *boxes;
+    gint *rects;
+    int i, n;
+
+    if (!pixman_region32_not_empty(&c->damage))
+        return;
+
+    boxes = pixman_region32_rectangles(&c->damage, &n);
+    if (n > DISPLAY_MAX_DAMAGE_RECTS) {
+        boxes = pixman_region32_extents(&c->damage);
+        n = 1;
+    }
+
+    rects = g_newa(gint, n * 4);
+    for (i = 0; i < n; i++) {
+        rects[i * 4] = boxes[i].x1;
+        rects[i * 4 + 1] = boxes[i].y1;
+        rects[i * 4 + 2] = boxes[i].x2 - boxes[i].x1;
+        rects[i * 4 + 3] = boxes[i].y2 - boxes[i].y1;
+    }
+    pixman_region32_clear(&c->damage);
+
+    g_return_if_fail(c->primary != NULL);
+    display_emit_invalidate(channel, c->primary, rects, n);
 }
 
 /* ------------------------------------------------------------------ */
@@ -1136,22 +1519,192 @@ static void spice_display_channel_up(SpiceChannel *channel)
     spice_msg_out_send_internal(out);
 
     /* notify of existence of this monitor */
-    g_coroutine_object_notify(G_OBJECT(channel), "monitors");
+    g_coroutine_object_notify_async(G_OBJECT(channel), "monitors");
 
     if (preferred_compression != SPICE_IMAGE_COMPRESSION_INVALID) {
         spice_display_channel_change_preferred_compression(channel, preferred_compression);
     }
 }
 
+/* ------------------------------------------------------------------ */
+/* decode pipeline                                                    */
+
+/* decode worker thread */
+static void display_decode_done(gpointer data)
+{
+    SpiceChannel *channel = data;
+
+    /* the coroutine is waiting for the socket, or for a held message
+     * in display_pending_flush() */
+    spice_channel_wakeup(channel, FALSE);
+    g_coroutine_condition_wakeup_all();
+}
+
+/* the images of a draw message that the pipeline may decode ahead */
+static guint display_msg_images(SpiceMsgIn *in, SpiceImage **images)
+{
+    void *op = spice_msg_in_parsed(in);
+
+    switch (spice_msg_in_type(in)) {
+    case SPICE_MSG_DISPLAY_DRAW_OPAQUE:
+        images[0] = ((SpiceMsgDisplayDrawOpaque *)op)->data.src_bitmap;
+        return 1;
+    case SPICE_MSG_DISPLAY_DRAW_COPY:
+        images[0] = ((SpiceMsgDisplayDrawCopy *)op)->data.src_bitmap;
+        return 1;
+    case SPICE_MSG_DISPLAY_DRAW_BLEND:
+        images[0] = ((SpiceMsgDisplayDrawBlend *)op)->data.src_bitmap;
+        return 1;
+    case SPICE_MSG_DISPLAY_DRAW_ROP3:
+        images[0] = ((SpiceMsgDisplayDrawRop3 *)op)->data.src_bitmap;
+        return 1;
+    case SPICE_MSG_DISPLAY_DRAW_TRANSPARENT:
+        images[0] = ((SpiceMsgDisplayDrawTransparent *)op)->data.src_bitmap;
+        return 1;
+    case SPICE_MSG_DISPLAY_DRAW_ALPHA_BLEND:
+        images[0] = ((SpiceMsgDisplayDrawAlphaBlend *)op)->data.src_bitmap;
+        return 1;
+    case SPICE_MSG_DISPLAY_DRAW_COMPOSITE:
+        images[0] = ((SpiceMsgDisplayDrawComposite *)op)->data.src_bitmap;
+        images[1] = ((SpiceMsgDisplayDrawComposite *)op)->data.mask_bitmap;
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+static gboolean display_pending_ready(gpointer data)
+{
+    display_pending *pending = data;
+    guint i;
+
+    for (i = 0; i < pending->njobs; i++) {
+        if (!decode_job_is_done(pending->jobs[i]))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void display_pending_free(SpiceChannel *channel, display_pending *pending)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    guint i;
+
+    for (i = 0; i < pending->njobs; i++)
+        decode_pipeline_release(c->decode, pending->jobs[i]);
+    /* other channels may wait for its serial */
+    spice_channel_msg_release(channel, pending->in);
+    spice_msg_in_unref(pending->in);
+    g_free(pending);
+}
+
+/*
+ * coroutine context
+ *
+ * Applies the held messages whose images are decoded, in order, and
+ * waits for the others while more than max_pending are held.
+ */
+static void display_pending_flush(SpiceChannel *channel, guint max_pending)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceChannelClass *parent_class = SPICE_CHANNEL_CLASS(spice_display_channel_parent_class);
+    display_pending *pending;
+
+    while ((pending = g_queue_peek_head(&c->pending)) != NULL) {
+        if (!display_pending_ready(pending)) {
+            if (g_queue_get_length(&c->pending) <= max_pending)
+                break;
+            if (!g_coroutine_condition_wait(g_coroutine_self(),
+                                            display_pending_ready, pending)) {
+                CHANNEL_DEBUG(channel, "wait for decode cancelled");
+                break;
+            }
+        }
+
+        g_queue_pop_head(&c->pending);
+        parent_class->handle_msg(channel, pending->in);
+        display_pending_free(channel, pending);
+    }
+}
+
+/* main or coroutine context: drops the held messages */
+static void display_pending_clear(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    display_pending *pending;
+
+    if (c->decode == NULL)
+        return;
+
+    while ((pending = g_queue_pop_head(&c->pending)) != NULL)
+        display_pending_free(channel, pending);
+    decode_pipeline_cancel(c->decode);
+}
+
+/* coroutine context */
+static void spice_display_handle_msg(SpiceChannel *channel, SpiceMsgIn *in)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceChannelClass *parent_class = SPICE_CHANNEL_CLASS(spice_display_channel_parent_class);
+    int type = spice_msg_in_type(in);
+    display_pending *pending;
+    SpiceImage *images[2];
+    guint n;
+
+    if (c->decode == NULL) {
+        parent_class->handle_msg(channel, in);
+        return;
+    }
+
+    if (type <= SPICE_MSG_BASE_LAST) {
+        /* pings and acks are answered right away, other common messages
+         * such as migration apply after the held draws */
+        if (type != SPICE_MSG_PING && type != SPICE_MSG_SET_ACK)
+            display_pending_flush(channel, 0);
+        parent_class->handle_msg(channel, in);
+        return;
+    }
+
+    pending = g_new0(display_pending, 1);
+    pending->in = in;
+    spice_msg_in_ref(in);
+    spice_channel_msg_hold(channel);
+
+    /* each job holds the message, which holds the image data */
+    n = display_msg_images(in, images);
+    pending->njobs = decode_pipeline_push_images(c->decode, images, n, pending->jobs, in,
+                                                 (SpiceDecodeOwnerFunc)spice_msg_in_ref,
+                                                 (GDestroyNotify)spice_msg_in_unref);
+
+    g_queue_push_tail(&c->pending, pending);
+    display_pending_flush(channel, DISPLAY_MAX_PENDING);
+}
+
+/* coroutine context */
+static void spice_display_channel_iterate_read(SpiceChannel *channel)
+{
+    /* apply the messages decoded while waiting for the socket, the
+     * decode wakes the coroutine up for them, and emit their damage
+     * before blocking again: an idle server sends nothing more */
+    display_pending_flush(channel, G_MAXUINT);
+    display_damage_flush(channel);
+
+    SPICE_CHANNEL_CLASS(spice_display_channel_parent_class)->iterate_read(channel);
+
+    display_damage_flush(channel);
+}
+
 #define DRAW(type) {                                                    \
         display_surface *surface =                                      \
             find_surface(SPICE_DISPLAY_CHANNEL(channel)->priv,          \
                 op->base.surface_id);                                   \
         g_return_if_fail(surface != NULL);                              \
+        display_surface_lock(surface);                                  \
         surface->canvas->ops->draw_##type(surface->canvas, &op->base.box, \
                                           &op->base.clip, &op->data);   \
+        display_surface_unlock(surface);                                \
         if (surface->primary) {                                         \
-            emit_invalidate(channel, &op->base.box);                    \
+            display_damage_add(channel, &op->base.box);                 \
         }                                                               \
 }
 
@@ -1186,8 +1739,9 @@ static void display_handle_mark(SpiceChannel *channel, SpiceMsgIn *in)
     g_warn_if_fail(c->mark == FALSE);
 #endif
 
+    display_damage_flush(channel);
     c->mark = TRUE;
-    g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_MARK], 0, TRUE);
+    g_coroutine_signal_emit_async(channel, signals[SPICE_DISPLAY_MARK], 0, NULL, NULL, TRUE);
 }
 
 /* coroutine context */
@@ -1198,13 +1752,16 @@ static void display_handle_reset(SpiceChannel *channel, SpiceMsgIn *in)
 
     CHANNEL_DEBUG(channel, "%s: TODO detach_from_screen", __FUNCTION__);
 
-    if (surface != NULL)
+    if (surface != NULL) {
+        display_surface_lock(surface);
         surface->canvas->ops->clear(surface->canvas);
+        display_surface_unlock(surface);
+    }
 
     cache_clear(c->palettes);
 
     c->mark = FALSE;
-    g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_MARK], 0, FALSE);
+    g_coroutine_signal_emit_async(channel, signals[SPICE_DISPLAY_MARK], 0, NULL, NULL, FALSE);
 }
 
 /* coroutine context */
@@ -1215,10 +1772,12 @@ static void display_handle_copy_bits(SpiceChannel *channel, SpiceMsgIn *in)
     display_surface *surface = find_surface(c, op->base.surface_id);
 
     g_return_if_fail(surface != NULL);
+    display_surface_lock(surface);
     surface->canvas->ops->copy_bits(surface->canvas, &op->base.box,
                                     &op->base.clip, &op->src_pos);
+    display_surface_unlock(surface);
     if (surface->primary) {
-        emit_invalidate(channel, &op->base.box);
+        display_damage_add(channel, &op->base.box);
     }
 }
 
@@ -1234,8 +1793,10 @@ static void display_handle_inv_list(SpiceChannel *channel, SpiceMsgIn *in)
 
         switch (list->resources[i].type) {
         case SPICE_RES_TYPE_PIXMAP:
+            cache_lock(c->images);
             if (!cache_remove(c->images, id))
                 SPICE_DEBUG("fail to remove image %" G_GUINT64_FORMAT, id);
+            cache_unlock(c->images);
             break;
         default:
             g_return_if_reached();
@@ -1250,7 +1811,9 @@ static void display_handle_inv_pixmap_all(SpiceChannel *channel, SpiceMsgIn *in)
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
 
     spice_channel_handle_wait_for_channels(channel, in);
+    cache_lock(c->images);
     cache_clear(c->images);
+    cache_unlock(c->images);
 }
 
 /* coroutine context */
@@ -1352,6 +1915,15 @@ static display_stream *display_stream_create(SpiceChannel *channel,
         break;
 #endif
     default:
+#ifdef HAVE_LIBAVCODEC
+        /* GStreamer handles what libavcodec cannot */
+        if (avcodec_video_enabled()) {
+            st->video_decoder = create_avcodec_decoder(codec_type, st);
+            if (st->video_decoder != NULL) {
+                break;
+            }
+        }
+#endif
         st->video_decoder = create_gstreamer_decoder(codec_type, st);
         break;
     }
@@ -1449,7 +2021,45 @@ void stream_dropped_frame_on_playback(display_stream *st)
     st->num_drops_on_playback++;
 }
 
-/* main context */
+/* 1 in STREAM_CATCHUP_DISPLAY_INTERVAL late reference frames is still
+ * displayed so that the video does not freeze while catching up */
+#define STREAM_CATCHUP_DISPLAY_INTERVAL 8
+
+/* channel context
+ *
+ * Late frames cost as much to decode as the others and are dropped at
+ * display anyway, so a client falling behind skips those no other frame
+ * references and only decodes the others, without the conversion and
+ * display work.
+ */
+G_GNUC_INTERNAL
+StreamFrameAction stream_get_frame_action(VideoDecoder *decoder, SpiceFrame *frame, int margin)
+{
+    display_stream *st = decoder->stream;
+    gboolean reference;
+
+    if (margin >= 0 && decoder->codec_type != SPICE_VIDEO_CODEC_TYPE_H265) {
+        return STREAM_FRAME_DISPLAY;
+    }
+
+    /* the H.265 parameter sets are followed on all the frames */
+    reference = video_nal_frame_is_reference(&st->nal_state, decoder->codec_type,
+                                             frame->data, frame->size);
+    if (margin >= 0) {
+        return STREAM_FRAME_DISPLAY;
+    }
+    if (!reference) {
+        st->num_drops_on_decode++;
+        return STREAM_FRAME_SKIP;
+    }
+    if (st->cur_drops_seq_stats.len % STREAM_CATCHUP_DISPLAY_INTERVAL == 0) {
+        return STREAM_FRAME_DISPLAY;
+    }
+    st->num_decode_only++;
+    return STREAM_FRAME_DECODE_ONLY;
+}
+
+/* channel context, see spice_channel_timeout_add() */
 G_GNUC_INTERNAL
 void stream_display_frame(display_stream *st, SpiceFrame *frame,
                           uint32_t width, uint32_t height, int stride, uint8_t *data)
@@ -1462,16 +2072,23 @@ void stream_display_frame(display_stream *st, SpiceFrame *frame,
         stride = -stride;
     }
 
+    display_surface_lock(st->surface);
     st->surface->canvas->ops->put_image(st->surface->canvas,
                                         &frame->dest, data,
                                         width, height, stride,
                                         st->have_region ? &st->region : NULL);
+    display_surface_unlock(st->surface);
 
+    /* not called from the channel coroutine, a frame is emitted
+     * on its own rather than added to the damage */
     if (st->surface->primary) {
-        g_signal_emit(st->channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
-                      frame->dest.left, frame->dest.top,
-                      frame->dest.right - frame->dest.left,
-                      frame->dest.bottom - frame->dest.top);
+        gint rect[4] = {
+            frame->dest.left, frame->dest.top,
+            frame->dest.right - frame->dest.left,
+            frame->dest.bottom - frame->dest.top
+        };
+
+        display_emit_invalidate(st->channel, st->surface, rect, 1);
     }
 }
 
@@ -1481,8 +2098,8 @@ gboolean hand_pipeline_to_widget(display_stream *st, GstPipeline *pipeline)
     gboolean res = false;
 
     if (st->surface->streaming_mode) {
-        g_signal_emit(st->channel, signals[SPICE_DISPLAY_OVERLAY], 0,
-                      pipeline, &res);
+        g_coroutine_signal_emit(st->channel, signals[SPICE_DISPLAY_OVERLAY], 0,
+                                pipeline, &res);
     }
     return res;
 }
@@ -1624,14 +2241,16 @@ static void display_stream_stats_debug(display_stream *st)
     CHANNEL_DEBUG(st->channel,
         "%s: id=%u #in-frames=%u out/in=%.2f "
         "#drops-on-receive=%u avg-late-time(ms)=%.2f "
-        "#drops-on-playback=%u",
+        "#drops-on-playback=%u #drops-on-decode=%u #decode-only=%u",
         __FUNCTION__,
         st->id,
         st->num_input_frames,
         num_out_frames / (double)st->num_input_frames,
         st->arrive_late_count,
         avg_late_time,
-        st->num_drops_on_playback);
+        st->num_drops_on_playback,
+        st->num_drops_on_decode,
+        st->num_decode_only);
 
     if (st->num_drops_seqs) {
         CHANNEL_DEBUG(st->channel,
@@ -1970,7 +2589,7 @@ static void display_handle_surface_create(SpiceChannel *channel, SpiceMsgIn *in)
         surface->primary = true;
         create_canvas(channel, surface);
         if (c->mark_false_event_id != 0) {
-            g_source_remove(c->mark_false_event_id);
+            spice_channel_source_remove(channel, c->mark_false_event_id);
             c->mark_false_event_id = 0;
         }
     } else {
@@ -1985,7 +2604,7 @@ static gboolean display_mark_false(gpointer data)
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
 
     c->mark = FALSE;
-    g_signal_emit(channel, signals[SPICE_DISPLAY_MARK], 0, FALSE);
+    g_coroutine_signal_emit_async(channel, signals[SPICE_DISPLAY_MARK], 0, NULL, NULL, FALSE);
 
     c->mark_false_event_id = 0;
     return FALSE;
@@ -2011,13 +2630,19 @@ static void display_handle_surface_destroy(SpiceChannel *channel, SpiceMsgIn *in
         CHANNEL_DEBUG(channel, "%d: FIXME primary destroy, but is display really disabled?", id);
         /* this is done with a timeout in spicec as well, it's *ugly* */
         if (id != 0 && c->mark_false_event_id == 0) {
-            c->mark_false_event_id = g_timeout_add_seconds(1, display_mark_false, channel);
+            c->mark_false_event_id = spice_channel_timeout_add(channel, 1000,
+                                                               display_mark_false, channel);
         }
+        display_damage_flush(channel);
+        g_mutex_lock(&c->surfaces_lock);
         c->primary = NULL;
-        g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
+        g_mutex_unlock(&c->surfaces_lock);
+        display_emit_primary_destroy(channel, surface);
     }
 
+    g_mutex_lock(&c->surfaces_lock);
     g_hash_table_remove(c->surfaces, GINT_TO_POINTER(surface->surface_id));
+    g_mutex_unlock(&c->surfaces_lock);
 }
 
 #define CLAMP_CHECK(x, low, high)  (((x) > (high)) ? TRUE : (((x) < (low)) ? TRUE : FALSE))
@@ -2027,6 +2652,7 @@ static void display_handle_monitors_config(SpiceChannel *channel, SpiceMsgIn *in
 {
     SpiceMsgDisplayMonitorsConfig *config = spice_msg_in_parsed(in);
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    GArray *monitors;
     guint i;
 
     g_return_if_fail(config != NULL);
@@ -2049,10 +2675,11 @@ static void display_handle_monitors_config(SpiceChannel *channel, SpiceMsgIn *in
         config->count = CLAMP(config->count, 1, c->monitors_max);
     }
 
-    c->monitors = g_array_set_size(c->monitors, config->count);
+    monitors = g_array_sized_new(FALSE, TRUE, sizeof(SpiceDisplayMonitorConfig), config->count);
+    g_array_set_size(monitors, config->count);
 
     for (i = 0; i < config->count; i++) {
-        SpiceDisplayMonitorConfig *mc = &g_array_index(c->monitors, SpiceDisplayMonitorConfig, i);
+        SpiceDisplayMonitorConfig *mc = &g_array_index(monitors, SpiceDisplayMonitorConfig, i);
         SpiceHead *head = &config->heads[i];
         CHANNEL_DEBUG(channel, "monitor id: %u, surface id: %u, +%u+%u-%ux%u",
                     head->monitor_id, head->surface_id,
@@ -2065,7 +2692,8 @@ static void display_handle_monitors_config(SpiceChannel *channel, SpiceMsgIn *in
         mc->height = head->height;
     }
 
-    g_coroutine_object_notify(G_OBJECT(channel), "monitors");
+    display_set_monitors(c, monitors);
+    g_coroutine_object_notify_async(G_OBJECT(channel), "monitors");
 }
 
 
@@ -2092,6 +2720,7 @@ static void display_handle_gl_scanout_unix(SpiceChannel *channel, SpiceMsgIn *in
     c->scanout.stride = scanout->stride;
     c->scanout.format = scanout->drm_fourcc_format;
 
+    /* synchronous, the main context reads c->scanout from the handlers */
     g_coroutine_object_notify(G_OBJECT(channel), "gl-scanout");
 }
 #endif
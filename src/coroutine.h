@@ -30,6 +30,9 @@
 #include <glib.h>
 #endif
 
+/* used when stack_size is 0, reserved rather than committed */
+#define COROUTINE_DEFAULT_STACK_SIZE (16 << 20)
+
 struct coroutine
 {
 	size_t stack_size;
@@ -37,6 +40,7 @@ struct coroutine
 
 	/* read-only */
 	int exited;
+	size_t stack_used; /* stack high-water mark, once exited */
 
 	/* private */
 	struct coroutine *caller;
@@ -60,6 +64,9 @@ void coroutine_init(struct coroutine *co);
 
 int coroutine_release(struct coroutine *co);
 
+/* deepest stack usage of the coroutines released so far, 0 if unknown */
+size_t coroutine_stack_high_water(void);
+
 struct coroutine *coroutine_self(void);
 
 void *coroutine_yieldto(struct coroutine *to, void *arg);
@@ -95,6 +95,11 @@ void coroutine_init(struct coroutine *co)
 	co->caller = NULL;
 }
 
+size_t coroutine_stack_high_water(void)
+{
+	return 0;
+}
+
 int coroutine_release(struct coroutine *co G_GNUC_UNUSED)
 {
 	return 0;
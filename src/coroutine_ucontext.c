@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #endif
 #include <sys/mman.h>
+#include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,6 +40,132 @@
 # define MAP_ANONYMOUS MAP_ANON
 #endif
 
+/*
+ * Stacks are recycled through a process-wide pool, so that channels
+ * coming and going (usbredir, reconnections) do not mmap/munmap a new
+ * stack each time. Each stack is lazily committed and has a guard page
+ * below it, so that an overflow faults instead of silently corrupting
+ * a neighbour mapping.
+ */
+#define STACK_POOL_MAX 16
+
+struct coroutine_stack {
+	char *map;
+	size_t map_size;
+};
+
+static GMutex stack_pool_lock;
+static GSList *stack_pool;
+static guint stack_pool_length;
+static size_t stack_high_water;
+
+static size_t page_size(void)
+{
+	static size_t size;
+
+	if (size == 0)
+		size = sysconf(_SC_PAGESIZE);
+	return size;
+}
+
+static char *stack_map(size_t map_size)
+{
+	struct coroutine_stack *stack = NULL;
+	char *map;
+	GSList *l;
+
+	g_mutex_lock(&stack_pool_lock);
+	for (l = stack_pool; l != NULL; l = l->next) {
+		stack = l->data;
+		if (stack->map_size == map_size) {
+			stack_pool = g_slist_delete_link(stack_pool, l);
+			stack_pool_length--;
+			break;
+		}
+		stack = NULL;
+	}
+	g_mutex_unlock(&stack_pool_lock);
+
+	if (stack != NULL) {
+		map = stack->map;
+		g_free(stack);
+		return map;
+	}
+
+	map = mmap(0, map_size,
+		   PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS,
+		   -1, 0);
+	if (map == MAP_FAILED)
+		g_error("mmap(%" G_GSIZE_FORMAT ") failed: %s",
+			map_size, g_strerror(errno));
+	if (mprotect(map, page_size(), PROT_NONE) < 0)
+		g_error("mprotect() failed: %s", g_strerror(errno));
+
+	return map;
+}
+
+static void stack_unmap(char *map, size_t map_size)
+{
+	struct coroutine_stack *stack;
+
+#ifdef MADV_DONTNEED
+	/* give the used pages back, so that an idle pooled stack costs no
+	 * memory and the next high-water mark is measured afresh */
+	madvise(map + page_size(), map_size - page_size(), MADV_DONTNEED);
+#endif
+
+	g_mutex_lock(&stack_pool_lock);
+	if (stack_pool_length < STACK_POOL_MAX) {
+		stack = g_new(struct coroutine_stack, 1);
+		stack->map = map;
+		stack->map_size = map_size;
+		stack_pool = g_slist_prepend(stack_pool, stack);
+		stack_pool_length++;
+		map = NULL;
+	}
+	g_mutex_unlock(&stack_pool_lock);
+
+	if (map != NULL)
+		munmap(map, map_size);
+}
+
+/* Stack pages are only committed when first touched: the lowest
+ * resident page tells how deep the stack went. */
+static size_t stack_used(char *stack, size_t size)
+{
+#ifdef __linux__
+	size_t npages = size / page_size();
+	unsigned char *vec = g_malloc(npages);
+	size_t i, used = 0;
+
+	if (mincore(stack, size, vec) == 0) {
+		for (i = 0; i < npages; i++) {
+			if (vec[i] & 1) {
+				used = (npages - i) * page_size();
+				break;
+			}
+		}
+	}
+	g_free(vec);
+
+	return used;
+#else
+	return 0;
+#endif
+}
+
+size_t coroutine_stack_high_water(void)
+{
+	size_t used;
+
+	g_mutex_lock(&stack_pool_lock);
+	used = stack_high_water;
+	g_mutex_unlock(&stack_pool_lock);
+
+	return used;
+}
+
 int coroutine_release(struct coroutine *co)
 {
 	return cc_release(&co->cc);
@@ -51,7 +178,12 @@ static int _coroutine_release(struct continuation *cc)
 #ifdef HAVE_VALGRIND
 	VALGRIND_STACK_DEREGISTER(co->vg_stack);
 #endif
-	munmap(co->cc.stack, co->cc.stack_size);
+	co->stack_used = stack_used(co->cc.stack, co->cc.stack_size);
+	g_mutex_lock(&stack_pool_lock);
+	stack_high_water = MAX(stack_high_water, co->stack_used);
+	g_mutex_unlock(&stack_pool_lock);
+
+	stack_unmap(co->cc.stack - page_size(), co->cc.stack_size + page_size());
 
 	co->caller = NULL;
 
@@ -67,18 +199,14 @@ static void coroutine_trampoline(struct continuation *cc)
 void coroutine_init(struct coroutine *co)
 {
 	if (co->stack_size == 0)
-		co->stack_size = 16 << 20;
-
-	co->cc.stack_size = co->stack_size;
-	co->cc.stack = mmap(0, co->stack_size,
-			    PROT_READ | PROT_WRITE,
-			    MAP_PRIVATE | MAP_ANONYMOUS,
-			    -1, 0);
-	if (co->cc.stack == MAP_FAILED)
-		g_error("mmap(%" G_GSIZE_FORMAT ") failed: %s",
-			co->stack_size, g_strerror(errno));
+		co->stack_size = COROUTINE_DEFAULT_STACK_SIZE;
+
+	/* round up to whole pages, the guard page comes on top */
+	co->cc.stack_size = (co->stack_size + page_size() - 1) & ~(page_size() - 1);
+	co->cc.stack = stack_map(co->cc.stack_size + page_size()) + page_size();
+	co->stack_used = 0;
 #ifdef HAVE_VALGRIND
-	co->vg_stack = VALGRIND_STACK_REGISTER(co->cc.stack, co->cc.stack + co->stack_size);
+	co->vg_stack = VALGRIND_STACK_REGISTER(co->cc.stack, co->cc.stack + co->cc.stack_size);
 #endif
 
 	co->cc.entry = coroutine_trampoline;
@@ -88,11 +216,16 @@ void coroutine_init(struct coroutine *co)
 	cc_init(&co->cc);
 }
 
-static struct coroutine leader;
-static struct coroutine *current = &leader;
+/* Each thread running coroutines has its own system coroutine, so that
+ * channels can be driven from worker threads (see
+ * SpiceSession:display-threads) */
+static __thread struct coroutine leader;
+static __thread struct coroutine *current;
 
 struct coroutine *coroutine_self(void)
 {
+	if (current == NULL)
+		current = &leader;
 	return current;
 }
 
@@ -24,8 +24,14 @@
 
 #include "coroutine.h"
 
-static struct coroutine leader = { 0, };
-static struct coroutine *current = &leader;
+/* one system coroutine per thread, see coroutine_ucontext.c */
+static __thread struct coroutine leader = { 0, };
+static __thread struct coroutine *current;
+
+size_t coroutine_stack_high_water(void)
+{
+	return 0;
+}
 
 int coroutine_release(struct coroutine *co)
 {
@@ -56,15 +62,22 @@ void coroutine_init(struct coroutine *co)
 	}
 
 	co->exited = 0;
-	co->fiber = CreateFiber(0, &coroutine_trampoline, co);
+	co->stack_used = 0;
+	if (co->stack_size == 0)
+		co->stack_size = COROUTINE_DEFAULT_STACK_SIZE;
+	/* only reserve the stack, the pages are committed as it grows */
+	co->fiber = CreateFiberEx(0 /* default commit */, co->stack_size /* reserve */,
+				  FIBER_FLAG_FLOAT_SWITCH, &coroutine_trampoline, co);
 	if (co->fiber == NULL)
-		g_error("CreateFiber() failed");
+		g_error("CreateFiberEx() failed");
 
 	co->ret = 0;
 }
 
 struct coroutine *coroutine_self(void)
 {
+	if (current == NULL)
+		current = &leader;
 	return current;
 }
 
@@ -173,7 +173,7 @@
 
 /* returns num of bytes read from in buf.
    size should be in PIXEL */
-static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
+static size_t FNAME(decode)(GlibGlzDecoder *decoder,
                             uint8_t* in_buf, uint8_t *out_buf, int size,
                             uint64_t image_id, SpicePalette *plt)
 {
@@ -256,29 +256,36 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
                 g_return_val_if_fail(ref + len <= op_limit, 0);
                 g_return_val_if_fail(ref >= out_pix_buf, 0);
             } else {
-                ref = glz_decoder_window_bits(window, image_id,
-                                              image_dist, pixel_ofs);
+                ref = glz_decoder_bits(decoder, image_id,
+                                       image_dist, pixel_ofs, len);
             }
 
             g_return_val_if_fail(ref != NULL, 0);
             g_return_val_if_fail(op + len <= op_limit, 0);
 
-            /* copying the match*/
+            /* copying the match, op + len <= op_limit was checked above */
 
+#if defined(LZ_RGB_ALPHA)
+            for (; len; --len) {
+                COPY_REF_PIXEL(ref, op);
+            }
+#else
             if (ref == (op - 1)) { // run (this will never be called in PLT4/1_TO_RGB because the
                                   // number of pixel copied is larger then one...
-                /* optimize copy for a run */
+                /* pattern fill for a run */
                 OUT_PIXEL b = *ref;
                 for (; len; --len) {
                     COPY_PIXEL(b, op);
-                    g_return_val_if_fail(op <= op_limit, 0);
                 }
+            } else if (image_dist) {
+                /* reference in another image, no overlap */
+                memcpy(op, ref, len * sizeof(OUT_PIXEL));
+                op += len;
             } else {
-                for (; len; --len) {
-                    COPY_REF_PIXEL(ref, op);
-                    g_return_val_if_fail(op <= op_limit, 0);
-                }
+                glz_copy_match((uint8_t *)op, (const uint8_t *)ref, len * sizeof(OUT_PIXEL));
+                op += len;
             }
+#endif
         } else { // copy
             ctrl++; // copy count is biased by 1
 #if defined(TO_RGB32) && (defined(PLT4_BE) || defined(PLT4_LE) || defined(PLT1_BE) || \
@@ -288,23 +295,25 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
             g_return_val_if_fail(op + ctrl <= op_limit, 0);
 #endif
 
-#if defined(TO_RGB32) && defined(LZ_PLT)
+            /* the whole literal run fits, no need to check each pixel */
+#if defined(LZ_RGB32)
+            glz_rgb24_to_rgb32(ip, (uint8_t *)op, ctrl);
+            ip += ctrl * 3;
+            op += ctrl;
+#elif defined(LZ_RGB16) && defined(TO_RGB32)
+            glz_rgb16_to_rgb32(ip, (uint8_t *)op, ctrl);
+            ip += ctrl * 2;
+            op += ctrl;
+#elif defined(TO_RGB32) && defined(LZ_PLT)
             g_return_val_if_fail(plt, 0);
-            COPY_COMP_PIXEL(ip, op, plt);
-#else
-            COPY_COMP_PIXEL(ip, op);
-#endif
-            g_return_val_if_fail(op <= op_limit, 0);
-
-            for (--ctrl; ctrl; ctrl--) {
-#if defined(TO_RGB32) && defined(LZ_PLT)
-                g_return_val_if_fail(plt, 0);
+            for (; ctrl; ctrl--) {
                 COPY_COMP_PIXEL(ip, op, plt);
+            }
 #else
+            for (; ctrl; ctrl--) {
                 COPY_COMP_PIXEL(ip, op);
-#endif
-                g_return_val_if_fail(op <= op_limit, 0);
             }
+#endif
         } // END REF/COPY
 
         if (LZ_EXPECT_CONDITIONAL(op < op_limit)) {
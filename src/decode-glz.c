@@ -18,6 +18,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <inttypes.h>
 
 #include <glib.h>
@@ -25,6 +26,7 @@
 #include "gio-coroutine.h"
 #include "spice-util.h"
 #include "decode.h"
+#include "spice-cpu.h"
 
 #include "common/canvas_utils.h"
 
@@ -39,6 +41,7 @@ struct glz_image_hdr {
 };
 
 struct glz_image {
+    gint                    ref_count;
     struct glz_image_hdr    hdr;
     pixman_image_t          *surface;
     uint8_t                 *data;
@@ -52,6 +55,7 @@ static struct glz_image *glz_image_new(struct glz_image_hdr *hdr,
     g_return_val_if_fail(type == LZ_IMAGE_TYPE_RGB32 || type == LZ_IMAGE_TYPE_RGBA, NULL);
 
     img = g_new0(struct glz_image, 1);
+    img->ref_count = 1;
     img->hdr = *hdr;
     img->surface = alloc_lz_image_surface
         (opaque, type == LZ_IMAGE_TYPE_RGBA ? PIXMAN_LE_a8r8g8b8 : PIXMAN_LE_x8r8g8b8,
@@ -64,9 +68,16 @@ static struct glz_image *glz_image_new(struct glz_image_hdr *hdr,
     return img;
 }
 
-static void glz_image_destroy(struct glz_image *img)
+static struct glz_image *glz_image_ref(struct glz_image *img)
 {
-    if (img == NULL)
+    g_atomic_int_inc(&img->ref_count);
+    return img;
+}
+
+/* the window and the decodes referencing an image hold a reference */
+static void glz_image_unref(struct glz_image *img)
+{
+    if (img == NULL || !g_atomic_int_dec_and_test(&img->ref_count))
         return;
 
     pixman_image_unref(img->surface);
@@ -75,59 +86,193 @@ static void glz_image_destroy(struct glz_image *img)
 
 /* ------------------------------------------------------------------ */
 
-#define INIT_IMAGES_CAPACITY 100
+#define WIN_INIT_CAPACITY 64
+/* the ring never spans more ids, about 8 MiB of slots */
+#define WIN_MAX_CAPACITY (1 << 20)
+/* the server sends smaller images uncompressed, this bounds the number
+ * of images the budget holds */
+#define WIN_MIN_IMAGE_SIZE 64
+/* images kept beyond the size of the server dictionary */
 #define WIN_OVERFLOW_FACTOR 1.5
-#define WIN_REALLOC_FACTOR 1.5
 
+/*
+ * The window is shared by the display channels of a session, which
+ * may run on different threads (see SpiceSession:display-threads), and
+ * by the decode pipeline workers (see decode-pipeline.c). The lock
+ * protects the image slots only: a decode references the images it
+ * copies from, so that pixels are decoded without holding the lock.
+ * A decode missing a reference image waits for that image id only,
+ * a coroutine on the keyed wait queue, a worker thread on the cond.
+ *
+ * The images are kept in a ring indexed by id, holding the ids from
+ * oldest to oldest + capacity - 1. Images from several displays may
+ * arrive out of order and leave empty slots, they never collide: the
+ * ring only grows when the ids it holds span more than its capacity,
+ * up to the number of images the budget may hold: an id further ahead
+ * drops the older images. The first ids added after a clear set the
+ * start of the ring.
+ * Images are released once no later image may reference them (see
+ * win_head_dist), and the oldest ones are dropped when the window
+ * exceeds its byte budget, derived from SpiceSession:glz-window-size.
+ */
 struct SpiceGlzDecoderWindow {
-    struct glz_image        **images;
-    uint32_t                nimages;
-    uint64_t                oldest;
-    uint64_t                tail_gap;
+    GMutex                  lock;
+    GCond                   cond;
+    GCoroutineWaitQueue     *waiters;
+    guint                   generation; /* bumped by each clear */
+    struct glz_image        **ring;
+    uint32_t                capacity;   /* a power of 2 */
+    uint64_t                oldest;     /* first id not released */
+    uint64_t                tail_gap;   /* first id not added */
+    uint64_t                newest;     /* last id added */
+    gboolean                started;    /* an image was added since the clear */
+    gboolean                released;   /* an image was released since the clear */
+    gsize                   used;       /* bytes of the images held */
+    gsize                   budget;     /* 0 if not set */
 };
 
-static void glz_decoder_window_resize(SpiceGlzDecoderWindow *w)
-{
-    struct glz_image  **new_images;
-    int i, new_slot;
-
-    SPICE_DEBUG("%s: array resize %u -> %u", __FUNCTION__,
-                w->nimages, w->nimages * 2);
-    new_images = g_new0(struct glz_image*, w->nimages * 2);
-    for (i = 0; i < w->nimages; i++) {
-        if (w->images[i] == NULL) {
-            /*
-             * We can have empty slots when images come in out of order, this
-             * can happen when a vm has multiple displays, since each display
-             * uses its own socket there is no guarantee that images
-             * originating from different displays are received in id order.
-             */
-            continue;
+static inline struct glz_image **glz_decoder_window_slot(SpiceGlzDecoderWindow *w,
+                                                         uint64_t id)
+{
+    return &w->ring[id & (w->capacity - 1)];
+}
+
+static gsize glz_image_size(struct glz_image *img)
+{
+    return (gsize)img->hdr.gross_pixels * 4;
+}
+
+static uint32_t glz_decoder_window_max_capacity(SpiceGlzDecoderWindow *w)
+{
+    gsize images = w->budget / WIN_MIN_IMAGE_SIZE;
+    uint32_t capacity = WIN_INIT_CAPACITY;
+
+    if (w->budget == 0 || images > WIN_MAX_CAPACITY)
+        return WIN_MAX_CAPACITY;
+    while (capacity < images)
+        capacity *= 2;
+    return capacity;
+}
+
+/* grows the ring to hold span + 1 ids, span is below the max capacity */
+static void glz_decoder_window_grow(SpiceGlzDecoderWindow *w, uint64_t span)
+{
+    struct glz_image **old_ring = w->ring;
+    uint32_t old_capacity = w->capacity;
+    uint32_t i;
+
+    while (span >= w->capacity)
+        w->capacity *= 2;
+
+    SPICE_DEBUG("%s: ring resize %u -> %u", __FUNCTION__, old_capacity, w->capacity);
+    w->ring = g_new0(struct glz_image *, w->capacity);
+    for (i = 0; i < old_capacity; i++) {
+        if (old_ring[i] != NULL)
+            *glz_decoder_window_slot(w, old_ring[i]->hdr.id) = old_ring[i];
+    }
+    g_free(old_ring);
+}
+
+/* releases the images before id oldest */
+static void glz_decoder_window_release(SpiceGlzDecoderWindow *w,
+                                       uint64_t oldest)
+{
+    uint32_t i;
+
+    if (oldest <= w->oldest)
+        return;
+
+    if (oldest - w->oldest >= w->capacity) {
+        /* all of them, without walking the ids in between */
+        for (i = 0; i < w->capacity; i++) {
+            if (w->ring[i] == NULL)
+                continue;
+            w->used -= glz_image_size(w->ring[i]);
+            g_clear_pointer(&w->ring[i], glz_image_unref);
         }
-        new_slot = w->images[i]->hdr.id % (w->nimages * 2);
-        new_images[new_slot] = w->images[i];
+        w->oldest = oldest;
     }
-    g_free(w->images);
-    w->images = new_images;
-    w->nimages *= 2;
+
+    for (; w->oldest < oldest; w->oldest++) {
+        struct glz_image **slot = glz_decoder_window_slot(w, w->oldest);
+
+        if (*slot == NULL)
+            continue;
+        w->used -= glz_image_size(*slot);
+        g_clear_pointer(slot, glz_image_unref);
+    }
+    w->tail_gap = MAX(w->tail_gap, w->oldest);
+    w->released = TRUE;
 }
 
-static void glz_decoder_window_add(SpiceGlzDecoderWindow *w,
-                                   struct glz_image *img)
+/* called with the window lock held, returns TRUE if images were
+ * dropped to fit the budget */
+static gboolean glz_decoder_window_add(SpiceGlzDecoderWindow *w,
+                                       struct glz_image *img)
 {
-    int slot = img->hdr.id % w->nimages;
+    uint64_t id = img->hdr.id;
+    uint32_t max_capacity = glz_decoder_window_max_capacity(w);
+    gboolean dropped = FALSE;
+    struct glz_image *last;
+
+    if (!w->started) {
+        w->started = TRUE;
+        w->oldest = w->tail_gap = w->newest = id;
+    } else if (id < w->oldest && !w->released && w->newest - id < max_capacity) {
+        /* images of other displays may come out of order after a clear,
+         * the ring starts at the lowest id until one is released */
+        if (w->newest - id >= w->capacity)
+            glz_decoder_window_grow(w, w->newest - id);
+        w->oldest = w->tail_gap = id;
+    }
+
+    if (id < w->oldest) {
+        /* no later image references it */
+        SPICE_DEBUG("%s: image %" G_GUINT64_FORMAT " already released",
+                    __FUNCTION__, id);
+        glz_image_unref(img);
+        return FALSE;
+    }
 
-    if (w->images[slot]) {
-        /* need more space */
-        glz_decoder_window_resize(w);
-        slot = img->hdr.id % w->nimages;
+    if (id - w->oldest >= max_capacity) {
+        g_warning("glz image %" G_GUINT64_FORMAT " is too far ahead of %" G_GUINT64_FORMAT
+                  ", dropping the older images", id, w->oldest);
+        glz_decoder_window_release(w, id - max_capacity + 1);
+        dropped = TRUE;
     }
 
-    w->images[slot] = img;
+    if (id - w->oldest >= w->capacity)
+        glz_decoder_window_grow(w, id - w->oldest);
+    w->newest = MAX(w->newest, id);
+
+    g_clear_pointer(glz_decoder_window_slot(w, id), glz_image_unref);
+    *glz_decoder_window_slot(w, id) = img;
+    w->used += glz_image_size(img);
 
     /* close the gap */
-    while (w->tail_gap <= img->hdr.id && w->images[w->tail_gap % w->nimages] != NULL)
+    while (w->tail_gap - w->oldest < w->capacity &&
+           *glz_decoder_window_slot(w, w->tail_gap) != NULL)
         w->tail_gap++;
+
+    /* release old images from last tail_gap, only if the gap is closed */
+    if (w->tail_gap > w->oldest) {
+        last = *glz_decoder_window_slot(w, w->tail_gap - 1);
+        g_warn_if_fail(last != NULL);
+        if (last != NULL)
+            glz_decoder_window_release(w, last->hdr.id - last->hdr.win_head_dist);
+    }
+
+    /* the server should not need more, drop the oldest images, up to
+     * the first gap, which images of another display may fill later */
+    if (w->budget != 0 && w->used > w->budget && w->oldest < MIN(id, w->tail_gap)) {
+        SPICE_DEBUG("%s: %" G_GSIZE_FORMAT " bytes over budget", __FUNCTION__,
+                    w->used - w->budget);
+        while (w->used > w->budget && w->oldest < MIN(id, w->tail_gap))
+            glz_decoder_window_release(w, w->oldest + 1);
+        dropped = TRUE;
+    }
+
+    return dropped;
 }
 
 struct wait_for_image_data {
@@ -135,46 +280,66 @@ struct wait_for_image_data {
     uint64_t                   id;
 };
 
-static gboolean wait_for_image(gpointer data)
+/* called with the window lock held */
+static struct glz_image *glz_decoder_window_lookup(SpiceGlzDecoderWindow *w, uint64_t id)
 {
-    struct wait_for_image_data *wait = data;
-    int slot = wait->id % wait->window->nimages;
-    struct glz_image *image = wait->window->images[slot];
-    gboolean ready = image && image->hdr.id == wait->id;
+    struct glz_image *image;
 
-    return ready;
+    if (id < w->oldest || id - w->oldest >= w->capacity)
+        return NULL;
+
+    image = *glz_decoder_window_slot(w, id);
+    return (image && image->hdr.id == id) ? image : NULL;
 }
 
-static void *glz_decoder_window_bits(SpiceGlzDecoderWindow *w, uint64_t id,
-                                     uint32_t dist, uint32_t offset)
+static gboolean wait_for_image(gpointer data)
 {
-    struct wait_for_image_data data = {
-        .window = w,
-        .id = id - dist,
-    };
-
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_for_image, &data))
-        SPICE_DEBUG("wait for image cancelled");
-
-    int slot = (id - dist) % w->nimages;
+    struct wait_for_image_data *wait = data;
+    gboolean ready;
 
-    g_return_val_if_fail(w->images[slot] != NULL, NULL);
-    g_return_val_if_fail(w->images[slot]->hdr.id == id - dist, NULL);
-    g_return_val_if_fail(w->images[slot]->hdr.gross_pixels >= offset, NULL);
+    /* a dropped image will not come back */
+    g_mutex_lock(&wait->window->lock);
+    ready = wait->id < wait->window->oldest ||
+        glz_decoder_window_lookup(wait->window, wait->id) != NULL;
+    g_mutex_unlock(&wait->window->lock);
 
-    return w->images[slot]->data + offset * 4;
+    return ready;
 }
 
-static void glz_decoder_window_release(SpiceGlzDecoderWindow *w,
-                                       uint64_t oldest)
+/* called with the window lock held, which is released while waiting */
+static struct glz_image *glz_decoder_window_wait(SpiceGlzDecoderWindow *w, uint64_t id,
+                                                 const gint *cancelled)
 {
-    int slot;
+    struct glz_image *image = glz_decoder_window_lookup(w, id);
 
-    while (w->oldest < oldest) {
-        slot = w->oldest % w->nimages;
-        g_clear_pointer(&w->images[slot], glz_image_destroy);
-        w->oldest++;
+    if (image != NULL)
+        return image;
+
+    if (decode_pipeline_in_worker()) {
+        /* pipeline worker: give up if the window is cleared meanwhile,
+         * or if the pipeline is cancelled */
+        guint generation = w->generation;
+
+        while (image == NULL && generation == w->generation && id >= w->oldest &&
+               !(cancelled && g_atomic_int_get(cancelled))) {
+            g_cond_wait(&w->cond, &w->lock);
+            image = glz_decoder_window_lookup(w, id);
+        }
+    } else {
+        struct wait_for_image_data data = {
+            .window = w,
+            .id = id,
+        };
+
+        g_mutex_unlock(&w->lock);
+        if (!g_coroutine_wait_queue_wait(g_coroutine_self(), w->waiters,
+                                         id, wait_for_image, &data))
+            SPICE_DEBUG("wait for image cancelled");
+        g_mutex_lock(&w->lock);
+        image = glz_decoder_window_lookup(w, id);
     }
+
+    return image;
 }
 
 /* ------------------------------------------------------------------ */
@@ -184,9 +349,48 @@ typedef struct GlibGlzDecoder {
     uint8_t                 *in_start;
     uint8_t                 *in_now;
     SpiceGlzDecoderWindow   *window;
+    SpiceDecodePipeline     *pipeline;
     struct glz_image_hdr    image;
+    /* images referenced by the image being decoded */
+    GPtrArray               *refs;
+    struct glz_image        *last_ref;
+    const gint              *cancelled;
 } GlibGlzDecoder;
 
+/* returns the pixels of image id - dist at offset, the image is held
+ * until the end of the decode, the len pixels from there must be in it */
+static void *glz_decoder_bits(GlibGlzDecoder *d, uint64_t id,
+                              uint32_t dist, uint32_t offset, uint32_t len)
+{
+    struct glz_image *image = d->last_ref;
+    guint i;
+
+    if (image == NULL || image->hdr.id != id - dist) {
+        image = NULL;
+        for (i = 0; i < d->refs->len; i++) {
+            struct glz_image *ref = g_ptr_array_index(d->refs, i);
+            if (ref->hdr.id == id - dist) {
+                image = ref;
+                break;
+            }
+        }
+    }
+
+    if (image == NULL) {
+        g_mutex_lock(&d->window->lock);
+        image = glz_decoder_window_wait(d->window, id - dist, d->cancelled);
+        if (image != NULL)
+            g_ptr_array_add(d->refs, glz_image_ref(image));
+        g_mutex_unlock(&d->window->lock);
+    }
+
+    g_return_val_if_fail(image != NULL, NULL);
+    g_return_val_if_fail((uint64_t)offset + len <= image->hdr.gross_pixels, NULL);
+
+    d->last_ref = image;
+    return image->data + offset * 4;
+}
+
 /*
  * Give hints to the compiler for branch prediction optimization.
  */
@@ -222,6 +426,242 @@ typedef struct rgb24_pixel_t {
 
 typedef uint16_t rgb16_pixel_t;
 
+/* ------------------------------------------------------------------ */
+/* literal expansion kernels                                          */
+
+/*
+ * Literal runs of RGB24 (and RGB32, which is sent as RGB24) images are
+ * expanded to BGRX, and RGB16 (big endian 555) to BGRX with the low
+ * bits replicated. These loops dominate the decoding of desktop
+ * images, so they have SIMD variants picked at runtime.
+ */
+static void glz_rgb24_to_rgb32_c(const uint8_t *in, uint8_t *out, uint32_t n)
+{
+    for (; n; n--) {
+        out[0] = in[0];
+        out[1] = in[1];
+        out[2] = in[2];
+        out[3] = 0;
+        in += 3;
+        out += 4;
+    }
+}
+
+static inline uint8_t glz_expand5(uint8_t c)
+{
+    return (c << 3) | (c >> 2);
+}
+
+static void glz_rgb16_to_rgb32_c(const uint8_t *in, uint8_t *out, uint32_t n)
+{
+    for (; n; n--) {
+        uint16_t v = (in[0] << 8) | in[1];
+        out[0] = glz_expand5(v & 0x1f);
+        out[1] = glz_expand5((v >> 5) & 0x1f);
+        out[2] = glz_expand5((v >> 10) & 0x1f);
+        out[3] = 0;
+        in += 2;
+        out += 4;
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GLZ_X86_KERNELS
+#include <immintrin.h>
+
+/* 16 pixels per iteration, the last load reads 4 bytes past the 48
+ * converted ones, hence the extra 2 pixels required */
+__attribute__((target("ssse3")))
+static void glz_rgb24_to_rgb32_ssse3(const uint8_t *in, uint8_t *out, uint32_t n)
+{
+    const __m128i mask = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                       6, 7, 8, -1, 9, 10, 11, -1);
+
+    for (; n >= 18; n -= 16, in += 48, out += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(in + 0));
+        __m128i b = _mm_loadu_si128((const __m128i *)(in + 12));
+        __m128i c = _mm_loadu_si128((const __m128i *)(in + 24));
+        __m128i d = _mm_loadu_si128((const __m128i *)(in + 36));
+
+        _mm_storeu_si128((__m128i *)(out + 0), _mm_shuffle_epi8(a, mask));
+        _mm_storeu_si128((__m128i *)(out + 16), _mm_shuffle_epi8(b, mask));
+        _mm_storeu_si128((__m128i *)(out + 32), _mm_shuffle_epi8(c, mask));
+        _mm_storeu_si128((__m128i *)(out + 48), _mm_shuffle_epi8(d, mask));
+    }
+    glz_rgb24_to_rgb32_c(in, out, n);
+}
+
+__attribute__((target("avx2")))
+static void glz_rgb24_to_rgb32_avx2(const uint8_t *in, uint8_t *out, uint32_t n)
+{
+    const __m256i mask = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                          6, 7, 8, -1, 9, 10, 11, -1,
+                                          0, 1, 2, -1, 3, 4, 5, -1,
+                                          6, 7, 8, -1, 9, 10, 11, -1);
+
+    for (; n >= 18; n -= 16, in += 48, out += 64) {
+        __m256i a = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(in + 0))),
+            _mm_loadu_si128((const __m128i *)(in + 12)), 1);
+        __m256i b = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(in + 24))),
+            _mm_loadu_si128((const __m128i *)(in + 36)), 1);
+
+        _mm256_storeu_si256((__m256i *)(out + 0), _mm256_shuffle_epi8(a, mask));
+        _mm256_storeu_si256((__m256i *)(out + 32), _mm256_shuffle_epi8(b, mask));
+    }
+    glz_rgb24_to_rgb32_c(in, out, n);
+}
+
+/* 8 pixels per iteration */
+__attribute__((target("sse2")))
+static void glz_rgb16_to_rgb32_sse2(const uint8_t *in, uint8_t *out, uint32_t n)
+{
+    const __m128i m5 = _mm_set1_epi16(0x1f);
+
+    for (; n >= 8; n -= 8, in += 16, out += 32) {
+        __m128i v = _mm_loadu_si128((const __m128i *)in);
+        __m128i r, g, b, bg;
+
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        r = _mm_and_si128(_mm_srli_epi16(v, 10), m5);
+        g = _mm_and_si128(_mm_srli_epi16(v, 5), m5);
+        b = _mm_and_si128(v, m5);
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+        g = _mm_or_si128(_mm_slli_epi16(g, 3), _mm_srli_epi16(g, 2));
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+        bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+
+        _mm_storeu_si128((__m128i *)(out + 0), _mm_unpacklo_epi16(bg, r));
+        _mm_storeu_si128((__m128i *)(out + 16), _mm_unpackhi_epi16(bg, r));
+    }
+    glz_rgb16_to_rgb32_c(in, out, n);
+}
+
+/* 16 pixels per iteration */
+__attribute__((target("avx2")))
+static void glz_rgb16_to_rgb32_avx2(const uint8_t *in, uint8_t *out, uint32_t n)
+{
+    const __m256i m5 = _mm256_set1_epi16(0x1f);
+
+    for (; n >= 16; n -= 16, in += 32, out += 64) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)in);
+        __m256i r, g, b, bg, lo, hi;
+
+        v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+        r = _mm256_and_si256(_mm256_srli_epi16(v, 10), m5);
+        g = _mm256_and_si256(_mm256_srli_epi16(v, 5), m5);
+        b = _mm256_and_si256(v, m5);
+        r = _mm256_or_si256(_mm256_slli_epi16(r, 3), _mm256_srli_epi16(r, 2));
+        g = _mm256_or_si256(_mm256_slli_epi16(g, 3), _mm256_srli_epi16(g, 2));
+        b = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_srli_epi16(b, 2));
+        bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+
+        /* the unpacks work within 128-bit lanes */
+        lo = _mm256_unpacklo_epi16(bg, r);
+        hi = _mm256_unpackhi_epi16(bg, r);
+        _mm256_storeu_si256((__m256i *)(out + 0), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(out + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    glz_rgb16_to_rgb32_sse2(in, out, n);
+}
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define GLZ_NEON_KERNELS
+#include <arm_neon.h>
+
+static void glz_rgb24_to_rgb32_neon(const uint8_t *in, uint8_t *out, uint32_t n)
+{
+    for (; n >= 16; n -= 16, in += 48, out += 64) {
+        uint8x16x3_t v = vld3q_u8(in);
+        uint8x16x4_t o = { { v.val[0], v.val[1], v.val[2], vdupq_n_u8(0) } };
+
+        vst4q_u8(out, o);
+    }
+    glz_rgb24_to_rgb32_c(in, out, n);
+}
+
+static inline uint8x16_t glz_expand5_neon(uint8x16_t c)
+{
+    return vorrq_u8(vshlq_n_u8(c, 3), vshrq_n_u8(c, 2));
+}
+
+static void glz_rgb16_to_rgb32_neon(const uint8_t *in, uint8_t *out, uint32_t n)
+{
+    const uint8x16_t m5 = vdupq_n_u8(0x1f);
+
+    for (; n >= 16; n -= 16, in += 32, out += 64) {
+        uint8x16x2_t v = vld2q_u8(in); /* high bytes, low bytes */
+        uint8x16_t r = vandq_u8(vshrq_n_u8(v.val[0], 2), m5);
+        uint8x16_t g = vorrq_u8(vshlq_n_u8(vandq_u8(v.val[0], vdupq_n_u8(0x03)), 3),
+                                vshrq_n_u8(v.val[1], 5));
+        uint8x16_t b = vandq_u8(v.val[1], m5);
+        uint8x16x4_t o = { { glz_expand5_neon(b), glz_expand5_neon(g),
+                             glz_expand5_neon(r), vdupq_n_u8(0) } };
+
+        vst4q_u8(out, o);
+    }
+    glz_rgb16_to_rgb32_c(in, out, n);
+}
+#endif
+
+static const GlzKernels glz_kernels[] = {
+#if defined(GLZ_X86_KERNELS)
+    { "avx2", glz_rgb24_to_rgb32_avx2, glz_rgb16_to_rgb32_avx2 },
+    { "ssse3", glz_rgb24_to_rgb32_ssse3, glz_rgb16_to_rgb32_sse2 },
+    { "sse2", glz_rgb24_to_rgb32_c, glz_rgb16_to_rgb32_sse2 },
+#elif defined(GLZ_NEON_KERNELS)
+    { "neon", glz_rgb24_to_rgb32_neon, glz_rgb16_to_rgb32_neon },
+#endif
+    { "c", glz_rgb24_to_rgb32_c, glz_rgb16_to_rgb32_c },
+};
+
+static GlzExpandFunc glz_rgb24_to_rgb32 = glz_rgb24_to_rgb32_c;
+static GlzExpandFunc glz_rgb16_to_rgb32 = glz_rgb16_to_rgb32_c;
+
+static void glz_kernels_init(void)
+{
+    static gsize initialized = 0;
+
+    if (!g_once_init_enter(&initialized))
+        return;
+
+    if (g_getenv("SPICE_GLZ_NO_SIMD") == NULL) {
+        const GlzKernels *k = &glz_kernels[SPICE_CPU_FIRST_SUPPORTED(glz_kernels)];
+
+        glz_rgb24_to_rgb32 = k->rgb24_to_rgb32;
+        glz_rgb16_to_rgb32 = k->rgb16_to_rgb32;
+    }
+
+    g_once_init_leave(&initialized, 1);
+}
+
+/* the kernels supported by the CPU, fastest first, the last one is the
+ * scalar fallback */
+G_GNUC_INTERNAL
+const GlzKernels *glz_get_supported_kernels(guint *n_kernels)
+{
+    guint first = SPICE_CPU_FIRST_SUPPORTED(glz_kernels);
+
+    *n_kernels = G_N_ELEMENTS(glz_kernels) - first;
+    return &glz_kernels[first];
+}
+
+/* the match repeats the op - ref bytes preceding op, copy them in
+ * chunks that do not overlap, each one twice as large as the previous
+ * one */
+G_GNUC_INTERNAL
+void glz_copy_match(uint8_t *op, const uint8_t *ref, size_t len)
+{
+    while (len) {
+        size_t n = MIN(len, (size_t)(op - ref));
+        memcpy(op, ref, n);
+        op += n;
+        len -= n;
+    }
+}
+
 
 #define LZ_PLT
 #define PLT8
@@ -262,7 +702,7 @@ typedef uint16_t rgb16_pixel_t;
 #undef LZ_UNEXPECT_CONDITIONAL
 #undef LZ_EXPECT_CONDITIONAL
 
-typedef size_t (*decode_function)(SpiceGlzDecoderWindow *window,
+typedef size_t (*decode_function)(GlibGlzDecoder *decoder,
                                   uint8_t* in_buf, uint8_t *out_buf, int size,
                                   uint64_t id, SpicePalette *plt);
 
@@ -343,15 +783,32 @@ static void decode(SpiceGlzDecoder *decoder,
                    void *usr_data)
 {
     GlibGlzDecoder *d = SPICE_CONTAINEROF(decoder, GlibGlzDecoder, base);
+    SpiceGlzDecoderWindow *w = d->window;
     LzImageType decoded_type;
     struct glz_image *decoded_image;
     size_t n_in_bytes_decoded;
+    guint generation;
+    gboolean dropped;
 
     d->in_start = data;
     d->in_now = data;
 
     decode_header(d);
 
+    if (d->pipeline != NULL) {
+        pixman_image_t *surface = decode_pipeline_take_glz(d->pipeline, d->image.id);
+
+        if (surface != NULL) {
+            /* decoded ahead by a worker, which added it to the window */
+            ((LzDecodeUsrData *)usr_data)->out_surface = surface;
+            return;
+        }
+    }
+
+    g_mutex_lock(&w->lock);
+    generation = w->generation;
+    g_mutex_unlock(&w->lock);
+
     if (d->image.type == LZ_IMAGE_TYPE_RGBA) {
         decoded_type = LZ_IMAGE_TYPE_RGBA;
     } else {
@@ -361,27 +818,36 @@ static void decode(SpiceGlzDecoder *decoder,
     decoded_image = glz_image_new(&d->image, decoded_type, usr_data);
 
     n_in_bytes_decoded = DECODE_TO_RGB32[d->image.type]
-        (d->window, d->in_now, decoded_image->data,
+        (d, d->in_now, decoded_image->data,
          d->image.gross_pixels, d->image.id, palette);
 
     d->in_now += n_in_bytes_decoded;
 
     if (d->image.type == LZ_IMAGE_TYPE_RGBA) {
-        glz_rgb_alpha_decode(d->window, d->in_now, decoded_image->data,
+        glz_rgb_alpha_decode(d, d->in_now, decoded_image->data,
                              d->image.gross_pixels, d->image.id, palette);
     }
 
-    glz_decoder_window_add(d->window, decoded_image);
+    d->last_ref = NULL;
+    g_ptr_array_set_size(d->refs, 0);
 
-    { /* release old images from last tail_gap, only if the gap is closed  */
-        uint64_t oldest;
-        struct glz_image *image = d->window->images[(d->window->tail_gap - 1) % d->window->nimages];
+    g_mutex_lock(&w->lock);
+    if (generation != w->generation) {
+        /* the window was cleared meanwhile, the image belongs to the
+         * previous dictionary */
+        g_mutex_unlock(&w->lock);
+        glz_image_unref(decoded_image);
+        return;
+    }
 
-        g_return_if_fail(image != NULL);
+    dropped = glz_decoder_window_add(w, decoded_image);
+    g_cond_broadcast(&w->cond);
+    g_mutex_unlock(&w->lock);
 
-        oldest = image->hdr.id - image->hdr.win_head_dist;
-        glz_decoder_window_release(d->window, oldest);
-    }
+    if (dropped)
+        g_coroutine_wait_queue_wake_all(w->waiters);
+    else
+        g_coroutine_wait_queue_wake(w->waiters, d->image.id);
 }
 
 /* ------------------------------------------------------------------ */
@@ -392,25 +858,100 @@ static SpiceGlzDecoderOps glz_decoder_ops = {
 
 void glz_decoder_window_clear(SpiceGlzDecoderWindow *w)
 {
-    int i;
+    uint32_t i;
 
-    g_return_if_fail(w->nimages == 0 || w->images != NULL);
-
-    for (i = 0; i < w->nimages; i++) {
-        if (w->images[i]) {
-            glz_image_destroy(w->images[i]);
-        }
-    }
+    g_mutex_lock(&w->lock);
+    for (i = 0; i < w->capacity; i++)
+        glz_image_unref(w->ring[i]);
 
-    w->nimages = 16;
-    g_free(w->images);
-    w->images = g_new0(struct glz_image*, w->nimages);
+    w->capacity = WIN_INIT_CAPACITY;
+    g_free(w->ring);
+    w->ring = g_new0(struct glz_image *, w->capacity);
+    /* set by the next image */
+    w->oldest = 0;
     w->tail_gap = 0;
+    w->newest = 0;
+    w->started = FALSE;
+    w->released = FALSE;
+    w->used = 0;
+    w->generation++;
+    g_cond_broadcast(&w->cond);
+    g_mutex_unlock(&w->lock);
+
+    if (w->waiters != NULL)
+        g_coroutine_wait_queue_wake_all(w->waiters);
+}
+
+/* wakes up the threads waiting for reference images */
+void glz_decoder_window_wakeup(SpiceGlzDecoderWindow *w)
+{
+    g_mutex_lock(&w->lock);
+    g_cond_broadcast(&w->cond);
+    g_mutex_unlock(&w->lock);
+}
+
+/* sets the size of the server dictionary, the server counts it in
+ * pixels of 4 bytes, 0 to unset */
+void glz_decoder_window_set_size(SpiceGlzDecoderWindow *w, gsize size)
+{
+    g_mutex_lock(&w->lock);
+    w->budget = size * 4 * WIN_OVERFLOW_FACTOR;
+    g_mutex_unlock(&w->lock);
+}
+
+/* bytes of the images held by the window */
+gsize glz_decoder_window_get_used(SpiceGlzDecoderWindow *w)
+{
+    gsize used;
+
+    g_mutex_lock(&w->lock);
+    used = w->used;
+    g_mutex_unlock(&w->lock);
+
+    return used;
+}
+
+gboolean glz_decoder_window_add_test_image(SpiceGlzDecoderWindow *w, uint64_t id,
+                                           uint32_t win_head_dist, uint32_t gross_pixels)
+{
+    struct glz_image *img = g_new0(struct glz_image, 1);
+    gboolean dropped;
+
+    img->ref_count = 1;
+    img->hdr.id = id;
+    img->hdr.type = LZ_IMAGE_TYPE_RGB32;
+    img->hdr.width = MAX(gross_pixels, 1);
+    img->hdr.height = 1;
+    img->hdr.gross_pixels = gross_pixels;
+    img->hdr.win_head_dist = win_head_dist;
+    img->surface = pixman_image_create_bits(PIXMAN_x8r8g8b8, img->hdr.width, 1, NULL, 0);
+    img->data = (uint8_t *)pixman_image_get_data(img->surface);
+    memset(img->data, id & 0xff, (gsize)img->hdr.width * 4);
+
+    g_mutex_lock(&w->lock);
+    dropped = glz_decoder_window_add(w, img);
+    g_mutex_unlock(&w->lock);
+
+    return dropped;
+}
+
+gboolean glz_decoder_window_has_image(SpiceGlzDecoderWindow *w, uint64_t id)
+{
+    gboolean found;
+
+    g_mutex_lock(&w->lock);
+    found = glz_decoder_window_lookup(w, id) != NULL;
+    g_mutex_unlock(&w->lock);
+
+    return found;
 }
 
 SpiceGlzDecoderWindow *glz_decoder_window_new(void)
 {
     SpiceGlzDecoderWindow *w = g_new0(SpiceGlzDecoderWindow, 1);
+    g_mutex_init(&w->lock);
+    g_cond_init(&w->cond);
+    w->waiters = g_coroutine_wait_queue_new();
     glz_decoder_window_clear(w);
     return w;
 }
@@ -421,19 +962,47 @@ void glz_decoder_window_destroy(SpiceGlzDecoderWindow *w)
         return;
 
     glz_decoder_window_clear(w);
-    g_free(w->images);
+    g_free(w->ring);
+    g_coroutine_wait_queue_free(w->waiters);
+    g_cond_clear(&w->cond);
+    g_mutex_clear(&w->lock);
     g_free(w);
 }
 
-SpiceGlzDecoder *glz_decoder_new(SpiceGlzDecoderWindow *w)
+SpiceGlzDecoder *glz_decoder_new(SpiceGlzDecoderWindow *w, SpiceDecodePipeline *pipeline)
 {
     GlibGlzDecoder *d = g_new0(GlibGlzDecoder, 1);
+
+    glz_kernels_init();
     d->base.ops = &glz_decoder_ops;
     d->window = w;
+    d->pipeline = pipeline;
+    d->refs = g_ptr_array_new_with_free_func((GDestroyNotify)glz_image_unref);
     return &d->base;
 }
 
-void glz_decoder_destroy(SpiceGlzDecoder *d)
+void glz_decoder_destroy(SpiceGlzDecoder *decoder)
 {
+    GlibGlzDecoder *d = SPICE_CONTAINEROF(decoder, GlibGlzDecoder, base);
+
+    g_ptr_array_unref(d->refs);
     g_free(d);
 }
+
+/* decodes an image into a new surface, adding it to the window, from
+ * a thread that is not running a coroutine. Waits for reference images
+ * stop when *cancelled is set, see glz_decoder_window_wakeup(). */
+pixman_image_t *glz_decoder_decode_image(SpiceGlzDecoder *decoder, uint8_t *data,
+                                         const gint *cancelled, uint64_t *id)
+{
+    GlibGlzDecoder *d = SPICE_CONTAINEROF(decoder, GlibGlzDecoder, base);
+    LzDecodeUsrData usr_data;
+
+    memset(&usr_data, 0, sizeof(usr_data));
+    d->cancelled = cancelled;
+    decode(decoder, data, NULL, &usr_data);
+    d->cancelled = NULL;
+    *id = d->image.id;
+
+    return usr_data.out_surface;
+}
@@ -43,6 +43,18 @@ typedef struct GlibJpegDecoder
     int      _data_size;
     int      _width;
     int      _height;
+
+#ifndef JCS_EXTENSIONS
+    /* the rows in RGB before their conversion, kept between images */
+    uint8_t *scan_lines;
+    gsize    scan_lines_size;
+#endif
+
+    SpiceDecodePipeline *pipeline;
+    /* the image decoded ahead, between begin_decode() and decode() */
+    SpiceDecodeJob      *job;
+    uint8_t             *job_data;
+    int                  job_data_size;
 } GlibJpegDecoder;
 
 static void begin_decode(SpiceJpegDecoder *decoder,
@@ -54,6 +66,16 @@ static void begin_decode(SpiceJpegDecoder *decoder,
     g_return_if_fail(data != NULL);
     g_return_if_fail(data_size != 0);
 
+    d->job = NULL;
+    if (d->pipeline != NULL) {
+        d->job = decode_pipeline_lookup_jpeg(d->pipeline, data, out_width, out_height);
+        if (d->job != NULL) {
+            d->job_data = data;
+            d->job_data_size = data_size;
+            return;
+        }
+    }
+
     if (d->_data)
         jpeg_abort_decompress(&d->_cinfo);
 
@@ -65,7 +87,6 @@ static void begin_decode(SpiceJpegDecoder *decoder,
 
     jpeg_read_header(&d->_cinfo, TRUE);
 
-    d->_cinfo.out_color_space = JCS_RGB;
     d->_width = d->_cinfo.image_width;
     d->_height = d->_cinfo.image_height;
 
@@ -73,7 +94,7 @@ static void begin_decode(SpiceJpegDecoder *decoder,
     *out_height = d->_height;
 }
 
-/* TODO: move it elsewhere and reuse it in get_pixbuf(), optimize? */
+#ifndef JCS_EXTENSIONS
 typedef void (*converter_rgb_t)(uint8_t* src, uint8_t* dest, int width);
 
 static void convert_rgb_to_bgr(uint8_t* src, uint8_t* dest, int width)
@@ -100,35 +121,109 @@ static void convert_rgb_to_bgrx(uint8_t* src, uint8_t* dest, int width)
         src += 3;
     }
 }
+#endif
+
+/* the most rows read at once. A jpeg_read_scanlines() call returns the
+ * rows of a single row group at most, rec_outbuf_height rows (1 to 4),
+ * and asking for fewer than that costs libjpeg an extra copy: 16 is
+ * enough for any image, the loop takes what each call returns */
+#define JPEG_MAX_ROWS 16
 
 static void decode(SpiceJpegDecoder *decoder,
                    uint8_t* dest, int stride, int format)
 {
     GlibJpegDecoder *d = SPICE_CONTAINEROF(decoder, GlibJpegDecoder, base);
-    uint8_t* scan_line = g_alloca(d->_width * 3);
+    JSAMPROW rows[JPEG_MAX_ROWS];
+#ifndef JCS_EXTENSIONS
     converter_rgb_t converter = NULL;
-    int row;
+#endif
+
+    if (d->job != NULL) {
+        SpiceDecodePipeline *pipeline = d->pipeline;
+        SpiceDecodeJob *job = d->job;
+        int width, height;
+
+        if (decode_job_copy_jpeg(job, dest, stride, format)) {
+            d->job = NULL;
+            return;
+        }
 
+        /* not decoded ahead to this format */
+        d->pipeline = NULL;
+        begin_decode(decoder, d->job_data, d->job_data_size, &width, &height);
+        d->pipeline = pipeline;
+    }
+
+    /* the 32 bit format is x8r8g8b8 in native order, the 24 bit one is
+     * stored as b, g, r */
+#ifndef JCS_EXTENSIONS
+    d->_cinfo.out_color_space = JCS_RGB;
+#endif
     switch (format) {
     case SPICE_BITMAP_FMT_24BIT:
+#ifdef JCS_EXTENSIONS
+        d->_cinfo.out_color_space = JCS_EXT_BGR;
+#else
         converter = convert_rgb_to_bgr;
+#endif
         break;
     case SPICE_BITMAP_FMT_32BIT:
+#ifdef JCS_EXTENSIONS
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+        d->_cinfo.out_color_space = JCS_EXT_BGRX;
+#else
+        d->_cinfo.out_color_space = JCS_EXT_XRGB;
+#endif
+#else
         converter = convert_rgb_to_bgrx;
+#endif
         break;
     default:
         g_warning("bad bitmap format, %d", format);
         return;
     }
 
-    g_return_if_fail(converter != NULL);
+#ifndef SPICE_QUALITY
+    d->_cinfo.dct_method = JDCT_IFAST;
+    d->_cinfo.do_fancy_upsampling = FALSE;
+    d->_cinfo.do_block_smoothing = FALSE;
+#endif
 
     jpeg_start_decompress(&d->_cinfo);
 
-    for (row = 0; row < d->_height; row++) {
-        jpeg_read_scanlines(&d->_cinfo, &scan_line, 1);
-        converter(scan_line, dest, d->_width);
-        dest += stride;
+    while (d->_cinfo.output_scanline < d->_cinfo.output_height) {
+        JDIMENSION n = MIN(d->_cinfo.output_height - d->_cinfo.output_scanline,
+                           JPEG_MAX_ROWS);
+        JDIMENSION i, read;
+
+#ifdef JCS_EXTENSIONS
+        /* straight to the destination */
+        for (i = 0; i < n; i++)
+            rows[i] = dest + (gsize)(d->_cinfo.output_scanline + i) * stride;
+        read = jpeg_read_scanlines(&d->_cinfo, rows, n);
+#else
+        uint8_t *out = dest + (gsize)d->_cinfo.output_scanline * stride;
+        gsize size = (gsize)d->_width * 3 * n;
+
+        if (d->scan_lines_size < size) {
+            g_free(d->scan_lines);
+            d->scan_lines = g_malloc(size);
+            d->scan_lines_size = size;
+        }
+        for (i = 0; i < n; i++)
+            rows[i] = d->scan_lines + (gsize)d->_width * 3 * i;
+        read = jpeg_read_scanlines(&d->_cinfo, rows, n);
+        for (i = 0; i < read; i++) {
+            converter(rows[i], out, d->_width);
+            out += stride;
+        }
+#endif
+        if (read == 0) {
+            g_warning("truncated jpeg image");
+            jpeg_abort_decompress(&d->_cinfo);
+            d->_data = NULL;
+            return;
+        }
     }
 
     jpeg_finish_decompress(&d->_cinfo);
@@ -162,7 +257,7 @@ static void jpeg_decoder_term_source (j_decompress_ptr cinfo)
     return;
 }
 
-SpiceJpegDecoder *jpeg_decoder_new(void)
+SpiceJpegDecoder *jpeg_decoder_new(SpiceDecodePipeline *pipeline)
 {
     GlibJpegDecoder *d = g_new0(GlibJpegDecoder, 1);
 
@@ -177,6 +272,7 @@ SpiceJpegDecoder *jpeg_decoder_new(void)
     d->_cinfo.src->term_source = jpeg_decoder_term_source;
 
     d->base.ops = &jpeg_decoder_ops;
+    d->pipeline = pipeline;
 
     return &d->base;
 }
@@ -186,5 +282,8 @@ void jpeg_decoder_destroy(SpiceJpegDecoder *decoder)
     GlibJpegDecoder *d = SPICE_CONTAINEROF(decoder, GlibJpegDecoder, base);
 
     jpeg_destroy_decompress(&d->_cinfo);
+#ifndef JCS_EXTENSIONS
+    g_free(d->scan_lines);
+#endif
     g_free(d);
 }
@@ -0,0 +1,495 @@
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spice-util.h"
+#include "decode.h"
+
+/*
+ * The decode pipeline decodes the GLZ, zlib+GLZ and JPEG images of the
+ * draw messages on a pool of worker threads, while the display
+ * coroutine keeps reading. The display channel holds each message
+ * until its jobs are done and then applies it in order: the canvas
+ * calls the decoders of the surface, which pick up the images decoded
+ * ahead instead of decoding them again.
+ *
+ * Jobs are looked up by their compressed data, which is what the canvas
+ * hands to the zlib and JPEG decoders, and GLZ images by their id once
+ * decoded, since the canvas decodes zlib+GLZ images through a temporary
+ * buffer.
+ *
+ * A GLZ job waits for the window images it references only, as it
+ * meets them (see glz_decoder_bits()). The pool runs jobs in the order
+ * they were pushed, so the images of earlier jobs are being decoded or
+ * already decoded, and all the threads cannot wait on each other. The
+ * images left to the canvas are only decoded once their message is
+ * applied, so no job may reference one of them, see
+ * decode_pipeline_push_images().
+ */
+
+/* smaller images are decoded by the canvas, a job costs more */
+#define DECODE_PIPELINE_MIN_PIXELS (64 * 64)
+#define DECODE_PIPELINE_MAX_THREADS 16
+
+struct SpiceDecodeJob {
+    gint                    ref_count;
+    SpiceDecodePipeline     *pipeline;
+    guint8                  type;
+    uint8_t                 *data;
+    uint32_t                size;
+    uint32_t                glz_size;
+    gpointer                owner;
+    GDestroyNotify          owner_free;
+    gint                    done;
+    gboolean                released;
+
+    /* GLZ */
+    pixman_image_t          *surface;
+    uint64_t                glz_id;
+    gboolean                has_glz_id;
+    /* inflated GLZ stream, or BGRX pixels */
+    uint8_t                 *buf;
+    gsize                   buf_size;
+    int                     width;
+    int                     height;
+};
+
+struct SpiceDecodePipeline {
+    GThreadPool             *pool;
+    SpiceGlzDecoderWindow   *window;
+    SpiceDecodeDoneFunc     done;
+    gpointer                done_data;
+
+    gint                    cancelled;
+
+    GMutex                  lock;
+    GCond                   cond;
+    guint                   running;
+    GHashTable              *by_data;
+    GHashTable              *by_glz_id;
+};
+
+/* decoders of the worker threads */
+static GPrivate worker_zlib = G_PRIVATE_INIT((GDestroyNotify)zlib_decoder_destroy);
+static GPrivate worker_jpeg = G_PRIVATE_INIT((GDestroyNotify)jpeg_decoder_destroy);
+/* set in the worker threads, which are not coroutines */
+static GPrivate worker_thread;
+
+static void decode_job_unref(SpiceDecodeJob *job)
+{
+    if (!g_atomic_int_dec_and_test(&job->ref_count))
+        return;
+
+    g_clear_pointer(&job->surface, pixman_image_unref);
+    g_free(job->buf);
+    if (job->owner_free)
+        job->owner_free(job->owner);
+    g_free(job);
+}
+
+static void decode_job_glz(SpiceDecodeJob *job, uint8_t *data)
+{
+    SpiceGlzDecoder *glz = glz_decoder_new(job->pipeline->window, NULL);
+
+    job->surface = glz_decoder_decode_image(glz, data, &job->pipeline->cancelled,
+                                            &job->glz_id);
+    job->has_glz_id = TRUE;
+    glz_decoder_destroy(glz);
+}
+
+static void decode_job_jpeg(SpiceDecodeJob *job)
+{
+    SpiceJpegDecoder *jpeg = g_private_get(&worker_jpeg);
+
+    if (jpeg == NULL) {
+        jpeg = jpeg_decoder_new(NULL);
+        g_private_set(&worker_jpeg, jpeg);
+    }
+
+    jpeg->ops->begin_decode(jpeg, job->data, job->size, &job->width, &job->height);
+    if (job->width <= 0 || job->height <= 0 ||
+        job->width > G_MAXINT / 4 / job->height) {
+        g_warning("bad jpeg image size %dx%d", job->width, job->height);
+        return;
+    }
+
+    job->buf_size = (gsize)job->width * job->height * 4;
+    job->buf = g_malloc(job->buf_size);
+    jpeg->ops->decode(jpeg, job->buf, job->width * 4, SPICE_BITMAP_FMT_32BIT);
+}
+
+static void decode_job_zlib_glz(SpiceDecodeJob *job)
+{
+    SpiceZlibDecoder *zlib = g_private_get(&worker_zlib);
+
+    if (zlib == NULL) {
+        zlib = zlib_decoder_new(NULL);
+        if (zlib == NULL)
+            return;
+        g_private_set(&worker_zlib, zlib);
+    }
+
+    job->buf_size = job->glz_size;
+    job->buf = g_malloc(job->buf_size);
+    zlib->ops->decode(zlib, job->data, job->size, job->buf, job->buf_size);
+    decode_job_glz(job, job->buf);
+}
+
+/* worker thread */
+static void decode_job_run(gpointer data, gpointer user_data)
+{
+    SpiceDecodeJob *job = data;
+    SpiceDecodePipeline *p = user_data;
+
+    g_private_set(&worker_thread, GINT_TO_POINTER(TRUE));
+
+    if (g_atomic_int_get(&p->cancelled)) {
+        /* the job is dropped, see decode_pipeline_cancel() */
+    } else if (job->type == SPICE_IMAGE_TYPE_GLZ_RGB) {
+        decode_job_glz(job, job->data);
+    } else if (job->type == SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB) {
+        decode_job_zlib_glz(job);
+    } else {
+        decode_job_jpeg(job);
+    }
+
+    g_mutex_lock(&p->lock);
+    if (job->has_glz_id && !job->released)
+        g_hash_table_insert(p->by_glz_id, &job->glz_id, job);
+    g_atomic_int_set(&job->done, TRUE);
+    g_mutex_unlock(&p->lock);
+
+    p->done(p->done_data);
+
+    g_mutex_lock(&p->lock);
+    p->running--;
+    g_cond_broadcast(&p->cond);
+    g_mutex_unlock(&p->lock);
+
+    decode_job_unref(job);
+}
+
+gboolean decode_pipeline_in_worker(void)
+{
+    return g_private_get(&worker_thread) != NULL;
+}
+
+/* 0 disables the pipeline, images are then decoded by the canvas */
+guint decode_pipeline_default_threads(void)
+{
+    const gchar *env = g_getenv("SPICE_DECODE_THREADS");
+    guint n;
+
+    if (env != NULL)
+        return MIN(strtoul(env, NULL, 10), DECODE_PIPELINE_MAX_THREADS);
+
+    n = g_get_num_processors();
+    return n > 1 ? MIN(n, 4) : 0;
+}
+
+SpiceDecodePipeline *decode_pipeline_new(SpiceGlzDecoderWindow *w, guint threads,
+                                         SpiceDecodeDoneFunc done, gpointer data)
+{
+    SpiceDecodePipeline *p;
+    GError *error = NULL;
+
+    g_return_val_if_fail(w != NULL, NULL);
+    g_return_val_if_fail(threads > 0, NULL);
+    g_return_val_if_fail(done != NULL, NULL);
+
+    p = g_new0(SpiceDecodePipeline, 1);
+    p->window = w;
+    p->done = done;
+    p->done_data = data;
+    g_mutex_init(&p->lock);
+    g_cond_init(&p->cond);
+    p->by_data = g_hash_table_new(NULL, NULL);
+    p->by_glz_id = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+    p->pool = g_thread_pool_new(decode_job_run, p, threads, FALSE, &error);
+    if (p->pool == NULL) {
+        g_warning("failed to create the decode pool: %s", error->message);
+        g_clear_error(&error);
+        decode_pipeline_free(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+/* waits for the jobs in flight, stopping those waiting for GLZ images
+ * and skipping those not started */
+void decode_pipeline_cancel(SpiceDecodePipeline *p)
+{
+    g_atomic_int_set(&p->cancelled, TRUE);
+    glz_decoder_window_wakeup(p->window);
+
+    g_mutex_lock(&p->lock);
+    while (p->running > 0)
+        g_cond_wait(&p->cond, &p->lock);
+    g_mutex_unlock(&p->lock);
+
+    g_atomic_int_set(&p->cancelled, FALSE);
+}
+
+void decode_pipeline_free(SpiceDecodePipeline *p)
+{
+    if (p == NULL)
+        return;
+
+    if (p->pool != NULL) {
+        decode_pipeline_cancel(p);
+        g_thread_pool_free(p->pool, FALSE, TRUE);
+    }
+    g_warn_if_fail(g_hash_table_size(p->by_data) == 0);
+    g_hash_table_unref(p->by_data);
+    g_hash_table_unref(p->by_glz_id);
+    g_cond_clear(&p->cond);
+    g_mutex_clear(&p->lock);
+    g_free(p);
+}
+
+/* the compressed data of @image, if the pipeline handles it */
+static gboolean decode_image_get_data(SpiceImage *image, SpiceChunks **chunks,
+                                      uint32_t *size, uint32_t *glz_size)
+{
+    *glz_size = 0;
+
+    if (image == NULL)
+        return FALSE;
+
+    switch (image->descriptor.type) {
+    case SPICE_IMAGE_TYPE_GLZ_RGB:
+        *chunks = image->u.lz_rgb.data;
+        *size = image->u.lz_rgb.data_size;
+        break;
+    case SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB:
+        *chunks = image->u.zlib_glz.data;
+        *size = image->u.zlib_glz.data_size;
+        *glz_size = image->u.zlib_glz.glz_data_size;
+        break;
+    case SPICE_IMAGE_TYPE_JPEG:
+        *chunks = image->u.jpeg.data;
+        *size = image->u.jpeg.data_size;
+        break;
+    case SPICE_IMAGE_TYPE_JPEG_ALPHA:
+        *chunks = image->u.jpeg_alpha.data;
+        *size = image->u.jpeg_alpha.jpeg_size;
+        break;
+    default:
+        return FALSE;
+    }
+
+    return *chunks != NULL && (*chunks)->num_chunks == 1 &&
+        (guint64)image->descriptor.width * image->descriptor.height >= DECODE_PIPELINE_MIN_PIXELS;
+}
+
+static gboolean decode_image_is_glz(SpiceImage *image)
+{
+    return image != NULL &&
+        (image->descriptor.type == SPICE_IMAGE_TYPE_GLZ_RGB ||
+         image->descriptor.type == SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB);
+}
+
+/*
+ * Queues the decoding of @image, if the pipeline handles it. @owner,
+ * which keeps the image data alive, is released with @owner_free
+ * once the job is released and done.
+ *
+ * Returns: the job, to be released with decode_pipeline_release(), or
+ * %NULL if the image is left to the canvas
+ */
+SpiceDecodeJob *decode_pipeline_push(SpiceDecodePipeline *p, SpiceImage *image,
+                                     gpointer owner, GDestroyNotify owner_free)
+{
+    SpiceDecodeJob *job;
+    SpiceChunks *chunks;
+    uint32_t size;
+    uint32_t glz_size;
+
+    if (!decode_image_get_data(image, &chunks, &size, &glz_size))
+        return NULL;
+
+    job = g_new0(SpiceDecodeJob, 1);
+    job->ref_count = 2; /* the caller and the worker */
+    job->pipeline = p;
+    job->type = image->descriptor.type;
+    job->data = chunks->chunk[0].data;
+    job->size = MIN(size, chunks->chunk[0].len);
+    job->glz_size = glz_size;
+
+    g_mutex_lock(&p->lock);
+    if (g_hash_table_contains(p->by_data, job->data)) {
+        /* the same image drawn twice by a message */
+        g_mutex_unlock(&p->lock);
+        g_free(job);
+        return NULL;
+    }
+    g_hash_table_insert(p->by_data, job->data, job);
+    p->running++;
+    g_mutex_unlock(&p->lock);
+
+    job->owner = owner;
+    job->owner_free = owner_free;
+    g_thread_pool_push(p->pool, job, NULL);
+
+    return job;
+}
+
+/*
+ * Queues the decoding of the @n images drawn by a message, each job
+ * holding a reference on @owner taken with @owner_ref, see
+ * decode_pipeline_push(). The jobs are stored in @jobs.
+ *
+ * A GLZ image may reference another GLZ image of the message. When that
+ * one is left to the canvas, which only decodes it once the message is
+ * applied, after its jobs, all the GLZ images of the message are left
+ * to the canvas.
+ *
+ * Returns: the number of jobs
+ */
+guint decode_pipeline_push_images(SpiceDecodePipeline *p, SpiceImage **images, guint n,
+                                  SpiceDecodeJob **jobs, gpointer owner,
+                                  SpiceDecodeOwnerFunc owner_ref, GDestroyNotify owner_free)
+{
+    gboolean glz_to_canvas = FALSE;
+    SpiceChunks *chunks;
+    uint32_t size, glz_size;
+    guint i, njobs = 0;
+
+    for (i = 0; i < n; i++) {
+        if (decode_image_is_glz(images[i]) &&
+            !decode_image_get_data(images[i], &chunks, &size, &glz_size))
+            glz_to_canvas = TRUE;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (glz_to_canvas && decode_image_is_glz(images[i]))
+            continue;
+
+        owner_ref(owner);
+        jobs[njobs] = decode_pipeline_push(p, images[i], owner, owner_free);
+        if (jobs[njobs] != NULL)
+            njobs++;
+        else
+            owner_free(owner);
+    }
+
+    return njobs;
+}
+
+gboolean decode_job_is_done(SpiceDecodeJob *job)
+{
+    return g_atomic_int_get(&job->done);
+}
+
+/* drops the results the canvas did not use */
+void decode_pipeline_release(SpiceDecodePipeline *p, SpiceDecodeJob *job)
+{
+    g_mutex_lock(&p->lock);
+    if (g_hash_table_lookup(p->by_data, job->data) == job)
+        g_hash_table_remove(p->by_data, job->data);
+    if (job->has_glz_id && g_hash_table_lookup(p->by_glz_id, &job->glz_id) == job)
+        g_hash_table_remove(p->by_glz_id, &job->glz_id);
+    job->released = TRUE;
+    g_mutex_unlock(&p->lock);
+
+    decode_job_unref(job);
+}
+
+/* called with the lock held */
+static SpiceDecodeJob *decode_pipeline_lookup(SpiceDecodePipeline *p, uint8_t *data)
+{
+    SpiceDecodeJob *job = g_hash_table_lookup(p->by_data, data);
+
+    return (job && g_atomic_int_get(&job->done)) ? job : NULL;
+}
+
+/* Returns: a reference to the surface of GLZ image @id, or %NULL */
+pixman_image_t *decode_pipeline_take_glz(SpiceDecodePipeline *p, uint64_t id)
+{
+    SpiceDecodeJob *job;
+    pixman_image_t *surface = NULL;
+
+    g_mutex_lock(&p->lock);
+    job = g_hash_table_lookup(p->by_glz_id, &id);
+    if (job != NULL) {
+        surface = g_steal_pointer(&job->surface);
+        g_hash_table_remove(p->by_glz_id, &id);
+    }
+    g_mutex_unlock(&p->lock);
+
+    return surface;
+}
+
+/* copies the inflated stream of @data to @dest */
+gboolean decode_pipeline_take_zlib(SpiceDecodePipeline *p, uint8_t *data,
+                                   uint8_t *dest, int dest_size)
+{
+    SpiceDecodeJob *job;
+    gboolean ret = FALSE;
+
+    g_mutex_lock(&p->lock);
+    job = decode_pipeline_lookup(p, data);
+    if (job != NULL && job->type == SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB &&
+        job->buf != NULL && job->buf_size == dest_size) {
+        memcpy(dest, job->buf, dest_size);
+        ret = TRUE;
+    }
+    g_mutex_unlock(&p->lock);
+
+    return ret;
+}
+
+/*
+ * Returns: the done JPEG job of @data, or %NULL. The job is valid until
+ * the message drawing it is applied.
+ */
+SpiceDecodeJob *decode_pipeline_lookup_jpeg(SpiceDecodePipeline *p, uint8_t *data,
+                                            int *width, int *height)
+{
+    SpiceDecodeJob *job;
+
+    g_mutex_lock(&p->lock);
+    job = decode_pipeline_lookup(p, data);
+    if (job != NULL && job->buf == NULL)
+        job = NULL;
+    g_mutex_unlock(&p->lock);
+
+    if (job != NULL) {
+        *width = job->width;
+        *height = job->height;
+    }
+    return job;
+}
+
+gboolean decode_job_copy_jpeg(SpiceDecodeJob *job, uint8_t *dest, int stride, int format)
+{
+    int row;
+
+    if (format != SPICE_BITMAP_FMT_32BIT)
+        return FALSE;
+
+    for (row = 0; row < job->height; row++) {
+        memcpy(dest, job->buf + (gsize)row * job->width * 4, job->width * 4);
+        dest += stride;
+    }
+    return TRUE;
+}
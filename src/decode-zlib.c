@@ -28,6 +28,7 @@ typedef struct GlibZlibDecoder
 {
     SpiceZlibDecoder         base;
     z_stream                 _z_strm;
+    SpiceDecodePipeline      *pipeline;
 } GlibZlibDecoder;
 
 static void decode(SpiceZlibDecoder *decoder,
@@ -37,6 +38,10 @@ static void decode(SpiceZlibDecoder *decoder,
     GlibZlibDecoder *d = SPICE_CONTAINEROF(decoder, GlibZlibDecoder, base);
     int z_ret;
 
+    if (d->pipeline != NULL &&
+        decode_pipeline_take_zlib(d->pipeline, data, dest, dest_size))
+        return;
+
     inflateReset(&d->_z_strm);
     d->_z_strm.next_in = data;
     d->_z_strm.avail_in = data_size;
@@ -54,7 +59,7 @@ static SpiceZlibDecoderOps zlib_decoder_ops = {
     .decode = decode,
 };
 
-SpiceZlibDecoder *zlib_decoder_new(void)
+SpiceZlibDecoder *zlib_decoder_new(SpiceDecodePipeline *pipeline)
 {
     GlibZlibDecoder *d = g_new0(GlibZlibDecoder, 1);
     int z_ret;
@@ -71,6 +76,7 @@ SpiceZlibDecoder *zlib_decoder_new(void)
     }
 
     d->base.ops = &zlib_decoder_ops;
+    d->pipeline = pipeline;
 
     return &d->base;
 
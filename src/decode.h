@@ -23,18 +23,72 @@
 G_BEGIN_DECLS
 
 typedef struct SpiceGlzDecoderWindow SpiceGlzDecoderWindow;
+typedef struct SpiceDecodePipeline SpiceDecodePipeline;
+typedef struct SpiceDecodeJob SpiceDecodeJob;
 
 SpiceGlzDecoderWindow *glz_decoder_window_new(void);
 void glz_decoder_window_clear(SpiceGlzDecoderWindow *w);
+void glz_decoder_window_wakeup(SpiceGlzDecoderWindow *w);
+void glz_decoder_window_set_size(SpiceGlzDecoderWindow *w, gsize size);
+gsize glz_decoder_window_get_used(SpiceGlzDecoderWindow *w);
 void glz_decoder_window_destroy(SpiceGlzDecoderWindow *w);
+/* for the tests, adds an image of @gross_pixels, whose bytes are all
+ * the low byte of @id */
+gboolean glz_decoder_window_add_test_image(SpiceGlzDecoderWindow *w, uint64_t id,
+                                           uint32_t win_head_dist, uint32_t gross_pixels);
+gboolean glz_decoder_window_has_image(SpiceGlzDecoderWindow *w, uint64_t id);
 
-SpiceGlzDecoder *glz_decoder_new(SpiceGlzDecoderWindow *w);
+/* the decoders use the images decoded ahead by @pipeline, if not NULL */
+SpiceGlzDecoder *glz_decoder_new(SpiceGlzDecoderWindow *w, SpiceDecodePipeline *pipeline);
 void glz_decoder_destroy(SpiceGlzDecoder *d);
+pixman_image_t *glz_decoder_decode_image(SpiceGlzDecoder *d, uint8_t *data,
+                                         const gint *cancelled, uint64_t *id);
 
-SpiceZlibDecoder *zlib_decoder_new(void);
+/* the pixel kernels of the GLZ decoder, exposed for the tests */
+typedef void (*GlzExpandFunc)(const uint8_t *in, uint8_t *out, uint32_t n);
+
+typedef struct GlzKernels {
+    const char *name;
+    /* expand @n literal pixels to BGRX */
+    GlzExpandFunc rgb24_to_rgb32;
+    GlzExpandFunc rgb16_to_rgb32;
+} GlzKernels;
+
+const GlzKernels *glz_get_supported_kernels(guint *n_kernels);
+/* copies a match of @len bytes at @ref, which may overlap @op */
+void glz_copy_match(uint8_t *op, const uint8_t *ref, size_t len);
+
+SpiceZlibDecoder *zlib_decoder_new(SpiceDecodePipeline *pipeline);
 void zlib_decoder_destroy(SpiceZlibDecoder *d);
 
-SpiceJpegDecoder *jpeg_decoder_new(void);
+SpiceJpegDecoder *jpeg_decoder_new(SpiceDecodePipeline *pipeline);
 void jpeg_decoder_destroy(SpiceJpegDecoder *d);
 
+/* decode-pipeline.c */
+typedef void (*SpiceDecodeDoneFunc)(gpointer data);
+
+SpiceDecodePipeline *decode_pipeline_new(SpiceGlzDecoderWindow *w, guint threads,
+                                         SpiceDecodeDoneFunc done, gpointer data);
+void decode_pipeline_free(SpiceDecodePipeline *p);
+void decode_pipeline_cancel(SpiceDecodePipeline *p);
+guint decode_pipeline_default_threads(void);
+/* whether the caller is a worker thread of a pipeline */
+gboolean decode_pipeline_in_worker(void);
+
+SpiceDecodeJob *decode_pipeline_push(SpiceDecodePipeline *p, SpiceImage *image,
+                                     gpointer owner, GDestroyNotify owner_free);
+typedef void (*SpiceDecodeOwnerFunc)(gpointer owner);
+guint decode_pipeline_push_images(SpiceDecodePipeline *p, SpiceImage **images, guint n,
+                                  SpiceDecodeJob **jobs, gpointer owner,
+                                  SpiceDecodeOwnerFunc owner_ref, GDestroyNotify owner_free);
+gboolean decode_job_is_done(SpiceDecodeJob *job);
+void decode_pipeline_release(SpiceDecodePipeline *p, SpiceDecodeJob *job);
+
+pixman_image_t *decode_pipeline_take_glz(SpiceDecodePipeline *p, uint64_t id);
+gboolean decode_pipeline_take_zlib(SpiceDecodePipeline *p, uint8_t *data,
+                                   uint8_t *dest, int dest_size);
+SpiceDecodeJob *decode_pipeline_lookup_jpeg(SpiceDecodePipeline *p, uint8_t *data,
+                                            int *width, int *height);
+gboolean decode_job_copy_jpeg(SpiceDecodeJob *job, uint8_t *dest, int stride, int format);
+
 G_END_DECLS
@@ -19,6 +19,8 @@
 */
 #include "config.h"
 
+#include <gobject/gvaluecollector.h>
+
 #include "gio-coroutine.h"
 
 typedef struct _GConditionWaitSource
@@ -28,6 +30,28 @@ typedef struct _GConditionWaitSource
     gpointer data;
 } GConditionWaitSource;
 
+typedef struct _GWaitQueueSource
+{
+    GSource parent; // this MUST be the first field
+    guint64 key;
+    gboolean queued; /* protected by the queue lock */
+} GWaitQueueSource;
+
+struct _GCoroutineWaitQueue
+{
+    GMutex lock;
+    GList *waiters; /* GWaitQueueSource, one per waiting coroutine */
+    gint n_waiters; /* atomic, for the lock-free fast path of wake-ups */
+    gint ref; /* atomic, the owner and each waiter */
+    gboolean dead; /* protected by the lock, set once freed */
+};
+
+/* Contexts with a pending g_coroutine_condition_wait(), so that a
+ * condition changed from another thread can wake them up */
+static GMutex waiting_contexts_lock;
+static GHashTable *waiting_contexts;
+static gint n_waiting_contexts; /* atomic */
+
 GCoroutine* g_coroutine_self(void)
 {
     return (GCoroutine*)coroutine_self();
@@ -56,14 +80,14 @@ GIOCondition g_coroutine_socket_wait(GCoroutine *self,
 
     src = g_socket_create_source(sock, cond | G_IO_HUP | G_IO_ERR | G_IO_NVAL, NULL);
     g_source_set_callback(src, (GSourceFunc)g_io_wait_helper, self, NULL);
-    self->wait_id = g_source_attach(src, NULL);
+    self->wait_id = g_source_attach(src, g_main_context_get_thread_default());
     ret = coroutine_yield(NULL);
-    g_source_unref(src);
 
     if (ret != NULL)
         val = *ret;
     else
-        g_source_remove(self->wait_id);
+        g_source_destroy(src);
+    g_source_unref(src);
 
     self->wait_id = 0;
     return val;
@@ -71,12 +95,17 @@ GIOCondition g_coroutine_socket_wait(GCoroutine *self,
 
 void g_coroutine_condition_cancel(GCoroutine *coroutine)
 {
+    GSource *src;
+
     g_return_if_fail(coroutine != NULL);
 
     if (coroutine->condition_id == 0)
         return;
 
-    g_source_remove(coroutine->condition_id);
+    src = g_main_context_find_source_by_id(g_main_context_get_thread_default(),
+                                           coroutine->condition_id);
+    if (src != NULL)
+        g_source_destroy(src);
     coroutine->condition_id = 0;
 }
 
@@ -122,6 +151,73 @@ static GSourceFuncs waitFuncs = {
     .dispatch = g_condition_wait_dispatch,
 };
 
+static GMainContext *g_coroutine_thread_context(void)
+{
+    GMainContext *context = g_main_context_get_thread_default();
+
+    return context != NULL ? context : g_main_context_default();
+}
+
+static void g_condition_wait_register(GMainContext *context, gint delta)
+{
+    guint count;
+
+    g_mutex_lock(&waiting_contexts_lock);
+    if (waiting_contexts == NULL)
+        waiting_contexts = g_hash_table_new(NULL, NULL);
+
+    count = GPOINTER_TO_UINT(g_hash_table_lookup(waiting_contexts, context)) + delta;
+    if (count == 0)
+        g_hash_table_remove(waiting_contexts, context);
+    else
+        g_hash_table_insert(waiting_contexts, context, GUINT_TO_POINTER(count));
+    g_atomic_int_set(&n_waiting_contexts, g_hash_table_size(waiting_contexts));
+    g_mutex_unlock(&waiting_contexts_lock);
+}
+
+/*
+ * g_coroutine_condition_wakeup_all:
+ *
+ * Wakes up the main contexts with a pending condition wait that
+ * belong to other threads, so that they re-evaluate their condition.
+ *
+ * Conditions waited on from the calling thread are re-evaluated on
+ * the next iteration anyway, this is only needed when the condition
+ * is shared with coroutines running on other threads.
+ *
+ * This is cheap when no condition wait is pending. Conditions changed
+ * frequently should rather use a #GCoroutineWaitQueue.
+ */
+void g_coroutine_condition_wakeup_all(void)
+{
+    GMainContext *self;
+    GHashTableIter iter;
+    GMainContext *context;
+
+    if (g_atomic_int_get(&n_waiting_contexts) == 0)
+        return;
+
+    self = g_coroutine_thread_context();
+    g_mutex_lock(&waiting_contexts_lock);
+    if (waiting_contexts != NULL) {
+        g_hash_table_iter_init(&iter, waiting_contexts);
+        while (g_hash_table_iter_next(&iter, (gpointer *)&context, NULL)) {
+            if (context != self)
+                g_main_context_wakeup(context);
+        }
+    }
+    g_mutex_unlock(&waiting_contexts_lock);
+}
+
+/* TRUE if running on a thread with its own main context, rather than
+ * on the thread owning the global default context */
+static gboolean g_coroutine_in_worker_thread(void)
+{
+    GMainContext *context = g_main_context_get_thread_default();
+
+    return context != NULL && context != g_main_context_default();
+}
+
 static gboolean g_condition_wait_helper(gpointer data)
 {
     GCoroutine *self = (GCoroutine *)data;
@@ -138,6 +234,8 @@ static gboolean g_condition_wait_helper(gpointer data)
  * This function will wait on caller coroutine until @func returns %TRUE.
  *
  * @func is called when entering the main loop from the main context (coroutine).
+ * If the condition can be changed from another thread, that thread
+ * must call g_coroutine_condition_wakeup_all() after changing it.
  *
  * The condition can be cancelled by calling g_coroutine_wakeup()
  *
@@ -147,6 +245,7 @@ gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, g
 {
     GSource *src;
     GConditionWaitSource *vsrc;
+    GMainContext *context;
 
     g_return_val_if_fail(self != NULL, FALSE);
     g_return_val_if_fail(self->condition_id == 0, FALSE);
@@ -166,10 +265,13 @@ gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, g
     vsrc->func = func;
     vsrc->data = data;
 
-    self->condition_id = g_source_attach(src, NULL);
+    context = g_coroutine_thread_context();
+    g_condition_wait_register(context, 1);
+    self->condition_id = g_source_attach(src, context);
     g_source_set_callback(src, g_condition_wait_helper, self, NULL);
     coroutine_yield(NULL);
     g_source_unref(src);
+    g_condition_wait_register(context, -1);
 
     /* it got woked up / cancelled? */
     if (self->condition_id == 0)
@@ -179,6 +281,229 @@ gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, g
     return TRUE;
 }
 
+/* ------------------------------------------------------------------ */
+/* keyed wait queues                                                   */
+
+/*
+ * Unlike g_coroutine_condition_wait(), which evaluates its condition
+ * on every main loop iteration, a coroutine waiting on a
+ * #GCoroutineWaitQueue is only resumed when a producer wakes up the
+ * key it is waiting for, from any thread. The waiting source has no
+ * prepare or check function: it becomes ready when its ready time is
+ * set by g_coroutine_wait_queue_wake().
+ */
+
+static gboolean g_wait_queue_dispatch(GSource *src,
+                                      GSourceFunc cb,
+                                      gpointer data)
+{
+    g_source_set_ready_time(src, -1);
+    return cb(data);
+}
+
+static GSourceFuncs waitQueueFuncs = {
+    .dispatch = g_wait_queue_dispatch,
+};
+
+static gboolean g_wait_queue_helper(gpointer data)
+{
+    GCoroutine *self = (GCoroutine *)data;
+    coroutine_yieldto(&self->coroutine, NULL);
+    return G_SOURCE_CONTINUE;
+}
+
+GCoroutineWaitQueue *g_coroutine_wait_queue_new(void)
+{
+    GCoroutineWaitQueue *queue = g_new0(GCoroutineWaitQueue, 1);
+
+    g_mutex_init(&queue->lock);
+    queue->ref = 1;
+
+    return queue;
+}
+
+static void g_wait_queue_unref(GCoroutineWaitQueue *queue)
+{
+    if (!g_atomic_int_dec_and_test(&queue->ref))
+        return;
+
+    g_warn_if_fail(queue->waiters == NULL);
+    g_mutex_clear(&queue->lock);
+    g_free(queue);
+}
+
+/* must be called with the queue lock held */
+static void g_wait_queue_remove_locked(GCoroutineWaitQueue *queue,
+                                       GWaitQueueSource *wsrc)
+{
+    if (!wsrc->queued)
+        return;
+
+    wsrc->queued = FALSE;
+    queue->waiters = g_list_remove(queue->waiters, wsrc);
+    g_atomic_int_dec_and_test(&queue->n_waiters);
+    g_source_unref(&wsrc->parent);
+}
+
+/* must be called with the queue lock held */
+static void g_wait_queue_wake_locked(GCoroutineWaitQueue *queue,
+                                     GWaitQueueSource *wsrc)
+{
+    /* this wakes up the context of the waiting coroutine, in whatever
+     * thread it runs */
+    g_source_set_ready_time(&wsrc->parent, 0);
+    g_wait_queue_remove_locked(queue, wsrc);
+}
+
+/*
+ * g_coroutine_wait_queue_free:
+ * @queue: a #GCoroutineWaitQueue
+ *
+ * Frees @queue. Pending waiters are woken up and their wait returns
+ * %FALSE unless their condition became true, like when cancelled. Each
+ * of them holds a reference on @queue until its wait returns, so the
+ * memory is only released once the last one left. The state their
+ * condition checks must outlive them as well.
+ */
+void g_coroutine_wait_queue_free(GCoroutineWaitQueue *queue)
+{
+    if (queue == NULL)
+        return;
+
+    g_mutex_lock(&queue->lock);
+    queue->dead = TRUE;
+    g_mutex_unlock(&queue->lock);
+    g_coroutine_wait_queue_wake_all(queue);
+    g_wait_queue_unref(queue);
+}
+
+/*
+ * g_coroutine_wait_queue_wait:
+ * @coroutine: the coroutine to wait on
+ * @queue: the queue the producer of @key wakes up
+ * @key: the key to wait for, for example an image id
+ * @func: the condition callback
+ * @data: the user data passed to @func callback
+ *
+ * Waits on caller coroutine until @func returns %TRUE. @func is
+ * evaluated again only when g_coroutine_wait_queue_wake() is called
+ * for @key, or g_coroutine_wait_queue_wake_all(), after the state
+ * checked by @func was updated.
+ *
+ * The wait can be cancelled with g_coroutine_condition_cancel(), and
+ * ends as well when @queue is freed.
+ *
+ * Returns: %TRUE if condition reached, %FALSE if not and cancelled or
+ * @queue was freed
+ */
+gboolean g_coroutine_wait_queue_wait(GCoroutine *self, GCoroutineWaitQueue *queue,
+                                     guint64 key, GConditionWaitFunc func, gpointer data)
+{
+    GSource *src;
+    GWaitQueueSource *wsrc;
+    gboolean ready;
+
+    g_return_val_if_fail(self != NULL, FALSE);
+    g_return_val_if_fail(self->condition_id == 0, FALSE);
+    g_return_val_if_fail(queue != NULL, FALSE);
+    g_return_val_if_fail(func != NULL, FALSE);
+
+    /* Short-circuit check in case we've got it ahead of time */
+    if (func(data))
+        return TRUE;
+
+    g_atomic_int_inc(&queue->ref);
+    src = g_source_new(&waitQueueFuncs, sizeof(GWaitQueueSource));
+    wsrc = (GWaitQueueSource *)src;
+    wsrc->key = key;
+    g_source_set_callback(src, g_wait_queue_helper, self, NULL);
+    self->condition_id = g_source_attach(src, g_coroutine_thread_context());
+
+    for (;;) {
+        gboolean dead;
+
+        g_mutex_lock(&queue->lock);
+        dead = queue->dead;
+        if (!dead && !wsrc->queued) {
+            wsrc->queued = TRUE;
+            queue->waiters = g_list_prepend(queue->waiters, g_source_ref(src));
+            g_atomic_int_inc(&queue->n_waiters);
+        }
+        g_mutex_unlock(&queue->lock);
+
+        /* check again once queued, so that a wake-up is not missed,
+         * nobody wakes up the waiters of a freed queue anymore */
+        ready = func(data);
+        if (ready || dead)
+            break;
+
+        coroutine_yield(NULL);
+
+        /* it got cancelled? */
+        if (self->condition_id == 0) {
+            ready = func(data);
+            break;
+        }
+    }
+
+    g_mutex_lock(&queue->lock);
+    g_wait_queue_remove_locked(queue, wsrc);
+    g_mutex_unlock(&queue->lock);
+
+    if (self->condition_id != 0) {
+        g_source_destroy(src);
+        self->condition_id = 0;
+    }
+    g_source_unref(src);
+    g_wait_queue_unref(queue);
+
+    return ready;
+}
+
+/*
+ * g_coroutine_wait_queue_wake:
+ * @queue: a #GCoroutineWaitQueue
+ * @key: the key that became available
+ *
+ * Resumes the coroutines waiting on @queue for @key. This can be called
+ * from any thread, and is cheap when nobody is waiting.
+ */
+void g_coroutine_wait_queue_wake(GCoroutineWaitQueue *queue, guint64 key)
+{
+    GList *l, *next;
+
+    if (g_atomic_int_get(&queue->n_waiters) == 0)
+        return;
+
+    g_mutex_lock(&queue->lock);
+    for (l = queue->waiters; l != NULL; l = next) {
+        GWaitQueueSource *wsrc = l->data;
+
+        next = l->next;
+        if (wsrc->key == key)
+            g_wait_queue_wake_locked(queue, wsrc);
+    }
+    g_mutex_unlock(&queue->lock);
+}
+
+/*
+ * g_coroutine_wait_queue_wake_all:
+ * @queue: a #GCoroutineWaitQueue
+ *
+ * Resumes all the coroutines waiting on @queue, for instance when the
+ * state they wait on was reset.
+ */
+void g_coroutine_wait_queue_wake_all(GCoroutineWaitQueue *queue)
+{
+    if (g_atomic_int_get(&queue->n_waiters) == 0)
+        return;
+
+    g_mutex_lock(&queue->lock);
+    while (queue->waiters != NULL)
+        g_wait_queue_wake_locked(queue, queue->waiters->data);
+    g_mutex_unlock(&queue->lock);
+}
+
 struct signal_data
 {
     gpointer instance;
@@ -188,24 +513,63 @@ struct signal_data
     const gchar *propname;
     gboolean notified;
     va_list var_args;
+    /* only used when called from a worker thread */
+    GMutex lock;
+    GCond cond;
 };
 
+/* main context */
+static void signal_data_complete(struct signal_data *signal)
+{
+    if (signal->caller == NULL) {
+        g_mutex_lock(&signal->lock);
+        signal->notified = TRUE;
+        g_cond_signal(&signal->cond);
+        g_mutex_unlock(&signal->lock);
+        return;
+    }
+
+    signal->notified = TRUE;
+    coroutine_yieldto(signal->caller, NULL);
+}
+
+/*
+ * Runs @func in the main context and waits for it to complete. The
+ * worker thread is blocked meanwhile, which keeps the emission
+ * synchronous exactly like it is from a coroutine of the main thread.
+ */
+static void invoke_main_context_sync(GSourceFunc func, struct signal_data *data)
+{
+    data->caller = NULL;
+    data->notified = FALSE;
+    g_mutex_init(&data->lock);
+    g_cond_init(&data->cond);
+
+    g_main_context_invoke(NULL, func, data);
+
+    g_mutex_lock(&data->lock);
+    while (!data->notified)
+        g_cond_wait(&data->cond, &data->lock);
+    g_mutex_unlock(&data->lock);
+
+    g_cond_clear(&data->cond);
+    g_mutex_clear(&data->lock);
+}
+
 static gboolean emit_main_context(gpointer opaque)
 {
     struct signal_data *signal = opaque;
 
     g_signal_emit_valist(signal->instance, signal->signal_id,
                          signal->detail, signal->var_args);
-    signal->notified = TRUE;
-
-    coroutine_yieldto(signal->caller, NULL);
+    signal_data_complete(signal);
 
     return FALSE;
 }
 
-void
-g_coroutine_signal_emit(gpointer instance, guint signal_id,
-                        GQuark detail, ...)
+static void
+g_coroutine_signal_emit_valist(gpointer instance, guint signal_id,
+                               GQuark detail, va_list var_args)
 {
     struct signal_data data = {
         .instance = instance,
@@ -214,9 +578,13 @@ g_coroutine_signal_emit(gpointer instance, guint signal_id,
         .caller = coroutine_self(),
     };
 
-    va_start (data.var_args, detail);
+    G_VA_COPY(data.var_args, var_args);
 
-    if (coroutine_self_is_main()) {
+    if (g_coroutine_in_worker_thread()) {
+        g_object_ref(instance);
+        invoke_main_context_sync(emit_main_context, &data);
+        g_object_unref(instance);
+    } else if (coroutine_self_is_main()) {
         g_signal_emit_valist(instance, signal_id, detail, data.var_args);
     } else {
         g_object_ref(instance);
@@ -229,15 +597,149 @@ g_coroutine_signal_emit(gpointer instance, guint signal_id,
     va_end (data.var_args);
 }
 
+void
+g_coroutine_signal_emit(gpointer instance, guint signal_id,
+                        GQuark detail, ...)
+{
+    va_list var_args;
+
+    va_start (var_args, detail);
+    g_coroutine_signal_emit_valist(instance, signal_id, detail, var_args);
+    va_end (var_args);
+}
+
+struct signal_async
+{
+    guint signal_id;
+    GQuark detail;
+    guint n_values;
+    GValue *values; /* the instance first */
+    gpointer data;
+    GDestroyNotify destroy;
+};
+
+static gboolean emit_async_main_context(gpointer opaque)
+{
+    struct signal_async *signal = opaque;
+
+    g_signal_emitv(signal->values, signal->signal_id, signal->detail, NULL);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void signal_async_free(gpointer opaque)
+{
+    struct signal_async *signal = opaque;
+    guint i;
+
+    for (i = 0; i < signal->n_values; i++)
+        g_value_unset(&signal->values[i]);
+    g_free(signal->values);
+    if (signal->destroy != NULL)
+        signal->destroy(signal->data);
+    g_free(signal);
+}
+
+/*
+ * g_coroutine_signal_emit_async:
+ * @data: freed with @destroy once the signal is emitted, typically a
+ * copy of a pointer argument
+ *
+ * Like g_coroutine_signal_emit(), but from a worker thread the emission
+ * is only queued on the main context, with a copy of the arguments,
+ * instead of waiting for it. This is meant for the frequent signals
+ * whose handlers do not need to run before the coroutine goes on, such
+ * as the display invalidations. The emissions stay in order with those
+ * of g_coroutine_signal_emit().
+ */
+void
+g_coroutine_signal_emit_async(gpointer instance, guint signal_id, GQuark detail,
+                              gpointer data, GDestroyNotify destroy, ...)
+{
+    struct signal_async *signal;
+    GSignalQuery query;
+    va_list var_args;
+    guint i;
+
+    va_start (var_args, destroy);
+
+    if (!g_coroutine_in_worker_thread()) {
+        g_coroutine_signal_emit_valist(instance, signal_id, detail, var_args);
+        va_end (var_args);
+        if (destroy != NULL)
+            destroy(data);
+        return;
+    }
+
+    g_signal_query(signal_id, &query);
+    signal = g_new0(struct signal_async, 1);
+    signal->signal_id = signal_id;
+    signal->detail = detail;
+    signal->data = data;
+    signal->destroy = destroy;
+    signal->values = g_new0(GValue, query.n_params + 1);
+    g_value_init_from_instance(&signal->values[0], instance);
+    signal->n_values = 1;
+    for (i = 0; i < query.n_params; i++) {
+        GType type = query.param_types[i] & ~G_SIGNAL_TYPE_STATIC_SCOPE;
+        gchar *error = NULL;
+
+        G_VALUE_COLLECT_INIT(&signal->values[i + 1], type, var_args, 0, &error);
+        if (error != NULL) {
+            g_warning("%s: %s", G_STRFUNC, error);
+            g_free(error);
+            va_end (var_args);
+            signal_async_free(signal);
+            return;
+        }
+        signal->n_values++;
+    }
+    va_end (var_args);
+
+    g_main_context_invoke_full(NULL, G_PRIORITY_DEFAULT, emit_async_main_context,
+                               signal, signal_async_free);
+}
+
+static gboolean notify_async_main_context(gpointer opaque)
+{
+    struct signal_async *signal = opaque;
+
+    g_object_notify(g_value_get_object(&signal->values[0]), signal->data);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * g_coroutine_object_notify_async:
+ *
+ * Like g_coroutine_object_notify(), but from a worker thread the
+ * notification is only queued, see g_coroutine_signal_emit_async().
+ * The property getter must then not rely on the coroutine waiting.
+ */
+void g_coroutine_object_notify_async(GObject *object, const gchar *property_name)
+{
+    struct signal_async *signal;
+
+    if (!g_coroutine_in_worker_thread()) {
+        g_coroutine_object_notify(object, property_name);
+        return;
+    }
+
+    signal = g_new0(struct signal_async, 1);
+    signal->values = g_new0(GValue, 1);
+    g_value_init_from_instance(&signal->values[0], object);
+    signal->n_values = 1;
+    signal->data = (gpointer)g_intern_string(property_name);
+    g_main_context_invoke_full(NULL, G_PRIORITY_DEFAULT, notify_async_main_context,
+                               signal, signal_async_free);
+}
 
 static gboolean notify_main_context(gpointer opaque)
 {
     struct signal_data *signal = opaque;
 
     g_object_notify(signal->instance, signal->propname);
-    signal->notified = TRUE;
-
-    coroutine_yieldto(signal->caller, NULL);
+    signal_data_complete(signal);
 
     return FALSE;
 }
@@ -248,7 +750,13 @@ void g_coroutine_object_notify(GObject *object,
 {
     struct signal_data data;
 
-    if (coroutine_self_is_main()) {
+    if (g_coroutine_in_worker_thread()) {
+        data.instance = g_object_ref(object);
+        data.propname = (gpointer)property_name;
+
+        invoke_main_context_sync(notify_main_context, &data);
+        g_object_unref(object);
+    } else if (coroutine_self_is_main()) {
         g_object_notify(object, property_name);
     } else {
 
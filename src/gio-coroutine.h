@@ -44,6 +44,8 @@ struct _GCoroutine
  */
 typedef gboolean (*GConditionWaitFunc)(gpointer);
 
+typedef struct _GCoroutineWaitQueue GCoroutineWaitQueue;
+
 typedef void (*GSignalEmitMainFunc)(GObject *object, int signum, gpointer params);
 
 GCoroutine*  g_coroutine_self           (void);
@@ -53,10 +55,22 @@ GIOCondition g_coroutine_socket_wait    (GCoroutine *coroutine,
 gboolean     g_coroutine_condition_wait (GCoroutine *coroutine,
                                          GConditionWaitFunc func, gpointer data);
 void         g_coroutine_condition_cancel(GCoroutine *coroutine);
+void         g_coroutine_condition_wakeup_all(void);
+
+GCoroutineWaitQueue *g_coroutine_wait_queue_new(void);
+void         g_coroutine_wait_queue_free(GCoroutineWaitQueue *queue);
+gboolean     g_coroutine_wait_queue_wait(GCoroutine *coroutine, GCoroutineWaitQueue *queue,
+                                         guint64 key, GConditionWaitFunc func, gpointer data);
+void         g_coroutine_wait_queue_wake(GCoroutineWaitQueue *queue, guint64 key);
+void         g_coroutine_wait_queue_wake_all(GCoroutineWaitQueue *queue);
 
 void         g_coroutine_signal_emit (gpointer instance, guint signal_id,
                                       GQuark detail, ...);
+void         g_coroutine_signal_emit_async(gpointer instance, guint signal_id,
+                                           GQuark detail, gpointer data,
+                                           GDestroyNotify destroy, ...);
 
 void         g_coroutine_object_notify(GObject *object, const gchar *property_name);
+void         g_coroutine_object_notify_async(GObject *object, const gchar *property_name);
 
 G_END_DECLS
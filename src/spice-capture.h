@@ -0,0 +1,62 @@
+/*
+  Copyright (C) 2026 Red Hat, Inc.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Channel capture files, written to SPICE_CAPTURE_DIR for the channel
+ * types listed in SPICE_CAPTURE_CHANNELS and read back by spicy-replay.
+ *
+ * A capture holds the decrypted inbound stream of one channel, from the
+ * first message after the link handshake. It starts with a
+ * SpiceCaptureHeader, followed by the remote common and channel caps
+ * (num_common_caps + num_channel_caps uint32), followed by one
+ * SpiceCaptureRecord per message, each followed by the message as read
+ * from the wire (header and payload, size bytes). All fields are little
+ * endian.
+ */
+
+#define SPICE_CAPTURE_MAGIC "SPICECAP"
+#define SPICE_CAPTURE_VERSION 1
+
+/* the messages have a SpiceMiniDataHeader rather than a SpiceDataHeader */
+#define SPICE_CAPTURE_FLAG_MINI_HEADER (1 << 0)
+
+typedef struct SpiceCaptureHeader {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    channel_type;
+    uint32_t    channel_id;
+    uint32_t    flags;
+    uint32_t    num_common_caps;
+    uint32_t    num_channel_caps;
+} SpiceCaptureHeader;
+
+typedef struct SpiceCaptureRecord {
+    uint64_t    time;   /* microseconds since the channel was up */
+    uint32_t    size;
+    uint32_t    reserved;
+} SpiceCaptureRecord;
+
+G_STATIC_ASSERT(sizeof(SpiceCaptureHeader) == 32);
+G_STATIC_ASSERT(sizeof(SpiceCaptureRecord) == 16);
+
+G_END_DECLS
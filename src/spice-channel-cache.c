@@ -0,0 +1,272 @@
+/*
+   Copyright (C) 2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <pixman.h>
+
+#include "spice-channel-cache.h"
+#include "spice-common.h"
+
+#define CACHE_INIT_CAPACITY 64
+
+static inline guint32 cache_slot(display_cache *cache, guint64 id)
+{
+    /* Fibonacci hashing, ids are often sequential */
+    return ((id * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15)) >> 32) & (cache->capacity - 1);
+}
+
+static display_cache_item *cache_lookup(display_cache *cache, guint64 id)
+{
+    guint32 i;
+
+    for (i = cache_slot(cache, id); cache->items[i].value != NULL;
+         i = (i + 1) & (cache->capacity - 1)) {
+        if (cache->items[i].id == id)
+            return &cache->items[i];
+    }
+
+    return NULL;
+}
+
+/* returns the item for id, or the free slot to store it in */
+static display_cache_item *cache_lookup_slot(display_cache *cache, guint64 id)
+{
+    guint32 i;
+
+    for (i = cache_slot(cache, id); cache->items[i].value != NULL;
+         i = (i + 1) & (cache->capacity - 1)) {
+        if (cache->items[i].id == id)
+            break;
+    }
+
+    return &cache->items[i];
+}
+
+static void cache_resize(display_cache *cache, guint32 capacity)
+{
+    display_cache_item *items = cache->items;
+    guint32 i, old_capacity = cache->capacity;
+
+    cache->items = g_new0(display_cache_item, capacity);
+    cache->capacity = capacity;
+    for (i = 0; i < old_capacity; i++) {
+        if (items[i].value != NULL)
+            *cache_lookup_slot(cache, items[i].id) = items[i];
+    }
+    g_free(items);
+}
+
+static void cache_item_destroy(display_cache *cache, display_cache_item *item)
+{
+    cache->stats.bytes -= item->size;
+    if (cache->value_destroy)
+        cache->value_destroy(item->value);
+    item->value = NULL;
+}
+
+/* frees the slot of item, moving back the items of its probe sequence */
+static void cache_item_remove(display_cache *cache, display_cache_item *item)
+{
+    guint32 mask = cache->capacity - 1;
+    guint32 hole = item - cache->items;
+    guint32 i, home;
+
+    cache_item_destroy(cache, item);
+    cache->stats.items--;
+
+    for (i = (hole + 1) & mask; cache->items[i].value != NULL; i = (i + 1) & mask) {
+        home = cache_slot(cache, cache->items[i].id);
+        /* move the item if its home slot is not between the hole and it */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            cache->items[hole] = cache->items[i];
+            cache->items[i].value = NULL;
+            hole = i;
+        }
+    }
+}
+
+G_GNUC_INTERNAL
+display_cache *cache_new(GDestroyNotify value_destroy,
+                         display_cache_size_func value_size)
+{
+    display_cache *self = g_new0(display_cache, 1);
+
+    self->capacity = CACHE_INIT_CAPACITY;
+    self->items = g_new0(display_cache_item, self->capacity);
+    self->value_destroy = value_destroy;
+    self->value_size = value_size;
+    self->ref_counted = FALSE;
+    g_mutex_init(&self->lock);
+    self->waiters = NULL;
+    return self;
+}
+
+static gsize pixman_image_size(gconstpointer value)
+{
+    pixman_image_t *image = (pixman_image_t *)value;
+
+    return (gsize)pixman_image_get_stride(image) * pixman_image_get_height(image);
+}
+
+G_GNUC_INTERNAL
+display_cache *cache_image_new(GDestroyNotify value_destroy)
+{
+    display_cache *self = cache_new(value_destroy, pixman_image_size);
+
+    self->ref_counted = TRUE;
+    self->waiters = g_coroutine_wait_queue_new();
+    return self;
+}
+
+G_GNUC_INTERNAL
+void cache_free(display_cache *cache)
+{
+    cache_clear(cache);
+    g_coroutine_wait_queue_free(cache->waiters);
+    g_free(cache->items);
+    g_mutex_clear(&cache->lock);
+    g_free(cache);
+}
+
+G_GNUC_INTERNAL
+gpointer cache_find(display_cache *cache, uint64_t id)
+{
+    display_cache_item *item = cache_lookup(cache, id);
+
+    if (item == NULL) {
+        cache->stats.misses++;
+        return NULL;
+    }
+
+    cache->stats.hits++;
+    return item->value;
+}
+
+G_GNUC_INTERNAL
+gpointer cache_find_lossy(display_cache *cache, uint64_t id, gboolean *lossy)
+{
+    display_cache_item *item = cache_lookup(cache, id);
+
+    if (item == NULL) {
+        cache->stats.misses++;
+        return NULL;
+    }
+
+    cache->stats.hits++;
+    *lossy = item->lossy;
+    return item->value;
+}
+
+static void cache_store(display_cache *cache, uint64_t id, gpointer value,
+                        gboolean lossy, gboolean replace)
+{
+    display_cache_item *item;
+    guint32 ref_count = 1;
+
+    g_return_if_fail(value != NULL);
+
+    /* keep the load factor under 1/2 */
+    if ((cache->stats.items + 1) * 2 > cache->capacity)
+        cache_resize(cache, cache->capacity * 2);
+
+    item = cache_lookup_slot(cache, id);
+    if (item->value != NULL) {
+        /* if the value is currently in the table, consider its
+         * reference count before replacing it */
+        if (cache->ref_counted)
+            ref_count = replace ? item->ref_count : item->ref_count + 1;
+        if (item->lossy && !lossy)
+            cache->stats.lossy_replacements++;
+        cache_item_destroy(cache, item);
+    } else {
+        cache->stats.items++;
+    }
+
+    item->id = id;
+    item->value = value;
+    item->size = cache->value_size ? cache->value_size(value) : 0;
+    item->ref_count = ref_count;
+    item->lossy = lossy;
+    cache->stats.bytes += item->size;
+
+    if (cache->budget != 0 && cache->stats.bytes > cache->budget) {
+        /* the server decides what to keep, it should not get there */
+        if (cache->stats.over_budget++ == 0)
+            SPICE_DEBUG("cache over budget: %" G_GUINT64_FORMAT " > %" G_GSIZE_FORMAT,
+                        cache->stats.bytes, cache->budget);
+    }
+}
+
+G_GNUC_INTERNAL
+void cache_add_lossy(display_cache *cache, uint64_t id,
+                     gpointer value, gboolean lossy)
+{
+    cache_store(cache, id, value, lossy, FALSE);
+}
+
+G_GNUC_INTERNAL
+void cache_replace_lossy(display_cache *cache, uint64_t id,
+                         gpointer value, gboolean lossy)
+{
+    cache_store(cache, id, value, lossy, TRUE);
+}
+
+G_GNUC_INTERNAL
+gboolean cache_remove(display_cache *cache, uint64_t id)
+{
+    display_cache_item *item = cache_lookup(cache, id);
+
+    if (item == NULL)
+        return FALSE;
+
+    --item->ref_count;
+    if (!cache->ref_counted || item->ref_count == 0)
+        cache_item_remove(cache, item);
+
+    return TRUE;
+}
+
+G_GNUC_INTERNAL
+void cache_clear(display_cache *cache)
+{
+    guint32 i;
+
+    for (i = 0; i < cache->capacity; i++) {
+        if (cache->items[i].value != NULL)
+            cache_item_destroy(cache, &cache->items[i]);
+    }
+    cache->stats.items = 0;
+
+    if (cache->capacity > CACHE_INIT_CAPACITY) {
+        g_free(cache->items);
+        cache->capacity = CACHE_INIT_CAPACITY;
+        cache->items = g_new0(display_cache_item, cache->capacity);
+    }
+}
+
+/* the number of bytes the server may ask to keep, 0 if unknown */
+G_GNUC_INTERNAL
+void cache_set_budget(display_cache *cache, gsize budget)
+{
+    cache->budget = budget;
+}
+
+G_GNUC_INTERNAL
+void cache_get_stats(display_cache *cache, display_cache_stats *stats)
+{
+    *stats = cache->stats;
+}
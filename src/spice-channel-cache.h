@@ -17,134 +17,82 @@
 #pragma once
 
 #include "common/mem.h"
+#include "gio-coroutine.h"
 
 G_BEGIN_DECLS
 
+/*
+ * Caches of the resources the server asks the client to keep, by 64-bit
+ * id: images (shared by the display channels of a session), palettes and
+ * cursors. The server decides what is cached and when it is removed, so
+ * the cache never evicts on its own; it only accounts the bytes it holds.
+ *
+ * The table uses open addressing with linear probing, the items are
+ * stored inline, so adding a value does not allocate.
+ */
 typedef struct display_cache_item {
     guint64                     id;
-    gboolean                    lossy;
+    gpointer                    value;      /* NULL if the slot is free */
+    gsize                       size;
     guint32                     ref_count;
+    gboolean                    lossy;
 } display_cache_item;
 
-typedef struct display_cache {
-    GHashTable  *table;
-    gboolean    ref_counted;
-}display_cache;
+typedef gsize (*display_cache_size_func)(gconstpointer value);
 
-static inline display_cache_item* cache_item_new(guint64 id, gboolean lossy)
-{
-    display_cache_item *self = g_new(display_cache_item, 1);
-    self->id = id;
-    self->lossy = lossy;
-    self->ref_count = 1;
-    return self;
-}
-
-static inline void cache_item_free(display_cache_item *self)
-{
-    g_free(self);
-}
+typedef struct display_cache_stats {
+    guint64     hits;
+    guint64     misses;
+    guint64     lossy_replacements; /* lossy values replaced by lossless ones */
+    guint64     over_budget;        /* additions leaving the cache over budget */
+    guint64     bytes;
+    guint64     items;
+} display_cache_stats;
 
-static inline display_cache* cache_new(GDestroyNotify value_destroy)
+typedef struct display_cache {
+    display_cache_item      *items;
+    guint32                 capacity;   /* a power of 2 */
+    GDestroyNotify          value_destroy;
+    display_cache_size_func value_size;
+    gsize                   budget;     /* 0 if not set */
+    display_cache_stats     stats;
+    gboolean                ref_counted;
+    GMutex                  lock;
+    GCoroutineWaitQueue     *waiters; /* image caches only, keyed by id */
+} display_cache;
+
+display_cache *cache_new(GDestroyNotify value_destroy,
+                         display_cache_size_func value_size);
+display_cache *cache_image_new(GDestroyNotify value_destroy);
+void cache_free(display_cache *cache);
+
+/* The image cache is shared by the display channels of a session,
+ * which may run on different threads: callers lock it around each
+ * operation. The cache functions themselves do not lock. */
+static inline void cache_lock(display_cache *cache)
 {
-    display_cache * self = g_new(display_cache, 1);
-    self->table = g_hash_table_new_full(g_int64_hash, g_int64_equal,
-                                       (GDestroyNotify) cache_item_free,
-                                       value_destroy);
-    self->ref_counted = FALSE;
-    return self;
+    g_mutex_lock(&cache->lock);
 }
 
-static inline display_cache * cache_image_new(GDestroyNotify value_destroy)
-{
-    display_cache * self = cache_new(value_destroy);
-    self->ref_counted = TRUE;
-    return self;
-};
-
-static inline gpointer cache_find(display_cache *cache, uint64_t id)
+static inline void cache_unlock(display_cache *cache)
 {
-    return g_hash_table_lookup(cache->table, &id);
+    g_mutex_unlock(&cache->lock);
 }
 
-static inline gpointer cache_find_lossy(display_cache *cache, uint64_t id, gboolean *lossy)
-{
-    gpointer value;
-    display_cache_item *item;
-
-    if (!g_hash_table_lookup_extended(cache->table, &id, (gpointer*)&item, &value))
-        return NULL;
-
-    *lossy = item->lossy;
-
-    return value;
-}
-
-static inline void cache_add_lossy(display_cache *cache, uint64_t id,
-                                   gpointer value, gboolean lossy)
-{
-    display_cache_item *item = cache_item_new(id, lossy);
-    display_cache_item *current_item;
-    gpointer            current_image;
-
-    //If image is currently in the table add its reference count before replacing it
-    if(cache->ref_counted) {
-        if(g_hash_table_lookup_extended(cache->table, &id, (gpointer*) &current_item,
-                                        (gpointer*) &current_image)) {
-            item->ref_count = current_item->ref_count + 1;
-        }
-    }
-    g_hash_table_replace(cache->table, item, value);
-}
-
-static inline void cache_replace_lossy(display_cache *cache, uint64_t id,
-                                       gpointer value, gboolean lossy)
-{
-    display_cache_item *item = cache_item_new(id, lossy);
-
-    // If image is currently in the table consider its reference count before replacing it
-    if (cache->ref_counted) {
-        display_cache_item *current_item;
-        gpointer current_image;
-        if (g_hash_table_lookup_extended(cache->table, &id, (gpointer*) &current_item,
-                                         &current_image)) {
-            item->ref_count = current_item->ref_count;
-        }
-    }
-    g_hash_table_replace(cache->table, item, value);
-}
+gpointer cache_find(display_cache *cache, uint64_t id);
+gpointer cache_find_lossy(display_cache *cache, uint64_t id, gboolean *lossy);
+void cache_add_lossy(display_cache *cache, uint64_t id,
+                     gpointer value, gboolean lossy);
+void cache_replace_lossy(display_cache *cache, uint64_t id,
+                         gpointer value, gboolean lossy);
+gboolean cache_remove(display_cache *cache, uint64_t id);
+void cache_clear(display_cache *cache);
+void cache_set_budget(display_cache *cache, gsize budget);
+void cache_get_stats(display_cache *cache, display_cache_stats *stats);
 
 static inline void cache_add(display_cache *cache, uint64_t id, gpointer value)
 {
     cache_add_lossy(cache, id, value, FALSE);
 }
 
-static inline gboolean cache_remove(display_cache *cache, uint64_t id)
-{
-    display_cache_item * item;
-    gpointer value;
-
-    if( g_hash_table_lookup_extended(cache->table, &id, (gpointer*) &item, &value)) {
-        --item->ref_count;
-        if(!cache->ref_counted || item->ref_count == 0 ) {
-            return g_hash_table_remove(cache->table, &id);
-        }
-    }
-    else {
-        return FALSE;
-    }
-    return TRUE;
-}
-
-static inline void cache_clear(display_cache *cache)
-{
-    g_hash_table_remove_all(cache->table);
-}
-
-static inline void cache_free(display_cache *cache)
-{
-    g_hash_table_unref(cache->table);
-    g_free(cache);
-}
-
 G_END_DECLS
@@ -38,6 +38,9 @@ G_BEGIN_DECLS
 
 #define MAX_SPICE_DATA_HEADER_SIZE sizeof(SpiceDataHeader)
 
+/* size of the per-channel receive buffer, see spice_channel_read() */
+#define SPICE_CHANNEL_RBUF_SIZE (64 * 1024)
+
 #define CHANNEL_DEBUG(channel, fmt, ...) \
     SPICE_DEBUG("%s: " fmt, SPICE_CHANNEL(channel)->priv->name, ## __VA_ARGS__)
 
@@ -50,13 +53,19 @@ struct _SpiceMsgOut {
     SpiceMarshaller       *marshaller;
     uint8_t               *header;
     gboolean              ro_check;
+    SpiceMsgOut           *next; /* link in the transmit queue */
 };
 
+typedef struct _SpiceMsgInPool SpiceMsgInPool;
+typedef struct SpiceMsgStatsTable SpiceMsgStatsTable;
+
 struct _SpiceMsgIn {
     int                   refcount;
     SpiceChannel          *channel;
+    SpiceMsgInPool        *pool;
     uint8_t               header[MAX_SPICE_DATA_HEADER_SIZE];
     uint8_t               *data;
+    int                   data_class;
     int                   dpos;
     uint8_t               *parsed;
     size_t                psize;
@@ -96,6 +105,11 @@ struct _SpiceChannelPrivate {
     unsigned int                sasl_decoded_offset;
 #endif
 
+    /* receive buffer, filled with large reads once the channel is up */
+    guint8                      *rbuf;
+    gsize                       rbuf_start;
+    gsize                       rbuf_end;
+
     gboolean                    use_mini_header;
     uint64_t                    out_serial;
     uint64_t                    in_serial;
@@ -107,11 +121,28 @@ struct _SpiceChannelPrivate {
     gboolean                    has_error;
     guint                       connect_delayed_id;
 
-    GQueue                      xmit_queue;
-    gboolean                    xmit_queue_blocked;
-    GMutex                      xmit_queue_lock;
-    guint                       xmit_queue_wakeup_id;
-    guint64                     xmit_queue_size;
+    /* context and thread running the coroutine of a display channel
+     * when SpiceSession:display-threads is set, NULL otherwise */
+    GMainContext                *context;
+    GMainLoop                   *loop;
+    GThread                     *thread;
+
+    SpiceMsgInPool              *msg_pool;
+
+    /* lock-free transmit queue, see spice_msg_out_send() */
+    SpiceMsgOut                 *xmit_queue_head; /* atomic, pushed by producers */
+    SpiceMsgOut                 *xmit_queue;      /* owned by the consumer */
+    gint                        xmit_queue_blocked; /* atomic */
+    /* read locked by the producers from their blocked check to their
+     * push, write locked to drain or move the queue */
+    GRWLock                     xmit_queue_lock;
+    gint                        xmit_queue_wakeup_pending; /* atomic */
+    gsize                       xmit_queue_size; /* atomic */
+#ifdef HAVE_SYS_EVENTFD_H
+    int                         xmit_queue_wakeup_fd;
+    GSource                     *xmit_queue_wakeup_source;
+#endif
+    GByteArray                  *xmit_buffer;
 
     char                        name[16];
     enum spice_channel_state    state;
@@ -137,9 +168,31 @@ struct _SpiceChannelPrivate {
     GArray                      *remote_common_caps;
 
     gsize                       total_read_bytes;
+    guint64                     total_read_calls;
+    guint64                     total_read_messages;
+    guint64                     total_write_bytes;
+    guint64                     total_write_calls;
+    guint64                     total_write_messages;
+    gsize                       xmit_queue_high_water;
+    guint64                     ack_stalls;
+    /* per message type metrics, see SpiceChannel:message-stats, NULL
+     * until enabled */
+    SpiceMsgStatsTable          *msg_stats;
+    gint64                      connect_start_time;
+    guint64                     connect_time;
+    guint64                     tls_handshake_time;
+    gboolean                    tls_session_reused;
     uint64_t                    last_message_serial;
+    /* messages held by the subclass, the serial of the last one read is
+     * only reached once they are released, see spice_channel_msg_hold() */
+    guint                       held_messages;
+    uint64_t                    held_message_serial;
     GSList                      *flushing;
 
+    /* inbound stream capture, see SPICE_CAPTURE_DIR */
+    FILE                        *capture;
+    gint64                      capture_start;
+
     gboolean                    disable_channel_msg;
     gboolean                    auth_needs_username;
     gboolean                    auth_needs_password;
@@ -168,6 +221,10 @@ uint32_t spice_header_get_msg_size(uint8_t *header, gboolean is_mini_header);
 
 void spice_channel_up(SpiceChannel *channel);
 void spice_channel_wakeup(SpiceChannel *channel, gboolean cancel);
+GMainContext *spice_channel_get_context(SpiceChannel *channel);
+guint spice_channel_timeout_add(SpiceChannel *channel, guint interval,
+                                GSourceFunc function, gpointer data);
+void spice_channel_source_remove(SpiceChannel *channel, guint id);
 
 SpiceSession* spice_channel_get_session(SpiceChannel *channel);
 enum spice_channel_state spice_channel_get_state(SpiceChannel *channel);
@@ -176,6 +233,8 @@ guint64 spice_channel_get_queue_size (SpiceChannel *channel);
 /* coroutine context */
 typedef void (*handler_msg_in)(SpiceChannel *channel, SpiceMsgIn *msg, gpointer data);
 void spice_channel_recv_msg(SpiceChannel *channel, handler_msg_in handler, gpointer data);
+void spice_channel_msg_hold(SpiceChannel *channel);
+void spice_channel_msg_release(SpiceChannel *channel, SpiceMsgIn *in);
 
 /* channel-base.c */
 void spice_channel_set_handlers(SpiceChannelClass *klass,
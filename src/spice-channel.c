@@ -22,9 +22,11 @@
 #include "spice-channel-priv.h"
 #include "spice-session-priv.h"
 #include "spice-marshal.h"
+#include "spice-capture.h"
 #include "bio-gio.h"
 
 #include <glib/gi18n-lib.h>
+#include <glib/gstdio.h>
 
 #include <openssl/rsa.h>
 #include <openssl/evp.h>
@@ -43,11 +45,23 @@
 #include <arpa/inet.h>
 #endif
 #include <ctype.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <glib-unix.h>
+#endif
 
 #include "gio-coroutine.h"
 #include "common/sm2-EVP/c/sm2.h"
 
 G_STATIC_ASSERT(sizeof(SpiceChannelClass) == sizeof(GObjectClass) + 19 * sizeof(gpointer));
+
+/* limits of a batch of messages written at once, see spice_channel_iterate_write() */
+#define XMIT_BATCH_MSGS 64
+#define XMIT_BATCH_BYTES (256 * 1024)
+#define XMIT_IOV_MAX 256
+
 gboolean ca_use_SM2 = TRUE;
 static void spice_channel_handle_msg(SpiceChannel *channel, SpiceMsgIn *msg);
 static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out);
@@ -94,6 +108,17 @@ enum {
     PROP_CHANNEL_ID,
     PROP_TOTAL_READ_BYTES,
     PROP_SOCKET,
+    PROP_TOTAL_READ_CALLS,
+    PROP_TOTAL_READ_MESSAGES,
+    PROP_CONNECT_TIME,
+    PROP_TLS_HANDSHAKE_TIME,
+    PROP_TLS_SESSION_REUSED,
+    PROP_TOTAL_WRITE_BYTES,
+    PROP_TOTAL_WRITE_CALLS,
+    PROP_TOTAL_WRITE_MESSAGES,
+    PROP_XMIT_QUEUE_HIGH_WATER,
+    PROP_ACK_STALLS,
+    PROP_MESSAGE_STATS,
 };
 
 /* Signals */
@@ -108,6 +133,297 @@ static guint signals[SPICE_CHANNEL_LAST_SIGNAL];
 
 static void spice_channel_iterate_write(SpiceChannel *channel);
 static void spice_channel_iterate_read(SpiceChannel *channel);
+#ifdef HAVE_SYS_EVENTFD_H
+static void spice_channel_xmit_wakeup_attach(SpiceChannel *channel);
+#endif
+static void spice_channel_thread_stop(SpiceChannel *channel);
+
+/* ---------------------------------------------------------------- */
+/* incoming message pool                                            */
+
+/*
+ * SpiceMsgIn structs and message payloads are recycled through a
+ * per-channel pool instead of going through malloc/free for each
+ * message. Payloads are kept in power-of-two size classes. Messages
+ * may be released from another thread (for example when GStreamer
+ * frees a SpiceFrame), so the pool is locked and refcounted: each
+ * message holds a reference so the pool outlives its channel if needed.
+ */
+#define MSG_POOL_MIN_SHIFT 8   /* 256 bytes */
+#define MSG_POOL_MAX_SHIFT 22  /* 4 MiB, larger payloads are not pooled */
+#define MSG_POOL_N_CLASSES (MSG_POOL_MAX_SHIFT - MSG_POOL_MIN_SHIFT + 1)
+#define MSG_POOL_MAX_FREE_MSGS 64
+#define MSG_POOL_MAX_FREE_BUFFERS 32
+#define MSG_POOL_CLASS_BYTES (256 * 1024)
+
+typedef struct MsgPoolBuffer MsgPoolBuffer;
+struct MsgPoolBuffer {
+    MsgPoolBuffer *next;
+};
+
+struct _SpiceMsgInPool {
+    gint refcount;
+    GMutex lock;
+    SpiceMsgIn *free_msgs;
+    guint n_free_msgs;
+    MsgPoolBuffer *free_buffers[MSG_POOL_N_CLASSES];
+    guint n_free_buffers[MSG_POOL_N_CLASSES];
+};
+
+static SpiceMsgInPool *msg_in_pool_new(void)
+{
+    SpiceMsgInPool *pool = g_new0(SpiceMsgInPool, 1);
+
+    pool->refcount = 1;
+    g_mutex_init(&pool->lock);
+
+    return pool;
+}
+
+static SpiceMsgInPool *msg_in_pool_ref(SpiceMsgInPool *pool)
+{
+    g_atomic_int_inc(&pool->refcount);
+    return pool;
+}
+
+static void msg_in_pool_unref(SpiceMsgInPool *pool)
+{
+    int i;
+
+    if (!g_atomic_int_dec_and_test(&pool->refcount))
+        return;
+
+    while (pool->free_msgs) {
+        SpiceMsgIn *in = pool->free_msgs;
+        pool->free_msgs = in->parent;
+        g_free(in);
+    }
+    for (i = 0; i < MSG_POOL_N_CLASSES; i++) {
+        while (pool->free_buffers[i]) {
+            MsgPoolBuffer *buf = pool->free_buffers[i];
+            pool->free_buffers[i] = buf->next;
+            g_free(buf);
+        }
+    }
+    g_mutex_clear(&pool->lock);
+    g_free(pool);
+}
+
+/* the returned message is zeroed and holds a reference on @pool */
+static SpiceMsgIn *msg_in_pool_alloc_msg(SpiceMsgInPool *pool)
+{
+    SpiceMsgIn *in;
+
+    g_mutex_lock(&pool->lock);
+    in = pool->free_msgs;
+    if (in) {
+        pool->free_msgs = in->parent;
+        pool->n_free_msgs--;
+    }
+    g_mutex_unlock(&pool->lock);
+
+    if (in)
+        memset(in, 0, sizeof(*in));
+    else
+        in = g_new0(SpiceMsgIn, 1);
+    in->pool = msg_in_pool_ref(pool);
+
+    return in;
+}
+
+static void msg_in_pool_free_msg(SpiceMsgInPool *pool, SpiceMsgIn *in)
+{
+    g_mutex_lock(&pool->lock);
+    if (pool->n_free_msgs < MSG_POOL_MAX_FREE_MSGS) {
+        in->parent = pool->free_msgs;
+        pool->free_msgs = in;
+        pool->n_free_msgs++;
+        in = NULL;
+    }
+    g_mutex_unlock(&pool->lock);
+
+    g_free(in);
+    msg_in_pool_unref(pool);
+}
+
+/* the returned buffer is not zeroed, @data_class is -1 if not pooled */
+static uint8_t *msg_in_pool_alloc_data(SpiceMsgInPool *pool, gsize size, int *data_class)
+{
+    MsgPoolBuffer *buf;
+    int i;
+
+    if (size == 0 || size > (1 << MSG_POOL_MAX_SHIFT)) {
+        *data_class = -1;
+        return g_malloc(size);
+    }
+
+    i = MAX((int)g_bit_storage(size - 1), MSG_POOL_MIN_SHIFT) - MSG_POOL_MIN_SHIFT;
+    *data_class = i;
+
+    g_mutex_lock(&pool->lock);
+    buf = pool->free_buffers[i];
+    if (buf) {
+        pool->free_buffers[i] = buf->next;
+        pool->n_free_buffers[i]--;
+    }
+    g_mutex_unlock(&pool->lock);
+
+    if (buf == NULL)
+        buf = g_malloc(1 << (i + MSG_POOL_MIN_SHIFT));
+
+    return (uint8_t *)buf;
+}
+
+static void msg_in_pool_free_data(SpiceMsgInPool *pool, uint8_t *data, int data_class)
+{
+    MsgPoolBuffer *buf = (MsgPoolBuffer *)data;
+    guint max_free;
+
+    if (data_class < 0) {
+        g_free(data);
+        return;
+    }
+
+    max_free = MSG_POOL_CLASS_BYTES >> (data_class + MSG_POOL_MIN_SHIFT);
+    max_free = CLAMP(max_free, 1, MSG_POOL_MAX_FREE_BUFFERS);
+
+    g_mutex_lock(&pool->lock);
+    if (pool->n_free_buffers[data_class] < max_free) {
+        buf->next = pool->free_buffers[data_class];
+        pool->free_buffers[data_class] = buf;
+        pool->n_free_buffers[data_class]++;
+        buf = NULL;
+    }
+    g_mutex_unlock(&pool->lock);
+
+    g_free(buf);
+}
+
+/* ---------------------------------------------------------------- */
+/* metrics                                                          */
+
+#define MSG_STATS_BUCKETS 16
+#define MSG_STATS_TYPES 512 /* above all the message types of the protocol */
+
+typedef struct SpiceMsgStats {
+    guint64 messages;
+    guint64 bytes;
+    guint64 time;
+    guint64 histogram[MSG_STATS_BUCKETS];
+} SpiceMsgStats;
+
+/*
+ * Only the channel coroutine updates the counters, the readers take a
+ * consistent copy: @seq is odd while an update is in progress and is
+ * checked again after the copy, like a seqlock.
+ */
+struct SpiceMsgStatsTable {
+    gint seq;
+    SpiceMsgStats in[MSG_STATS_TYPES];
+    SpiceMsgStats out[MSG_STATS_TYPES];
+};
+
+/* any context, the collection starts once the metrics are read, or
+ * from the start if SPICE_MESSAGE_STATS is set */
+static SpiceMsgStatsTable *spice_channel_msg_stats_enable(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    SpiceMsgStatsTable *table = g_atomic_pointer_get(&c->msg_stats);
+
+    if (table != NULL)
+        return table;
+
+    table = g_new0(SpiceMsgStatsTable, 1);
+    if (!g_atomic_pointer_compare_and_exchange(&c->msg_stats, NULL, table)) {
+        g_free(table);
+        table = g_atomic_pointer_get(&c->msg_stats);
+    }
+
+    return table;
+}
+
+/* coroutine context, @time is the handler time in microseconds, or -1 */
+static void spice_channel_msg_stats_add(SpiceChannel *channel, gboolean outgoing,
+                                        guint16 type, gsize bytes, gint64 time)
+{
+    SpiceMsgStatsTable *table = g_atomic_pointer_get(&channel->priv->msg_stats);
+    SpiceMsgStats *stats;
+
+    if (table == NULL || type >= MSG_STATS_TYPES)
+        return;
+
+    stats = outgoing ? &table->out[type] : &table->in[type];
+    g_atomic_int_inc(&table->seq);
+    stats->messages++;
+    stats->bytes += bytes;
+    if (time >= 0) {
+        stats->time += time;
+        stats->histogram[MIN(g_bit_storage(time) - (time == 0), MSG_STATS_BUCKETS - 1)]++;
+    }
+    g_atomic_int_inc(&table->seq);
+}
+
+/* coroutine context */
+static void spice_channel_handle_msg_timed(SpiceChannel *channel, handler_msg_in msg_handler,
+                                           SpiceMsgIn *in, gpointer data)
+{
+    gint64 start;
+
+    if (g_atomic_pointer_get(&channel->priv->msg_stats) == NULL) {
+        msg_handler(channel, in, data);
+        return;
+    }
+
+    start = g_get_monotonic_time();
+    msg_handler(channel, in, data);
+    spice_channel_msg_stats_add(channel, FALSE, spice_msg_in_type(in), in->dpos,
+                                g_get_monotonic_time() - start);
+}
+
+static void spice_channel_msg_stats_add_variant(GVariantBuilder *builder, gboolean outgoing,
+                                                const SpiceMsgStats *stats)
+{
+    guint type;
+
+    for (type = 0; type < MSG_STATS_TYPES; type++) {
+        if (stats[type].messages == 0)
+            continue;
+
+        g_variant_builder_add(builder, "(bqttt@at)",
+                              outgoing, (guint16)type,
+                              stats[type].messages, stats[type].bytes, stats[type].time,
+                              g_variant_new_fixed_array(G_VARIANT_TYPE_UINT64,
+                                                        stats[type].histogram,
+                                                        outgoing ? 0 : MSG_STATS_BUCKETS,
+                                                        sizeof(guint64)));
+    }
+}
+
+/* any context */
+static GVariant *spice_channel_get_msg_stats(SpiceChannel *channel)
+{
+    SpiceMsgStatsTable *table = spice_channel_msg_stats_enable(channel);
+    SpiceMsgStatsTable *copy = g_new(SpiceMsgStatsTable, 1);
+    GVariantBuilder builder;
+    gint seq;
+
+    for (;;) {
+        seq = g_atomic_int_get(&table->seq);
+        if (seq % 2 == 0) {
+            memcpy(copy, table, sizeof(*copy));
+            if (g_atomic_int_get(&table->seq) == seq)
+                break;
+        }
+        g_thread_yield();
+    }
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(bqtttat)"));
+    spice_channel_msg_stats_add_variant(&builder, FALSE, copy->in);
+    spice_channel_msg_stats_add_variant(&builder, TRUE, copy->out);
+    g_free(copy);
+
+    return g_variant_builder_end(&builder);
+}
 
 static void spice_channel_init(SpiceChannel *channel)
 {
@@ -130,8 +446,18 @@ static void spice_channel_init(SpiceChannel *channel)
 #ifdef HAVE_SASL
     spice_channel_set_common_capability(channel, SPICE_COMMON_CAP_AUTH_SASL);
 #endif
-    g_queue_init(&c->xmit_queue);
-    g_mutex_init(&c->xmit_queue_lock);
+    c->msg_pool = msg_in_pool_new();
+    c->xmit_buffer = g_byte_array_new();
+    if (g_getenv("SPICE_MESSAGE_STATS") != NULL)
+        spice_channel_msg_stats_enable(channel);
+    g_rw_lock_init(&c->xmit_queue_lock);
+#ifdef HAVE_SYS_EVENTFD_H
+    c->xmit_queue_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (c->xmit_queue_wakeup_fd < 0)
+        g_warning("failed to create eventfd, using timeouts to wake up: %s",
+                  g_strerror(errno));
+    spice_channel_xmit_wakeup_attach(channel);
+#endif
 }
 
 static void spice_channel_constructed(GObject *gobject)
@@ -182,7 +508,22 @@ static void spice_channel_finalize(GObject *gobject)
 
     g_idle_remove_by_data(gobject);
 
-    g_mutex_clear(&c->xmit_queue_lock);
+#ifdef HAVE_SYS_EVENTFD_H
+    if (c->xmit_queue_wakeup_source != NULL) {
+        g_source_destroy(c->xmit_queue_wakeup_source);
+        g_source_unref(c->xmit_queue_wakeup_source);
+    }
+    if (c->xmit_queue_wakeup_fd >= 0)
+        close(c->xmit_queue_wakeup_fd);
+#endif
+
+    spice_channel_thread_stop(channel);
+
+    g_clear_pointer(&c->rbuf, g_free);
+    g_clear_pointer(&c->msg_pool, msg_in_pool_unref);
+    g_clear_pointer(&c->xmit_buffer, g_byte_array_unref);
+    g_clear_pointer(&c->msg_stats, g_free);
+    g_rw_lock_clear(&c->xmit_queue_lock);
 
     if (c->caps)
         g_array_free(c->caps, TRUE);
@@ -227,6 +568,39 @@ static void spice_channel_get_property(GObject    *gobject,
     case PROP_SOCKET:
         g_value_set_object(value, c->sock);
         break;
+    case PROP_TOTAL_READ_CALLS:
+        g_value_set_uint64(value, c->total_read_calls);
+        break;
+    case PROP_TOTAL_READ_MESSAGES:
+        g_value_set_uint64(value, c->total_read_messages);
+        break;
+    case PROP_CONNECT_TIME:
+        g_value_set_uint64(value, c->connect_time);
+        break;
+    case PROP_TLS_HANDSHAKE_TIME:
+        g_value_set_uint64(value, c->tls_handshake_time);
+        break;
+    case PROP_TLS_SESSION_REUSED:
+        g_value_set_boolean(value, c->tls_session_reused);
+        break;
+    case PROP_TOTAL_WRITE_BYTES:
+        g_value_set_uint64(value, c->total_write_bytes);
+        break;
+    case PROP_TOTAL_WRITE_CALLS:
+        g_value_set_uint64(value, c->total_write_calls);
+        break;
+    case PROP_TOTAL_WRITE_MESSAGES:
+        g_value_set_uint64(value, c->total_write_messages);
+        break;
+    case PROP_XMIT_QUEUE_HIGH_WATER:
+        g_value_set_uint64(value, c->xmit_queue_high_water);
+        break;
+    case PROP_ACK_STALLS:
+        g_value_set_uint64(value, c->ack_stalls);
+        break;
+    case PROP_MESSAGE_STATS:
+        g_value_take_variant(value, spice_channel_get_msg_stats(channel));
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -348,6 +722,212 @@ static void spice_channel_class_init(SpiceChannelClass *klass)
                              G_PARAM_READABLE |
                              G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceChannel:total-read-calls:
+     *
+     * Number of read calls issued on the underlying connection (socket,
+     * TLS or SASL layer). Compared with #SpiceChannel:total-read-messages,
+     * this shows how well incoming messages are batched.
+     *
+     * Since: 0.41
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_TOTAL_READ_CALLS,
+         g_param_spec_uint64("total-read-calls",
+                             "Total read calls",
+                             "Total read calls on the connection",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:total-read-messages:
+     *
+     * Number of messages received on the channel.
+     *
+     * Since: 0.41
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_TOTAL_READ_MESSAGES,
+         g_param_spec_uint64("total-read-messages",
+                             "Total read messages",
+                             "Total read messages",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:connect-time:
+     *
+     * Time in microseconds it took for the last connection to get ready,
+     * from the start of the connection to the end of the authentication.
+     *
+     * Since: 0.41
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_CONNECT_TIME,
+         g_param_spec_uint64("connect-time",
+                             "Connect time",
+                             "Connection time in microseconds",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:tls-handshake-time:
+     *
+     * Time in microseconds spent in the TLS handshake of the last
+     * connection, or 0 if TLS is not used.
+     *
+     * Since: 0.41
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_TLS_HANDSHAKE_TIME,
+         g_param_spec_uint64("tls-handshake-time",
+                             "TLS handshake time",
+                             "TLS handshake time in microseconds",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:tls-session-reused:
+     *
+     * Whether the last TLS handshake resumed a session negotiated by
+     * another channel of the session (abbreviated handshake).
+     *
+     * Since: 0.41
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_TLS_SESSION_REUSED,
+         g_param_spec_boolean("tls-session-reused",
+                              "TLS session reused",
+                              "Whether the TLS session was resumed",
+                              FALSE,
+                              G_PARAM_READABLE |
+                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:total-write-bytes:
+     *
+     * Number of bytes written to the connection.
+     *
+     * Since: 0.41
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_TOTAL_WRITE_BYTES,
+         g_param_spec_uint64("total-write-bytes",
+                             "Total write bytes",
+                             "Total bytes written on the connection",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:total-write-calls:
+     *
+     * Number of write calls made on the connection, compared to
+     * #SpiceChannel:total-write-messages this shows how well outgoing
+     * messages are batched.
+     *
+     * Since: 0.41
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_TOTAL_WRITE_CALLS,
+         g_param_spec_uint64("total-write-calls",
+                             "Total write calls",
+                             "Total write calls on the connection",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:total-write-messages:
+     *
+     * Number of messages sent on the channel.
+     *
+     * Since: 0.41
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_TOTAL_WRITE_MESSAGES,
+         g_param_spec_uint64("total-write-messages",
+                             "Total write messages",
+                             "Total write messages",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:xmit-queue-high-water:
+     *
+     * Largest size in bytes reached by the transmit queue, see
+     * spice_channel_get_queue_size().
+     *
+     * Since: 0.41
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_XMIT_QUEUE_HIGH_WATER,
+         g_param_spec_uint64("xmit-queue-high-water",
+                             "Transmit queue high-water mark",
+                             "Largest size of the transmit queue in bytes",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:ack-stalls:
+     *
+     * Number of acknowledgements sent while no more data was pending
+     * from the server, which most likely stopped sending until it got
+     * the acknowledgement. A high count compared to the number of
+     * received messages means the acknowledgement window limits the
+     * throughput.
+     *
+     * Since: 0.41
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_ACK_STALLS,
+         g_param_spec_uint64("ack-stalls",
+                             "Acknowledgement stalls",
+                             "Acknowledgements sent with no data in flight",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:message-stats:
+     *
+     * Metrics per message type, as an array of
+     * (outgoing, type, messages, bytes, time, histogram) tuples of
+     * type "a(bqtttat)":
+     *
+     * - outgoing: %TRUE for messages sent by the client, %FALSE for
+     *   messages received from the server
+     * - type: the message type
+     * - messages: number of messages
+     * - bytes: size of the messages, without headers
+     * - time: total time spent in the message handler, in microseconds,
+     *   0 for outgoing messages
+     * - histogram: number of handler runs per duration, entry 0 counts
+     *   the runs below 1 microsecond, entry i the runs from 2^(i-1) to
+     *   2^i microseconds, and the last entry all the longer runs
+     *
+     * The metrics cost a little on each message, they are only
+     * collected once this property was read, or from the connection if
+     * the SPICE_MESSAGE_STATS environment variable is set.
+     *
+     * Since: 0.41
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_MESSAGE_STATS,
+         g_param_spec_variant("message-stats",
+                              "Message stats",
+                              "Metrics per message type",
+                              G_VARIANT_TYPE("a(bqtttat)"),
+                              NULL,
+                              G_PARAM_READABLE |
+                              G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceChannel::channel-event:
      * @channel: the channel that emitted the signal
@@ -498,9 +1078,10 @@ SpiceMsgIn *spice_msg_in_new(SpiceChannel *channel)
 
     g_return_val_if_fail(channel != NULL, NULL);
 
-    in = g_new0(SpiceMsgIn, 1);
+    in = msg_in_pool_alloc_msg(channel->priv->msg_pool);
     in->refcount = 1;
     in->channel  = channel;
+    in->data_class = -1;
 
     return in;
 }
@@ -528,25 +1109,25 @@ void spice_msg_in_ref(SpiceMsgIn *in)
 {
     g_return_if_fail(in != NULL);
 
-    in->refcount++;
+    g_atomic_int_inc(&in->refcount);
 }
 
+/* any context: SpiceFrame may release its message from a decoder thread */
 G_GNUC_INTERNAL
 void spice_msg_in_unref(SpiceMsgIn *in)
 {
     g_return_if_fail(in != NULL);
 
-    in->refcount--;
-    if (in->refcount > 0)
+    if (!g_atomic_int_dec_and_test(&in->refcount))
         return;
     if (in->parsed)
         in->pfree(in->parsed);
     if (in->parent) {
         spice_msg_in_unref(in->parent);
     } else {
-        g_free(in->data);
+        msg_in_pool_free_data(in->pool, in->data, in->data_class);
     }
-    g_free(in);
+    msg_in_pool_free_msg(in->pool, in);
 }
 
 G_GNUC_INTERNAL
@@ -690,33 +1271,176 @@ void spice_msg_out_unref(SpiceMsgOut *out)
     g_free(out);
 }
 
+/* ---------------------------------------------------------------- */
+/* transmit queue                                                   */
+
+/*
+ * The transmit queue is a lock-free multi-producer single-consumer
+ * queue: spice_msg_out_send() may be called from the main context, the
+ * channel coroutine or the usb event thread, and pushes messages with a
+ * compare-and-swap on xmit_queue_head (a LIFO stack). The consumer (the
+ * channel coroutine, or the main context once the coroutine is gone)
+ * takes the whole stack at once and keeps it in FIFO order in
+ * xmit_queue.
+ *
+ * Only the producer turning the queue from empty to non-empty wakes the
+ * channel up, through an eventfd watched by the channel context when
+ * available, a timeout source otherwise.
+ *
+ * Producers hold xmit_queue_lock for reading from their
+ * xmit_queue_blocked check to their push, which does not serialize
+ * them. A reset or a migration swap takes it for writing, so that no
+ * producer is past the check while the queue is drained or moved.
+ */
+
+static gboolean spice_channel_unref_idle(gpointer data)
+{
+    g_object_unref(data);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Drops a reference from any context, making sure the channel is not
+ * finalized on its own thread, since that would emit signals and join
+ * the thread from itself.
+ */
+static void spice_channel_unref_main(gpointer data)
+{
+    SpiceChannel *channel = data;
+
+    if (channel->priv->context == NULL)
+        g_object_unref(channel);
+    else
+        g_idle_add(spice_channel_unref_idle, channel);
+}
+
 /* system context */
-static gboolean spice_channel_idle_wakeup(gpointer user_data)
+static void spice_channel_xmit_wakeup(SpiceChannel *channel)
 {
-    SpiceChannel *channel = SPICE_CHANNEL(user_data);
     SpiceChannelPrivate *c = channel->priv;
 
-    /*
-     * Note:
-     *
-     * - This must be done before the wakeup as that may eventually
-     *   call channel_reset() which checks this.
-     * - The lock calls are really necessary, this fixes the following race:
-     *   1) usb-event-thread calls spice_msg_out_send()
-     *   2) spice_msg_out_send calls g_timeout_add_full(...)
-     *   3) we run, set xmit_queue_wakeup_id to 0
-     *   4) spice_msg_out_send stores the result of g_timeout_add_full() in
-     *      xmit_queue_wakeup_id, overwriting the 0 we just stored
-     *   5) xmit_queue_wakeup_id now says there is a wakeup pending which is
-     *      false
-     */
-    g_mutex_lock(&c->xmit_queue_lock);
-    c->xmit_queue_wakeup_id = 0;
-    g_mutex_unlock(&c->xmit_queue_lock);
+    /* This must be done before the wakeup, so that a message queued
+     * from now on triggers a new one */
+    g_atomic_int_set(&c->xmit_queue_wakeup_pending, FALSE);
 
     spice_channel_wakeup(channel, FALSE);
+}
 
-    return FALSE;
+#ifdef HAVE_SYS_EVENTFD_H
+/* system context */
+static gboolean spice_channel_xmit_wakeup_fd(gint fd, GIOCondition condition,
+                                             gpointer user_data)
+{
+    SpiceChannel *channel = SPICE_CHANNEL(user_data);
+    guint64 val;
+
+    if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+        g_warning("%s: failed to read wakeup eventfd: %s",
+                  channel->priv->name, g_strerror(errno));
+
+    spice_channel_xmit_wakeup(channel);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* (re)attach the eventfd watch to the context running the channel */
+static void spice_channel_xmit_wakeup_attach(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    GSource *src;
+
+    if (c->xmit_queue_wakeup_fd < 0)
+        return;
+
+    if (c->xmit_queue_wakeup_source != NULL) {
+        g_source_destroy(c->xmit_queue_wakeup_source);
+        g_source_unref(c->xmit_queue_wakeup_source);
+    }
+
+    src = g_unix_fd_source_new(c->xmit_queue_wakeup_fd, G_IO_IN);
+    g_source_set_priority(src, G_PRIORITY_HIGH);
+    g_source_set_callback(src, (GSourceFunc)spice_channel_xmit_wakeup_fd, channel, NULL);
+    g_source_attach(src, c->context);
+    c->xmit_queue_wakeup_source = src;
+}
+#endif
+
+/* system context */
+static gboolean spice_channel_xmit_wakeup_idle(gpointer user_data)
+{
+    spice_channel_xmit_wakeup(SPICE_CHANNEL(user_data));
+
+    return G_SOURCE_REMOVE;
+}
+
+/* any context */
+static void spice_channel_xmit_queue_signal(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (!g_atomic_int_compare_and_exchange(&c->xmit_queue_wakeup_pending, FALSE, TRUE))
+        return;
+
+#ifdef HAVE_SYS_EVENTFD_H
+    if (c->xmit_queue_wakeup_fd >= 0) {
+        guint64 val = 1;
+
+        if (write(c->xmit_queue_wakeup_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+            g_warning("%s: failed to write wakeup eventfd: %s", c->name, g_strerror(errno));
+        return;
+    }
+#endif
+    {
+        GSource *src = g_timeout_source_new(0);
+
+        /* G_PRIORITY_HIGH, like the eventfd watch */
+        g_source_set_priority(src, G_PRIORITY_HIGH);
+        g_source_set_callback(src, spice_channel_xmit_wakeup_idle,
+                              g_object_ref(channel), spice_channel_unref_main);
+        g_source_attach(src, c->context);
+        g_source_unref(src);
+    }
+}
+
+/* coroutine context, or system context when the coroutine is not running */
+static SpiceMsgOut *spice_channel_xmit_queue_pop(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    SpiceMsgOut *out;
+
+    if (c->xmit_queue == NULL) {
+        SpiceMsgOut *stack;
+
+        /* take the whole stack, the consumer is the only one removing
+         * elements so this does not suffer from ABA */
+        do {
+            stack = g_atomic_pointer_get(&c->xmit_queue_head);
+        } while (stack != NULL &&
+                 !g_atomic_pointer_compare_and_exchange(&c->xmit_queue_head, stack, NULL));
+
+        /* reverse it to get the messages in order */
+        while (stack != NULL) {
+            out = stack;
+            stack = out->next;
+            out->next = c->xmit_queue;
+            c->xmit_queue = out;
+        }
+    }
+
+    out = c->xmit_queue;
+    if (out != NULL) {
+        /* the queue only shrinks here, so its peak is seen here too */
+        gsize size = (gsize)g_atomic_pointer_get(&c->xmit_queue_size);
+        if (size > c->xmit_queue_high_water)
+            c->xmit_queue_high_water = size;
+
+        c->xmit_queue = out->next;
+        out->next = NULL;
+        g_atomic_pointer_add(&c->xmit_queue_size,
+                             -(gssize)spice_marshaller_get_total_size(out->marshaller));
+    }
+
+    return out;
 }
 
 /* any context (system/co-routine/usb-event-thread) */
@@ -724,7 +1448,7 @@ G_GNUC_INTERNAL
 void spice_msg_out_send(SpiceMsgOut *out)
 {
     SpiceChannelPrivate *c;
-    gboolean was_empty;
+    SpiceMsgOut *head;
     guint32 size;
 
     g_return_if_fail(out != NULL);
@@ -732,28 +1456,27 @@ void spice_msg_out_send(SpiceMsgOut *out)
     c = out->channel->priv;
     size = spice_marshaller_get_total_size(out->marshaller);
 
-    g_mutex_lock(&c->xmit_queue_lock);
-    if (c->xmit_queue_blocked) {
+    /* waits while the queue is drained or moved */
+    g_rw_lock_reader_lock(&c->xmit_queue_lock);
+
+    if (g_atomic_int_get(&c->xmit_queue_blocked)) {
+        g_rw_lock_reader_unlock(&c->xmit_queue_lock);
         g_warning("message queue is blocked, dropping message");
-        goto end;
+        spice_msg_out_unref(out);
+        return;
     }
 
-    was_empty = g_queue_is_empty(&c->xmit_queue);
-    g_queue_push_tail(&c->xmit_queue, out);
-    c->xmit_queue_size = (was_empty) ? size : c->xmit_queue_size + size;
+    g_atomic_pointer_add(&c->xmit_queue_size, size);
+    do {
+        head = g_atomic_pointer_get(&c->xmit_queue_head);
+        out->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange(&c->xmit_queue_head, head, out));
+    g_rw_lock_reader_unlock(&c->xmit_queue_lock);
 
     /* One wakeup is enough to empty the entire queue -> only do a wakeup
-       if the queue was empty, and there isn't one pending already. */
-    if (was_empty && !c->xmit_queue_wakeup_id) {
-        c->xmit_queue_wakeup_id =
-            /* Use g_timeout_add_full so that can specify the priority */
-            g_timeout_add_full(G_PRIORITY_HIGH, 0,
-                               spice_channel_idle_wakeup,
-                               out->channel, NULL);
-    }
-
-end:
-    g_mutex_unlock(&c->xmit_queue_lock);
+       if the queue was empty */
+    if (head == NULL)
+        spice_channel_xmit_queue_signal(out->channel);
 }
 
 /* coroutine context */
@@ -796,6 +1519,7 @@ static gint spice_channel_flush_wire_nonblocking(SpiceChannel *channel,
     g_assert(cond != NULL);
     *cond = 0;
 
+    c->total_write_calls++;
     if (c->tls) {
         ret = SSL_write(c->ssl, ptr, len);
         if (ret < 0) {
@@ -858,6 +1582,7 @@ static void spice_channel_flush_wire(SpiceChannel *channel,
             return;
         }
         offset += ret;
+        c->total_write_bytes += ret;
     }
 }
 
@@ -898,36 +1623,176 @@ static void spice_channel_write(SpiceChannel *channel, const void *data, size_t
     spice_channel_flush_wire(channel, data, len);
 }
 
+/*
+ * Write all 'vectors' out to the socket with as few send calls as
+ * possible. Only usable when there is no TLS or SASL layer.
+ */
 /* coroutine context */
-static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out)
+static void spice_channel_flush_wire_vectors(SpiceChannel *channel,
+                                             GOutputVector *vectors,
+                                             int n_vectors)
 {
-    uint8_t *data;
-    int free_data;
-    size_t len;
-    uint32_t msg_size;
+    SpiceChannelPrivate *c = channel->priv;
 
-    g_return_if_fail(channel != NULL);
-    g_return_if_fail(out != NULL);
-    g_return_if_fail(channel == out->channel);
+    while (n_vectors > 0) {
+        GError *error = NULL;
+        gssize ret;
 
-    if (out->ro_check &&
-        spice_channel_get_read_only(channel)) {
-        g_warning("Try to send message while read-only. Please report a bug.");
+        if (c->has_error) return;
+
+        c->total_write_calls++;
+        ret = g_socket_send_message(c->sock, NULL, vectors, n_vectors,
+                                    NULL, 0, 0, NULL, &error);
+        if (ret < 0) {
+            if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+                g_clear_error(&error);
+                g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_OUT);
+                continue;
+            }
+            CHANNEL_DEBUG(channel, "Closing the channel: send error %s", error->message);
+            g_clear_error(&error);
+            c->has_error = TRUE;
+            return;
+        }
+        if (ret == 0) {
+            CHANNEL_DEBUG(channel, "Closing the connection: spice_channel_flush_wire_vectors");
+            c->has_error = TRUE;
+            return;
+        }
+        c->total_write_bytes += ret;
+
+        /* skip what has been written */
+        while (n_vectors > 0 && ret >= vectors->size) {
+            ret -= vectors->size;
+            vectors++;
+            n_vectors--;
+        }
+        if (ret > 0) {
+            vectors->buffer = (const guint8 *)vectors->buffer + ret;
+            vectors->size -= ret;
+        }
+    }
+}
+
+/* the vectored path writes directly to the socket, bypassing c->out */
+static gboolean spice_channel_can_write_vectors(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+#ifdef HAVE_SASL
+    if (c->sasl_conn)
+        return FALSE;
+#endif
+    return !c->tls && !G_IS_TCP_WRAPPER_CONNECTION(c->conn);
+}
+
+/*
+ * Write out the data pointed to by 'iov'. On TLS or SASL connections,
+ * the data is gathered into a single buffer so that it is encoded and
+ * written at once.
+ */
+/* coroutine context */
+static void spice_channel_flush_iovec(SpiceChannel *channel,
+                                      const struct iovec *iov, int n_iov)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    int i;
+
+    if (n_iov == 0)
+        return;
+
+    if (spice_channel_can_write_vectors(channel)) {
+        GOutputVector vectors[XMIT_IOV_MAX];
+
+        for (i = 0; i < n_iov; i++) {
+            vectors[i].buffer = iov[i].iov_base;
+            vectors[i].size = iov[i].iov_len;
+        }
+        spice_channel_flush_wire_vectors(channel, vectors, n_iov);
         return;
     }
 
-    spice_marshaller_flush(out->marshaller);
-    msg_size = spice_marshaller_get_total_size(out->marshaller) -
-               spice_header_get_header_size(channel->priv->use_mini_header);
-    spice_header_set_msg_size(out->header, channel->priv->use_mini_header, msg_size);
-    data = spice_marshaller_linearize(out->marshaller, 0, &len, &free_data);
-    /* spice_msg_out_hexdump(out, data, len); */
-    spice_channel_write(channel, data, len);
+    if (n_iov == 1) {
+        spice_channel_write(channel, iov[0].iov_base, iov[0].iov_len);
+        return;
+    }
 
-    if (free_data)
-        g_free(data);
+    g_byte_array_set_size(c->xmit_buffer, 0);
+    for (i = 0; i < n_iov; i++) {
+        g_byte_array_append(c->xmit_buffer, iov[i].iov_base, iov[i].iov_len);
+    }
+    spice_channel_write(channel, c->xmit_buffer->data, c->xmit_buffer->len);
+    if (c->xmit_buffer->len > XMIT_BATCH_BYTES) {
+        /* do not keep a large buffer around after a big message */
+        g_byte_array_set_size(c->xmit_buffer, 0);
+        g_byte_array_unref(c->xmit_buffer);
+        c->xmit_buffer = g_byte_array_new();
+    }
+}
+
+/*
+ * Write several messages at once, gathering the items of their
+ * marshallers without linearizing them. The messages are unref'd.
+ */
+/* coroutine context */
+static void spice_channel_write_msgs(SpiceChannel *channel,
+                                     SpiceMsgOut **msgs, int n_msgs)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    struct iovec iov[XMIT_IOV_MAX];
+    int i, n_iov = 0;
+
+    for (i = 0; i < n_msgs; i++) {
+        SpiceMsgOut *out = msgs[i];
+        size_t total, skip = 0;
+        uint32_t msg_size;
+
+        g_warn_if_fail(channel == out->channel);
 
-    spice_msg_out_unref(out);
+        if (out->ro_check &&
+            spice_channel_get_read_only(channel)) {
+            g_warning("Try to send message while read-only. Please report a bug.");
+            continue;
+        }
+
+        spice_marshaller_flush(out->marshaller);
+        total = spice_marshaller_get_total_size(out->marshaller);
+        msg_size = total - spice_header_get_header_size(c->use_mini_header);
+        spice_header_set_msg_size(out->header, c->use_mini_header, msg_size);
+        c->total_write_messages++;
+        spice_channel_msg_stats_add(channel, TRUE,
+                                    spice_header_get_msg_type(out->header, c->use_mini_header),
+                                    msg_size, -1);
+
+        while (skip < total) {
+            int n = spice_marshaller_fill_iovec(out->marshaller, iov + n_iov,
+                                                XMIT_IOV_MAX - n_iov, skip);
+            if (n == 0)
+                break;
+            for (; n > 0; n--, n_iov++) {
+                skip += iov[n_iov].iov_len;
+            }
+            if (n_iov == XMIT_IOV_MAX) {
+                spice_channel_flush_iovec(channel, iov, n_iov);
+                n_iov = 0;
+            }
+        }
+    }
+    spice_channel_flush_iovec(channel, iov, n_iov);
+
+    for (i = 0; i < n_msgs; i++) {
+        spice_msg_out_unref(msgs[i]);
+    }
+}
+
+/* coroutine context */
+static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out)
+{
+    g_return_if_fail(channel != NULL);
+    g_return_if_fail(out != NULL);
+    g_return_if_fail(channel == out->channel);
+
+    spice_channel_write_msgs(channel, &out, 1);
 }
 
 #ifdef G_OS_UNIX
@@ -1017,6 +1882,7 @@ static int spice_channel_read_wire_nonblocking(SpiceChannel *channel,
     g_assert(cond != NULL);
     *cond = 0;
 
+    c->total_read_calls++;
     if (c->tls) {
         ret = SSL_read(c->ssl, data, len);
         if (ret < 0) {
@@ -1131,10 +1997,60 @@ static int spice_channel_read_sasl(SpiceChannel *channel, void *data, size_t len
 }
 #endif
 
+/*
+ * Read at least 1 more byte of data from the connection, going through
+ * the SASL layer if needed
+ */
+/* coroutine context */
+static int spice_channel_read_some(SpiceChannel *channel, void *data, size_t len)
+{
+#ifdef HAVE_SASL
+    if (channel->priv->sasl_conn)
+        return spice_channel_read_sasl(channel, data, len);
+#endif
+    return spice_channel_read_wire(channel, data, len);
+}
+
+static inline gsize spice_channel_rbuf_pending(SpiceChannelPrivate *c)
+{
+    return c->rbuf_end - c->rbuf_start;
+}
+
+/*
+ * Enable the receive buffer. This is only done once link and
+ * authentication are complete, so that the handshake never reads ahead
+ * into data that has to go through another layer (SASL).
+ */
+/* coroutine context */
+static void spice_channel_rbuf_enable(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (c->rbuf != NULL)
+        return;
+
+#ifdef G_OS_UNIX
+    /* file descriptors are passed along with a data byte on display
+     * channels, reading ahead would drop them, see
+     * spice_channel_unix_read_fd() */
+    if (c->channel_type == SPICE_CHANNEL_DISPLAY &&
+        g_socket_get_family(c->sock) == G_SOCKET_FAMILY_UNIX)
+        return;
+#endif
+
+    c->rbuf = g_malloc(SPICE_CHANNEL_RBUF_SIZE);
+    c->rbuf_start = c->rbuf_end = 0;
+}
+
 /*
  * Fill the 'data' buffer up with exactly 'len' bytes worth of data
  * Returns 0 if connection was closed or on unknown errors, <0 for error and
  * length on success
+ *
+ * When the receive buffer is enabled, small reads are served from it and
+ * it is refilled with reads of up to SPICE_CHANNEL_RBUF_SIZE bytes, so
+ * that a burst of small messages costs a single read call. Reads larger
+ * than the buffer go straight to 'data' once it is drained.
  */
 /* coroutine context */
 static int spice_channel_read(SpiceChannel *channel, void *data, size_t length)
@@ -1146,12 +2062,29 @@ static int spice_channel_read(SpiceChannel *channel, void *data, size_t length)
     while (len > 0) {
         if (c->has_error) return 0; /* has_error is set by disconnect(), return no error */
 
-#ifdef HAVE_SASL
-        if (c->sasl_conn)
-            ret = spice_channel_read_sasl(channel, data, len);
-        else
-#endif
-            ret = spice_channel_read_wire(channel, data, len);
+        if (c->rbuf != NULL) {
+            gsize pending = spice_channel_rbuf_pending(c);
+
+            if (pending > 0) {
+                pending = MIN(pending, len);
+                memcpy(data, c->rbuf + c->rbuf_start, pending);
+                c->rbuf_start += pending;
+                len -= pending;
+                data = ((char*)data) + pending;
+                continue;
+            }
+
+            c->rbuf_start = c->rbuf_end = 0;
+            if (len < SPICE_CHANNEL_RBUF_SIZE) {
+                ret = spice_channel_read_some(channel, c->rbuf, SPICE_CHANNEL_RBUF_SIZE);
+                if (ret < 0)
+                    return ret;
+                c->rbuf_end = ret;
+                continue;
+            }
+        }
+
+        ret = spice_channel_read_some(channel, data, len);
         if (ret < 0)
             return ret;
         g_assert(ret <= len);
@@ -1283,47 +2216,165 @@ cleanup:
 static SpiceChannelEvent spice_channel_send_spice_ticket_sm2(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c = channel->priv;
-    EVP_PKEY *pubkey;
-    int en_password_len;
-    BIO *bioKey, *bioKey_pem;
-    char *password, *en_password;
-    uint8_t *encrypted;
-    char *sm2_pubkey;
-    int rc;
-    SpiceChannelEvent ret = SPICE_CHANNEL_ERROR_LINK;
-    spice_warning("Send Ticket With SM2.");
-    bioKey = BIO_new(BIO_s_mem());
-    g_return_val_if_fail(bioKey != NULL, ret);
-    // wirte pub_key into biokey
-    BIO_write(bioKey, c->peer_msg->pub_key, SPICE_TICKET_PUBKEY_BYTES);
-    // Use BIO to get DER pubKey
-    pubkey = d2i_PUBKEY_bio(bioKey, NULL);
-    encrypted = g_alloca(128);
+    EVP_PKEY *pubkey;
+    int en_password_len;
+    BIO *bioKey, *bioKey_pem;
+    char *password, *en_password;
+    uint8_t *encrypted;
+    char *sm2_pubkey;
+    int rc;
+    SpiceChannelEvent ret = SPICE_CHANNEL_ERROR_LINK;
+    spice_warning("Send Ticket With SM2.");
+    bioKey = BIO_new(BIO_s_mem());
+    g_return_val_if_fail(bioKey != NULL, ret);
+    // wirte pub_key into biokey
+    BIO_write(bioKey, c->peer_msg->pub_key, SPICE_TICKET_PUBKEY_BYTES);
+    // Use BIO to get DER pubKey
+    pubkey = d2i_PUBKEY_bio(bioKey, NULL);
+    encrypted = g_alloca(128);
+
+    // SM2 handle password
+    bioKey_pem = BIO_new(BIO_s_mem());
+    PEM_write_bio_PUBKEY(bioKey_pem, pubkey);
+    bio_to_string(bioKey_pem, &sm2_pubkey);
+    g_object_get(c->session, "password", &password, NULL);
+    if (password == NULL) password = g_strdup("");
+    if (strlen(password) > SPICE_MAX_PASSWORD_LENGTH) {
+        spice_channel_failed_spice_authentication(channel, TRUE);
+        ret = SPICE_CHANNEL_ERROR_AUTH;
+        goto cleanup;
+    }
+    rc = Encrypt(password, strlen(password) + 1, &en_password, &en_password_len, sm2_pubkey);
+    g_warn_if_fail(rc > 0);
+    encrypted = (uint8_t *)en_password;
+    // printf("Debug: encrypted: %s \n", encrypted);
+    spice_channel_write(channel, encrypted, 128);
+    ret = SPICE_CHANNEL_NONE;
+    return ret;
+cleanup:
+    memset(encrypted, 0, 128);
+    EVP_PKEY_free(pubkey);
+    BIO_free(bioKey);
+    g_free(password);
+    return ret;
+}
+
+static gboolean spice_channel_capture_write_caps(FILE *file, GArray *caps)
+{
+    guint i;
+
+    for (i = 0; i < caps->len; i++) {
+        guint32 cap = GUINT32_TO_LE(g_array_index(caps, guint32, i));
+        if (fwrite(&cap, sizeof(cap), 1, file) != 1)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* whether SPICE_CAPTURE_CHANNELS, a comma separated list of channel
+ * types such as "display,cursor", names the type of @channel */
+static gboolean spice_channel_capture_enabled(SpiceChannel *channel)
+{
+    const gchar *desc = spice_channel_type_to_string(channel->priv->channel_type);
+    const gchar *env = g_getenv("SPICE_CAPTURE_CHANNELS");
+    gchar **types, **type;
+    gboolean enabled = FALSE;
+
+    if (env == NULL) {
+        static gsize warned = 0;
+
+        if (g_once_init_enter(&warned)) {
+            g_warning("SPICE_CAPTURE_DIR is set, but SPICE_CAPTURE_CHANNELS "
+                      "names no channel to capture");
+            g_once_init_leave(&warned, 1);
+        }
+        return FALSE;
+    }
+
+    types = g_strsplit(env, ",", -1);
+    for (type = types; *type != NULL && !enabled; type++)
+        enabled = g_strcmp0(g_strstrip(*type), desc) == 0;
+    g_strfreev(types);
+
+    return enabled;
+}
+
+/*
+ * When SPICE_CAPTURE_DIR is set, the inbound messages of the channels
+ * listed in SPICE_CAPTURE_CHANNELS are recorded there once the link is
+ * established, in the format described in spice-capture.h, so that they
+ * can be replayed offline with spicy-replay. The captures hold the
+ * decrypted session, they are only readable by the user and never
+ * overwrite an existing file.
+ */
+/* coroutine context */
+static void spice_channel_capture_open(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    const gchar *dir = g_getenv("SPICE_CAPTURE_DIR");
+    SpiceCaptureHeader hdr = { { 0, }, };
+    gchar *path;
+    int fd;
+
+    if (dir == NULL || c->capture != NULL || !spice_channel_capture_enabled(channel))
+        return;
+
+    path = g_strdup_printf("%s" G_DIR_SEPARATOR_S "%s-%d-%" G_GINT64_FORMAT ".spicecap",
+                           dir, spice_channel_type_to_string(c->channel_type),
+                           c->channel_id, g_get_real_time() / 1000);
+#ifdef O_BINARY
+    fd = g_open(path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0600);
+#else
+    fd = g_open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+#endif
+    if (fd >= 0) {
+        c->capture = fdopen(fd, "wb");
+        if (c->capture == NULL)
+            g_close(fd, NULL);
+    }
+    if (c->capture == NULL) {
+        g_warning("failed to create capture file %s: %s", path, g_strerror(errno));
+        g_free(path);
+        return;
+    }
+
+    memcpy(hdr.magic, SPICE_CAPTURE_MAGIC, sizeof(hdr.magic));
+    hdr.version = GUINT32_TO_LE(SPICE_CAPTURE_VERSION);
+    hdr.channel_type = GUINT32_TO_LE(c->channel_type);
+    hdr.channel_id = GUINT32_TO_LE(c->channel_id);
+    hdr.flags = GUINT32_TO_LE(c->use_mini_header ? SPICE_CAPTURE_FLAG_MINI_HEADER : 0);
+    hdr.num_common_caps = GUINT32_TO_LE(c->remote_common_caps->len);
+    hdr.num_channel_caps = GUINT32_TO_LE(c->remote_caps->len);
+
+    if (fwrite(&hdr, sizeof(hdr), 1, c->capture) != 1 ||
+        !spice_channel_capture_write_caps(c->capture, c->remote_common_caps) ||
+        !spice_channel_capture_write_caps(c->capture, c->remote_caps)) {
+        g_warning("failed to write capture file %s: %s", path, g_strerror(errno));
+        g_clear_pointer(&c->capture, fclose);
+    } else {
+        CHANNEL_DEBUG(channel, "capturing to %s", path);
+    }
+    c->capture_start = g_get_monotonic_time();
+    g_free(path);
+}
+
+/* coroutine context */
+static void spice_channel_capture_msg(SpiceChannel *channel, SpiceMsgIn *in,
+                                      int header_size, int msg_size)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    SpiceCaptureRecord rec = {
+        .time = GUINT64_TO_LE(g_get_monotonic_time() - c->capture_start),
+        .size = GUINT32_TO_LE(header_size + msg_size),
+    };
 
-    // SM2 handle password
-    bioKey_pem = BIO_new(BIO_s_mem());
-    PEM_write_bio_PUBKEY(bioKey_pem, pubkey);
-    bio_to_string(bioKey_pem, &sm2_pubkey);
-    g_object_get(c->session, "password", &password, NULL);
-    if (password == NULL) password = g_strdup("");
-    if (strlen(password) > SPICE_MAX_PASSWORD_LENGTH) {
-        spice_channel_failed_spice_authentication(channel, TRUE);
-        ret = SPICE_CHANNEL_ERROR_AUTH;
-        goto cleanup;
+    if (fwrite(&rec, sizeof(rec), 1, c->capture) != 1 ||
+        fwrite(in->header, header_size, 1, c->capture) != 1 ||
+        (msg_size > 0 && fwrite(in->data, msg_size, 1, c->capture) != 1)) {
+        g_warning("%s: failed to write capture, stopping: %s", c->name, g_strerror(errno));
+        g_clear_pointer(&c->capture, fclose);
     }
-    rc = Encrypt(password, strlen(password) + 1, &en_password, &en_password_len, sm2_pubkey);
-    g_warn_if_fail(rc > 0);
-    encrypted = (uint8_t *)en_password;
-    // printf("Debug: encrypted: %s \n", encrypted);
-    spice_channel_write(channel, encrypted, 128);
-    ret = SPICE_CHANNEL_NONE;
-    return ret;
-cleanup:
-    memset(encrypted, 0, 128);
-    EVP_PKEY_free(pubkey);
-    BIO_free(bioKey);
-    g_free(password);
-    return ret;
 }
 
 /* coroutine context */
@@ -1347,6 +2398,9 @@ static gboolean spice_channel_recv_auth(SpiceChannel *channel)
         return FALSE;
     }
 
+    spice_channel_rbuf_enable(channel);
+    spice_channel_capture_open(channel);
+    c->connect_time = g_get_monotonic_time() - c->connect_start_time;
     c->state = SPICE_CHANNEL_STATE_READY;
 
     g_coroutine_signal_emit(channel, signals[SPICE_CHANNEL_EVENT], 0, SPICE_CHANNEL_OPENED);
@@ -2090,6 +3144,27 @@ error:
     return FALSE;
 }
 
+typedef struct {
+    SpiceChannel *channel;
+    gboolean cancel;
+} WakeupData;
+
+static gboolean spice_channel_wakeup_in_context(gpointer user_data)
+{
+    WakeupData *data = user_data;
+
+    spice_channel_wakeup(data->channel, data->cancel);
+    return G_SOURCE_REMOVE;
+}
+
+static void wakeup_data_free(gpointer user_data)
+{
+    WakeupData *data = user_data;
+
+    spice_channel_unref_main(data->channel);
+    g_free(data);
+}
+
 /* system context */
 G_GNUC_INTERNAL
 void spice_channel_wakeup(SpiceChannel *channel, gboolean cancel)
@@ -2099,6 +3174,25 @@ void spice_channel_wakeup(SpiceChannel *channel, gboolean cancel)
     g_return_if_fail(SPICE_IS_CHANNEL(channel));
     c = &channel->priv->coroutine;
 
+    /* the coroutine can only be resumed from the thread running it,
+     * the caller may be a decode worker (see decode-pipeline.c) */
+    if (!g_main_context_is_owner(channel->priv->context ?
+                                 channel->priv->context : g_main_context_default())) {
+        WakeupData *data = g_new(WakeupData, 1);
+        GSource *src = g_idle_source_new();
+
+        data->channel = g_object_ref(channel);
+        data->cancel = cancel;
+        /* not g_main_context_invoke(), which would run it right away
+         * on this thread if the context is not acquired */
+        g_source_set_priority(src, G_PRIORITY_HIGH);
+        g_source_set_callback(src, spice_channel_wakeup_in_context,
+                              data, wakeup_data_free);
+        g_source_attach(src, channel->priv->context);
+        g_source_unref(src);
+        return;
+    }
+
     if (cancel)
         g_coroutine_condition_cancel(c);
 
@@ -2111,6 +3205,37 @@ gboolean spice_channel_get_read_only(SpiceChannel *channel)
     return spice_session_get_read_only(channel->priv->session);
 }
 
+/*
+ * coroutine context
+ *
+ * Called by a message handler that applies @in later, so that the
+ * channels waiting for its serial keep waiting until it is released
+ * with spice_channel_msg_release().
+ */
+G_GNUC_INTERNAL
+void spice_channel_msg_hold(SpiceChannel *channel)
+{
+    channel->priv->held_messages++;
+}
+
+/* coroutine context, once the held @in is applied or dropped */
+G_GNUC_INTERNAL
+void spice_channel_msg_release(SpiceChannel *channel, SpiceMsgIn *in)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    g_return_if_fail(c->held_messages > 0);
+
+    /* the messages are released in order, the last one releases the
+     * serials of the messages read meanwhile */
+    if (--c->held_messages == 0)
+        c->last_message_serial = c->held_message_serial;
+    else
+        c->last_message_serial = spice_header_get_in_msg_serial(in);
+
+    g_coroutine_condition_wakeup_all();
+}
+
 /* coroutine context */
 G_GNUC_INTERNAL
 void spice_channel_recv_msg(SpiceChannel *channel,
@@ -2131,14 +3256,17 @@ void spice_channel_recv_msg(SpiceChannel *channel,
         goto end;
 
     msg_size = spice_header_get_msg_size(in->header, c->use_mini_header);
-    /* FIXME: do not allow others to take ref on in, and use realloc here?
-     * this would avoid malloc/free on each message?
-     */
-    in->data = g_malloc0(msg_size);
+    /* no need to zero the payload, it is read over right away */
+    in->data = msg_in_pool_alloc_data(c->msg_pool, msg_size, &in->data_class);
     spice_channel_read(channel, in->data, msg_size);
     if (c->has_error)
         goto end;
     in->dpos = msg_size;
+    c->total_read_messages++;
+
+    if (c->capture != NULL)
+        spice_channel_capture_msg(channel, in,
+                                  spice_header_get_header_size(c->use_mini_header), msg_size);
 
     msg_type = spice_header_get_msg_type(in->header, c->use_mini_header);
     sub_list_offset = spice_header_get_msg_sub_list(in->header, c->use_mini_header);
@@ -2163,7 +3291,7 @@ void spice_channel_recv_msg(SpiceChannel *channel,
                            c->name, spice_header_get_msg_type(sub_in->header, c->use_mini_header));
                 goto end;
             }
-            msg_handler(channel, sub_in, data);
+            spice_channel_handle_msg_timed(channel, msg_handler, sub_in, data);
             spice_msg_in_unref(sub_in);
         }
     }
@@ -2173,6 +3301,10 @@ void spice_channel_recv_msg(SpiceChannel *channel,
         c->message_ack_count--;
         if (!c->message_ack_count) {
             SpiceMsgOut *out = spice_msg_out_new(channel, SPICE_MSGC_ACK);
+            /* nothing more pending, the server is probably waiting for the ack */
+            if (spice_channel_rbuf_pending(c) == 0 &&
+                !g_pollable_input_stream_is_readable(G_POLLABLE_INPUT_STREAM(c->in)))
+                c->ack_stalls++;
             spice_msg_out_send_internal(out);
             c->message_ack_count = c->message_ack_window;
         }
@@ -2193,14 +3325,21 @@ void spice_channel_recv_msg(SpiceChannel *channel,
 
     /* process message */
     /* spice_msg_in_hexdump(in); */
-    msg_handler(channel, in, data);
+    spice_channel_handle_msg_timed(channel, msg_handler, in, data);
 
 end:
     /* If the server uses full header, the serial is not necessarily equal
      * to c->in_serial (the server can sometimes skip serials) */
-    c->last_message_serial = spice_header_get_in_msg_serial(in);
+    if (c->held_messages == 0)
+        c->last_message_serial = spice_header_get_in_msg_serial(in);
+    else
+        c->held_message_serial = spice_header_get_in_msg_serial(in);
     c->in_serial++;
     spice_msg_in_unref(in);
+
+    /* a channel on another thread may wait for this serial, see
+     * spice_channel_handle_wait_for_channels() */
+    g_coroutine_condition_wakeup_all();
 }
 
 static const char *to_string[] = {
@@ -2403,18 +3542,26 @@ static void spice_channel_flushed(SpiceChannel *channel, gboolean success)
 static void spice_channel_iterate_write(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c = channel->priv;
-    SpiceMsgOut *out;
+    SpiceMsgOut *batch[XMIT_BATCH_MSGS];
+    int n;
 
+    /* send queued messages in batches, a batch is written with as few
+     * calls as possible */
     do {
-        g_mutex_lock(&c->xmit_queue_lock);
-        out = g_queue_pop_head(&c->xmit_queue);
-        g_mutex_unlock(&c->xmit_queue_lock);
-        if (out) {
-            guint32 size = spice_marshaller_get_total_size(out->marshaller);
-            c->xmit_queue_size = (c->xmit_queue_size < size) ? 0 : c->xmit_queue_size - size;
-            spice_channel_write_msg(channel, out);
+        guint64 batch_size = 0;
+
+        for (n = 0; n < XMIT_BATCH_MSGS && batch_size < XMIT_BATCH_BYTES; n++) {
+            SpiceMsgOut *out = spice_channel_xmit_queue_pop(channel);
+
+            if (out == NULL)
+                break;
+            batch_size += spice_marshaller_get_total_size(out->marshaller);
+            batch[n] = out;
         }
-    } while (out);
+
+        if (n > 0)
+            spice_channel_write_msgs(channel, batch, n);
+    } while (n > 0);
 
     spice_channel_flushed(channel, TRUE);
 }
@@ -2424,12 +3571,16 @@ static void spice_channel_iterate_read(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c = channel->priv;
 
-    g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_IN);
+    /* messages may be left in the receive buffer after a migration freeze */
+    if (spice_channel_rbuf_pending(c) == 0)
+        g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_IN);
 
     /* treat all incoming data (block on message completion) */
     while (!c->has_error &&
            c->state != SPICE_CHANNEL_STATE_MIGRATING &&
            (g_pollable_input_stream_is_readable(G_POLLABLE_INPUT_STREAM(c->in))
+           /* parse all complete messages already buffered */
+           || spice_channel_rbuf_pending(c) > 0
 #ifdef HAVE_SASL
             /* flush the sasl buffer too */
            || c->sasl_decoded != NULL
@@ -2496,6 +3647,207 @@ static gboolean spice_channel_iterate(SpiceChannel *channel)
     return TRUE;
 }
 
+/* ---------------------------------------------------------------- */
+/* channel thread                                                   */
+
+/*
+ * With SpiceSession:display-threads, each display channel runs its
+ * coroutine on a dedicated thread, dispatching its own GMainContext.
+ * The coroutine helpers (see gio-coroutine.c) emit signals on the main
+ * context, waiting for the handlers to return, so that the surfaces
+ * are still handed over to the application synchronously.
+ *
+ * The coroutine can only be resumed from that thread, so
+ * spice_channel_wakeup() and the sources used by the channel are
+ * routed to c->context.
+ */
+
+static guint spice_channel_idle_add(SpiceChannel *channel,
+                                    GSourceFunc function, gpointer data)
+{
+    GSource *src = g_idle_source_new();
+    guint id;
+
+    g_source_set_callback(src, function, data, NULL);
+    id = g_source_attach(src, channel->priv->context);
+    g_source_unref(src);
+
+    return id;
+}
+
+static gpointer spice_channel_thread(gpointer data)
+{
+    GMainLoop *loop = data;
+    GMainContext *context = g_main_loop_get_context(loop);
+
+    g_main_context_push_thread_default(context);
+    g_main_loop_run(loop);
+    g_main_context_pop_thread_default(context);
+    g_main_loop_unref(loop);
+
+    return NULL;
+}
+
+static gboolean spice_channel_use_thread(SpiceChannel *channel)
+{
+#if WITH_GTHREAD
+    /* the gthread coroutines rely on a single system coroutine */
+    return FALSE;
+#else
+    SpiceChannelPrivate *c = channel->priv;
+
+    return c->channel_type == SPICE_CHANNEL_DISPLAY &&
+        spice_session_get_display_threads(c->session);
+#endif
+}
+
+/* main context */
+static void spice_channel_thread_start(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (c->thread != NULL || !spice_channel_use_thread(channel))
+        return;
+
+    CHANNEL_DEBUG(channel, "starting channel thread");
+    c->context = g_main_context_new();
+    c->loop = g_main_loop_new(c->context, FALSE);
+    c->thread = g_thread_new(c->name, spice_channel_thread, g_main_loop_ref(c->loop));
+#ifdef HAVE_SYS_EVENTFD_H
+    spice_channel_xmit_wakeup_attach(channel);
+#endif
+}
+
+static gboolean spice_channel_thread_quit(gpointer data)
+{
+    g_main_loop_quit(data);
+    return G_SOURCE_REMOVE;
+}
+
+/* any context, once the coroutine exited */
+static void spice_channel_thread_stop(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (c->thread == NULL)
+        return;
+
+    CHANNEL_DEBUG(channel, "stopping channel thread");
+    /* g_main_loop_quit() is a no-op if the loop is not running yet */
+    spice_channel_idle_add(channel, spice_channel_thread_quit, c->loop);
+    if (g_thread_self() == c->thread)
+        g_thread_unref(c->thread);
+    else
+        g_thread_join(c->thread);
+    c->thread = NULL;
+    g_clear_pointer(&c->loop, g_main_loop_unref);
+    g_clear_pointer(&c->context, g_main_context_unref);
+}
+
+typedef struct {
+    GSourceFunc func;
+    gpointer data;
+    gint done; /* atomic */
+    GMutex lock;
+    GCond cond;
+} SpiceChannelInvoke;
+
+/* channel thread */
+static gboolean spice_channel_invoke_cb(gpointer user_data)
+{
+    SpiceChannelInvoke *invoke = user_data;
+
+    invoke->func(invoke->data);
+
+    g_mutex_lock(&invoke->lock);
+    g_atomic_int_set(&invoke->done, TRUE);
+    g_cond_signal(&invoke->cond);
+    g_mutex_unlock(&invoke->lock);
+    /* in case the caller dispatches the main context meanwhile */
+    g_main_context_wakeup(NULL);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Runs @func on the context of the channel and returns once it ran, so
+ * that the channel state is not touched from two threads when the
+ * channel has its own thread. The main context is dispatched while
+ * waiting, since @func may emit signals there (see
+ * g_coroutine_signal_emit()).
+ */
+static void spice_channel_invoke_sync(SpiceChannel *channel,
+                                      GSourceFunc func, gpointer data)
+{
+    GMainContext *context = channel->priv->context;
+    SpiceChannelInvoke invoke = { func, data, FALSE };
+
+    if (context == NULL || g_main_context_is_owner(context)) {
+        func(data);
+        return;
+    }
+
+    g_mutex_init(&invoke.lock);
+    g_cond_init(&invoke.cond);
+    spice_channel_idle_add(channel, spice_channel_invoke_cb, &invoke);
+
+    if (g_main_context_acquire(NULL)) {
+        while (!g_atomic_int_get(&invoke.done))
+            g_main_context_iteration(NULL, TRUE);
+        g_main_context_release(NULL);
+    }
+    g_mutex_lock(&invoke.lock);
+    while (!g_atomic_int_get(&invoke.done))
+        g_cond_wait(&invoke.cond, &invoke.lock);
+    g_mutex_unlock(&invoke.lock);
+
+    g_cond_clear(&invoke.cond);
+    g_mutex_clear(&invoke.lock);
+}
+
+/*
+ * Returns: (transfer none): the context running the channel coroutine,
+ * %NULL for the main context.
+ */
+G_GNUC_INTERNAL
+GMainContext *spice_channel_get_context(SpiceChannel *channel)
+{
+    g_return_val_if_fail(SPICE_IS_CHANNEL(channel), NULL);
+
+    return channel->priv->context;
+}
+
+/* like g_timeout_add(), on the context running the channel */
+G_GNUC_INTERNAL
+guint spice_channel_timeout_add(SpiceChannel *channel, guint interval,
+                                GSourceFunc function, gpointer data)
+{
+    GSource *src;
+    guint id;
+
+    g_return_val_if_fail(SPICE_IS_CHANNEL(channel), 0);
+
+    src = g_timeout_source_new(interval);
+    g_source_set_callback(src, function, data, NULL);
+    id = g_source_attach(src, channel->priv->context);
+    g_source_unref(src);
+
+    return id;
+}
+
+/* like g_source_remove(), for sources of the context running the channel */
+G_GNUC_INTERNAL
+void spice_channel_source_remove(SpiceChannel *channel, guint id)
+{
+    GSource *src;
+
+    g_return_if_fail(SPICE_IS_CHANNEL(channel));
+
+    src = g_main_context_find_source_by_id(channel->priv->context, id);
+    g_return_if_fail(src != NULL);
+    g_source_destroy(src);
+}
+
 /* we use an idle function to allow the coroutine to exit before we actually
  * unref the object since the coroutine's state is part of the object */
 static gboolean spice_channel_delayed_unref(gpointer data)
@@ -2508,6 +3860,12 @@ static gboolean spice_channel_delayed_unref(gpointer data)
 
     g_return_val_if_fail(c->coroutine.coroutine.exited == TRUE, FALSE);
 
+    if (c->coroutine.coroutine.stack_used != 0)
+        CHANNEL_DEBUG(channel, "coroutine stack used %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT
+                      " bytes, high-water %" G_GSIZE_FORMAT,
+                      c->coroutine.coroutine.stack_used, c->coroutine.coroutine.stack_size,
+                      coroutine_stack_high_water());
+
     c->state = SPICE_CHANNEL_STATE_UNCONNECTED;
 
     if (c->event != SPICE_CHANNEL_NONE) {
@@ -2524,6 +3882,14 @@ static gboolean spice_channel_delayed_unref(gpointer data)
     return FALSE;
 }
 
+/* channel thread context, once the coroutine exited */
+static gboolean spice_channel_delayed_unref_thread(gpointer data)
+{
+    g_idle_add(spice_channel_delayed_unref, data);
+
+    return FALSE;
+}
+
 X509 *get_x509_from_PEM_file(const char* file_path) {
     X509 *cert = NULL;
     BIO *cert_bio = BIO_new(BIO_s_file());
@@ -2544,7 +3910,7 @@ int check_x509_use_rsa(X509 *cert) {
     return 0;
 }
 
-static int spice_channel_load_ca(SpiceChannel *channel)
+static int spice_channel_load_ca(SpiceChannel *channel, SSL_CTX *ctx)
 {
     SpiceChannelPrivate *c = channel->priv;
     int i, count = 0;
@@ -2553,7 +3919,7 @@ static int spice_channel_load_ca(SpiceChannel *channel)
     const gchar *ca_file;
     int rc;
 
-    g_return_val_if_fail(c->ctx != NULL, 0);
+    g_return_val_if_fail(ctx != NULL, 0);
 
     ca_file = spice_session_get_ca_file(c->session);
     spice_session_get_ca(c->session, &ca, &size);
@@ -2565,7 +3931,7 @@ static int spice_channel_load_ca(SpiceChannel *channel)
         X509_STORE *store;
         BIO *in;
 
-        store = SSL_CTX_get_cert_store(c->ctx);
+        store = SSL_CTX_get_cert_store(ctx);
         in = BIO_new_mem_buf(ca, size);
         inf = PEM_X509_INFO_read_bio(in, NULL, NULL, NULL);
         BIO_free(in);
@@ -2590,7 +3956,7 @@ static int spice_channel_load_ca(SpiceChannel *channel)
         if (tmp_cert) {
             if (check_x509_use_rsa(tmp_cert)) ca_use_SM2 = FALSE;
         }
-        rc = SSL_CTX_load_verify_locations(c->ctx, ca_file, NULL);
+        rc = SSL_CTX_load_verify_locations(ctx, ca_file, NULL);
         if (rc != 1)
             g_warning("loading ca certs from %s failed", ca_file);
         else
@@ -2602,7 +3968,7 @@ static int spice_channel_load_ca(SpiceChannel *channel)
         if (tmp_cert) {
             if (check_x509_use_rsa(tmp_cert)) ca_use_SM2 = FALSE;
         }
-        rc = SSL_CTX_set_default_verify_paths(c->ctx);
+        rc = SSL_CTX_set_default_verify_paths(ctx);
         if (rc != 1)
             g_warning("loading ca certs from default location failed");
         else
@@ -2612,6 +3978,64 @@ static int spice_channel_load_ca(SpiceChannel *channel)
     return count;
 }
 
+/* called by OpenSSL when a new TLS session (ticket) is received */
+static int spice_channel_ssl_new_session(SSL *ssl, SSL_SESSION *ssl_session)
+{
+    SpiceSession *session = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+    if (session == NULL)
+        return 0;
+
+    /* the session takes our reference */
+    spice_session_set_ssl_session(session, ssl_session);
+    return 1;
+}
+
+/*
+ * Create the TLS context shared by all the channels of the session: the
+ * CA certificates are loaded once, and new TLS sessions are stored in
+ * the session so that other channels can resume them.
+ */
+/* coroutine context */
+static SSL_CTX *spice_channel_new_ssl_ctx(SpiceChannel *channel, guint verify,
+                                          int *ca_count)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    const gchar *ciphers;
+    SSL_CTX *ctx;
+    int rc;
+
+    ctx = SSL_CTX_new(TLS_method());
+    if (ctx == NULL) {
+        g_critical("SSL_CTX_new failed");
+        return NULL;
+    }
+
+    /* When some other SSL/TLS version becomes obsolete, add it to this
+     * variable. */
+    // SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1);
+    SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+    *ca_count = 0;
+    if (verify &
+        (SPICE_SESSION_VERIFY_SUBJECT | SPICE_SESSION_VERIFY_HOSTNAME)) {
+        *ca_count = spice_channel_load_ca(channel, ctx);
+        if (ca_use_SM2 == TRUE) SSL_CTX_set_ciphersuites(ctx, "TLS_SM4_GCM_SM3");
+    }
+
+    ciphers = spice_session_get_ciphers(c->session);
+    if (ciphers != NULL) {
+        rc = SSL_CTX_set_cipher_list(ctx, ciphers);
+        if (rc != 1)
+            g_warning("loading cipher list %s failed", ciphers);
+    }
+
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                        SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, spice_channel_ssl_new_session);
+
+    return ctx;
+}
+
 /**
  * spice_channel_get_error:
  * @channel: a #SpiceChannel
@@ -2639,11 +4063,12 @@ static void *spice_channel_coroutine(void *data)
     SpiceChannelPrivate *c = channel->priv;
     guint verify;
     int rc, delay_val = 1;
-    /* When some other SSL/TLS version becomes obsolete, add it to this
-     * variable. */
-    long ssl_options = SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1;
 
     CHANNEL_DEBUG(channel, "Started background coroutine %p", &c->coroutine);
+    c->connect_start_time = g_get_monotonic_time();
+    c->connect_time = 0;
+    c->tls_handshake_time = 0;
+    c->tls_session_reused = FALSE;
 
     if (spice_session_get_client_provided_socket(c->session)) {
         if (c->fd < 0) {
@@ -2681,38 +4106,31 @@ reconnect:
     c->sock = g_object_ref(g_socket_connection_get_socket(c->conn));
 
     if (c->tls) {
-        c->ctx = SSL_CTX_new(TLS_method());
-        if (c->ctx == NULL) {
-            g_critical("SSL_CTX_new failed");
-            c->event = SPICE_CHANNEL_ERROR_TLS;
-            goto cleanup;
-        }
+        gint64 handshake_start = g_get_monotonic_time();
+        SSL_SESSION *ssl_session;
+        int ca_count = 0;
 
-        // SSL_CTX_set_options(c->ctx, ssl_options);
-        SSL_CTX_set_min_proto_version(c->ctx, TLS1_3_VERSION);
         verify = spice_session_get_verify(c->session);
-        if (verify &
-            (SPICE_SESSION_VERIFY_SUBJECT | SPICE_SESSION_VERIFY_HOSTNAME)) {
-            rc = spice_channel_load_ca(channel);
-            if (ca_use_SM2 == TRUE) SSL_CTX_set_ciphersuites(c->ctx, "TLS_SM4_GCM_SM3");
-            if (rc == 0) {
-                g_warning("no cert loaded");
-                if (verify & SPICE_SESSION_VERIFY_PUBKEY) {
-                    g_warning("only pubkey active");
-                    verify = SPICE_SESSION_VERIFY_PUBKEY;
-                } else {
-                    c->event = SPICE_CHANNEL_ERROR_TLS;
-                    goto cleanup;
-                }
+        c->ctx = spice_session_get_ssl_ctx(c->session, &ca_count);
+        if (c->ctx == NULL) {
+            c->ctx = spice_channel_new_ssl_ctx(channel, verify, &ca_count);
+            if (c->ctx == NULL) {
+                c->event = SPICE_CHANNEL_ERROR_TLS;
+                goto cleanup;
             }
+            spice_session_set_ssl_ctx(c->session, c->ctx, ca_count);
         }
 
-        {
-            const gchar *ciphers = spice_session_get_ciphers(c->session);
-            if (ciphers != NULL) {
-                rc = SSL_CTX_set_cipher_list(c->ctx, ciphers);
-                if (rc != 1)
-                    g_warning("loading cipher list %s failed", ciphers);
+        if ((verify &
+             (SPICE_SESSION_VERIFY_SUBJECT | SPICE_SESSION_VERIFY_HOSTNAME)) &&
+            ca_count == 0) {
+            g_warning("no cert loaded");
+            if (verify & SPICE_SESSION_VERIFY_PUBKEY) {
+                g_warning("only pubkey active");
+                verify = SPICE_SESSION_VERIFY_PUBKEY;
+            } else {
+                c->event = SPICE_CHANNEL_ERROR_TLS;
+                goto cleanup;
             }
         }
 
@@ -2723,6 +4141,14 @@ reconnect:
             goto cleanup;
         }
 
+        /* try an abbreviated handshake with a session from another channel */
+        ssl_session = spice_session_get_ssl_session(c->session);
+        if (ssl_session != NULL) {
+            if (SSL_SESSION_is_resumable(ssl_session))
+                SSL_set_session(c->ssl, ssl_session);
+            SSL_SESSION_free(ssl_session);
+        }
+
 
         BIO *bio = bio_new_giostream(G_IO_STREAM(c->conn));
         SSL_set_bio(c->ssl, bio, bio);
@@ -2765,6 +4191,12 @@ ssl_reconnect:
                 goto cleanup;
             }
         }
+
+        c->tls_handshake_time = g_get_monotonic_time() - handshake_start;
+        c->tls_session_reused = SSL_session_reused(c->ssl);
+        CHANNEL_DEBUG(channel, "TLS handshake done in %" G_GUINT64_FORMAT " us%s",
+                      c->tls_handshake_time,
+                      c->tls_session_reused ? " (session resumed)" : "");
     }
 
 connected:
@@ -2808,12 +4240,54 @@ cleanup:
         c->event = SPICE_CHANNEL_ERROR_CONNECT;
     }
 
-    g_idle_add(spice_channel_delayed_unref, channel);
+    if (c->context != NULL)
+        spice_channel_idle_add(channel, spice_channel_delayed_unref_thread, channel);
+    else
+        g_idle_add(spice_channel_delayed_unref, channel);
     /* Co-routine exits now - the SpiceChannel object may no longer exist,
        so don't do anything else now unless you like SEGVs */
     return NULL;
 }
 
+/*
+ * All the channels get the default coroutine stack size: the stacks are
+ * only committed as they grow, and a single size lets the stack pool
+ * recycle them across channel types. SPICE_COROUTINE_STACK_SIZE
+ * overrides the size per channel type, in KiB, e.g.
+ * "usbredir=512,display=8192". The debug log reports the stack
+ * high-water mark when a channel disconnects, to help sizing.
+ */
+static gsize spice_channel_stack_size(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    const char *desc = spice_channel_type_to_string(c->channel_type);
+    const char *env = g_getenv("SPICE_COROUTINE_STACK_SIZE");
+    gsize size = COROUTINE_DEFAULT_STACK_SIZE;
+
+    if (env != NULL) {
+        gchar **entries = g_strsplit(env, ",", -1);
+        gchar **entry;
+
+        for (entry = entries; *entry != NULL; entry++) {
+            gchar **kv = g_strsplit(*entry, "=", 2);
+
+            if (kv[0] != NULL && kv[1] != NULL &&
+                g_strcmp0(g_strstrip(kv[0]), desc) == 0) {
+                guint64 kib = g_ascii_strtoull(kv[1], NULL, 10);
+                if (kib >= 64)
+                    size = kib << 10;
+                else
+                    g_warning("ignoring too small %s coroutine stack size", desc);
+            }
+            g_strfreev(kv);
+        }
+        g_strfreev(entries);
+    }
+
+    return size;
+}
+
+/* channel context */
 static gboolean connect_delayed(gpointer data)
 {
     SpiceChannel *channel = data;
@@ -2825,7 +4299,7 @@ static gboolean connect_delayed(gpointer data)
 
     co = &c->coroutine.coroutine;
 
-    co->stack_size = 16 << 20; /* 16Mb */
+    co->stack_size = spice_channel_stack_size(channel);
     co->entry = spice_channel_coroutine;
 
     coroutine_init(co);
@@ -2861,13 +4335,15 @@ static gboolean channel_connect(SpiceChannel *channel, gboolean tls)
         }
     }
 
-    c->xmit_queue_blocked = FALSE;
+    g_atomic_int_set(&c->xmit_queue_blocked, FALSE);
 
     g_return_val_if_fail(c->sock == NULL, FALSE);
     g_object_ref(G_OBJECT(channel)); /* Unref'd when co-routine exits */
 
+    spice_channel_thread_start(channel);
+
     /* we connect in idle, to let previous coroutine exit, if present */
-    c->connect_delayed_id = g_idle_add(connect_delayed, channel);
+    c->connect_delayed_id = spice_channel_idle_add(channel, connect_delayed, channel);
 
     return true;
 }
@@ -2933,7 +4409,7 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
 
     CHANNEL_DEBUG(channel, "channel reset");
     if (c->connect_delayed_id) {
-        g_source_remove(c->connect_delayed_id);
+        spice_channel_source_remove(channel, c->connect_delayed_id);
         c->connect_delayed_id = 0;
     }
 
@@ -2952,6 +4428,11 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
     g_clear_object(&c->conn);
     g_clear_object(&c->sock);
 
+    g_clear_pointer(&c->rbuf, g_free);
+    c->rbuf_start = c->rbuf_end = 0;
+
+    g_clear_pointer(&c->capture, fclose);
+
     c->fd = -1;
 
     c->auth_needs_username = FALSE;
@@ -2959,16 +4440,16 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
 
     g_clear_pointer(&c->peer_msg, g_free);
 
-    g_mutex_lock(&c->xmit_queue_lock);
-    c->xmit_queue_blocked = TRUE; /* Disallow queuing new messages */
-    gboolean was_empty = g_queue_is_empty(&c->xmit_queue);
-    g_queue_foreach(&c->xmit_queue, (GFunc)spice_msg_out_unref, NULL);
-    g_queue_clear(&c->xmit_queue);
-    if (c->xmit_queue_wakeup_id) {
-        g_source_remove(c->xmit_queue_wakeup_id);
-        c->xmit_queue_wakeup_id = 0;
+    /* Disallow queuing new messages, once those being queued landed */
+    g_rw_lock_writer_lock(&c->xmit_queue_lock);
+    g_atomic_int_set(&c->xmit_queue_blocked, TRUE);
+    g_rw_lock_writer_unlock(&c->xmit_queue_lock);
+    gboolean was_empty = TRUE;
+    SpiceMsgOut *out;
+    while ((out = spice_channel_xmit_queue_pop(channel)) != NULL) {
+        spice_msg_out_unref(out);
+        was_empty = FALSE;
     }
-    g_mutex_unlock(&c->xmit_queue_lock);
     spice_channel_flushed(channel, was_empty);
 
     g_array_set_size(c->remote_common_caps, 0);
@@ -2979,12 +4460,29 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
                                           SPICE_SESSION_MIGRATION_NONE);
 }
 
-/* system or coroutine context */
+typedef struct {
+    SpiceChannel *channel;
+    SpiceChannel *swap;
+    gboolean flag;
+} SpiceChannelCall;
+
+static gboolean spice_channel_reset_cb(gpointer data)
+{
+    SpiceChannelCall *call = data;
+
+    SPICE_CHANNEL_GET_CLASS(call->channel)->channel_reset(call->channel, call->flag);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* system or coroutine context, runs on the channel context */
 G_GNUC_INTERNAL
 void spice_channel_reset(SpiceChannel *channel, gboolean migrating)
 {
+    SpiceChannelCall call = { channel, NULL, migrating };
+
     CHANNEL_DEBUG(channel, "reset %s", migrating ? "migrating" : "");
-    SPICE_CHANNEL_GET_CLASS(channel)->channel_reset(channel, migrating);
+    spice_channel_invoke_sync(channel, spice_channel_reset_cb, &call);
 }
 
 /**
@@ -3144,16 +4642,13 @@ enum spice_channel_state spice_channel_get_state(SpiceChannel *channel)
 G_GNUC_INTERNAL
 guint64 spice_channel_get_queue_size (SpiceChannel *channel)
 {
-    guint64 size;
     SpiceChannelPrivate *c = channel->priv;
-    g_mutex_lock(&c->xmit_queue_lock);
-    size = c->xmit_queue_size;
-    g_mutex_unlock(&c->xmit_queue_lock);
-    return size;
+
+    return (gsize)g_atomic_pointer_get(&c->xmit_queue_size);
 }
 
-G_GNUC_INTERNAL
-void spice_channel_swap(SpiceChannel *channel, SpiceChannel *swap, gboolean swap_msgs)
+static void spice_channel_swap_state(SpiceChannel *channel, SpiceChannel *swap,
+                                     gboolean swap_msgs)
 {
     SpiceChannelPrivate *c = channel->priv;
     SpiceChannelPrivate *s = swap->priv;
@@ -3180,12 +4675,27 @@ void spice_channel_swap(SpiceChannel *channel, SpiceChannel *swap, gboolean swap
     SWAP(ssl);
     SWAP(sslverify);
     SWAP(tls);
+    SWAP(rbuf);
+    SWAP(rbuf_start);
+    SWAP(rbuf_end);
     SWAP(use_mini_header);
     if (swap_msgs) {
+        /* the producers wait until both queues are moved, the locks are
+         * taken in address order as producers only take one */
+        gboolean c_first = (guintptr)c < (guintptr)s;
+        GRWLock *first = c_first ? &c->xmit_queue_lock : &s->xmit_queue_lock;
+        GRWLock *second = c_first ? &s->xmit_queue_lock : &c->xmit_queue_lock;
+
+        g_rw_lock_writer_lock(first);
+        g_rw_lock_writer_lock(second);
+        SWAP(xmit_queue_head);
         SWAP(xmit_queue);
+        SWAP(xmit_queue_size);
         SWAP(xmit_queue_blocked);
         SWAP(in_serial);
         SWAP(out_serial);
+        g_rw_lock_writer_unlock(second);
+        g_rw_lock_writer_unlock(first);
     }
     SWAP(caps);
     SWAP(common_caps);
@@ -3199,6 +4709,24 @@ void spice_channel_swap(SpiceChannel *channel, SpiceChannel *swap, gboolean swap
 #endif
 }
 
+static gboolean spice_channel_swap_cb(gpointer data)
+{
+    SpiceChannelCall *call = data;
+
+    spice_channel_swap_state(call->channel, call->swap, call->flag);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* system or coroutine context, runs on the context of @channel */
+G_GNUC_INTERNAL
+void spice_channel_swap(SpiceChannel *channel, SpiceChannel *swap, gboolean swap_msgs)
+{
+    SpiceChannelCall call = { channel, swap, swap_msgs };
+
+    spice_channel_invoke_sync(channel, spice_channel_swap_cb, &call);
+}
+
 /* coroutine context */
 static void spice_channel_handle_msg(SpiceChannel *channel, SpiceMsgIn *msg)
 {
@@ -3262,9 +4790,7 @@ void spice_channel_flush_async(SpiceChannel *self, GCancellable *cancellable,
 
     task = g_task_new(self, cancellable, callback, user_data);
 
-    g_mutex_lock(&c->xmit_queue_lock);
-    was_empty = g_queue_is_empty(&c->xmit_queue);
-    g_mutex_unlock(&c->xmit_queue_lock);
+    was_empty = spice_channel_get_queue_size(self) == 0;
     if (was_empty) {
         g_task_return_boolean(task, TRUE);
         g_object_unref(task);
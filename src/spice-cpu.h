@@ -0,0 +1,67 @@
+/*
+  Copyright (C) 2026 Red Hat, Inc.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <string.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Runtime selection of SIMD kernels, shared by spice-client-glib and
+ * spice-client-gtk, hence inline. A kernels table lists its variants
+ * fastest first, each one a struct whose first member is the name of
+ * the CPU feature it requires, and ends with the scalar "c" variant.
+ */
+
+static inline gboolean spice_cpu_supports(const char *feature)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (strcmp(feature, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (strcmp(feature, "ssse3") == 0)
+        return __builtin_cpu_supports("ssse3");
+    if (strcmp(feature, "sse2") == 0)
+        return __builtin_cpu_supports("sse2");
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    if (strcmp(feature, "neon") == 0)
+        return TRUE;
+#endif
+    return strcmp(feature, "c") == 0;
+}
+
+/* the index of the first of the @n kernels of @size bytes the CPU
+ * supports */
+static inline guint spice_cpu_first_supported(const void *kernels, gsize size, guint n)
+{
+    guint i;
+
+    for (i = 0; i < n - 1; i++) {
+        const char *feature = *(const char * const *)((const guint8 *)kernels + i * size);
+
+        if (spice_cpu_supports(feature))
+            break;
+    }
+
+    return i;
+}
+
+#define SPICE_CPU_FIRST_SUPPORTED(kernels) \
+    spice_cpu_first_supported((kernels), sizeof((kernels)[0]), G_N_ELEMENTS(kernels))
+
+G_END_DECLS
@@ -34,6 +34,7 @@ static char *usbredir_redirect_on_connect = NULL;
 static gboolean smartcard = FALSE;
 static gboolean disable_audio = FALSE;
 static gboolean disable_usbredir = FALSE;
+static gboolean display_threads = FALSE;
 static gint cache_size = 0;
 static gint glz_window_size = 0;
 static gchar *secure_channels = NULL;
@@ -189,6 +190,8 @@ GOptionGroup* spice_get_option_group(void)
           N_("Image cache size (deprecated)"), N_("<bytes>") },
         { "spice-glz-window-size", '\0', 0, G_OPTION_ARG_INT, &glz_window_size,
           N_("Glz compression history size (deprecated)"), N_("<bytes>") },
+        { "spice-display-threads", '\0', 0, G_OPTION_ARG_NONE, &display_threads,
+          N_("Decode and draw each display on its own thread"), NULL },
         { "spice-shared-dir", '\0', 0, G_OPTION_ARG_FILENAME, &shared_dir,
           N_("Shared directory"), N_("<dir>") },
         { "spice-preferred-compression", '\0', 0, G_OPTION_ARG_CALLBACK, parse_preferred_compression,
@@ -325,6 +328,8 @@ void spice_set_session_option(SpiceSession *session)
         g_object_set(session, "glz-window-size", glz_window_size, NULL);
     if (shared_dir)
         g_object_set(session, "shared-dir", shared_dir, NULL);
+    if (display_threads)
+        g_object_set(session, "display-threads", TRUE, NULL);
     if (preferred_compression != SPICE_IMAGE_COMPRESSION_INVALID)
         g_object_set(session, "preferred-compression", preferred_compression, NULL);
 }
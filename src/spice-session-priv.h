@@ -20,6 +20,7 @@
 
 #include <glib.h>
 #include <gio/gio.h>
+#include <openssl/ssl.h>
 
 #ifdef USE_PHODAV
 #include <libphodav/phodav.h>
@@ -32,9 +33,19 @@ typedef struct _PhodavServer PhodavServer;
 #include "spice-gtk-session.h"
 #include "spice-channel-cache.h"
 #include "decode.h"
+#include "spice-surface-pool.h"
 
 G_BEGIN_DECLS
 
+/* the idle video decoders of the session, see channel-display-gst.c */
+typedef struct SpiceVideoDecoderPool SpiceVideoDecoderPool;
+
+SpiceVideoDecoderPool *video_decoder_pool_new(guint size);
+void video_decoder_pool_free(SpiceVideoDecoderPool *pool);
+void video_decoder_pool_trim(SpiceVideoDecoderPool *pool);
+void video_decoder_pool_set_size(SpiceVideoDecoderPool *pool, guint size);
+GVariant *video_decoder_pool_get_stats(SpiceVideoDecoderPool *pool);
+
 SpiceSession *spice_session_new_from_session(SpiceSession *session);
 
 void spice_session_set_connection_id(SpiceSession *session, int id);
@@ -65,13 +76,19 @@ const gchar* spice_session_get_cert_subject(SpiceSession *session);
 const gchar* spice_session_get_ciphers(SpiceSession *session);
 const gchar* spice_session_get_ca_file(SpiceSession *session);
 void spice_session_get_ca(SpiceSession *session, guint8 **ca, guint *size);
+SSL_CTX *spice_session_get_ssl_ctx(SpiceSession *session, int *ca_count);
+void spice_session_set_ssl_ctx(SpiceSession *session, SSL_CTX *ctx, int ca_count);
+SSL_SESSION *spice_session_get_ssl_session(SpiceSession *session);
+void spice_session_set_ssl_session(SpiceSession *session, SSL_SESSION *ssl_session);
 
 void spice_session_set_caches_hints(SpiceSession *session,
                                     uint32_t pci_ram_size,
                                     uint32_t n_display_channels);
 void spice_session_get_caches(SpiceSession *session,
                               display_cache **images,
-                              SpiceGlzDecoderWindow **glz_window);
+                              SpiceGlzDecoderWindow **glz_window,
+                              SpiceSurfacePool **surface_pool);
+SpiceVideoDecoderPool *spice_session_get_video_decoder_pool(SpiceSession *session);
 void spice_session_palettes_clear(SpiceSession *session);
 void spice_session_images_clear(SpiceSession *session);
 void spice_session_migrate_end(SpiceSession *session);
@@ -86,6 +103,7 @@ gboolean spice_session_get_audio_enabled(SpiceSession *session);
 gboolean spice_session_get_smartcard_enabled(SpiceSession *session);
 gboolean spice_session_get_usbredir_enabled(SpiceSession *session);
 gboolean spice_session_get_gl_scanout_enabled(SpiceSession *session);
+gboolean spice_session_get_display_threads(SpiceSession *session);
 
 PhodavServer *spice_session_get_webdav_server(SpiceSession *session);
 guint spice_session_get_n_display_channels(SpiceSession *session);
@@ -46,6 +46,7 @@ G_STATIC_ASSERT(sizeof(SpiceSessionClass) == sizeof(GObjectClass) + 12 * sizeof(
 #define IMAGES_CACHE_SIZE_DEFAULT (1024 * 1024 * 80)
 #define MIN_GLZ_WINDOW_SIZE_DEFAULT (1024 * 1024 * 12)
 #define MAX_GLZ_WINDOW_SIZE_DEFAULT MIN((LZ_MAX_WINDOW_SIZE * 4), 1024 * 1024 * 64)
+#define VIDEO_DECODER_POOL_SIZE_DEFAULT 2
 
 struct _SpiceSessionPrivate {
     char              *host;
@@ -75,6 +76,9 @@ struct _SpiceSessionPrivate {
     /* whether to enable GL scanout */
     gboolean          gl_scanout;
 
+    /* whether to run display channels on their own thread */
+    gboolean          display_threads;
+
     /* list of certificates to use for the software smartcard reader if
      * enabled. For now, it has to contain exactly 3 certificates for
      * the software reader to be functional
@@ -113,8 +117,18 @@ struct _SpiceSessionPrivate {
     guint             after_main_init;
     gboolean          for_migration;
 
+    /* TLS context and session shared by all channels, so that only the
+     * first channel does a full handshake */
+    SSL_CTX           *ssl_ctx;
+    int               ssl_ctx_ca_count;
+    SSL_SESSION       *ssl_session;
+    GMutex            ssl_cache_lock;
+
     display_cache     *images;
     SpiceGlzDecoderWindow *glz_window;
+    SpiceSurfacePool  *surface_pool;
+    SpiceVideoDecoderPool *video_decoders;
+    int               video_decoder_pool_size;
     int               images_cache_size;
     int               glz_window_size;
     uint32_t          n_display_channels;
@@ -205,6 +219,12 @@ enum {
     PROP_PREF_COMPRESSION,
     PROP_GL_SCANOUT,
     PROP_TICKET_HANDLER,
+    PROP_DISPLAY_THREADS,
+    PROP_GLZ_WINDOW_USED,
+    PROP_IMAGES_CACHE_STATS,
+    PROP_SURFACES_MEMORY,
+    PROP_VIDEO_DECODER_POOL_SIZE,
+    PROP_VIDEO_DECODER_POOL_STATS,
 };
 
 /* signals */
@@ -255,6 +275,32 @@ static guint signals[SPICE_SESSION_LAST_SIGNAL];
 
 static void spice_session_channel_destroy(SpiceSession *session, SpiceChannel *channel);
 
+/* must be called with ssl_cache_lock held */
+static void ssl_cache_clear_locked(SpiceSession *self)
+{
+    SpiceSessionPrivate *s = self->priv;
+
+    if (s->ssl_ctx) {
+        /* channels may still hold a reference, make sure they do not
+         * report new TLS sessions to us anymore */
+        SSL_CTX_set_app_data(s->ssl_ctx, NULL);
+        g_clear_pointer(&s->ssl_ctx, SSL_CTX_free);
+    }
+    g_clear_pointer(&s->ssl_session, SSL_SESSION_free);
+    s->ssl_ctx_ca_count = 0;
+}
+
+/* display channels may run on their own thread (see
+ * SpiceSession:display-threads) and access the cache concurrently */
+static void ssl_cache_clear(SpiceSession *self)
+{
+    SpiceSessionPrivate *s = self->priv;
+
+    g_mutex_lock(&s->ssl_cache_lock);
+    ssl_cache_clear_locked(self);
+    g_mutex_unlock(&s->ssl_cache_lock);
+}
+
 static void update_proxy(SpiceSession *self, const gchar *str)
 {
     SpiceSessionPrivate *s = self->priv;
@@ -296,6 +342,10 @@ static void spice_session_init(SpiceSession *session)
 
     s->images = cache_image_new((GDestroyNotify)pixman_image_unref);
     s->glz_window = glz_decoder_window_new();
+    s->surface_pool = surface_pool_new();
+    s->video_decoder_pool_size = VIDEO_DECODER_POOL_SIZE_DEFAULT;
+    s->video_decoders = video_decoder_pool_new(s->video_decoder_pool_size);
+    g_mutex_init(&s->ssl_cache_lock);
     update_proxy(session, NULL);
 }
 
@@ -376,6 +426,11 @@ spice_session_finalize(GObject *gobject)
 
     g_clear_pointer(&s->images, cache_free);
     glz_decoder_window_destroy(s->glz_window);
+    surface_pool_unref(s->surface_pool);
+    video_decoder_pool_free(s->video_decoders);
+
+    ssl_cache_clear(session);
+    g_mutex_clear(&s->ssl_cache_lock);
 
     g_clear_pointer(&s->pubkey, g_byte_array_unref);
     g_clear_pointer(&s->ca, g_byte_array_unref);
@@ -602,6 +657,37 @@ fail:
     return -1;
 }
 
+/* the server counts the cache size in pixels of 4 bytes */
+static void spice_session_set_images_cache_budget(SpiceSession *session)
+{
+    SpiceSessionPrivate *s = session->priv;
+
+    cache_lock(s->images);
+    cache_set_budget(s->images, (gsize)s->images_cache_size * 4);
+    cache_unlock(s->images);
+}
+
+static GVariant *spice_session_get_images_cache_stats(SpiceSession *session)
+{
+    SpiceSessionPrivate *s = session->priv;
+    display_cache_stats stats;
+    GVariantBuilder builder;
+
+    cache_lock(s->images);
+    cache_get_stats(s->images, &stats);
+    cache_unlock(s->images);
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{st}"));
+    g_variant_builder_add(&builder, "{st}", "items", stats.items);
+    g_variant_builder_add(&builder, "{st}", "bytes", stats.bytes);
+    g_variant_builder_add(&builder, "{st}", "hits", stats.hits);
+    g_variant_builder_add(&builder, "{st}", "misses", stats.misses);
+    g_variant_builder_add(&builder, "{st}", "lossy-replacements", stats.lossy_replacements);
+    g_variant_builder_add(&builder, "{st}", "over-budget", stats.over_budget);
+
+    return g_variant_builder_end(&builder);
+}
+
 static void spice_session_get_property(GObject    *gobject,
                                        guint       prop_id,
                                        GValue     *value,
@@ -698,6 +784,21 @@ static void spice_session_get_property(GObject    *gobject,
     case PROP_GLZ_WINDOW_SIZE:
         g_value_set_int(value, s->glz_window_size);
         break;
+    case PROP_GLZ_WINDOW_USED:
+        g_value_set_uint64(value, glz_decoder_window_get_used(s->glz_window));
+        break;
+    case PROP_IMAGES_CACHE_STATS:
+        g_value_take_variant(value, spice_session_get_images_cache_stats(session));
+        break;
+    case PROP_SURFACES_MEMORY:
+        g_value_set_uint64(value, surface_pool_get_used(s->surface_pool));
+        break;
+    case PROP_VIDEO_DECODER_POOL_SIZE:
+        g_value_set_int(value, s->video_decoder_pool_size);
+        break;
+    case PROP_VIDEO_DECODER_POOL_STATS:
+        g_value_take_variant(value, video_decoder_pool_get_stats(s->video_decoders));
+        break;
     case PROP_NAME:
         g_value_set_string(value, s->name);
 	break;
@@ -722,6 +823,9 @@ static void spice_session_get_property(GObject    *gobject,
     case PROP_GL_SCANOUT:
         g_value_set_boolean(value, s->gl_scanout);
         break;
+    case PROP_DISPLAY_THREADS:
+        g_value_set_boolean(value, s->display_threads);
+        break;
     default:
 	G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
 	break;
@@ -737,6 +841,24 @@ static void spice_session_set_property(GObject      *gobject,
     SpiceSessionPrivate *s = session->priv;
     const char *str;
 
+    switch (prop_id) {
+    case PROP_HOST:
+    case PROP_PORT:
+    case PROP_TLS_PORT:
+    case PROP_CA_FILE:
+    case PROP_CA:
+    case PROP_CIPHERS:
+    case PROP_PUBKEY:
+    case PROP_CERT_SUBJECT:
+    case PROP_VERIFY:
+    case PROP_URI:
+        /* TLS parameters may change, don't reuse the context or session */
+        ssl_cache_clear(session);
+        break;
+    default:
+        break;
+    }
+
     switch (prop_id) {
     case PROP_HOST:
         g_free(s->host);
@@ -845,9 +967,15 @@ static void spice_session_set_property(GObject      *gobject,
         break;
     case PROP_CACHE_SIZE:
         s->images_cache_size = g_value_get_int(value);
+        spice_session_set_images_cache_budget(session);
         break;
     case PROP_GLZ_WINDOW_SIZE:
         s->glz_window_size = g_value_get_int(value);
+        glz_decoder_window_set_size(s->glz_window, s->glz_window_size);
+        break;
+    case PROP_VIDEO_DECODER_POOL_SIZE:
+        s->video_decoder_pool_size = g_value_get_int(value);
+        video_decoder_pool_set_size(s->video_decoders, s->video_decoder_pool_size);
         break;
     case PROP_CA:
         g_clear_pointer(&s->ca, g_byte_array_unref);
@@ -872,6 +1000,9 @@ static void spice_session_set_property(GObject      *gobject,
         g_warning("SpiceSession:gl-scanout is only available on Unix");
 #endif
         break;
+    case PROP_DISPLAY_THREADS:
+        s->display_threads = g_value_get_boolean(value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -1574,6 +1705,126 @@ static void spice_session_class_init(SpiceSessionClass *klass)
 #endif
                               G_PARAM_READWRITE |
                               G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:display-threads:
+     *
+     * Whether to run each display channel on a dedicated thread with
+     * its own #GMainContext, so that image decoding and drawing of
+     * several monitors can happen in parallel, off the main thread.
+     * The display channel signals are still emitted on the main
+     * context, mostly without waiting for the handlers, and the
+     * primary surface data is then a copy updated right before each
+     * invalidation. Set to TRUE by default if the SPICE_DISPLAY_THREADS
+     * environment variable is set. Changes only apply to channels
+     * connected afterwards.
+     *
+     * Since: 0.41
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_DISPLAY_THREADS,
+         g_param_spec_boolean("display-threads",
+                              "Display threads",
+                              "Run display channels on their own thread",
+                              g_getenv("SPICE_DISPLAY_THREADS") != NULL,
+                              G_PARAM_READWRITE |
+                              G_PARAM_CONSTRUCT |
+                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:glz-window-used:
+     *
+     * Memory held by the images of the Glz decoder window, in bytes. The
+     * window keeps at most 1.5 times #SpiceSession:glz-window-size. No
+     * notification is emitted when it changes.
+     *
+     * Since: 0.41
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_GLZ_WINDOW_USED,
+         g_param_spec_uint64("glz-window-used",
+                             "Glz window used",
+                             "Memory held by the Glz window (bytes)",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:images-cache-stats:
+     *
+     * Statistics of the images cache shared by the display channels, as
+     * a #GVariant dictionary "a{st}" with the following keys: "items",
+     * "bytes" held, "hits" and "misses" of the lookups, "lossy-replacements"
+     * of lossy images by lossless ones, and "over-budget", the number
+     * of images added while the cache held more than
+     * #SpiceSession:cache-size.
+     *
+     * Since: 0.41
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_IMAGES_CACHE_STATS,
+         g_param_spec_variant("images-cache-stats",
+                              "Images cache stats",
+                              "Statistics of the images cache",
+                              G_VARIANT_TYPE("a{st}"), NULL,
+                              G_PARAM_READABLE |
+                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:surfaces-memory:
+     *
+     * Memory allocated for the pixels of the display surfaces of all the
+     * display channels, primary and off-screen, in bytes. No
+     * notification is emitted when it changes.
+     *
+     * Since: 0.41
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_SURFACES_MEMORY,
+         g_param_spec_uint64("surfaces-memory",
+                             "Surfaces memory",
+                             "Memory allocated for display surfaces (bytes)",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:video-decoder-pool-size:
+     *
+     * The number of idle GStreamer video decoders kept for each codec.
+     * When a video stream ends, its decoder is flushed and kept for the
+     * next stream of the same codec rather than torn down, if it
+     * presents through appsink. 0 disables the reuse.
+     *
+     * Since: 0.41
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_VIDEO_DECODER_POOL_SIZE,
+         g_param_spec_int("video-decoder-pool-size",
+                          "Video decoder pool size",
+                          "Idle video decoders kept per codec",
+                          0, 16, VIDEO_DECODER_POOL_SIZE_DEFAULT,
+                          G_PARAM_READWRITE |
+                          G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:video-decoder-pool-stats:
+     *
+     * Statistics of the idle video decoders, as a #GVariant dictionary
+     * "a{st}" with the following keys: "idle", the number of decoders
+     * kept, "hits" and "misses", the number of streams that could and
+     * could not reuse one.
+     *
+     * Since: 0.41
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_VIDEO_DECODER_POOL_STATS,
+         g_param_spec_variant("video-decoder-pool-stats",
+                              "Video decoder pool stats",
+                              "Statistics of the idle video decoders",
+                              G_VARIANT_TYPE("a{st}"), NULL,
+                              G_PARAM_READABLE |
+                              G_PARAM_STATIC_STRINGS));
 }
 
 G_GNUC_INTERNAL
@@ -1582,6 +1833,12 @@ gboolean spice_session_get_gl_scanout_enabled(SpiceSession *session)
     return session->priv->gl_scanout;
 }
 
+G_GNUC_INTERNAL
+gboolean spice_session_get_display_threads(SpiceSession *session)
+{
+    return session->priv->display_threads;
+}
+
 /* ------------------------------------------------------------------ */
 /* public functions                                                   */
 
@@ -1693,6 +1950,7 @@ gboolean spice_session_connect(SpiceSession *session)
     session_disconnect(session, TRUE);
 
     s->client_provided_sockets = FALSE;
+    ssl_cache_clear(session);
 
     if (s->cmain == NULL)
         s->cmain = spice_channel_new(session, SPICE_CHANNEL_MAIN, 0);
@@ -1736,6 +1994,7 @@ gboolean spice_session_open_fd(SpiceSession *session, int fd)
     session_disconnect(session, TRUE);
 
     s->client_provided_sockets = TRUE;
+    ssl_cache_clear(session);
 
     if (s->cmain == NULL)
         s->cmain = spice_channel_new(session, SPICE_CHANNEL_MAIN, 0);
@@ -1758,8 +2017,12 @@ static void cache_clear_all(SpiceSession *self)
 {
     SpiceSessionPrivate *s = self->priv;
 
+    cache_lock(s->images);
     cache_clear(s->images);
+    cache_unlock(s->images);
     glz_decoder_window_clear(s->glz_window);
+    surface_pool_trim(s->surface_pool);
+    video_decoder_pool_trim(s->video_decoders);
 }
 
 G_GNUC_INTERNAL
@@ -1910,7 +2173,7 @@ void spice_session_channel_migrate(SpiceSession *session, SpiceChannel *channel)
     c = spice_session_lookup_channel(s->migration, id, type);
     g_return_if_fail(c != NULL);
 
-    if (!g_queue_is_empty(&c->priv->xmit_queue) && s->full_migration) {
+    if (spice_channel_get_queue_size(c) != 0 && s->full_migration) {
         CHANNEL_DEBUG(channel, "mig channel xmit queue is not empty. type %s", c->priv->name);
     }
     spice_channel_swap(channel, c, !s->full_migration);
@@ -2586,10 +2849,86 @@ const gchar* spice_session_get_ca_file(SpiceSession *session)
     return s->ca_file;
 }
 
+/*
+ * Returns: (transfer full): the TLS context shared by the session
+ * channels, or %NULL if none was created yet. @ca_count is set to the
+ * number of CA certificates and CRLs loaded in the context.
+ */
+G_GNUC_INTERNAL
+SSL_CTX *spice_session_get_ssl_ctx(SpiceSession *session, int *ca_count)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    SpiceSessionPrivate *s = session->priv;
+    SSL_CTX *ctx = NULL;
+
+    g_mutex_lock(&s->ssl_cache_lock);
+    if (s->ssl_ctx != NULL) {
+        *ca_count = s->ssl_ctx_ca_count;
+        SSL_CTX_up_ref(s->ssl_ctx);
+        ctx = s->ssl_ctx;
+    }
+    g_mutex_unlock(&s->ssl_cache_lock);
+
+    return ctx;
+}
+
+G_GNUC_INTERNAL
+void spice_session_set_ssl_ctx(SpiceSession *session, SSL_CTX *ctx, int ca_count)
+{
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    SpiceSessionPrivate *s = session->priv;
+
+    g_mutex_lock(&s->ssl_cache_lock);
+    ssl_cache_clear_locked(session);
+    SSL_CTX_up_ref(ctx);
+    SSL_CTX_set_app_data(ctx, session);
+    s->ssl_ctx = ctx;
+    s->ssl_ctx_ca_count = ca_count;
+    g_mutex_unlock(&s->ssl_cache_lock);
+}
+
+/*
+ * Returns: (transfer full): the last TLS session negotiated by a
+ * channel, to be resumed by other channels, or %NULL
+ */
+G_GNUC_INTERNAL
+SSL_SESSION *spice_session_get_ssl_session(SpiceSession *session)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    SpiceSessionPrivate *s = session->priv;
+    SSL_SESSION *ssl_session;
+
+    g_mutex_lock(&s->ssl_cache_lock);
+    ssl_session = s->ssl_session;
+    if (ssl_session != NULL)
+        SSL_SESSION_up_ref(ssl_session);
+    g_mutex_unlock(&s->ssl_cache_lock);
+
+    return ssl_session;
+}
+
+/* takes ownership of @ssl_session */
+G_GNUC_INTERNAL
+void spice_session_set_ssl_session(SpiceSession *session, SSL_SESSION *ssl_session)
+{
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    SpiceSessionPrivate *s = session->priv;
+
+    g_mutex_lock(&s->ssl_cache_lock);
+    g_clear_pointer(&s->ssl_session, SSL_SESSION_free);
+    s->ssl_session = ssl_session;
+    g_mutex_unlock(&s->ssl_cache_lock);
+}
+
 G_GNUC_INTERNAL
 void spice_session_get_caches(SpiceSession *session,
                               display_cache **images,
-                              SpiceGlzDecoderWindow **glz_window)
+                              SpiceGlzDecoderWindow **glz_window,
+                              SpiceSurfacePool **surface_pool)
 {
     g_return_if_fail(SPICE_IS_SESSION(session));
 
@@ -2599,6 +2938,16 @@ void spice_session_get_caches(SpiceSession *session,
         *images = s->images;
     if (glz_window)
         *glz_window = s->glz_window;
+    if (surface_pool)
+        *surface_pool = s->surface_pool;
+}
+
+G_GNUC_INTERNAL
+SpiceVideoDecoderPool *spice_session_get_video_decoder_pool(SpiceSession *session)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    return session->priv->video_decoders;
 }
 
 G_GNUC_INTERNAL
@@ -2617,11 +2966,13 @@ void spice_session_set_caches_hints(SpiceSession *session,
     if (s->images_cache_size == 0) {
         s->images_cache_size = IMAGES_CACHE_SIZE_DEFAULT;
     }
+    spice_session_set_images_cache_budget(session);
 
     if (s->glz_window_size == 0) {
         s->glz_window_size = MIN(MAX_GLZ_WINDOW_SIZE_DEFAULT, pci_ram_size / 2);
         s->glz_window_size = MAX(MIN_GLZ_WINDOW_SIZE_DEFAULT, s->glz_window_size);
     }
+    glz_decoder_window_set_size(s->glz_window, s->glz_window_size);
 }
 
 G_GNUC_INTERNAL
@@ -0,0 +1,242 @@
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <glib.h>
+#ifdef G_OS_UNIX
+#include <sys/mman.h>
+#endif
+
+#include "spice-surface-pool.h"
+#include "spice-common.h"
+
+#ifndef MAP_ANONYMOUS
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+ * Small surfaces come from g_malloc0(). Large ones are mapped in size
+ * classes of powers of 2: a mapping is only committed as its pages are
+ * first touched, so the rounding costs address space only, and it comes
+ * zero-filled without a memset. Released mappings are kept for reuse by
+ * the next surface of the same class, with their pages given back, so
+ * that a guest churning off-screen surfaces or resizing its primary
+ * does not map and unmap each time, and an idle pooled buffer costs no
+ * memory. Set SPICE_SURFACE_HUGEPAGES to back large buffers with
+ * transparent huge pages.
+ */
+#define SURFACE_POOL_MAP_MIN (1024 * 1024)
+#define SURFACE_POOL_CLASSES 32
+#define SURFACE_POOL_MAX_FREE 4 /* per class */
+
+struct SpiceSurfacePool {
+    gint        ref_count; /* the session and each buffer */
+    GMutex      lock;
+    GSList      *free[SURFACE_POOL_CLASSES];
+    guint       nfree[SURFACE_POOL_CLASSES];
+    gsize       used;
+    gboolean    hugepages;
+};
+
+G_GNUC_INTERNAL
+SpiceSurfacePool *surface_pool_new(void)
+{
+    SpiceSurfacePool *pool = g_new0(SpiceSurfacePool, 1);
+
+    pool->ref_count = 1;
+    g_mutex_init(&pool->lock);
+    pool->hugepages = g_getenv("SPICE_SURFACE_HUGEPAGES") != NULL;
+    return pool;
+}
+
+G_GNUC_INTERNAL
+SpiceSurfacePool *surface_pool_ref(SpiceSurfacePool *pool)
+{
+    g_atomic_int_inc(&pool->ref_count);
+    return pool;
+}
+
+/* the buffers still allocated keep the pool alive */
+G_GNUC_INTERNAL
+void surface_pool_unref(SpiceSurfacePool *pool)
+{
+    if (pool == NULL || !g_atomic_int_dec_and_test(&pool->ref_count))
+        return;
+
+    g_warn_if_fail(pool->used == 0);
+    surface_pool_trim(pool);
+    g_mutex_clear(&pool->lock);
+    g_free(pool);
+}
+
+#ifdef G_OS_UNIX
+static guint surface_pool_class(gsize size)
+{
+    return g_bit_storage(size - 1);
+}
+
+static uint8_t *surface_pool_map(SpiceSurfacePool *pool, guint class)
+{
+    gsize map_size = (gsize)1 << class;
+    uint8_t *map;
+
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        g_warning("mmap(%" G_GSIZE_FORMAT ") failed: %s",
+                  map_size, g_strerror(errno));
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (pool->hugepages)
+        madvise(map, map_size, MADV_HUGEPAGE);
+#endif
+
+    return map;
+}
+#endif
+
+/*
+ * Returns a zero-filled buffer of size bytes, holding a reference on
+ * pool until it is released. mapped tells surface_pool_release() how
+ * the buffer was allocated.
+ */
+G_GNUC_INTERNAL
+uint8_t *surface_pool_alloc(SpiceSurfacePool *pool, gsize size, gboolean *mapped)
+{
+    uint8_t *data = NULL;
+
+    surface_pool_ref(pool);
+    *mapped = FALSE;
+
+#ifdef G_OS_UNIX
+    if (size >= SURFACE_POOL_MAP_MIN && surface_pool_class(size) < SURFACE_POOL_CLASSES) {
+        guint class = surface_pool_class(size);
+
+        g_mutex_lock(&pool->lock);
+        if (pool->free[class] != NULL) {
+            data = pool->free[class]->data;
+            pool->free[class] = g_slist_delete_link(pool->free[class], pool->free[class]);
+            pool->nfree[class]--;
+        }
+        pool->used += size;
+        g_mutex_unlock(&pool->lock);
+
+        if (data == NULL)
+            data = surface_pool_map(pool, class);
+        if (data != NULL) {
+            *mapped = TRUE;
+            return data;
+        }
+
+        g_mutex_lock(&pool->lock);
+        pool->used -= size;
+        g_mutex_unlock(&pool->lock);
+    }
+#endif
+
+    /* small or huge buffer, or mmap() failed */
+    data = g_malloc0(size);
+    if (data == NULL) {
+        /* empty, not released */
+        surface_pool_unref(pool);
+        return NULL;
+    }
+    g_mutex_lock(&pool->lock);
+    pool->used += size;
+    g_mutex_unlock(&pool->lock);
+
+    return data;
+}
+
+G_GNUC_INTERNAL
+void surface_pool_release(SpiceSurfacePool *pool, uint8_t *data, gsize size,
+                          gboolean mapped)
+{
+    if (data == NULL)
+        return;
+
+    g_mutex_lock(&pool->lock);
+    pool->used -= size;
+    g_mutex_unlock(&pool->lock);
+
+#ifdef G_OS_UNIX
+    if (mapped) {
+        guint class = surface_pool_class(size);
+        gsize map_size = (gsize)1 << class;
+
+#ifdef MADV_DONTNEED
+        /* give the pages back, they read as zero when touched again */
+        madvise(data, map_size, MADV_DONTNEED);
+#else
+        memset(data, 0, size);
+#endif
+
+        g_mutex_lock(&pool->lock);
+        if (pool->nfree[class] < SURFACE_POOL_MAX_FREE) {
+            pool->free[class] = g_slist_prepend(pool->free[class], data);
+            pool->nfree[class]++;
+            data = NULL;
+        }
+        g_mutex_unlock(&pool->lock);
+
+        if (data != NULL)
+            munmap(data, map_size);
+        surface_pool_unref(pool);
+        return;
+    }
+#endif
+
+    g_free(data);
+    surface_pool_unref(pool);
+}
+
+/* unmaps the released buffers */
+G_GNUC_INTERNAL
+void surface_pool_trim(SpiceSurfacePool *pool)
+{
+#ifdef G_OS_UNIX
+    guint class;
+
+    g_mutex_lock(&pool->lock);
+    for (class = 0; class < SURFACE_POOL_CLASSES; class++) {
+        GSList *l;
+
+        for (l = pool->free[class]; l != NULL; l = l->next)
+            munmap(l->data, (gsize)1 << class);
+        g_clear_pointer(&pool->free[class], g_slist_free);
+        pool->nfree[class] = 0;
+    }
+    g_mutex_unlock(&pool->lock);
+#endif
+}
+
+/* bytes of the surfaces allocated */
+G_GNUC_INTERNAL
+gsize surface_pool_get_used(SpiceSurfacePool *pool)
+{
+    gsize used;
+
+    g_mutex_lock(&pool->lock);
+    used = pool->used;
+    g_mutex_unlock(&pool->lock);
+
+    return used;
+}
@@ -0,0 +1,39 @@
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Pixel buffers of the display surfaces of a session. The buffers are
+ * zero-filled and may be used from the display channel threads.
+ */
+typedef struct SpiceSurfacePool SpiceSurfacePool;
+
+SpiceSurfacePool *surface_pool_new(void);
+SpiceSurfacePool *surface_pool_ref(SpiceSurfacePool *pool);
+void surface_pool_unref(SpiceSurfacePool *pool);
+uint8_t *surface_pool_alloc(SpiceSurfacePool *pool, gsize size, gboolean *mapped);
+void surface_pool_release(SpiceSurfacePool *pool, uint8_t *data, gsize size,
+                          gboolean mapped);
+void surface_pool_trim(SpiceSurfacePool *pool);
+gsize surface_pool_get_used(SpiceSurfacePool *pool);
+
+G_END_DECLS
@@ -0,0 +1,239 @@
+/*
+  Copyright (C) 2026 Red Hat, Inc.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include "spice-widget-convert.h"
+#include "spice-cpu.h"
+
+/*
+ * 16bpp to 32bpp conversion of the primary surface, for guests using a
+ * 16bpp mode. The kernels are picked at runtime: AVX2 or SSE2 on x86,
+ * NEON on aarch64, with a scalar fallback. SPICE_WIDGET_NO_SIMD=1
+ * forces the scalar version. Each 5 or 6 bit component c is expanded to
+ * 8 bits by replicating its high bits, (c << 3) | (c >> 2) for 5 bits.
+ */
+
+#define CONVERT_0565_TO_0888(s)                                         \
+    (((((s) << 3) & 0xf8) | (((s) >> 2) & 0x7)) |                       \
+     ((((s) << 5) & 0xfc00) | (((s) >> 1) & 0x300)) |                   \
+     ((((s) << 8) & 0xf80000) | (((s) << 3) & 0x70000)))
+
+#define CONVERT_0555_TO_0888(s)                                         \
+    (((((s) & 0x001f) << 3) | (((s) & 0x001c) >> 2)) |                  \
+     ((((s) & 0x03e0) << 6) | (((s) & 0x0380) << 1)) |                  \
+     ((((s) & 0x7c00) << 9) | ((((s) & 0x7000)) << 4)))
+
+static void convert_rgb555_c(const guint16 *src, guint32 *dest, guint n)
+{
+    guint i;
+
+    for (i = 0; i < n; i++)
+        dest[i] = CONVERT_0555_TO_0888(src[i]);
+}
+
+static void convert_rgb565_c(const guint16 *src, guint32 *dest, guint n)
+{
+    guint i;
+
+    for (i = 0; i < n; i++)
+        dest[i] = CONVERT_0565_TO_0888(src[i]);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONVERT_X86_KERNELS
+#include <immintrin.h>
+
+/* 8 pixels per iteration, green has 5 bits at 5 or 6 bits at 5, red
+ * 5 bits at 10 or 11 */
+#define CONVERT_SSE2(name, gmask, gshl, gshr, rshift)                   \
+__attribute__((target("sse2")))                                         \
+static void name(const guint16 *src, guint32 *dest, guint n)            \
+{                                                                       \
+    const __m128i m5 = _mm_set1_epi16(0x1f);                            \
+    const __m128i mg = _mm_set1_epi16(gmask);                           \
+                                                                        \
+    for (; n >= 8; n -= 8, src += 8, dest += 8) {                       \
+        __m128i v = _mm_loadu_si128((const __m128i *)src);              \
+        __m128i r = _mm_and_si128(_mm_srli_epi16(v, rshift), m5);       \
+        __m128i g = _mm_and_si128(_mm_srli_epi16(v, 5), mg);            \
+        __m128i b = _mm_and_si128(v, m5);                               \
+        __m128i bg;                                                     \
+                                                                        \
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));   \
+        g = _mm_or_si128(_mm_slli_epi16(g, gshl), _mm_srli_epi16(g, gshr)); \
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));   \
+        bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));                     \
+                                                                        \
+        _mm_storeu_si128((__m128i *)(dest + 0), _mm_unpacklo_epi16(bg, r)); \
+        _mm_storeu_si128((__m128i *)(dest + 4), _mm_unpackhi_epi16(bg, r)); \
+    }                                                                   \
+}
+
+CONVERT_SSE2(convert_rgb555_sse2_loop, 0x1f, 3, 2, 10)
+CONVERT_SSE2(convert_rgb565_sse2_loop, 0x3f, 2, 4, 11)
+
+/* 16 pixels per iteration */
+#define CONVERT_AVX2(name, gmask, gshl, gshr, rshift)                   \
+__attribute__((target("avx2")))                                         \
+static void name(const guint16 *src, guint32 *dest, guint n)            \
+{                                                                       \
+    const __m256i m5 = _mm256_set1_epi16(0x1f);                         \
+    const __m256i mg = _mm256_set1_epi16(gmask);                        \
+                                                                        \
+    for (; n >= 16; n -= 16, src += 16, dest += 16) {                   \
+        __m256i v = _mm256_loadu_si256((const __m256i *)src);           \
+        __m256i r = _mm256_and_si256(_mm256_srli_epi16(v, rshift), m5); \
+        __m256i g = _mm256_and_si256(_mm256_srli_epi16(v, 5), mg);      \
+        __m256i b = _mm256_and_si256(v, m5);                            \
+        __m256i bg, lo, hi;                                             \
+                                                                        \
+        r = _mm256_or_si256(_mm256_slli_epi16(r, 3), _mm256_srli_epi16(r, 2)); \
+        g = _mm256_or_si256(_mm256_slli_epi16(g, gshl), _mm256_srli_epi16(g, gshr)); \
+        b = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_srli_epi16(b, 2)); \
+        bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));               \
+                                                                        \
+        /* the unpacks work within 128-bit lanes */                     \
+        lo = _mm256_unpacklo_epi16(bg, r);                              \
+        hi = _mm256_unpackhi_epi16(bg, r);                              \
+        _mm256_storeu_si256((__m256i *)(dest + 0),                      \
+                            _mm256_permute2x128_si256(lo, hi, 0x20));   \
+        _mm256_storeu_si256((__m256i *)(dest + 8),                      \
+                            _mm256_permute2x128_si256(lo, hi, 0x31));   \
+    }                                                                   \
+}
+
+CONVERT_AVX2(convert_rgb555_avx2_loop, 0x1f, 3, 2, 10)
+CONVERT_AVX2(convert_rgb565_avx2_loop, 0x3f, 2, 4, 11)
+
+static void convert_rgb555_sse2(const guint16 *src, guint32 *dest, guint n)
+{
+    convert_rgb555_sse2_loop(src, dest, n);
+    convert_rgb555_c(src + (n & ~7), dest + (n & ~7), n & 7);
+}
+
+static void convert_rgb565_sse2(const guint16 *src, guint32 *dest, guint n)
+{
+    convert_rgb565_sse2_loop(src, dest, n);
+    convert_rgb565_c(src + (n & ~7), dest + (n & ~7), n & 7);
+}
+
+static void convert_rgb555_avx2(const guint16 *src, guint32 *dest, guint n)
+{
+    convert_rgb555_avx2_loop(src, dest, n);
+    convert_rgb555_sse2(src + (n & ~15), dest + (n & ~15), n & 15);
+}
+
+static void convert_rgb565_avx2(const guint16 *src, guint32 *dest, guint n)
+{
+    convert_rgb565_avx2_loop(src, dest, n);
+    convert_rgb565_sse2(src + (n & ~15), dest + (n & ~15), n & 15);
+}
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define CONVERT_NEON_KERNELS
+#include <arm_neon.h>
+
+static inline uint8x8_t convert_expand_neon(uint16x8_t c, int bits)
+{
+    uint16x8_t v = bits == 6 ? vorrq_u16(vshlq_n_u16(c, 2), vshrq_n_u16(c, 4))
+                             : vorrq_u16(vshlq_n_u16(c, 3), vshrq_n_u16(c, 2));
+
+    return vmovn_u16(v);
+}
+
+/* 8 pixels per iteration */
+static void convert_rgb16_neon_loop(const guint16 *src, guint32 *dest, guint n,
+                                    int gbits, int rshift)
+{
+    const uint16x8_t m5 = vdupq_n_u16(0x1f);
+    const uint16x8_t mg = vdupq_n_u16((1 << gbits) - 1);
+
+    for (; n >= 8; n -= 8, src += 8, dest += 8) {
+        uint16x8_t v = vld1q_u16(src);
+        uint8x8x4_t o;
+
+        o.val[0] = convert_expand_neon(vandq_u16(v, m5), 5);
+        o.val[1] = convert_expand_neon(vandq_u16(vshrq_n_u16(v, 5), mg), gbits);
+        o.val[2] = convert_expand_neon(vandq_u16(vshlq_u16(v, vdupq_n_s16(-rshift)), m5), 5);
+        o.val[3] = vdup_n_u8(0);
+        vst4_u8((uint8_t *)dest, o);
+    }
+}
+
+static void convert_rgb555_neon(const guint16 *src, guint32 *dest, guint n)
+{
+    convert_rgb16_neon_loop(src, dest, n, 5, 10);
+    convert_rgb555_c(src + (n & ~7), dest + (n & ~7), n & 7);
+}
+
+static void convert_rgb565_neon(const guint16 *src, guint32 *dest, guint n)
+{
+    convert_rgb16_neon_loop(src, dest, n, 6, 11);
+    convert_rgb565_c(src + (n & ~7), dest + (n & ~7), n & 7);
+}
+#endif
+
+static const SpiceConvertKernels convert_kernels[] = {
+#if defined(CONVERT_X86_KERNELS)
+    { "avx2", convert_rgb555_avx2, convert_rgb565_avx2 },
+    { "sse2", convert_rgb555_sse2, convert_rgb565_sse2 },
+#elif defined(CONVERT_NEON_KERNELS)
+    { "neon", convert_rgb555_neon, convert_rgb565_neon },
+#endif
+    { "c", convert_rgb555_c, convert_rgb565_c },
+};
+
+static guint convert_kernels_first_supported(void)
+{
+    static gsize first = 0;
+
+    if (g_once_init_enter(&first)) {
+        /* g_once_init_leave() does not take 0 */
+        g_once_init_leave(&first, SPICE_CPU_FIRST_SUPPORTED(convert_kernels) + 1);
+    }
+
+    return first - 1;
+}
+
+/* the kernels supported by the CPU, fastest first, the last one is the
+ * scalar fallback */
+G_GNUC_INTERNAL
+const SpiceConvertKernels *spice_convert_get_supported_kernels(guint *n_kernels)
+{
+    guint first = convert_kernels_first_supported();
+
+    *n_kernels = G_N_ELEMENTS(convert_kernels) - first;
+    return &convert_kernels[first];
+}
+
+G_GNUC_INTERNAL
+const SpiceConvertKernels *spice_convert_get_kernels(void)
+{
+    static const SpiceConvertKernels *kernels = NULL;
+
+    if (g_once_init_enter(&kernels)) {
+        const SpiceConvertKernels *k = &convert_kernels[G_N_ELEMENTS(convert_kernels) - 1];
+        guint n;
+
+        if (g_getenv("SPICE_WIDGET_NO_SIMD") == NULL)
+            k = spice_convert_get_supported_kernels(&n);
+        g_once_init_leave(&kernels, k);
+    }
+
+    return kernels;
+}
@@ -0,0 +1,35 @@
+/*
+  Copyright (C) 2026 Red Hat, Inc.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* converts n native endian 16bpp pixels to cairo RGB24 */
+typedef void (*SpiceConvertFunc)(const guint16 *src, guint32 *dest, guint n);
+
+typedef struct SpiceConvertKernels {
+    const gchar         *name;
+    SpiceConvertFunc    rgb555;
+    SpiceConvertFunc    rgb565;
+} SpiceConvertKernels;
+
+const SpiceConvertKernels *spice_convert_get_kernels(void);
+const SpiceConvertKernels *spice_convert_get_supported_kernels(guint *n_kernels);
+
+G_END_DECLS
@@ -153,6 +153,21 @@ struct _SpiceDisplayPrivate {
 #endif // HAVE_EGL
     double scroll_delta_y;
     GWeakRef overlay_weak_ref;
+
+    /* damage presented on the next frame clock tick, see invalidate() */
+    struct {
+        cairo_region_t      *damage; /* primary coordinates */
+        guint               tick_id;
+        gint64              damage_time; /* first damage of the next present */
+        gint64              draw_time; /* first damage presented, not drawn */
+        guint64             frames;
+        guint64             updates;
+        guint64             merged;
+        guint64             dropped;
+        gint64              latency_last;
+        gint64              latency_max;
+        gint64              latency_total;
+    } present;
 };
 
 int      spice_cairo_image_create                 (SpiceDisplay *display);
@@ -52,6 +52,7 @@
 
 #include "spice-widget.h"
 #include "spice-widget-priv.h"
+#include "spice-widget-convert.h"
 #include "spice-gtk-session-priv.h"
 #include "vncdisplaykeymap.h"
 #include "spice-grabsequence-priv.h"
@@ -98,7 +99,8 @@ enum {
     PROP_ZOOM_LEVEL,
     PROP_MONITOR_ID,
     PROP_KEYPRESS_DELAY,
-    PROP_READY
+    PROP_READY,
+    PROP_PRESENT_STATS,
 };
 
 /* Signals */
@@ -137,6 +139,9 @@ static void update_size_request(SpiceDisplay *display);
 static GdkDevice *spice_gdk_window_get_pointing_device(GdkWindow *window);
 static void gst_size_allocate(GtkWidget *widget, GdkRectangle *a, gpointer data);
 static gboolean gst_draw_event(GtkWidget *widget, cairo_t *cr, gpointer data);
+static void present_drawn(SpiceDisplay *display);
+static void present_cancel(SpiceDisplay *display);
+static GVariant *present_get_stats(SpiceDisplay *display);
 
 /* ---------------------------------------------------------------- */
 
@@ -185,6 +190,9 @@ static void spice_display_get_property(GObject    *object,
     case PROP_KEYPRESS_DELAY:
         g_value_set_uint(value, d->keypress_delay);
         break;
+    case PROP_PRESENT_STATS:
+        g_value_take_variant(value, present_get_stats(display));
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -461,6 +469,7 @@ static void spice_display_dispose(GObject *obj)
     DISPLAY_DEBUG(display, "spice display dispose");
 
     spice_cairo_image_destroy(display);
+    present_cancel(display);
     g_clear_object(&d->session);
     d->gtk_session = NULL;
 
@@ -1405,52 +1414,31 @@ static void recalc_geometry(GtkWidget *widget)
 
 /* ---------------------------------------------------------------- */
 
-#define CONVERT_0565_TO_0888(s)                                         \
-    (((((s) << 3) & 0xf8) | (((s) >> 2) & 0x7)) |                       \
-     ((((s) << 5) & 0xfc00) | (((s) >> 1) & 0x300)) |                   \
-     ((((s) << 8) & 0xf80000) | (((s) << 3) & 0x70000)))
-
-#define CONVERT_0565_TO_8888(s) (CONVERT_0565_TO_0888(s) | 0xff000000)
-
-#define CONVERT_0555_TO_0888(s)                                         \
-    (((((s) & 0x001f) << 3) | (((s) & 0x001c) >> 2)) |                  \
-     ((((s) & 0x03e0) << 6) | (((s) & 0x0380) << 1)) |                  \
-     ((((s) & 0x7c00) << 9) | ((((s) & 0x7000)) << 4)))
-
-#define CONVERT_0555_TO_8888(s) (CONVERT_0555_TO_0888(s) | 0xff000000)
-
 static gboolean do_color_convert(SpiceDisplay *display, GdkRectangle *r)
 {
     SpiceDisplayPrivate *d = display->priv;
     guint32 *dest = d->canvas.data;
     guint16 *src = d->canvas.data_origin;
-    gint x, y;
+    SpiceConvertFunc convert;
+    gint y;
 
     g_return_val_if_fail(r != NULL, false);
     g_return_val_if_fail(d->canvas.format == SPICE_SURFACE_FMT_16_555 ||
                          d->canvas.format == SPICE_SURFACE_FMT_16_565, false);
 
+    if (d->canvas.format == SPICE_SURFACE_FMT_16_555)
+        convert = spice_convert_get_kernels()->rgb555;
+    else
+        convert = spice_convert_get_kernels()->rgb565;
+
     src += (d->canvas.stride / 2) * r->y + r->x;
     dest += d->area.width * (r->y - d->area.y) + (r->x - d->area.x);
 
-    if (d->canvas.format == SPICE_SURFACE_FMT_16_555) {
-        for (y = 0; y < r->height; y++) {
-            for (x = 0; x < r->width; x++) {
-                dest[x] = CONVERT_0555_TO_0888(src[x]);
-            }
-
-            dest += d->area.width;
-            src += d->canvas.stride / 2;
-        }
-    } else if (d->canvas.format == SPICE_SURFACE_FMT_16_565) {
-        for (y = 0; y < r->height; y++) {
-            for (x = 0; x < r->width; x++) {
-                dest[x] = CONVERT_0565_TO_0888(src[x]);
-            }
+    for (y = 0; y < r->height; y++) {
+        convert(src, dest, r->width);
 
-            dest += d->area.width;
-            src += d->canvas.stride / 2;
-        }
+        dest += d->area.width;
+        src += d->canvas.stride / 2;
     }
 
     return true;
@@ -1509,6 +1497,7 @@ static gboolean draw_event(GtkWidget *widget, cairo_t *cr, gpointer data)
 
     spice_cairo_draw_event(display, cr);
     update_mouse_pointer(display);
+    present_drawn(display);
 
     return true;
 }
@@ -2566,6 +2555,30 @@ static void spice_display_class_init(SpiceDisplayClass *klass)
                           G_PARAM_CONSTRUCT |
                           G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceDisplay:present-stats:
+     *
+     * Statistics of the presentation of the display updates, as a
+     * #GVariant dictionary "a{st}". The updates received from the
+     * display channel are gathered and drawn at most once per frame
+     * clock tick. "updates" counts the updates received, "merged" those
+     * gathered with a previous update, "dropped" those outside of the
+     * monitor area or received while the widget is not realized, and
+     * "frames" the frames drawn. "latency-last", "latency-max" and
+     * "latency-mean" are the times between the first update of a frame
+     * and the frame being drawn, in microseconds.
+     *
+     * Since: 0.41
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_PRESENT_STATS,
+         g_param_spec_variant("present-stats",
+                              "Present stats",
+                              "Statistics of the presentation of updates",
+                              G_VARIANT_TYPE("a{st}"), NULL,
+                              G_PARAM_READABLE |
+                              G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceDisplay::mouse-grab:
      * @display: the #SpiceDisplay that emitted the signal
@@ -2761,6 +2774,7 @@ static void primary_destroy(SpiceDisplayChannel *channel, gpointer data)
     SpiceDisplayPrivate *d = display->priv;
 
     spice_cairo_image_destroy(display);
+    present_cancel(display);
     d->canvas.width  = 0;
     d->canvas.height = 0;
     d->canvas.stride = 0;
@@ -2933,10 +2947,9 @@ static gboolean set_overlay(SpiceChannel *channel, void* pipeline_ptr, SpiceDisp
     return false;
 }
 
-static void invalidate(SpiceChannel *channel,
-                       gint x, gint y, gint w, gint h, gpointer data)
+static void invalidate_rect(SpiceDisplay *display,
+                            gint x, gint y, gint w, gint h)
 {
-    SpiceDisplay *display = data;
     SpiceDisplayPrivate *d = display->priv;
     int display_x, display_y;
     int x1, y1, x2, y2;
@@ -2949,13 +2962,6 @@ static void invalidate(SpiceChannel *channel,
         .height = h
     };
 
-#if HAVE_EGL
-    set_egl_enabled(display, false);
-#endif
-
-    if (!gtk_widget_get_window(GTK_WIDGET(display)))
-        return;
-
     if (!gdk_rectangle_intersect(&rect, &d->area, &rect))
         return;
 
@@ -2986,6 +2992,129 @@ static void invalidate(SpiceChannel *channel,
                     x2 - x1, y2 - y1);
 }
 
+static gboolean present_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer data)
+{
+    SpiceDisplay *display = data;
+    SpiceDisplayPrivate *d = display->priv;
+    cairo_rectangle_int_t rect;
+    int i, n;
+
+    d->present.tick_id = 0;
+    if (d->present.damage == NULL)
+        return G_SOURCE_REMOVE;
+
+    n = cairo_region_num_rectangles(d->present.damage);
+    for (i = 0; i < n; i++) {
+        cairo_region_get_rectangle(d->present.damage, i, &rect);
+        invalidate_rect(display, rect.x, rect.y, rect.width, rect.height);
+    }
+    g_clear_pointer(&d->present.damage, cairo_region_destroy);
+
+    /* the frame may not be drawn before the next present, if the
+     * widget is hidden for instance, keep the oldest damage */
+    if (d->present.draw_time == 0)
+        d->present.draw_time = d->present.damage_time;
+
+    return G_SOURCE_REMOVE;
+}
+
+static void present_drawn(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    gint64 latency;
+
+    if (d->present.draw_time == 0)
+        return;
+
+    latency = g_get_monotonic_time() - d->present.draw_time;
+    d->present.draw_time = 0;
+    d->present.frames++;
+    d->present.latency_last = latency;
+    d->present.latency_max = MAX(d->present.latency_max, latency);
+    d->present.latency_total += latency;
+}
+
+static void present_cancel(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+
+    if (d->present.tick_id != 0) {
+        gtk_widget_remove_tick_callback(GTK_WIDGET(display), d->present.tick_id);
+        d->present.tick_id = 0;
+    }
+    g_clear_pointer(&d->present.damage, cairo_region_destroy);
+    d->present.draw_time = 0;
+}
+
+static GVariant *present_get_stats(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    GVariantBuilder builder;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{st}"));
+    g_variant_builder_add(&builder, "{st}", "frames", d->present.frames);
+    g_variant_builder_add(&builder, "{st}", "updates", d->present.updates);
+    g_variant_builder_add(&builder, "{st}", "merged", d->present.merged);
+    g_variant_builder_add(&builder, "{st}", "dropped", d->present.dropped);
+    g_variant_builder_add(&builder, "{st}", "latency-last",
+                          (guint64)d->present.latency_last);
+    g_variant_builder_add(&builder, "{st}", "latency-max",
+                          (guint64)d->present.latency_max);
+    g_variant_builder_add(&builder, "{st}", "latency-mean",
+                          d->present.frames ?
+                          (guint64)d->present.latency_total / d->present.frames : 0);
+
+    return g_variant_builder_end(&builder);
+}
+
+/* The damage is gathered and presented on the next frame clock tick:
+ * color conversion and redraw requests happen at most once per frame,
+ * however fast the guest updates. */
+static void invalidate(SpiceChannel *channel, GArray *rects, gpointer data)
+{
+    SpiceDisplay *display = data;
+    SpiceDisplayPrivate *d = display->priv;
+    gboolean damaged = FALSE;
+    guint i;
+
+#if HAVE_EGL
+    set_egl_enabled(display, false);
+#endif
+
+    d->present.updates++;
+    if (!gtk_widget_get_window(GTK_WIDGET(display))) {
+        d->present.dropped++;
+        return;
+    }
+
+    if (d->present.damage == NULL)
+        d->present.damage = cairo_region_create();
+
+    for (i = 0; i < rects->len; i++) {
+        GdkRectangle rect = g_array_index(rects, cairo_rectangle_int_t, i);
+
+        if (!gdk_rectangle_intersect(&rect, &d->area, &rect))
+            continue;
+        cairo_region_union_rectangle(d->present.damage, &rect);
+        damaged = TRUE;
+    }
+
+    if (!damaged) {
+        /* outside of the monitor area */
+        d->present.dropped++;
+        return;
+    }
+
+    if (d->present.tick_id != 0) {
+        d->present.merged++;
+        return;
+    }
+
+    d->present.damage_time = g_get_monotonic_time();
+    d->present.tick_id = gtk_widget_add_tick_callback(GTK_WIDGET(display),
+                                                      present_tick, display, NULL);
+}
+
 static void mark(SpiceDisplay *display, gint mark)
 {
     SpiceDisplayPrivate *d = display->priv;
@@ -3382,7 +3511,7 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, SpiceDisplay *di
                                       G_CALLBACK(primary_create), display, 0);
         spice_g_signal_connect_object(channel, "display-primary-destroy",
                                       G_CALLBACK(primary_destroy), display, 0);
-        spice_g_signal_connect_object(channel, "display-invalidate",
+        spice_g_signal_connect_object(channel, "display-invalidate-region",
                                       G_CALLBACK(invalidate), display, 0);
         spice_g_signal_connect_object(channel, "display-mark",
                                       G_CALLBACK(mark), display, G_CONNECT_AFTER | G_CONNECT_SWAPPED);
@@ -0,0 +1,102 @@
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <string.h>
+#include <spice/enums.h>
+
+#include "video-nal.h"
+
+/*
+ * The H.264 and H.265 frames are Annex B byte streams of NAL units, each
+ * after a 00 00 01 start code. All the slices of a picture have the same
+ * reference flags so only the NAL headers up to the first slice are
+ * read, the parameter sets come before it.
+ */
+
+#define H264_NAL_SLICE      1
+#define H264_NAL_IDR_SLICE  5
+
+#define H265_NAL_RSV_VCL_N14 14
+#define H265_NAL_RSV_VCL31   31
+#define H265_NAL_SPS         33
+
+/* returns the first byte after the next start code, or end */
+static const uint8_t *nal_next(const uint8_t *p, const uint8_t *end)
+{
+    if (end - p < 3)
+        return end;
+    for (p += 2; p < end; p += 3) {
+        p = memchr(p, 1, end - p);
+        if (p == NULL)
+            return end;
+        if (p[-1] == 0 && p[-2] == 0)
+            return p + 1;
+        /* and a start code cannot end in the next 2 bytes */
+    }
+    return end;
+}
+
+static gboolean h264_frame_is_reference(const uint8_t *p, const uint8_t *end)
+{
+    for (p = nal_next(p, end); p < end; p = nal_next(p, end)) {
+        guint type = p[0] & 0x1f;
+
+        if (type >= H264_NAL_SLICE && type <= H264_NAL_IDR_SLICE) {
+            /* nal_ref_idc */
+            return (p[0] & 0x60) != 0;
+        }
+    }
+    return TRUE;
+}
+
+static gboolean h265_frame_is_reference(VideoNalState *state,
+                                        const uint8_t *p, const uint8_t *end)
+{
+    for (p = nal_next(p, end); end - p >= 2; p = nal_next(p, end)) {
+        guint type = (p[0] >> 1) & 0x3f;
+        guint tid_plus1 = p[1] & 0x7;
+
+        if (type == H265_NAL_SPS && end - p >= 3) {
+            /* sps_max_sub_layers_minus1 */
+            state->h265_sub_layers = ((p[2] >> 1) & 0x7) + 1;
+        } else if (type <= H265_NAL_RSV_VCL31) {
+            /* The even types up to 14 are sub-layer non-reference
+             * pictures, which pictures of the higher sub-layers may
+             * still use, unless there is none. */
+            return type > H265_NAL_RSV_VCL_N14 || type % 2 != 0 ||
+                   state->h265_sub_layers == 0 || tid_plus1 != state->h265_sub_layers;
+        }
+    }
+    return TRUE;
+}
+
+G_GNUC_INTERNAL
+gboolean video_nal_frame_is_reference(VideoNalState *state, int codec_type,
+                                      const uint8_t *data, gsize size)
+{
+    switch (codec_type) {
+    case SPICE_VIDEO_CODEC_TYPE_MJPEG:
+        return FALSE;
+    case SPICE_VIDEO_CODEC_TYPE_H264:
+        return h264_frame_is_reference(data, data + size);
+    case SPICE_VIDEO_CODEC_TYPE_H265:
+        return h265_frame_is_reference(state, data, data + size);
+    default:
+        return TRUE;
+    }
+}
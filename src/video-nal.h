@@ -0,0 +1,36 @@
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <glib.h>
+#include <stdint.h>
+
+G_BEGIN_DECLS
+
+/* what the previous frames of a stream told about it */
+typedef struct VideoNalState {
+    /* sps_max_sub_layers_minus1 + 1 of an H.265 stream, 0 until an SPS
+     * is seen */
+    guint h265_sub_layers;
+} VideoNalState;
+
+/* whether other frames may need @data, a frame of a @codec_type stream,
+ * to be decoded. TRUE when it cannot tell. */
+gboolean video_nal_frame_is_reference(VideoNalState *state, int codec_type,
+                                      const uint8_t *data, gsize size);
+
+G_END_DECLS
@@ -0,0 +1,174 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <glib.h>
+
+#include "spice-channel-cache.h"
+
+/* the values are derived from their id, and never NULL */
+#define VALUE(id) GSIZE_TO_POINTER((gsize)(id) << 1 | 1)
+
+static guint destroyed;
+
+static void value_destroy(gpointer value)
+{
+    destroyed++;
+}
+
+static gsize value_size(gconstpointer value)
+{
+    return 10;
+}
+
+static void check_stats(display_cache *cache, guint64 items)
+{
+    display_cache_stats stats;
+
+    cache_get_stats(cache, &stats);
+    g_assert_cmpuint(stats.items, ==, items);
+    g_assert_cmpuint(stats.bytes, ==, items * 10);
+}
+
+/* sequential ids, across the largest ones */
+static void test_sequential(void)
+{
+    display_cache *cache = cache_new(value_destroy, value_size);
+    guint64 first = G_MAXUINT64 - 500, id;
+    guint i;
+
+    destroyed = 0;
+    for (i = 0, id = first; i < 1000; i++, id++)
+        cache_add(cache, id, VALUE(id));
+    check_stats(cache, 1000);
+
+    for (i = 0, id = first; i < 1000; i++, id++)
+        g_assert_true(cache_find(cache, id) == VALUE(id));
+    g_assert_null(cache_find(cache, first - 1));
+    g_assert_null(cache_find(cache, id));
+
+    for (i = 0, id = first; i < 1000; i += 2, id += 2)
+        g_assert_true(cache_remove(cache, id));
+    g_assert_false(cache_remove(cache, first));
+    g_assert_cmpuint(destroyed, ==, 500);
+    check_stats(cache, 500);
+
+    for (i = 0, id = first; i < 1000; i++, id++) {
+        if (i % 2)
+            g_assert_true(cache_find(cache, id) == VALUE(id));
+        else
+            g_assert_null(cache_find(cache, id));
+    }
+
+    cache_clear(cache);
+    g_assert_cmpuint(destroyed, ==, 1000);
+    check_stats(cache, 0);
+    g_assert_null(cache_find(cache, first + 1));
+
+    cache_free(cache);
+}
+
+/* removals in the middle of probe sequences keep the items after them
+ * reachable, against a GHashTable */
+static void test_remove_reinsert(void)
+{
+    display_cache *cache = cache_new(value_destroy, value_size);
+    GHashTable *ref = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+    GHashTableIter iter;
+    gpointer key;
+    guint i;
+
+    destroyed = 0;
+    for (i = 0; i < 20000; i++) {
+        /* few ids, so that they collide and get removed and added again */
+        guint64 id = g_test_rand_int_range(0, 2000);
+
+        if (i % 1000 == 0)
+            id |= G_GUINT64_CONSTANT(0xffffffff00000000);
+
+        if (g_hash_table_contains(ref, &id) && g_test_rand_bit()) {
+            g_assert_true(cache_remove(cache, id));
+            g_hash_table_remove(ref, &id);
+        } else if (!g_hash_table_contains(ref, &id)) {
+            guint64 *copy = g_new(guint64, 1);
+
+            *copy = id;
+            cache_add(cache, id, VALUE(id));
+            g_hash_table_add(ref, copy);
+        }
+
+        if (i % 500 == 0) {
+            check_stats(cache, g_hash_table_size(ref));
+            g_hash_table_iter_init(&iter, ref);
+            while (g_hash_table_iter_next(&iter, &key, NULL))
+                g_assert_true(cache_find(cache, *(guint64 *)key) == VALUE(*(guint64 *)key));
+        }
+    }
+
+    for (i = 0; i < 2000; i++) {
+        guint64 id = i;
+
+        if (g_hash_table_contains(ref, &id))
+            g_assert_true(cache_find(cache, id) == VALUE(id));
+        else
+            g_assert_null(cache_find(cache, id));
+    }
+
+    g_hash_table_unref(ref);
+    cache_free(cache);
+}
+
+/* an image added twice is kept until it is removed twice, replacing it
+ * keeps its count */
+static void test_ref_count(void)
+{
+    display_cache *cache = cache_new(value_destroy, value_size);
+    gboolean lossy = FALSE;
+
+    cache->ref_counted = TRUE;
+    destroyed = 0;
+
+    cache_add_lossy(cache, 1, VALUE(1), TRUE);
+    cache_add(cache, 1, VALUE(1));
+    g_assert_cmpuint(destroyed, ==, 1);
+    check_stats(cache, 1);
+    g_assert_true(cache_find_lossy(cache, 1, &lossy) == VALUE(1));
+    g_assert_false(lossy);
+
+    cache_replace_lossy(cache, 1, VALUE(1), TRUE);
+    g_assert_true(cache_find_lossy(cache, 1, &lossy) == VALUE(1));
+    g_assert_true(lossy);
+
+    g_assert_true(cache_remove(cache, 1));
+    g_assert_true(cache_find(cache, 1) == VALUE(1));
+    g_assert_true(cache_remove(cache, 1));
+    g_assert_null(cache_find(cache, 1));
+    g_assert_cmpuint(destroyed, ==, 3);
+    check_stats(cache, 0);
+
+    cache_free(cache);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/cache/sequential", test_sequential);
+    g_test_add_func("/cache/remove-reinsert", test_remove_reinsert);
+    g_test_add_func("/cache/ref-count", test_ref_count);
+
+    return g_test_run();
+}
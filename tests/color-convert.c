@@ -0,0 +1,161 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <glib.h>
+
+#include "spice-widget-convert.h"
+
+/* each 5 or 6 bit component, as an independent reference for the
+ * CONVERT_0555_TO_0888() and CONVERT_0565_TO_0888() macros */
+static guint32 expand(guint c, guint bits)
+{
+    return (c << (8 - bits)) | (c >> (2 * bits - 8));
+}
+
+static guint32 reference(guint16 s, gboolean rgb565)
+{
+    guint green_bits = rgb565 ? 6 : 5;
+    guint b = s & 0x1f;
+    guint g = (s >> 5) & ((1 << green_bits) - 1);
+    guint r = (s >> (5 + green_bits)) & 0x1f;
+
+    return expand(r, 5) << 16 | expand(g, green_bits) << 8 | expand(b, 5);
+}
+
+static void check_convert(SpiceConvertFunc convert, const gchar *name, gboolean rgb565)
+{
+    guint16 *src = g_new(guint16, 65536);
+    guint32 *dest = g_new(guint32, 65536 + 1);
+    guint i, width;
+
+    g_test_message("%s %s", name, rgb565 ? "565" : "555");
+
+    /* every pixel value, the unused bit of 555 included */
+    for (i = 0; i < 65536; i++)
+        src[i] = i;
+    convert(src, dest, 65536);
+    for (i = 0; i < 65536; i++) {
+        if (dest[i] != reference(i, rgb565))
+            g_test_message("pixel 0x%04x", i);
+        g_assert_cmphex(dest[i], ==, reference(i, rgb565));
+    }
+
+    /* rows of any width, at an odd pixel, without writing past them */
+    for (width = 0; width < 40; width++) {
+        dest[width] = 0xdeadbeef;
+        convert(src + 1, dest, width);
+        for (i = 0; i < width; i++)
+            g_assert_cmphex(dest[i], ==, reference(i + 1, rgb565));
+        g_assert_cmphex(dest[width], ==, 0xdeadbeef);
+    }
+
+    g_free(src);
+    g_free(dest);
+}
+
+/* cairo RGB24 pixels, with the components of the 16bpp pixel expanded
+ * to 8 bits, by every kernel the CPU supports */
+static void test_kernels(void)
+{
+    const SpiceConvertKernels *kernels;
+    guint n_kernels, i;
+
+    kernels = spice_convert_get_supported_kernels(&n_kernels);
+    g_assert_cmpuint(n_kernels, >=, 1);
+    g_assert_cmpstr(kernels[n_kernels - 1].name, ==, "c");
+
+    /* a few components expanded by hand */
+    g_assert_cmphex(reference(0x7fff, FALSE), ==, 0xffffff);
+    g_assert_cmphex(reference(0x0210, FALSE), ==, 0x008484);
+    g_assert_cmphex(reference(0x07e0, TRUE), ==, 0x00ff00);
+    g_assert_cmphex(reference(0x0410, TRUE), ==, 0x008284);
+
+    for (i = 0; i < n_kernels; i++) {
+        check_convert(kernels[i].rgb555, kernels[i].name, FALSE);
+        check_convert(kernels[i].rgb565, kernels[i].name, TRUE);
+    }
+}
+
+/* the kernel used by the widget is one of them */
+static void test_selected(void)
+{
+    const SpiceConvertKernels *kernels, *selected;
+    guint n_kernels;
+
+    kernels = spice_convert_get_supported_kernels(&n_kernels);
+    selected = spice_convert_get_kernels();
+    g_assert_true(selected >= kernels && selected < kernels + n_kernels);
+}
+
+static void test_perf(void)
+{
+    static const struct {
+        guint width, height;
+    } sizes[] = {
+        { 1920, 1080 },
+        { 3840, 2160 },
+    };
+    const SpiceConvertKernels *kernels;
+    guint n_kernels, i, s, y, f;
+
+    kernels = spice_convert_get_supported_kernels(&n_kernels);
+
+    for (s = 0; s < G_N_ELEMENTS(sizes); s++) {
+        guint width = sizes[s].width, height = sizes[s].height;
+        guint16 *src = g_new(guint16, width * height);
+        guint32 *dest = g_new(guint32, width * height);
+
+        for (i = 0; i < width * height; i++)
+            src[i] = g_test_rand_int();
+
+        for (f = 0; f < 2; f++) {
+            for (i = 0; i < n_kernels; i++) {
+                SpiceConvertFunc convert = f ? kernels[i].rgb565 : kernels[i].rgb555;
+                guint frames = 0;
+                gdouble elapsed;
+
+                g_test_timer_start();
+                do {
+                    for (y = 0; y < height; y++)
+                        convert(src + y * width, dest + y * width, width);
+                    frames++;
+                } while (g_test_timer_elapsed() < 0.5);
+                elapsed = g_test_timer_last();
+
+                g_test_maximized_result((gdouble)width * height * frames / elapsed / 1e6,
+                                        "%ux%u %s %s: %.1f Mpix/s", width, height,
+                                        f ? "565" : "555", kernels[i].name,
+                                        (gdouble)width * height * frames / elapsed / 1e6);
+            }
+        }
+
+        g_free(src);
+        g_free(dest);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/color-convert/kernels", test_kernels);
+    g_test_add_func("/color-convert/selected", test_selected);
+    if (g_test_perf())
+        g_test_add_func("/color-convert/perf", test_perf);
+
+    return g_test_run();
+}
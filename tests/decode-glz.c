@@ -0,0 +1,448 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include <glib.h>
+
+#include "decode.h"
+#include "common/lz_common.h"
+
+#define MAX_PIXELS 200
+
+typedef enum {
+    RGB24,
+    RGB16,
+} Format;
+
+static const guint pixel_size[] = { 3, 2 };
+
+static GlzExpandFunc get_func(const GlzKernels *kernels, Format format)
+{
+    return format == RGB24 ? kernels->rgb24_to_rgb32 : kernels->rgb16_to_rgb32;
+}
+
+static void fill_random(uint8_t *data, gsize size)
+{
+    gsize i;
+
+    for (i = 0; i < size; i++)
+        data[i] = g_test_rand_int_range(0, 256);
+}
+
+/* every kernel must give the same result as the scalar one, for any
+ * length, including the tails shorter than a vector, and any alignment */
+static void test_expand(void)
+{
+    const GlzKernels *kernels;
+    guint n_kernels, i, n, offset, run;
+    Format format;
+    uint8_t *in = g_new(uint8_t, MAX_PIXELS * 3 + 4);
+    uint8_t *expected = g_new(uint8_t, MAX_PIXELS * 4);
+    uint8_t *out = g_new(uint8_t, MAX_PIXELS * 4 + 4 + 4);
+
+    kernels = glz_get_supported_kernels(&n_kernels);
+    g_assert_cmpuint(n_kernels, >=, 1);
+    g_assert_cmpstr(kernels[n_kernels - 1].name, ==, "c");
+
+    /* a few pixels expanded by hand */
+    memcpy(in, "\x01\x02\x03\xff\xfe\xfd", 6);
+    get_func(&kernels[n_kernels - 1], RGB24)(in, out, 2);
+    g_assert_cmpmem(out, 8, "\x01\x02\x03\x00\xff\xfe\xfd\x00", 8);
+    memcpy(in, "\x7f\xff\x04\x21", 4);
+    get_func(&kernels[n_kernels - 1], RGB16)(in, out, 2);
+    g_assert_cmpmem(out, 8, "\xff\xff\xff\x00\x08\x08\x08\x00", 8);
+
+    for (format = RGB24; format <= RGB16; format++) {
+        for (run = 0; run < 8; run++) {
+            fill_random(in, MAX_PIXELS * 3 + 4);
+            for (offset = 0; offset < 4; offset++) {
+                for (n = 0; n <= MAX_PIXELS - 4; n++) {
+                    get_func(&kernels[n_kernels - 1], format)(in + offset, expected, n);
+
+                    for (i = 0; i < n_kernels - 1; i++) {
+                        /* no write past the end */
+                        memset(out, 0xaa, MAX_PIXELS * 4 + 8);
+                        get_func(&kernels[i], format)(in + offset, out + offset, n);
+                        if (memcmp(out + offset, expected, n * 4) != 0)
+                            g_test_message("%s, %u bpp, %u pixels at +%u", kernels[i].name,
+                                           pixel_size[format] * 8, n, offset);
+                        g_assert_cmpmem(out + offset, n * 4, expected, n * 4);
+                        g_assert_cmphex(out[offset + n * 4], ==, 0xaa);
+                    }
+                }
+            }
+        }
+    }
+
+    g_free(in);
+    g_free(expected);
+    g_free(out);
+}
+
+/* a match overlapping its reference repeats the preceding bytes, like a
+ * byte by byte copy would */
+static void test_copy_match(void)
+{
+    uint8_t *buf = g_new(uint8_t, 1024);
+    uint8_t *expected = g_new(uint8_t, 1024);
+    guint pixel, dist, len, i;
+
+    for (pixel = 1; pixel <= 4; pixel *= 2) {
+        for (dist = pixel; dist <= 64 * pixel; dist += pixel) {
+            for (len = 0; len <= 400; len += pixel) {
+                fill_random(buf, 1024);
+                memcpy(expected, buf, 1024);
+                for (i = 0; i < len; i++)
+                    expected[dist + 64 + i] = expected[64 + i];
+
+                glz_copy_match(buf + dist + 64, buf + 64, len);
+                g_assert_cmpmem(buf, 1024, expected, 1024);
+            }
+        }
+    }
+
+    g_free(buf);
+    g_free(expected);
+}
+
+#define IMAGE_PIXELS 100
+#define IMAGE_SIZE (IMAGE_PIXELS * 4)
+
+static gboolean add_image(SpiceGlzDecoderWindow *w, uint64_t id, uint32_t win_head_dist)
+{
+    return glz_decoder_window_add_test_image(w, id, win_head_dist, IMAGE_PIXELS);
+}
+
+/* the ids go past the ring capacity and past 32 bits, each image
+ * referencing the 10 previous ones */
+static void test_window_wraparound(void)
+{
+    SpiceGlzDecoderWindow *w = glz_decoder_window_new();
+    uint64_t first = G_GUINT64_CONSTANT(0xffffff00), id;
+
+    for (id = first; id < first + 1000; id++) {
+        g_assert_false(add_image(w, id, MIN(id - first, 10)));
+        g_assert_true(glz_decoder_window_has_image(w, id));
+        if (id - first >= 10) {
+            g_assert_true(glz_decoder_window_has_image(w, id - 10));
+            g_assert_false(glz_decoder_window_has_image(w, id - 11));
+            g_assert_cmpuint(glz_decoder_window_get_used(w), ==, 11 * IMAGE_SIZE);
+        }
+    }
+
+    glz_decoder_window_destroy(w);
+}
+
+/* the images are only released once the ids before them are added */
+static void test_window_gap(void)
+{
+    SpiceGlzDecoderWindow *w = glz_decoder_window_new();
+
+    add_image(w, 100, 0);
+    add_image(w, 101, 1);
+    add_image(w, 103, 3);
+    add_image(w, 104, 2);
+    g_assert_true(glz_decoder_window_has_image(w, 100));
+    g_assert_true(glz_decoder_window_has_image(w, 101));
+    g_assert_false(glz_decoder_window_has_image(w, 102));
+
+    add_image(w, 102, 2);
+    g_assert_false(glz_decoder_window_has_image(w, 100));
+    g_assert_false(glz_decoder_window_has_image(w, 101));
+    g_assert_true(glz_decoder_window_has_image(w, 102));
+    g_assert_true(glz_decoder_window_has_image(w, 104));
+    g_assert_cmpuint(glz_decoder_window_get_used(w), ==, 3 * IMAGE_SIZE);
+
+    /* already released */
+    add_image(w, 101, 0);
+    g_assert_false(glz_decoder_window_has_image(w, 101));
+
+    glz_decoder_window_destroy(w);
+}
+
+/* over budget, the oldest images are dropped up to the first gap */
+static void test_window_budget(void)
+{
+    SpiceGlzDecoderWindow *w = glz_decoder_window_new();
+
+    /* 1.5 images */
+    glz_decoder_window_set_size(w, IMAGE_PIXELS);
+
+    g_assert_false(add_image(w, 10, 0));
+    g_assert_true(add_image(w, 12, 2));
+    g_assert_false(glz_decoder_window_has_image(w, 10));
+    g_assert_true(glz_decoder_window_has_image(w, 12));
+
+    g_assert_false(add_image(w, 13, 3));
+    g_assert_true(glz_decoder_window_has_image(w, 12));
+    g_assert_true(glz_decoder_window_has_image(w, 13));
+
+    /* the gap is filled, but the new image is kept */
+    g_assert_false(add_image(w, 11, 1));
+    g_assert_true(glz_decoder_window_has_image(w, 11));
+    g_assert_true(glz_decoder_window_has_image(w, 13));
+
+    g_assert_true(add_image(w, 14, 4));
+    g_assert_false(glz_decoder_window_has_image(w, 12));
+    g_assert_true(glz_decoder_window_has_image(w, 14));
+
+    glz_decoder_window_destroy(w);
+}
+
+/* the first images after a clear set the start of the window, in any
+ * order until one is released */
+static void test_window_clear(void)
+{
+    SpiceGlzDecoderWindow *w = glz_decoder_window_new();
+    uint64_t id;
+
+    add_image(w, 10, 0);
+    glz_decoder_window_clear(w);
+    g_assert_false(glz_decoder_window_has_image(w, 10));
+    g_assert_cmpuint(glz_decoder_window_get_used(w), ==, 0);
+
+    add_image(w, 5000, 0);
+    add_image(w, 4990, 0);
+    g_assert_true(glz_decoder_window_has_image(w, 5000));
+    g_assert_true(glz_decoder_window_has_image(w, 4990));
+
+    /* closing the gap releases the images before 5000 */
+    for (id = 4991; id < 5000; id++)
+        add_image(w, id, 1);
+    g_assert_false(glz_decoder_window_has_image(w, 4990));
+    g_assert_false(glz_decoder_window_has_image(w, 4999));
+    g_assert_true(glz_decoder_window_has_image(w, 5000));
+
+    add_image(w, 4995, 0);
+    g_assert_false(glz_decoder_window_has_image(w, 4995));
+
+    glz_decoder_window_destroy(w);
+}
+
+/* the ring does not grow past what the budget may hold */
+static void test_window_capacity(void)
+{
+    SpiceGlzDecoderWindow *w = glz_decoder_window_new();
+
+    /* 6000 bytes, at most 128 ids */
+    glz_decoder_window_set_size(w, 1000);
+
+    g_assert_false(add_image(w, 0, 0));
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*too far ahead*");
+    g_assert_true(add_image(w, 1000, 1000));
+    g_test_assert_expected_messages();
+    g_assert_false(glz_decoder_window_has_image(w, 0));
+    g_assert_true(glz_decoder_window_has_image(w, 1000));
+    g_assert_cmpuint(glz_decoder_window_get_used(w), ==, IMAGE_SIZE);
+
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*too far ahead*");
+    g_assert_true(add_image(w, G_MAXUINT64 - 1, 0));
+    g_test_assert_expected_messages();
+    g_assert_false(glz_decoder_window_has_image(w, 1000));
+    g_assert_true(glz_decoder_window_has_image(w, G_MAXUINT64 - 1));
+
+    glz_decoder_window_destroy(w);
+}
+
+static guint8 *put_32(guint8 *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+/* a 4x1 RGB32 image, a single match of 4 pixels at @offset in the
+ * previous image */
+static void make_ref_image(guint8 *buf, uint64_t id, uint32_t offset)
+{
+    guint8 *p = buf;
+
+    p = put_32(p, LZ_MAGIC);
+    p = put_32(p, LZ_VERSION);
+    *p++ = LZ_IMAGE_TYPE_RGB32;
+    p = put_32(p, 4);
+    p = put_32(p, 1);
+    p = put_32(p, 4 * 4);
+    p = put_32(p, id >> 32);
+    p = put_32(p, id);
+    p = put_32(p, 1);
+
+    g_assert_cmpuint(offset, <, 1 << 12);
+    *p++ = 4 << 5 | (offset & 0x0f);
+    *p++ = offset >> 4;
+    *p++ = 1;
+}
+
+/* a match in another image must end within it */
+static void test_ref_bounds(void)
+{
+    SpiceGlzDecoderWindow *w = glz_decoder_window_new();
+    SpiceGlzDecoder *d = glz_decoder_new(w, NULL);
+    guint8 buf[64];
+    pixman_image_t *surface;
+    uint32_t *pixels;
+    uint64_t id;
+    guint i;
+
+    /* 6 pixels of 0x07070707 */
+    glz_decoder_window_add_test_image(w, 7, 0, 6);
+
+    /* its last 4 pixels */
+    make_ref_image(buf, 8, 2);
+    surface = glz_decoder_decode_image(d, buf, NULL, &id);
+    g_assert_nonnull(surface);
+    g_assert_cmpuint(id, ==, 8);
+    pixels = pixman_image_get_data(surface);
+    for (i = 0; i < 4; i++)
+        g_assert_cmphex(pixels[i], ==, 0x07070707);
+    pixman_image_unref(surface);
+
+    /* one pixel past the end of image 8 */
+    make_ref_image(buf, 9, 1);
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_CRITICAL, "*offset + len <=*");
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_CRITICAL, "*ref != NULL*");
+    surface = glz_decoder_decode_image(d, buf, NULL, &id);
+    g_test_assert_expected_messages();
+    g_clear_pointer(&surface, pixman_image_unref);
+
+    glz_decoder_destroy(d);
+    glz_decoder_window_destroy(w);
+}
+
+static gint owner_refs;
+
+static void owner_ref(gpointer owner)
+{
+    g_atomic_int_inc(&owner_refs);
+}
+
+static void owner_unref(gpointer owner)
+{
+    g_atomic_int_dec_and_test(&owner_refs);
+}
+
+static void pipeline_done(gpointer data)
+{
+}
+
+static void set_glz_image(SpiceImage *image, uint32_t width, uint32_t height,
+                          guint8 *buf, gsize size)
+{
+    SpiceChunks *chunks = g_malloc0(sizeof(SpiceChunks) + sizeof(SpiceChunk));
+
+    chunks->data_size = size;
+    chunks->num_chunks = 1;
+    chunks->chunk[0].data = buf;
+    chunks->chunk[0].len = size;
+
+    memset(image, 0, sizeof(*image));
+    image->descriptor.type = SPICE_IMAGE_TYPE_GLZ_RGB;
+    image->descriptor.width = width;
+    image->descriptor.height = height;
+    image->u.lz_rgb.data_size = size;
+    image->u.lz_rgb.data = chunks;
+}
+
+static void check_ref_pixels(pixman_image_t *surface)
+{
+    uint32_t *pixels;
+    guint i;
+
+    g_assert_nonnull(surface);
+    pixels = pixman_image_get_data(surface);
+    for (i = 0; i < 4; i++)
+        g_assert_cmphex(pixels[i], ==, 0x07070707);
+    pixman_image_unref(surface);
+}
+
+/* a large GLZ image of a message referencing another one: the pipeline
+ * decodes both ahead, or neither if the other one is left to the canvas,
+ * which only decodes it when the message is applied */
+static void test_pipeline_message(void)
+{
+    SpiceGlzDecoderWindow *w = glz_decoder_window_new();
+    SpiceDecodePipeline *p = decode_pipeline_new(w, 1, pipeline_done, NULL);
+    SpiceGlzDecoder *d = glz_decoder_new(w, p);
+    guint8 buf[2][64];
+    SpiceImage images[2];
+    SpiceImage *list[2] = { &images[0], &images[1] };
+    SpiceDecodeJob *jobs[2];
+    uint64_t id;
+    guint i, n;
+
+    /* 6 pixels of 0x07070707, image 8 copies 4 of them, image 9 copies
+     * image 8 */
+    glz_decoder_window_add_test_image(w, 7, 0, 6);
+    make_ref_image(buf[0], 8, 2);
+    make_ref_image(buf[1], 9, 0);
+
+    /* image 8 is too small for the pipeline */
+    set_glz_image(&images[0], 8, 8, buf[0], sizeof(buf[0]));
+    set_glz_image(&images[1], 64, 64, buf[1], sizeof(buf[1]));
+    n = decode_pipeline_push_images(p, list, 2, jobs, NULL, owner_ref, owner_unref);
+    g_assert_cmpuint(n, ==, 0);
+    g_assert_cmpint(owner_refs, ==, 0);
+
+    check_ref_pixels(glz_decoder_decode_image(d, buf[0], NULL, &id));
+    g_assert_cmpuint(id, ==, 8);
+    check_ref_pixels(glz_decoder_decode_image(d, buf[1], NULL, &id));
+    g_assert_cmpuint(id, ==, 9);
+
+    /* both large, again as images 10 and 11, copying image 9 */
+    make_ref_image(buf[0], 10, 0);
+    make_ref_image(buf[1], 11, 0);
+    images[0].descriptor.width = images[0].descriptor.height = 64;
+    n = decode_pipeline_push_images(p, list, 2, jobs, NULL, owner_ref, owner_unref);
+    g_assert_cmpuint(n, ==, 2);
+    for (i = 0; i < n; i++) {
+        while (!decode_job_is_done(jobs[i]))
+            g_usleep(1000);
+    }
+
+    check_ref_pixels(glz_decoder_decode_image(d, buf[0], NULL, &id));
+    g_assert_cmpuint(id, ==, 10);
+    check_ref_pixels(glz_decoder_decode_image(d, buf[1], NULL, &id));
+    g_assert_cmpuint(id, ==, 11);
+
+    for (i = 0; i < n; i++)
+        decode_pipeline_release(p, jobs[i]);
+    glz_decoder_destroy(d);
+    decode_pipeline_free(p);
+    g_assert_cmpint(owner_refs, ==, 0);
+    glz_decoder_window_destroy(w);
+    g_free(images[0].u.lz_rgb.data);
+    g_free(images[1].u.lz_rgb.data);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/decode-glz/expand", test_expand);
+    g_test_add_func("/decode-glz/copy-match", test_copy_match);
+    g_test_add_func("/decode-glz/window/wraparound", test_window_wraparound);
+    g_test_add_func("/decode-glz/window/gap", test_window_gap);
+    g_test_add_func("/decode-glz/window/budget", test_window_budget);
+    g_test_add_func("/decode-glz/window/clear", test_window_clear);
+    g_test_add_func("/decode-glz/window/capacity", test_window_capacity);
+    g_test_add_func("/decode-glz/ref-bounds", test_ref_bounds);
+    g_test_add_func("/decode-glz/pipeline/message", test_pipeline_message);
+
+    return g_test_run();
+}
@@ -0,0 +1,121 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <glib.h>
+#include <spice/enums.h>
+#include "video-nal.h"
+
+static gboolean is_reference(VideoNalState *state, int codec_type,
+                             const uint8_t *data, gsize size)
+{
+    return video_nal_frame_is_reference(state, codec_type, data, size);
+}
+
+static void test_h264(void)
+{
+    VideoNalState state = { 0 };
+    /* AUD, SPS, PPS, IDR slice */
+    static const uint8_t idr[] = {
+        0, 0, 0, 1, 0x09, 0xf0,
+        0, 0, 0, 1, 0x67, 0x42, 0x00, 0x1e,
+        0, 0, 1, 0x68, 0xce,
+        0, 0, 1, 0x65, 0x88, 0x80,
+    };
+    /* SEI, then a slice with nal_ref_idc 2 */
+    static const uint8_t p[] = {
+        0, 0, 0, 1, 0x06, 0x05, 0x01,
+        0, 0, 1, 0x41, 0x9a, 0x00,
+    };
+    /* a slice with nal_ref_idc 0, a 1 in its payload */
+    static const uint8_t b[] = {
+        0, 0, 0, 1, 0x01, 0x9e, 0x01, 0x00, 0x01, 0x01,
+    };
+    /* no slice */
+    static const uint8_t sei[] = {
+        0, 0, 1, 0x06, 0x05, 0x00,
+    };
+
+    g_assert_true(is_reference(&state, SPICE_VIDEO_CODEC_TYPE_H264, idr, sizeof(idr)));
+    g_assert_true(is_reference(&state, SPICE_VIDEO_CODEC_TYPE_H264, p, sizeof(p)));
+    g_assert_false(is_reference(&state, SPICE_VIDEO_CODEC_TYPE_H264, b, sizeof(b)));
+    g_assert_true(is_reference(&state, SPICE_VIDEO_CODEC_TYPE_H264, sei, sizeof(sei)));
+    g_assert_true(is_reference(&state, SPICE_VIDEO_CODEC_TYPE_H264, b, 3));
+    g_assert_true(is_reference(&state, SPICE_VIDEO_CODEC_TYPE_H264, b, 0));
+}
+
+static void test_h265(void)
+{
+    VideoNalState state = { 0 };
+    /* SPS with sps_max_sub_layers_minus1 = 1 */
+    static const uint8_t sps[] = {
+        0, 0, 0, 1, 0x42, 0x01, 0x03, 0x01,
+    };
+    /* TRAIL_N with TemporalId 0 and 1 */
+    static const uint8_t trail_n_t0[] = {
+        0, 0, 0, 1, 0x00, 0x01, 0xaf,
+    };
+    static const uint8_t trail_n_t1[] = {
+        0, 0, 0, 1, 0x00, 0x02, 0xaf,
+    };
+    /* TRAIL_R with TemporalId 1 */
+    static const uint8_t trail_r_t1[] = {
+        0, 0, 0, 1, 0x02, 0x02, 0xaf,
+    };
+    /* an SPS with a single sub-layer, then a TRAIL_N */
+    static const uint8_t sps_trail_n[] = {
+        0, 0, 0, 1, 0x42, 0x01, 0x01, 0x01,
+        0, 0, 1, 0x00, 0x01, 0xaf,
+    };
+
+    /* unknown number of sub-layers */
+    g_assert_true(is_reference(&state, SPICE_VIDEO_CODEC_TYPE_H265,
+                               trail_n_t1, sizeof(trail_n_t1)));
+
+    g_assert_true(is_reference(&state, SPICE_VIDEO_CODEC_TYPE_H265, sps, sizeof(sps)));
+    g_assert_cmpuint(state.h265_sub_layers, ==, 2);
+    g_assert_true(is_reference(&state, SPICE_VIDEO_CODEC_TYPE_H265,
+                               trail_n_t0, sizeof(trail_n_t0)));
+    g_assert_false(is_reference(&state, SPICE_VIDEO_CODEC_TYPE_H265,
+                                trail_n_t1, sizeof(trail_n_t1)));
+    g_assert_true(is_reference(&state, SPICE_VIDEO_CODEC_TYPE_H265,
+                               trail_r_t1, sizeof(trail_r_t1)));
+
+    g_assert_false(is_reference(&state, SPICE_VIDEO_CODEC_TYPE_H265,
+                                sps_trail_n, sizeof(sps_trail_n)));
+    g_assert_cmpuint(state.h265_sub_layers, ==, 1);
+}
+
+static void test_other(void)
+{
+    VideoNalState state = { 0 };
+    static const uint8_t data[] = { 0, 0, 1, 0x01, 0x00 };
+
+    g_assert_false(is_reference(&state, SPICE_VIDEO_CODEC_TYPE_MJPEG, data, sizeof(data)));
+    g_assert_true(is_reference(&state, SPICE_VIDEO_CODEC_TYPE_VP8, data, sizeof(data)));
+    g_assert_true(is_reference(&state, SPICE_VIDEO_CODEC_TYPE_VP9, data, sizeof(data)));
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/video-nal/h264", test_h264);
+    g_test_add_func("/video-nal/h265", test_h265);
+    g_test_add_func("/video-nal/other", test_other);
+
+    return g_test_run();
+}
@@ -0,0 +1,510 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Replays a channel capture (see SPICE_CAPTURE_DIR and spice-capture.h)
+ * through a regular SpiceChannel: a fake server thread performs the link
+ * handshake on a loopback connection and sends the recorded messages,
+ * which go through spice_channel_recv_msg() and the channel handlers as
+ * in a live session. The handling time of each message type and the
+ * overall throughput are reported at the end.
+ *
+ * The handling time of a message held for the decode pipeline (see
+ * spice_channel_msg_hold()) only covers queuing its images: they are
+ * decoded on the pipeline threads, and the message is applied later on.
+ * Those messages are counted in the "held" column.
+ *
+ * This is linked against the library objects, to time the handlers with
+ * the message types.
+ */
+#include "config.h"
+
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-channel-priv.h"
+#include "spice-capture.h"
+
+/* config */
+static gboolean version = FALSE;
+static gboolean realtime = FALSE;
+static gchar **captures = NULL;
+
+/* state */
+static GMainLoop     *mainloop;
+static const guint8  *capture_data;
+static gsize         capture_size;
+static const SpiceCaptureHeader *capture_hdr;
+static guint32       *capture_caps;
+static gsize         records_offset;
+
+static void (*parent_handle_msg)(SpiceChannel *channel, SpiceMsgIn *msg);
+
+typedef struct MsgStats {
+    guint64 count;
+    guint64 held;
+    guint64 bytes;
+    gint64  total_time;
+    gint64  max_time;
+} MsgStats;
+
+static GHashTable    *msg_stats; /* msg type -> MsgStats */
+static guint64       replay_messages;
+static guint64       replay_bytes;
+static gint64        replay_start;
+static gint64        replay_end;
+
+/* ------------------------------------------------------------------ */
+/* capture file                                                        */
+
+static gboolean capture_load(const gchar *filename, GError **error)
+{
+    gchar *contents;
+    gsize len, caps_len;
+
+    if (!g_file_get_contents(filename, &contents, &len, error))
+        return FALSE;
+
+    capture_hdr = (const SpiceCaptureHeader *)contents;
+    if (len < sizeof(*capture_hdr) ||
+        memcmp(capture_hdr->magic, SPICE_CAPTURE_MAGIC, sizeof(capture_hdr->magic)) != 0 ||
+        GUINT32_FROM_LE(capture_hdr->version) != SPICE_CAPTURE_VERSION) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "%s is not a spice capture file", filename);
+        g_free(contents);
+        return FALSE;
+    }
+
+    /* a capture with mini headers was made with the common caps */
+    if ((GUINT32_FROM_LE(capture_hdr->flags) & SPICE_CAPTURE_FLAG_MINI_HEADER) &&
+        GUINT32_FROM_LE(capture_hdr->num_common_caps) <= SPICE_COMMON_CAP_MINI_HEADER / 32) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "%s: mini headers without common capabilities", filename);
+        g_free(contents);
+        return FALSE;
+    }
+
+    caps_len = ((gsize)GUINT32_FROM_LE(capture_hdr->num_common_caps) +
+                GUINT32_FROM_LE(capture_hdr->num_channel_caps)) * sizeof(guint32);
+    if (len - sizeof(*capture_hdr) < caps_len) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "%s: truncated capabilities", filename);
+        g_free(contents);
+        return FALSE;
+    }
+
+    capture_caps = g_memdup(contents + sizeof(*capture_hdr), caps_len);
+    capture_data = (const guint8 *)contents;
+    capture_size = len;
+    records_offset = sizeof(*capture_hdr) + caps_len;
+
+    return TRUE;
+}
+
+/* ------------------------------------------------------------------ */
+/* fake server                                                         */
+
+static gboolean read_all(GSocket *sock, gpointer data, gsize len)
+{
+    while (len > 0) {
+        gssize ret = g_socket_receive(sock, data, len, NULL, NULL);
+        if (ret <= 0)
+            return FALSE;
+        data = (guint8 *)data + ret;
+        len -= ret;
+    }
+    return TRUE;
+}
+
+static gboolean write_all(GSocket *sock, gconstpointer data, gsize len)
+{
+    while (len > 0) {
+        gssize ret = g_socket_send(sock, data, len, NULL, NULL);
+        if (ret <= 0)
+            return FALSE;
+        data = (const guint8 *)data + ret;
+        len -= ret;
+    }
+    return TRUE;
+}
+
+/* the client acks and sends a few messages, they are discarded */
+static gpointer server_drain(gpointer data)
+{
+    GSocket *sock = data;
+    guint8 buf[4096];
+
+    while (g_socket_receive(sock, (gchar *)buf, sizeof(buf), NULL, NULL) > 0)
+        ;
+    g_object_unref(sock);
+
+    return NULL;
+}
+
+static gboolean server_link(GSocket *sock, EVP_PKEY *key)
+{
+    SpiceLinkHeader hdr;
+    SpiceLinkReply reply = { 0, };
+    guint32 num_common_caps = GUINT32_FROM_LE(capture_hdr->num_common_caps);
+    guint32 num_channel_caps = GUINT32_FROM_LE(capture_hdr->num_channel_caps);
+    guint32 *common_caps = g_memdup(capture_caps, num_common_caps * sizeof(guint32));
+    guint8 *pub_key = reply.pub_key;
+    guint8 ticket[256];
+    gboolean auth_selection;
+    guint32 link_res = GUINT32_TO_LE(SPICE_LINK_ERR_OK);
+    gpointer mess;
+    int key_size;
+    gboolean ret = FALSE;
+
+    /* link message of the client */
+    if (!read_all(sock, &hdr, sizeof(hdr)) ||
+        GUINT32_FROM_LE(hdr.magic) != SPICE_MAGIC)
+        goto end;
+    mess = g_malloc(GUINT32_FROM_LE(hdr.size));
+    if (!read_all(sock, mess, GUINT32_FROM_LE(hdr.size))) {
+        g_free(mess);
+        goto end;
+    }
+    g_free(mess);
+
+    /* the client must pick the header format of the recorded messages */
+    if (GUINT32_FROM_LE(capture_hdr->flags) & SPICE_CAPTURE_FLAG_MINI_HEADER)
+        common_caps[SPICE_COMMON_CAP_MINI_HEADER / 32] |=
+            GUINT32_TO_LE(1u << (SPICE_COMMON_CAP_MINI_HEADER % 32));
+    else if (num_common_caps > SPICE_COMMON_CAP_MINI_HEADER / 32)
+        common_caps[SPICE_COMMON_CAP_MINI_HEADER / 32] &=
+            ~GUINT32_TO_LE(1u << (SPICE_COMMON_CAP_MINI_HEADER % 32));
+
+    /* the client would pick SASL, which the replay can't do */
+    if (num_common_caps > SPICE_COMMON_CAP_AUTH_SASL / 32)
+        common_caps[SPICE_COMMON_CAP_AUTH_SASL / 32] &=
+            ~GUINT32_TO_LE(1u << (SPICE_COMMON_CAP_AUTH_SASL % 32));
+    auth_selection = num_common_caps > SPICE_COMMON_CAP_PROTOCOL_AUTH_SELECTION / 32 &&
+        (GUINT32_FROM_LE(common_caps[SPICE_COMMON_CAP_PROTOCOL_AUTH_SELECTION / 32]) &
+         (1u << (SPICE_COMMON_CAP_PROTOCOL_AUTH_SELECTION % 32)));
+
+    hdr.magic = GUINT32_TO_LE(SPICE_MAGIC);
+    hdr.major_version = GUINT32_TO_LE(SPICE_VERSION_MAJOR);
+    hdr.minor_version = GUINT32_TO_LE(SPICE_VERSION_MINOR);
+    hdr.size = GUINT32_TO_LE(sizeof(reply) + (num_common_caps + num_channel_caps) * sizeof(guint32));
+
+    reply.error = GUINT32_TO_LE(SPICE_LINK_ERR_OK);
+    if (i2d_PUBKEY(key, &pub_key) > SPICE_TICKET_PUBKEY_BYTES)
+        g_error("public key too large");
+    reply.num_common_caps = GUINT32_TO_LE(num_common_caps);
+    reply.num_channel_caps = GUINT32_TO_LE(num_channel_caps);
+    reply.caps_offset = GUINT32_TO_LE(sizeof(reply));
+
+    if (!write_all(sock, &hdr, sizeof(hdr)) ||
+        !write_all(sock, &reply, sizeof(reply)) ||
+        !write_all(sock, common_caps, num_common_caps * sizeof(guint32)) ||
+        !write_all(sock, capture_caps + num_common_caps, num_channel_caps * sizeof(guint32)))
+        goto end;
+
+    /* auth mechanism, then the encrypted ticket, which is not checked */
+    if (auth_selection && !read_all(sock, ticket, sizeof(guint32)))
+        goto end;
+    key_size = EVP_PKEY_size(key);
+    g_assert((gsize)key_size <= sizeof(ticket));
+    if (!read_all(sock, ticket, key_size))
+        goto end;
+
+    ret = write_all(sock, &link_res, sizeof(link_res));
+
+end:
+    g_free(common_caps);
+    return ret;
+}
+
+static gpointer server_thread(gpointer data)
+{
+    GSocket *listener = data;
+    GSocket *sock;
+    GThread *drain;
+    EVP_PKEY_CTX *ctx;
+    EVP_PKEY *key = NULL;
+    gsize offset = records_offset;
+    gint64 start;
+
+    sock = g_socket_accept(listener, NULL, NULL);
+    if (sock == NULL)
+        g_error("accept failed");
+
+    ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+    if (ctx == NULL ||
+        EVP_PKEY_keygen_init(ctx) <= 0 ||
+        EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 1024) <= 0 ||
+        EVP_PKEY_keygen(ctx, &key) <= 0)
+        g_error("failed to generate the link key");
+    EVP_PKEY_CTX_free(ctx);
+
+    if (!server_link(sock, key)) {
+        g_warning("link handshake failed");
+        goto end;
+    }
+
+    drain = g_thread_new("replay-drain", server_drain, g_object_ref(sock));
+
+    start = g_get_monotonic_time();
+    while (offset + sizeof(SpiceCaptureRecord) <= capture_size) {
+        const SpiceCaptureRecord *rec = (const SpiceCaptureRecord *)(capture_data + offset);
+        guint32 size = GUINT32_FROM_LE(rec->size);
+
+        offset += sizeof(*rec);
+        if (size > capture_size - offset) {
+            g_warning("truncated capture");
+            break;
+        }
+
+        if (realtime) {
+            gint64 delay = start + GUINT64_FROM_LE(rec->time) - g_get_monotonic_time();
+            if (delay > 0)
+                g_usleep(delay);
+        }
+
+        if (!write_all(sock, capture_data + offset, size))
+            break;
+        offset += size;
+    }
+
+    /* the channel closes once it has handled everything */
+    g_socket_shutdown(sock, FALSE, TRUE, NULL);
+    g_thread_join(drain);
+
+end:
+    EVP_PKEY_free(key);
+    g_object_unref(sock);
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* client                                                              */
+
+static void timed_handle_msg(SpiceChannel *channel, SpiceMsgIn *msg)
+{
+    int type = spice_msg_in_type(msg);
+    guint held = channel->priv->held_messages;
+    int len;
+    gint64 start, elapsed;
+    MsgStats *stats;
+
+    spice_msg_in_raw(msg, &len);
+
+    start = g_get_monotonic_time();
+    parent_handle_msg(channel, msg);
+    elapsed = g_get_monotonic_time() - start;
+
+    stats = g_hash_table_lookup(msg_stats, GINT_TO_POINTER(type));
+    if (stats == NULL) {
+        stats = g_new0(MsgStats, 1);
+        g_hash_table_insert(msg_stats, GINT_TO_POINTER(type), stats);
+    }
+    stats->count++;
+    if (channel->priv->held_messages > held)
+        stats->held++;
+    stats->bytes += len;
+    stats->total_time += elapsed;
+    stats->max_time = MAX(stats->max_time, elapsed);
+
+    replay_messages++;
+    replay_bytes += len;
+}
+
+static void channel_event(SpiceChannel *channel, SpiceChannelEvent event,
+                          gpointer data)
+{
+    switch (event) {
+    case SPICE_CHANNEL_OPENED:
+        if (!channel->priv->use_mini_header !=
+            !(GUINT32_FROM_LE(capture_hdr->flags) & SPICE_CAPTURE_FLAG_MINI_HEADER))
+            g_warning("the channel does not use the header format of the capture");
+        replay_start = g_get_monotonic_time();
+        break;
+    case SPICE_CHANNEL_CLOSED:
+        replay_end = g_get_monotonic_time();
+        g_main_loop_quit(mainloop);
+        break;
+    default:
+        g_warning("channel event: %u", event);
+        replay_end = g_get_monotonic_time();
+        g_main_loop_quit(mainloop);
+    }
+}
+
+static gint compare_msg_type(gconstpointer a, gconstpointer b)
+{
+    return GPOINTER_TO_INT(a) - GPOINTER_TO_INT(b);
+}
+
+static void print_stats(int channel_type)
+{
+    GList *types, *l;
+    gdouble elapsed = (replay_end - replay_start) / (gdouble)G_USEC_PER_SEC;
+
+    printf("%s: %" G_GUINT64_FORMAT " messages, %" G_GUINT64_FORMAT " bytes in %.3f s",
+           spice_channel_type_to_string(channel_type),
+           replay_messages, replay_bytes, elapsed);
+    if (elapsed > 0)
+        printf(" (%.1f MB/s, %.0f msg/s)",
+               replay_bytes / elapsed / (1024 * 1024), replay_messages / elapsed);
+    printf("\n");
+
+    printf("%6s %10s %10s %12s %10s %10s %12s\n",
+           "type", "count", "held", "total (ms)", "avg (us)", "max (us)", "bytes");
+    types = g_list_sort(g_hash_table_get_keys(msg_stats), compare_msg_type);
+    for (l = types; l != NULL; l = l->next) {
+        MsgStats *stats = g_hash_table_lookup(msg_stats, l->data);
+
+        printf("%6d %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT " %12.3f %10.1f %10"
+               G_GINT64_FORMAT " %12" G_GUINT64_FORMAT "\n",
+               GPOINTER_TO_INT(l->data), stats->count, stats->held,
+               stats->total_time / 1000.0,
+               (gdouble)stats->total_time / stats->count,
+               stats->max_time, stats->bytes);
+    }
+    g_list_free(types);
+}
+
+/* ------------------------------------------------------------------ */
+
+static GOptionEntry app_entries[] = {
+    {
+        .long_name        = "realtime",
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &realtime,
+        .description      = "Replay with the recorded timing instead of as fast as possible",
+    },{
+        .long_name        = "version",
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &version,
+        .description      = "Display version and quit",
+    },{
+        .long_name        = G_OPTION_REMAINING,
+        .arg              = G_OPTION_ARG_FILENAME_ARRAY,
+        .arg_data         = &captures,
+        .arg_description  = "CAPTURE",
+    },{
+        /* end of list */
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    GSocket *listener, *client;
+    GInetAddress *loopback;
+    GSocketAddress *addr;
+    SpiceSession *session;
+    SpiceChannel *channel;
+    GThread *server;
+    int channel_type;
+
+    /* parse opts */
+    context = g_option_context_new(NULL);
+    g_option_context_set_summary(context, "Replays a channel capture, recorded with "
+                                 "SPICE_CAPTURE_DIR, and reports the message handling time.");
+    g_option_context_set_description(context, "Report bugs to " PACKAGE_BUGREPORT ".");
+    g_option_context_add_main_entries(context, app_entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_print("option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+
+    if (version) {
+        g_print("spicy-replay " PACKAGE_VERSION "\n");
+        exit(0);
+    }
+
+    if (captures == NULL || captures[0] == NULL || captures[1] != NULL) {
+        g_print("%s", g_option_context_get_help(context, TRUE, NULL));
+        exit(1);
+    }
+
+    if (!capture_load(captures[0], &error)) {
+        g_printerr("%s\n", error->message);
+        exit(1);
+    }
+    channel_type = GUINT32_FROM_LE(capture_hdr->channel_type);
+
+    /* loopback connection, the server side is fed by server_thread() */
+    listener = g_socket_new(G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM,
+                            G_SOCKET_PROTOCOL_TCP, &error);
+    loopback = g_inet_address_new_loopback(G_SOCKET_FAMILY_IPV4);
+    addr = g_inet_socket_address_new(loopback, 0);
+    if (listener == NULL ||
+        !g_socket_bind(listener, addr, TRUE, &error) ||
+        !g_socket_listen(listener, &error)) {
+        g_printerr("failed to listen: %s\n", error->message);
+        exit(1);
+    }
+    g_object_unref(addr);
+    g_object_unref(loopback);
+
+    addr = g_socket_get_local_address(listener, &error);
+    client = g_socket_new(G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM,
+                          G_SOCKET_PROTOCOL_TCP, &error);
+    if (addr == NULL || client == NULL ||
+        !g_socket_connect(client, addr, NULL, &error)) {
+        g_printerr("failed to connect: %s\n", error->message);
+        exit(1);
+    }
+    g_object_unref(addr);
+
+    server = g_thread_new("replay-server", server_thread, listener);
+
+    mainloop = g_main_loop_new(NULL, false);
+    msg_stats = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+
+    session = spice_session_new();
+    g_object_set(session, "ticket-handler", "rsa", NULL);
+    channel = spice_channel_new(session, channel_type,
+                                GUINT32_FROM_LE(capture_hdr->channel_id));
+    if (channel == NULL) {
+        g_printerr("can't replay %s channels\n", spice_channel_type_to_string(channel_type));
+        exit(1);
+    }
+    g_signal_connect(channel, "channel-event", G_CALLBACK(channel_event), NULL);
+
+    parent_handle_msg = SPICE_CHANNEL_GET_CLASS(channel)->handle_msg;
+    SPICE_CHANNEL_GET_CLASS(channel)->handle_msg = timed_handle_msg;
+
+    /* the channel owns the fd */
+    spice_channel_open_fd(channel, dup(g_socket_get_fd(client)));
+    g_object_unref(client);
+
+    g_main_loop_run(mainloop);
+    g_thread_join(server);
+
+    print_stats(channel_type);
+
+    spice_session_disconnect(session);
+    g_object_unref(session);
+    g_object_unref(listener);
+    g_hash_table_unref(msg_stats);
+    g_main_loop_unref(mainloop);
+    g_free((gpointer)capture_data);
+    g_free(capture_caps);
+    g_strfreev(captures);
+
+    return 0;
+}
@@ -86,6 +86,8 @@ int main(int argc, char *argv[])
     GOptionContext *context;
 
     signal(SIGINT, signal_handler);
+    /* the channels only collect the message metrics when asked to */
+    g_setenv("SPICE_MESSAGE_STATS", "1", FALSE);
 
     /* parse opts */
     context = g_option_context_new(NULL);
@@ -119,18 +121,117 @@ int main(int argc, char *argv[])
     {
         GList *iter, *list = spice_session_get_channels(session);
         gulong total_read_bytes;
+        guint64 total_read_calls, total_read_messages;
         gint  channel_type;
-        printf("total bytes read:\n");
+        printf("total bytes read (read calls, messages):\n");
         for (iter = list ; iter ; iter = iter->next) {
             g_object_get(iter->data,
                 "total-read-bytes", &total_read_bytes,
+                "total-read-calls", &total_read_calls,
+                "total-read-messages", &total_read_messages,
                 "channel-type", &channel_type,
                 NULL);
-            printf("%s: %lu\n",
+            printf("%s: %lu (%" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT ")\n",
                    spice_channel_type_to_string(channel_type),
-                   total_read_bytes);
+                   total_read_bytes, total_read_calls, total_read_messages);
+        }
+        printf("total bytes written (write calls, messages):\n");
+        for (iter = list ; iter ; iter = iter->next) {
+            guint64 total_write_bytes, total_write_calls, total_write_messages;
+
+            g_object_get(iter->data,
+                "total-write-bytes", &total_write_bytes,
+                "total-write-calls", &total_write_calls,
+                "total-write-messages", &total_write_messages,
+                "channel-type", &channel_type,
+                NULL);
+            printf("%s: %" G_GUINT64_FORMAT " (%" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT ")\n",
+                   spice_channel_type_to_string(channel_type),
+                   total_write_bytes, total_write_calls, total_write_messages);
+        }
+        printf("transmit queue high-water mark in bytes (ack stalls):\n");
+        for (iter = list ; iter ; iter = iter->next) {
+            guint64 xmit_queue_high_water, ack_stalls;
+
+            g_object_get(iter->data,
+                "xmit-queue-high-water", &xmit_queue_high_water,
+                "ack-stalls", &ack_stalls,
+                "channel-type", &channel_type,
+                NULL);
+            printf("%s: %" G_GUINT64_FORMAT " (%" G_GUINT64_FORMAT ")\n",
+                   spice_channel_type_to_string(channel_type),
+                   xmit_queue_high_water, ack_stalls);
+        }
+        printf("messages per type (direction, type: count, bytes, handler time in us):\n");
+        for (iter = list ; iter ; iter = iter->next) {
+            GVariant *stats;
+            GVariantIter stats_iter;
+            gboolean outgoing;
+            guint16 type;
+            guint64 messages, bytes, time;
+
+            g_object_get(iter->data,
+                "message-stats", &stats,
+                "channel-type", &channel_type,
+                NULL);
+            g_variant_iter_init(&stats_iter, stats);
+            while (g_variant_iter_next(&stats_iter, "(bqttt@at)",
+                                       &outgoing, &type, &messages, &bytes, &time, NULL)) {
+                printf("%s: %s %u: %" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT
+                       ", %" G_GUINT64_FORMAT "\n",
+                       spice_channel_type_to_string(channel_type),
+                       outgoing ? "out" : "in", type, messages, bytes, time);
+            }
+            g_variant_unref(stats);
+        }
+        printf("connect time in us (TLS handshake time in us):\n");
+        for (iter = list ; iter ; iter = iter->next) {
+            guint64 connect_time, tls_handshake_time;
+            gboolean tls_session_reused;
+
+            g_object_get(iter->data,
+                "connect-time", &connect_time,
+                "tls-handshake-time", &tls_handshake_time,
+                "tls-session-reused", &tls_session_reused,
+                "channel-type", &channel_type,
+                NULL);
+            printf("%s: %" G_GUINT64_FORMAT " (%" G_GUINT64_FORMAT "%s)\n",
+                   spice_channel_type_to_string(channel_type),
+                   connect_time, tls_handshake_time,
+                   tls_session_reused ? ", resumed" : "");
         }
         g_list_free(list);
+
+        {
+            guint64 glz_window_used, surfaces_memory;
+
+            g_object_get(session,
+                "glz-window-used", &glz_window_used,
+                "surfaces-memory", &surfaces_memory,
+                NULL);
+            printf("glz window bytes: %" G_GUINT64_FORMAT "\n", glz_window_used);
+            printf("surfaces bytes: %" G_GUINT64_FORMAT "\n", surfaces_memory);
+        }
+        {
+            GVariant *stats;
+            GVariantIter iter;
+            const gchar *key;
+            guint64 val;
+
+            g_object_get(session, "images-cache-stats", &stats, NULL);
+            printf("images cache:\n");
+            g_variant_iter_init(&iter, stats);
+            while (g_variant_iter_next(&iter, "{&st}", &key, &val))
+                printf("%s: %" G_GUINT64_FORMAT "\n", key, val);
+            g_variant_unref(stats);
+
+            g_object_get(session, "video-decoder-pool-stats", &stats, NULL);
+            printf("video decoder pool:\n");
+            g_variant_iter_init(&iter, stats);
+            while (g_variant_iter_next(&iter, "{&st}", &key, &val))
+                printf("%s: %" G_GUINT64_FORMAT "\n", key, val);
+            g_variant_unref(stats);
+        }
     }
     return 0;
 }